@@ -0,0 +1,56 @@
+#include <RcppEigen.h>
+
+#include "CompiledTransform.h"
+
+// Size of the data of an image, or zero if it is null
+static size_t imageBytes (const NiftiImage &image)
+{
+    if (image.isNull())
+        return 0;
+    else
+        return image->nvox * image->nbyper;
+}
+
+CompiledTransform::CompiledTransform (const NiftiImage &targetImage, const AffineMatrix &affineMatrix, const bool keepJacobian)
+    : targetImage(targetImage), affine(true), affineMatrix(affineMatrix), keepJacobian(keepJacobian), fieldBuilt(false)
+{
+}
+
+CompiledTransform::CompiledTransform (const NiftiImage &targetImage, const NiftiImage &transformationImage, const bool keepJacobian)
+    : targetImage(targetImage), affine(false), transformationImage(transformationImage), keepJacobian(keepJacobian), fieldBuilt(false)
+{
+}
+
+const DeformationField & CompiledTransform::getField ()
+{
+    // The field is only calculated the first time it is needed
+    if (!fieldBuilt)
+    {
+        if (affine)
+            field = DeformationField(targetImage, affineMatrix);
+        else
+            field = DeformationField(targetImage, transformationImage);
+        fieldBuilt = true;
+
+        if (keepJacobian)
+            getJacobian();
+    }
+
+    return field;
+}
+
+const NiftiImage & CompiledTransform::getJacobian ()
+{
+    if (jacobianImage.isNull())
+        jacobianImage = getField().getJacobian();
+
+    return jacobianImage;
+}
+
+size_t CompiledTransform::memoryUsage () const
+{
+    size_t bytes = imageBytes(transformationImage) + imageBytes(jacobianImage);
+    if (fieldBuilt)
+        bytes += imageBytes(field.getFieldImage());
+    return bytes;
+}
@@ -0,0 +1,40 @@
+#ifndef _COMPILED_TRANSFORM_H_
+#define _COMPILED_TRANSFORM_H_
+
+#include "RNifti.h"
+#include "AffineMatrix.h"
+#include "DeformationField.h"
+
+// A transformation together with its deformation field, and optionally its Jacobian map, which are
+// built on first use and then kept, so that the transformation can be applied repeatedly at no extra cost
+class CompiledTransform
+{
+protected:
+    NiftiImage targetImage;
+    bool affine;
+    AffineMatrix affineMatrix;
+    NiftiImage transformationImage;
+    bool keepJacobian;
+
+    bool fieldBuilt;
+    DeformationField field;
+    NiftiImage jacobianImage;
+
+public:
+    CompiledTransform (const NiftiImage &targetImage, const AffineMatrix &affineMatrix, const bool keepJacobian = false);
+    CompiledTransform (const NiftiImage &targetImage, const NiftiImage &transformationImage, const bool keepJacobian = false);
+
+    bool isAffine () const { return affine; }
+    bool hasField () const { return fieldBuilt; }
+    bool hasJacobian () const { return !jacobianImage.isNull(); }
+
+    const NiftiImage & getTargetImage () const { return targetImage; }
+
+    const DeformationField & getField ();
+    const NiftiImage & getJacobian ();
+
+    // Bytes of image data currently held, including the transformation itself
+    size_t memoryUsage () const;
+};
+
+#endif
@@ -52,33 +52,45 @@ DeformationField::DeformationField (const NiftiImage &targetImage, const NiftiIm
     initImages(targetImage);
     reg_checkAndCorrectDimension(transformationImage);
     
-    switch (reg_round(transformationImage->intent_p1))
+    // Transformations estimated at single precision are converted to match the field
+    NiftiImage convertedImage;
+    if (transformationImage->datatype != deformationFieldImage->datatype)
+    {
+        convertedImage = NiftiImage(transformationImage, true);
+        reg_tools_changeDatatype<PRECISION_TYPE>(convertedImage);
+    }
+    const NiftiImage &transformation = (convertedImage.isNull() ? transformationImage : convertedImage);
+    
+    switch (reg_round(transformation->intent_p1))
     {
         case SPLINE_GRID:
-        reg_spline_getDeformationField(transformationImage, deformationFieldImage, NULL, compose, true);
+        reg_spline_getDeformationField(transformation, deformationFieldImage, NULL, compose, true);
+        // The grid allows points to be mapped back exactly
+        if (!compose)
+            this->transformationImage = transformation;
         break;
         
         case DISP_VEL_FIELD:
-        reg_getDeformationFromDisplacement(transformationImage);
+        reg_getDeformationFromDisplacement(transformation);
         case DEF_VEL_FIELD:
         {
             nifti_image *tempFlowField = deformationFieldImage;
-            reg_defField_compose(transformationImage, tempFlowField, NULL);
-            tempFlowField->intent_p1 = transformationImage->intent_p1;
-            tempFlowField->intent_p2 = transformationImage->intent_p2;
+            reg_defField_compose(transformation, tempFlowField, NULL);
+            tempFlowField->intent_p1 = transformation->intent_p1;
+            tempFlowField->intent_p2 = transformation->intent_p2;
             reg_defField_getDeformationFieldFromFlowField(tempFlowField, deformationFieldImage, false);
             nifti_image_free(tempFlowField);
         }
         break;
         
         case SPLINE_VEL_GRID:
-        reg_spline_getDefFieldFromVelocityGrid(transformationImage, deformationFieldImage, false);
+        reg_spline_getDefFieldFromVelocityGrid(transformation, deformationFieldImage, false);
         break;
         
         case DISP_FIELD:
-        reg_getDeformationFromDisplacement(transformationImage);
+        reg_getDeformationFromDisplacement(transformation);
         default:
-        reg_defField_compose(transformationImage, deformationFieldImage, NULL);
+        reg_defField_compose(transformation, deformationFieldImage, NULL);
         break;
     }
 }
@@ -101,9 +113,9 @@ NiftiImage DeformationField::getJacobian () const
     return NiftiImage(jacobianImage);
 }
 
-NiftiImage DeformationField::resampleImage (const NiftiImage &sourceImage, const int interpolation) const
+// Allocate an image in target space to hold the resampled source image
+nifti_image * DeformationField::allocateResultImage (const NiftiImage &sourceImage, const int datatype) const
 {
-    // Allocate result image
     nifti_image *resultImage = nifti_copy_nim_info(targetImage);
     resultImage->dim[0] = resultImage->ndim = sourceImage->dim[0];
     resultImage->dim[4] = resultImage->nt = sourceImage->dim[4];
@@ -111,105 +123,526 @@ NiftiImage DeformationField::resampleImage (const NiftiImage &sourceImage, const
     resultImage->cal_max = sourceImage->cal_max;
     resultImage->scl_slope = sourceImage->scl_slope;
     resultImage->scl_inter = sourceImage->scl_inter;
-    resultImage->datatype = sourceImage->datatype;
-    resultImage->nbyper = sourceImage->nbyper;
+    resultImage->datatype = (datatype == DT_NONE ? sourceImage->datatype : datatype);
+    nifti_datatype_sizes(resultImage->datatype, &resultImage->nbyper, NULL);
     resultImage->nvox = size_t(resultImage->dim[1]) * size_t(resultImage->dim[2]) * size_t(resultImage->dim[3]) * size_t(resultImage->dim[4]);
-    resultImage->data = (void *) calloc(resultImage->nvox, resultImage->nbyper);
+    
+    // Every voxel is written by the resampler, so the data need not be cleared
+    resultImage->data = (void *) malloc(resultImage->nvox * resultImage->nbyper);
+    return resultImage;
+}
 
-    // Resample source image to target space
+NiftiImage DeformationField::resampleImage (const NiftiImage &sourceImage, const int interpolation, const int datatype) const
+{
+    nifti_image *resultImage = allocateResultImage(sourceImage, datatype);
+    resampleImage(sourceImage, interpolation, resultImage);
+    return NiftiImage(resultImage);
+}
+
+// Resample into an existing image, such as one volume of a larger result
+void DeformationField::resampleImage (const NiftiImage &sourceImage, const int interpolation, nifti_image *resultImage) const
+{
     reg_resampleImage(sourceImage, resultImage, deformationFieldImage, NULL, interpolation, 0);
+}
 
-    return NiftiImage(resultImage);
+// Check whether two images can share interpolation weights: same data type, voxel grid and xform
+static bool sharesResamplingGrid (const NiftiImage &image1, const NiftiImage &image2)
+{
+    const mat44 &ijk1 = (image1->sform_code > 0 ? image1->sto_ijk : image1->qto_ijk);
+    const mat44 &ijk2 = (image2->sform_code > 0 ? image2->sto_ijk : image2->qto_ijk);
+    return (image1->datatype == image2->datatype && image1->nx == image2->nx && image1->ny == image2->ny && image1->nz == image2->nz && memcmp(&ijk1, &ijk2, sizeof(mat44)) == 0);
 }
 
+std::vector<NiftiImage> DeformationField::resampleImages (const std::vector<NiftiImage> &sourceImages, const int interpolation) const
+{
+    const size_t nImages = sourceImages.size();
+    std::vector<NiftiImage> resultImages(nImages);
+    std::vector<bool> done(nImages, false);
+    
+    // Images sharing a grid and data type are resampled together, with one pass over the field
+    for (size_t i=0; i<nImages; i++)
+    {
+        if (done[i])
+            continue;
+        
+        std::vector<nifti_image *> sourceGroup, resultGroup;
+        for (size_t j=i; j<nImages; j++)
+        {
+            if (!done[j] && sharesResamplingGrid(sourceImages[i], sourceImages[j]))
+            {
+                resultImages[j] = NiftiImage(allocateResultImage(sourceImages[j]));
+                sourceGroup.push_back(sourceImages[j]);
+                resultGroup.push_back(resultImages[j]);
+                done[j] = true;
+            }
+        }
+        
+        reg_resampleImages(&sourceGroup[0], &resultGroup[0], sourceGroup.size(), deformationFieldImage, NULL, interpolation, 0);
+    }
+    
+    return resultImages;
+}
+
+// A uniform grid over the deformed locations of a deformation field, which
+// allows the voxel closest to a point to be found without visiting every voxel
 template <int Dim>
-Rcpp::NumericVector DeformationField::findPoint (const NiftiImage &sourceImage, const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest) const
+class DeformedLocationGrid
 {
+public:
     typedef Eigen::Matrix<double,Dim,1> Point;
-    Point closestLoc = Point::Zero();
     
-    const PRECISION_TYPE *deformationPointer = (const PRECISION_TYPE *) deformationFieldImage->data;
-    const size_t nVoxels = deformationFieldImage->nx * deformationFieldImage->ny * deformationFieldImage->nz;
-    double closestDistance = R_PosInf;
-    size_t closestVoxel = 0;
+protected:
+    const PRECISION_TYPE *deformationPointer;
+    size_t nVoxels;
+    
+    Point origin, upperCorner;
+    double cellSize;
+    int cellCounts[3];
+    std::vector<size_t> cellStarts;
+    std::vector<size_t> cellVoxels;
     
-    for (size_t v=0; v<nVoxels; v++)
+    Point getLocation (const size_t voxel) const
     {
         Point loc;
         for (int i=0; i<Dim; i++)
-            loc[i] = deformationPointer[v + i*nVoxels];
-        
-        const double currentDistance = (loc - sourceLoc).norm();
-        if (currentDistance < closestDistance)
+            loc[i] = deformationPointer[voxel + i*nVoxels];
+        return loc;
+    }
+    
+    // Cell containing a location; locations outside the grid map to the nearest edge cell
+    void getCell (const Point &loc, int *cell) const
+    {
+        cell[2] = 0;
+        for (int i=0; i<Dim; i++)
         {
-            closestDistance = currentDistance;
-            closestVoxel = v;
-            closestLoc = loc;
+            const double index = std::floor((loc[i] - origin[i]) / cellSize);
+            cell[i] = (index < 0.0 ? 0 : (index >= cellCounts[i] ? cellCounts[i] - 1 : int(index)));
         }
     }
     
-    std::vector<size_t> strides(Dim);
-    strides[0] = 1;
-    for (int i=1; i<Dim; i++)
-        strides[i] = strides[i-1] * std::abs(deformationFieldImage->dim[i]);
-    
-    if (nearest || closestDistance == 0.0)
+    void searchCell (const int x, const int y, const int z, const Point &loc, double &closestDistance, size_t &closestVoxel) const
     {
-        Rcpp::NumericVector result(Dim);
-        result[0] = closestVoxel % deformationFieldImage->dim[1] + 1.0;
-        for (int i=1; i<Dim; i++)
-            result[i] = (closestVoxel / strides[i]) % deformationFieldImage->dim[i+1] + 1.0;
+        if (x < 0 || x >= cellCounts[0] || y < 0 || y >= cellCounts[1] || z < 0 || z >= cellCounts[2])
+            return;
         
-        return result;
+        const size_t cell = size_t(x) + size_t(cellCounts[0]) * (size_t(y) + size_t(cellCounts[1]) * size_t(z));
+        for (size_t j=cellStarts[cell]; j<cellStarts[cell+1]; j++)
+        {
+            const size_t v = cellVoxels[j];
+            const double currentDistance = (getLocation(v) - loc).norm();
+            
+            // Ties go to the lowest voxel index, as with an exhaustive search
+            if (currentDistance < closestDistance || (currentDistance == closestDistance && v < closestVoxel))
+            {
+                closestDistance = currentDistance;
+                closestVoxel = v;
+            }
+        }
     }
-    else
+    
+public:
+    DeformedLocationGrid (const nifti_image *deformationField)
     {
-        Rcpp::NumericVector result(int(R_pow_di(4.0,Dim)) * 2 * Dim);
-        const mat44 &xform = sourceImage.xform();
-        Point offset = sourceLoc - closestLoc;
+        deformationPointer = (const PRECISION_TYPE *) deformationField->data;
+        nVoxels = size_t(deformationField->nx) * size_t(deformationField->ny) * size_t(deformationField->nz);
         
+        // Bounding box of the finite deformed locations
+        Point lower = Point::Constant(R_PosInf);
+        Point upper = Point::Constant(R_NegInf);
+        size_t nLocations = 0;
+        for (size_t v=0; v<nVoxels; v++)
+        {
+            const Point loc = getLocation(v);
+            if (loc.allFinite())
+            {
+                lower = lower.cwiseMin(loc);
+                upper = upper.cwiseMax(loc);
+                nLocations++;
+            }
+        }
+        
+        // Aim for a few locations per cell, ignoring flat dimensions
+        origin = (nLocations == 0 ? Point::Zero() : lower);
+        upperCorner = (nLocations == 0 ? Point::Zero() : upper);
+        double volume = 1.0;
+        int nSpannedDims = 0;
         for (int i=0; i<Dim; i++)
-            offset[i] = (offset[i] * xform.m[i][i] >= 0.0 ? 0.0 : -1.0);
+        {
+            if (nLocations > 0 && upper[i] > lower[i])
+            {
+                volume *= upper[i] - lower[i];
+                nSpannedDims++;
+            }
+        }
+        const double targetCells = std::max(1.0, nLocations / 4.0);
+        cellSize = (nSpannedDims == 0 ? 1.0 : std::pow(volume / targetCells, 1.0 / nSpannedDims));
         
-        for (int i=0; i<4; i++)
+        size_t nCells = 1;
+        cellCounts[2] = 1;
+        for (int i=0; i<Dim; i++)
         {
-            const int xShift = i + offset[0] - 1;
-
-            for (int j=0; j<4; j++)
+            cellCounts[i] = (nLocations == 0 ? 1 : int(std::min(std::floor((upper[i] - lower[i]) / cellSize) + 1.0, targetCells)));
+            nCells *= size_t(cellCounts[i]);
+        }
+        
+        // Bucket the voxels by cell, keeping them in index order within each cell
+        std::vector<size_t> voxelCells(nVoxels, nCells);
+        cellStarts.assign(nCells + 1, 0);
+        for (size_t v=0; v<nVoxels; v++)
+        {
+            const Point loc = getLocation(v);
+            if (loc.allFinite())
+            {
+                int cell[3];
+                getCell(loc, cell);
+                voxelCells[v] = size_t(cell[0]) + size_t(cellCounts[0]) * (size_t(cell[1]) + size_t(cellCounts[1]) * size_t(cell[2]));
+                cellStarts[voxelCells[v] + 1]++;
+            }
+        }
+        for (size_t c=0; c<nCells; c++)
+            cellStarts[c+1] += cellStarts[c];
+        
+        cellVoxels.resize(nLocations);
+        std::vector<size_t> cellFill(cellStarts.begin(), cellStarts.end() - 1);
+        for (size_t v=0; v<nVoxels; v++)
+        {
+            if (voxelCells[v] < nCells)
+                cellVoxels[cellFill[voxelCells[v]]++] = v;
+        }
+    }
+    
+    // Search shells of cells around the point until no unvisited cell can hold a closer location
+    size_t findClosestVoxel (const Point &loc, double &closestDistance) const
+    {
+        size_t closestVoxel = 0;
+        closestDistance = R_PosInf;
+        if (!loc.allFinite() || cellVoxels.empty())
+            return closestVoxel;
+        
+        int centre[3];
+        getCell(loc, centre);
+        const int maxRadius = std::max(std::max(cellCounts[0], cellCounts[1]), cellCounts[2]);
+        
+        for (int r=0; r<maxRadius; r++)
+        {
+            const int zStart = std::max(centre[2]-r, 0), zEnd = std::min(centre[2]+r, cellCounts[2]-1);
+            for (int x=std::max(centre[0]-r,0); x<=std::min(centre[0]+r,cellCounts[0]-1); x++)
             {
-                const int yShift = j + offset[1] - 1;
-                
-                if (Dim == 2)
+                for (int y=std::max(centre[1]-r,0); y<=std::min(centre[1]+r,cellCounts[1]-1); y++)
                 {
-                    const size_t v = closestVoxel + xShift + yShift * strides[1];
-                    const size_t w = size_t(i + j*4);
-                
-                    result[2*Dim*w] = deformationPointer[v];
-                    result[2*Dim*w + 1] = deformationPointer[v + nVoxels];
-                    result[2*Dim*w + 2] = v % deformationFieldImage->dim[1] + 1.0;
-                    result[2*Dim*w + 3] = (v / strides[1]) % deformationFieldImage->dim[2] + 1.0;
+                    if (std::abs(x-centre[0]) == r || std::abs(y-centre[1]) == r)
+                    {
+                        for (int z=zStart; z<=zEnd; z++)
+                            searchCell(x, y, z, loc, closestDistance, closestVoxel);
+                    }
+                    else
+                    {
+                        searchCell(x, y, centre[2]-r, loc, closestDistance, closestVoxel);
+                        if (r > 0)
+                            searchCell(x, y, centre[2]+r, loc, closestDistance, closestVoxel);
+                    }
                 }
-                else
+            }
+            
+            // Any location not yet visited lies within the bounding box but beyond one face of the
+            // searched block of cells, so the distance to the nearest such region bounds its
+            // distance from below. The bound is reduced slightly to allow for rounding
+            double bound = R_PosInf;
+            for (int i=0; i<Dim; i++)
+            {
+                for (int side=0; side<2; side++)
                 {
-                    for (int k=0; k<4; k++)
+                    double lower, upper;
+                    if (side == 0 && centre[i] - r > 0)
                     {
-                        const int zShift = k + offset[2] - 1;
-                        const size_t v = closestVoxel + xShift + yShift * strides[1] + zShift * strides[2];
-                        const size_t w = size_t(i + j*4 + k*16);
-                        
-                        result[2*Dim*w] = deformationPointer[v];
-                        result[2*Dim*w + 1] = deformationPointer[v + nVoxels];
-                        result[2*Dim*w + 2] = deformationPointer[v + 2*nVoxels];
-                        result[2*Dim*w + 3] = v % deformationFieldImage->dim[1] + 1.0;
-                        result[2*Dim*w + 4] = (v / strides[1]) % deformationFieldImage->dim[2] + 1.0;
-                        result[2*Dim*w + 5] = (v / strides[2]) % deformationFieldImage->dim[3] + 1.0;
+                        lower = R_NegInf;
+                        upper = origin[i] + (centre[i] - r) * cellSize;
                     }
+                    else if (side == 1 && centre[i] + r < cellCounts[i] - 1)
+                    {
+                        lower = origin[i] + (centre[i] + r + 1) * cellSize;
+                        upper = R_PosInf;
+                    }
+                    else
+                        continue;
+                    
+                    double squaredDistance = 0.0;
+                    for (int j=0; j<Dim; j++)
+                    {
+                        const double jLower = (j == i ? lower : origin[j]);
+                        const double jUpper = (j == i ? upper : upperCorner[j]);
+                        const double gap = (loc[j] < jLower ? jLower - loc[j] : (loc[j] > jUpper ? loc[j] - jUpper : 0.0));
+                        squaredDistance += gap * gap;
+                    }
+                    bound = std::min(bound, std::sqrt(squaredDistance));
                 }
             }
+            if (closestDistance < bound - 1e-6 * cellSize)
+                break;
         }
         
-        return result;
+        return closestVoxel;
     }
+};
+
+// Inverts the transformation locally around a point by Newton iteration, using
+// the cubic B-spline control point grid where one is available, and linear
+// interpolation of the deformation field otherwise
+template <int Dim>
+class LocalTransformationInverter
+{
+public:
+    typedef Eigen::Matrix<double,Dim,1> Point;
+    typedef Eigen::Matrix<double,Dim,Dim> Matrix;
+    
+protected:
+    const nifti_image *deformationField;
+    const nifti_image *controlPointGrid;
+    
+    Matrix targetToWorld, worldToGrid, gridToWorld, affine;
+    Point targetOffset, gridOffset, affineOffset;
+    bool hasAffine;
+    double tolerance;
+    
+    static void getMatrix (const mat44 &xform, Matrix &matrix, Point &offset)
+    {
+        for (int i=0; i<Dim; i++)
+        {
+            for (int j=0; j<Dim; j++)
+                matrix(i,j) = xform.m[i][j];
+            offset[i] = xform.m[i][3];
+        }
+    }
+    
+    static void getBSplineBasis (const double basis, double *values, double *first)
+    {
+        const double squared = basis * basis;
+        const double complement = 1.0 - basis;
+        values[0] = complement * complement * complement / 6.0;
+        values[1] = (3.0*squared*basis - 6.0*squared + 4.0) / 6.0;
+        values[2] = (-3.0*squared*basis + 3.0*squared + 3.0*basis + 1.0) / 6.0;
+        values[3] = squared * basis / 6.0;
+        first[0] = -complement * complement / 2.0;
+        first[1] = (3.0*squared - 4.0*basis) / 2.0;
+        first[2] = (-3.0*squared + 2.0*basis + 1.0) / 2.0;
+        first[3] = squared / 2.0;
+    }
+    
+    // Value of a field or grid at an integer location, slid beyond its edges as in NiftyReg
+    Point getNodeValue (const nifti_image *image, const Matrix &voxelToWorld, const int *index) const
+    {
+        const size_t nVoxels = size_t(image->nx) * size_t(image->ny) * size_t(image->nz);
+        Point shift;
+        size_t voxel = 0, stride = 1;
+        for (int i=0; i<Dim; i++)
+        {
+            const int clamped = std::min(std::max(index[i], 0), image->dim[i+1] - 1);
+            shift[i] = index[i] - clamped;
+            voxel += clamped * stride;
+            stride *= size_t(image->dim[i+1]);
+        }
+        
+        const PRECISION_TYPE *data = (const PRECISION_TYPE *) image->data;
+        Point value;
+        for (int i=0; i<Dim; i++)
+            value[i] = data[voxel + i*nVoxels];
+        return value + voxelToWorld * shift;
+    }
+    
+public:
+    LocalTransformationInverter (const nifti_image *deformationField, const nifti_image *controlPointGrid)
+        : deformationField(deformationField), controlPointGrid(controlPointGrid), hasAffine(false)
+    {
+        getMatrix(deformationField->sform_code > 0 ? deformationField->sto_xyz : deformationField->qto_xyz, targetToWorld, targetOffset);
+        
+        // Converge to a small fraction of a voxel
+        tolerance = 1e-6 * targetToWorld.colwise().norm().minCoeff();
+        
+        if (controlPointGrid != NULL)
+        {
+            getMatrix(controlPointGrid->sform_code > 0 ? controlPointGrid->sto_ijk : controlPointGrid->qto_ijk, worldToGrid, gridOffset);
+            Point unused;
+            getMatrix(controlPointGrid->sform_code > 0 ? controlPointGrid->sto_xyz : controlPointGrid->qto_xyz, gridToWorld, unused);
+            
+            // An affine transformation stored with the grid is applied before it
+            if (controlPointGrid->num_ext > 0 && controlPointGrid->ext_list[0].edata != NULL)
+            {
+                getMatrix(*reinterpret_cast<const mat44 *>(controlPointGrid->ext_list[0].edata), affine, affineOffset);
+                hasAffine = true;
+            }
+        }
+    }
+    
+    // Source space location of a target voxel, and its derivatives with respect to the voxel coordinates
+    void evaluate (const Point &targetVoxel, Point &value, Matrix &jacobian) const
+    {
+        int start[Dim];
+        double basis[Dim][4], first[Dim][4];
+        int nNodes;
+        Matrix nodeToTarget;
+        
+        value.setZero();
+        jacobian.setZero();
+        
+        if (controlPointGrid != NULL)
+        {
+            Point location = targetToWorld * targetVoxel + targetOffset;
+            Matrix locationToTarget = targetToWorld;
+            if (hasAffine)
+            {
+                location = affine * location + affineOffset;
+                locationToTarget = affine * locationToTarget;
+            }
+            const Point gridVoxel = worldToGrid * location + gridOffset;
+            nodeToTarget = worldToGrid * locationToTarget;
+            
+            for (int i=0; i<Dim; i++)
+            {
+                const double floor = std::floor(gridVoxel[i]);
+                start[i] = int(floor) - 1;
+                getBSplineBasis(gridVoxel[i] - floor, basis[i], first[i]);
+            }
+            nNodes = 4;
+        }
+        else
+        {
+            for (int i=0; i<Dim; i++)
+            {
+                const double floor = std::floor(targetVoxel[i]);
+                const double fraction = targetVoxel[i] - floor;
+                start[i] = int(floor);
+                basis[i][0] = 1.0 - fraction;
+                basis[i][1] = fraction;
+                first[i][0] = -1.0;
+                first[i][1] = 1.0;
+            }
+            nodeToTarget = Matrix::Identity();
+            nNodes = 2;
+        }
+        
+        // Accumulate over the nodes supporting the location, with the derivative
+        // taken first with respect to the node coordinates
+        Matrix nodeJacobian = Matrix::Zero();
+        int offsets[Dim] = { 0 };
+        while (true)
+        {
+            int index[Dim];
+            double weight = 1.0;
+            Point weightDerivative = Point::Ones();
+            for (int i=0; i<Dim; i++)
+            {
+                index[i] = start[i] + offsets[i];
+                weight *= basis[i][offsets[i]];
+                for (int j=0; j<Dim; j++)
+                    weightDerivative[j] *= (i == j ? first[i][offsets[i]] : basis[i][offsets[i]]);
+            }
+            
+            const Point node = (controlPointGrid != NULL ? getNodeValue(controlPointGrid, gridToWorld, index) : getNodeValue(deformationField, targetToWorld, index));
+            value += weight * node;
+            nodeJacobian += node * weightDerivative.transpose();
+            
+            int i = 0;
+            while (i < Dim && ++offsets[i] == nNodes)
+                offsets[i++] = 0;
+            if (i == Dim)
+                break;
+        }
+        
+        jacobian = nodeJacobian * nodeToTarget;
+    }
+    
+    // Refine the target voxel location, given a starting estimate, whose image is closest to the source location
+    void invert (const Point &sourceLoc, Point &targetVoxel) const
+    {
+        Point value;
+        Matrix jacobian;
+        evaluate(targetVoxel, value, jacobian);
+        double error = (value - sourceLoc).norm();
+        
+        for (int iteration=0; iteration<50 && error > tolerance; iteration++)
+        {
+            if (std::abs(jacobian.determinant()) < 1e-12)
+                break;
+            const Point step = jacobian.inverse() * (value - sourceLoc);
+            
+            // Shorten the step until the mismatch decreases
+            bool improved = false;
+            for (double scale=1.0; scale>1e-3 && !improved; scale*=0.5)
+            {
+                const Point candidate = targetVoxel - scale * step;
+                Point candidateValue;
+                Matrix candidateJacobian;
+                evaluate(candidate, candidateValue, candidateJacobian);
+                const double candidateError = (candidateValue - sourceLoc).norm();
+                if (candidateError < error)
+                {
+                    targetVoxel = candidate;
+                    value = candidateValue;
+                    jacobian = candidateJacobian;
+                    error = candidateError;
+                    improved = true;
+                }
+            }
+            
+            if (!improved)
+                break;
+        }
+    }
+};
+
+template <int Dim>
+Rcpp::NumericMatrix DeformationField::findPoints (const Rcpp::NumericMatrix &points, const bool nearest) const
+{
+    typedef Eigen::Matrix<double,Dim,1> Point;
+    
+    int nPoints = points.nrow();
+    std::vector<double> coordinates(points.begin(), points.end());
+    Rcpp::NumericMatrix result(nPoints, Dim);
+    double *resultPointer = result.begin();
+    
+    // The index and inverter are built once, and used concurrently since they are not modified
+    DeformedLocationGrid<Dim> grid(deformationFieldImage);
+    const nifti_image *controlPointGrid = (transformationImage.isNull() ? NULL : (const nifti_image *) transformationImage);
+    LocalTransformationInverter<Dim> inverter(deformationFieldImage, controlPointGrid);
+    const int nx = deformationFieldImage->nx;
+    const int ny = deformationFieldImage->ny;
+    
+    int i;
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+    shared(grid, inverter, nPoints, coordinates, resultPointer, nearest, nx, ny) \
+    private(i)
+#endif
+    for (i=0; i<nPoints; i++)
+    {
+        Point sourceLoc;
+        for (int j=0; j<Dim; j++)
+            sourceLoc[j] = coordinates[i + j*nPoints];
+        
+        double closestDistance;
+        const size_t closestVoxel = grid.findClosestVoxel(sourceLoc, closestDistance);
+        if (!R_FINITE(closestDistance))
+        {
+            for (int j=0; j<Dim; j++)
+                resultPointer[i + j*nPoints] = NA_REAL;
+            continue;
+        }
+        
+        Point targetVoxel;
+        targetVoxel[0] = closestVoxel % nx;
+        targetVoxel[1] = (closestVoxel / nx) % ny;
+        if (Dim > 2)
+            targetVoxel[Dim-1] = closestVoxel / (size_t(nx) * size_t(ny));
+        
+        if (!nearest && closestDistance > 0.0)
+            inverter.invert(sourceLoc, targetVoxel);
+        
+        // R indices are one-based
+        for (int j=0; j<Dim; j++)
+            resultPointer[i + j*nPoints] = targetVoxel[j] + 1.0;
+    }
+    
+    return result;
 }
 
 void DeformationField::compose (const DeformationField &otherField)
@@ -218,7 +651,7 @@ void DeformationField::compose (const DeformationField &otherField)
 }
 
 template
-Rcpp::NumericVector DeformationField::findPoint (const NiftiImage &sourceImage, const Eigen::Matrix<double,2,1> &sourceLoc, const bool nearest) const;
+Rcpp::NumericMatrix DeformationField::findPoints<2> (const Rcpp::NumericMatrix &points, const bool nearest) const;
 
 template
-Rcpp::NumericVector DeformationField::findPoint (const NiftiImage &sourceImage, const Eigen::Matrix<double,3,1> &sourceLoc, const bool nearest) const;
+Rcpp::NumericMatrix DeformationField::findPoints<3> (const Rcpp::NumericMatrix &points, const bool nearest) const;
@@ -15,22 +15,35 @@ class DeformationField
 protected:
     NiftiImage deformationFieldImage;
     NiftiImage targetImage;
+    NiftiImage transformationImage;
     
     void initImages (const NiftiImage &targetImage);
+    nifti_image * allocateResultImage (const NiftiImage &sourceImage, const int datatype = DT_NONE) const;
     
 public:
     DeformationField () {}
     DeformationField (const NiftiImage &targetImage, const AffineMatrix &affine, const bool compose = false);
     DeformationField (const NiftiImage &targetImage, const NiftiImage &transformationImage, const bool compose = false);
     
+    // Copy a field, duplicating its data so that the copy can be modified independently
+    DeformationField (const DeformationField &otherField, const bool copyData)
+        : deformationFieldImage(otherField.deformationFieldImage, copyData), targetImage(otherField.targetImage), transformationImage(otherField.transformationImage) {}
+    
     NiftiImage getFieldImage () const { return deformationFieldImage; }
     
     NiftiImage getJacobian () const;
     
-    NiftiImage resampleImage (const NiftiImage &sourceImage, const int interpolation) const;
+    // The result has the data type of the source image unless another one is given
+    NiftiImage resampleImage (const NiftiImage &sourceImage, const int interpolation, const int datatype = DT_NONE) const;
+    void resampleImage (const NiftiImage &sourceImage, const int interpolation, nifti_image *resultImage) const;
+    
+    // Resample several images at once, sharing the interpolation weights between those on the same grid
+    std::vector<NiftiImage> resampleImages (const std::vector<NiftiImage> &sourceImages, const int interpolation) const;
     
+    // Find the target locations corresponding to each row of the points matrix,
+    // either as the nearest voxel or by inverting the transformation locally
     template <int Dim>
-    Rcpp::NumericVector findPoint (const NiftiImage &sourceImage, const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest) const;
+    Rcpp::NumericMatrix findPoints (const Rcpp::NumericMatrix &points, const bool nearest) const;
     
     void compose (const DeformationField &otherField);
 };
@@ -8,8 +8,9 @@
 #include "AffineMatrix.h"
 #include "DeformationField.h"
 
-// Run the "aladin" registration algorithm
-AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const AffineMatrix &initAffine, const bool verbose, const bool estimateOnly)
+// Run the "aladin" registration algorithm, working in single or double precision
+template <typename PrecisionType>
+AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int captureRange, const bool hierarchicalSearch, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const AffineMatrix &initAffine, const bool verbose, const bool estimateOnly, reg_sharedReference<PrecisionType> *sharedTarget, nifti_image *outputImage)
 {
     // Binarise the mask images
     if (!sourceMaskImage.isNull())
@@ -17,25 +18,26 @@ AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetI
     if (!targetMaskImage.isNull())
         reg_tools_binarise_image(targetMaskImage);
     
-    // The source data type is changed for interpolation precision if necessary
-    if (interpolation != 0)
-        reg_tools_changeDatatype<PRECISION_TYPE>(sourceImage);
-    
     AladinResult result;
     
     if (nLevels == 0)
     {
+        // The source image is read in its own data type, but interpolated intensities are stored in the working precision
+        const int resultDatatype = (interpolation == 0 ? DT_NONE : (sizeof(PrecisionType) == 4 ? DT_FLOAT32 : DT_FLOAT64));
         DeformationField deformationField(targetImage, initAffine);
-        result.image = deformationField.resampleImage(sourceImage, interpolation);
+        if (outputImage != NULL)
+            deformationField.resampleImage(sourceImage, interpolation, outputImage);
+        else
+            result.image = deformationField.resampleImage(sourceImage, interpolation, resultDatatype);
         result.forwardTransform = initAffine;
     }
     else
     {
-        reg_aladin<PRECISION_TYPE> *reg;
+        reg_aladin<PrecisionType> *reg;
         if (symmetric)
-            reg = new reg_aladin_sym<PRECISION_TYPE>;
+            reg = new reg_aladin_sym<PrecisionType>;
         else
-            reg = new reg_aladin<PRECISION_TYPE>;
+            reg = new reg_aladin<PrecisionType>;
     
         reg->SetMaxIterations(maxIterations);
         reg->SetNumberOfLevels(nLevels);
@@ -51,10 +53,11 @@ AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetI
         reg->SetInlierLts(50.0);
         reg->SetInterpolation(interpolation);
         reg->setPlatformCode(NR_PLATFORM_CPU);
-        reg->setCaptureRangeVox(3);
+        reg->setCaptureRangeVox(captureRange);
+        reg->setHierarchicalSearch(hierarchicalSearch);
         
-        reg->SetFloatingLowerThreshold(-std::numeric_limits<PRECISION_TYPE>::max());
-        reg->SetFloatingUpperThreshold(std::numeric_limits<PRECISION_TYPE>::max());
+        reg->SetFloatingLowerThreshold(-std::numeric_limits<PrecisionType>::max());
+        reg->SetFloatingUpperThreshold(std::numeric_limits<PrecisionType>::max());
         
         // Set the reference and floating images
         reg->SetInputReference(targetImage);
@@ -70,11 +73,17 @@ AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetI
         if (!targetMaskImage.isNull())
             reg->SetInputMask(targetMaskImage);
     
+        // Reuse the target pyramids if they have already been computed
+        if (sharedTarget != NULL)
+            reg->SetSharedReference(sharedTarget);
+    
         // Run the registration
         reg->Run();
     
-        // Store the results
-        if (!estimateOnly)
+        // Store the results, writing the image into the output buffer if there is one
+        if (!estimateOnly && outputImage != NULL)
+            reg->GetFinalWarpedImage(outputImage);
+        else if (!estimateOnly)
             result.image = NiftiImage(reg->GetFinalWarpedImage());
         result.forwardTransform = AffineMatrix(*reg->GetTransformationMatrix());
         result.iterations = reg->GetCompletedIterations();
@@ -87,3 +96,6 @@ AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetI
     
     return result;
 }
+
+template AladinResult regAladin<float> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int captureRange, const bool hierarchicalSearch, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const AffineMatrix &initAffine, const bool verbose, const bool estimateOnly, reg_sharedReference<float> *sharedTarget, nifti_image *outputImage);
+template AladinResult regAladin<double> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int captureRange, const bool hierarchicalSearch, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const AffineMatrix &initAffine, const bool verbose, const bool estimateOnly, reg_sharedReference<double> *sharedTarget, nifti_image *outputImage);
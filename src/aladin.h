@@ -3,6 +3,9 @@
 
 #include "RNifti.h"
 #include "AffineMatrix.h"
+#include "config.h"
+
+template <class T> class reg_sharedReference;
 
 enum LinearTransformScope { RigidScope, AffineScope };
 
@@ -14,6 +17,7 @@ struct AladinResult
     std::vector<int> iterations;
 };
 
-AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const AffineMatrix &initAffine, const bool verbose, const bool estimateOnly);
+template <typename PrecisionType>
+AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int captureRange, const bool hierarchicalSearch, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const AffineMatrix &initAffine, const bool verbose, const bool estimateOnly, reg_sharedReference<PrecisionType> *sharedTarget = NULL, nifti_image *outputImage = NULL);
 
 #endif
@@ -0,0 +1,270 @@
+// Timing of the main reg-lib kernels for inst/benchmarks/benchmark.R. This is
+// only compiled when RNIFTYREG_BENCHMARK is defined (see Makevars), so that
+// regular installations do not carry the benchmark entry points
+#ifdef RNIFTYREG_BENCHMARK
+
+#include <RcppEigen.h>
+
+#include "RNifti.h"
+
+#include "_reg_resampling.h"
+#include "_reg_localTrans.h"
+#include "_reg_localTrans_simd.h"
+#include "_reg_blockMatching.h"
+#include "_reg_nmi.h"
+#include "_reg_lncc.h"
+#include "_reg_tools.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Working precision of the benchmarked kernels, as for the registration functions
+#define PRECISION_DOUBLE    0
+#define PRECISION_SINGLE    1
+
+using namespace Rcpp;
+
+// Wall-clock time in seconds; without OpenMP the kernels run on one thread,
+// so processor time is equivalent
+static double benchmarkTime ()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return double(clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+// Creates a synthetic image made of a few smooth waves and some texture. The
+// texture comes from a linear congruential generator, so that the volumes are
+// identical on every platform and between releases
+template <typename PrecisionType>
+static nifti_image * createVolume (const std::vector<int> &dim, const int nComponents, const int seed)
+{
+    if (dim.size() < 2 || dim.size() > 3)
+        throw std::runtime_error("Benchmark volumes must be two- or three-dimensional");
+
+    int dims[8] = { int(dim.size()), dim[0], dim[1], (dim.size() > 2 ? dim[2] : 1), 1, 1, 1, 1 };
+    if (nComponents > 1)
+    {
+        dims[0] = 5;
+        dims[5] = nComponents;
+    }
+    nifti_image *image = nifti_make_new_nim(dims, (sizeof(PrecisionType)==4 ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64), 1);
+    image->sform_code = NIFTI_XFORM_SCANNER_ANAT;
+    reg_mat44_eye(&image->sto_xyz);
+    image->sto_ijk = nifti_mat44_inverse(image->sto_xyz);
+
+    unsigned int state = 12345u + 1000u * (unsigned int) seed;
+    PrecisionType *data = static_cast<PrecisionType *>(image->data);
+    size_t index = 0;
+    for (int c=0; c<nComponents; c++)
+    {
+        for (int z=0; z<image->nz; z++)
+        {
+            for (int y=0; y<image->ny; y++)
+            {
+                for (int x=0; x<image->nx; x++)
+                {
+                    state = 1664525u * state + 1013904223u;
+                    const double noise = double(state >> 8) / 16777216.0;
+                    data[index++] = PrecisionType(100.0 + 40.0 * sin(0.13*x + 0.05*y + 0.09*z + seed + c) + 30.0 * cos(0.07*x - 0.11*y + 0.04*z + c) + 10.0 * noise);
+                }
+            }
+        }
+    }
+    return image;
+}
+
+// Turns a synthetic image with one component per dimension into a smooth
+// deformation field, whose displacements are of a few voxels
+template <typename PrecisionType>
+static void toDeformationField (nifti_image *image)
+{
+    PrecisionType *data = static_cast<PrecisionType *>(image->data);
+    for (size_t i=0; i<image->nvox; i++)
+        data[i] = PrecisionType((data[i] - 100.0) / 40.0);
+    image->intent_p1 = DISP_FIELD;
+    reg_getDeformationFromDisplacement(image);
+}
+
+// Times one of the reg-lib kernels, the data being restored before each
+// repetition for the kernels which update their input
+template <typename PrecisionType>
+static NumericVector timeKernel (const std::string &kernel, const std::vector<int> &dim, const int repeats)
+{
+    const int nDims = int(dim.size());
+    NiftiImage reference(createVolume<PrecisionType>(dim, 1, 1));
+    NiftiImage floating(createVolume<PrecisionType>(dim, 1, 2));
+    NiftiImage field(createVolume<PrecisionType>(dim, nDims, 3));
+    toDeformationField<PrecisionType>(field);
+    std::vector<int> mask(reference->nvox, 0);
+
+    NumericVector times(repeats);
+    double start;
+
+    if (kernel == "resampleNearest" || kernel == "resampleLinear" || kernel == "resampleCubic")
+    {
+        const int interpolation = (kernel == "resampleNearest" ? 0 : (kernel == "resampleLinear" ? 1 : 3));
+        NiftiImage warped(reference, true);
+        for (int r=0; r<repeats; r++)
+        {
+            start = benchmarkTime();
+            reg_resampleImage(floating, warped, field, &mask[0], interpolation, 0.0f);
+            times[r] = benchmarkTime() - start;
+        }
+    }
+    else if (kernel == "splineDeformationField" || kernel == "bendingEnergyGradient")
+    {
+        nifti_image *grid = NULL;
+        float spacing[3] = { 5.0f, 5.0f, 5.0f };
+        reg_createControlPointGrid<PrecisionType>(&grid, reference, spacing);
+        NiftiImage gridImage(grid);
+        NiftiImage displacement(createVolume<PrecisionType>(std::vector<int>(gridImage->dim+1, gridImage->dim+1+nDims), nDims, 4));
+        PrecisionType *gridData = static_cast<PrecisionType *>(gridImage->data);
+        const PrecisionType *displacementData = static_cast<const PrecisionType *>(displacement->data);
+        reg_getDeformationFromDisplacement(gridImage);
+        for (size_t i=0; i<gridImage->nvox; i++)
+            gridData[i] += PrecisionType((displacementData[i] - 100.0) / 40.0);
+
+        if (kernel == "splineDeformationField")
+        {
+            for (int r=0; r<repeats; r++)
+            {
+                start = benchmarkTime();
+                reg_spline_getDeformationField(gridImage, field, &mask[0], false, true);
+                times[r] = benchmarkTime() - start;
+            }
+        }
+        else
+        {
+            NiftiImage gradient(gridImage, true);
+            for (int r=0; r<repeats; r++)
+            {
+                reg_tools_multiplyValueToImage(gradient, gradient, 0.0f);
+                start = benchmarkTime();
+                reg_spline_approxBendingEnergyGradient(gridImage, gradient, 0.01f);
+                times[r] = benchmarkTime() - start;
+            }
+        }
+    }
+    else if (kernel == "nmi" || kernel == "nmiGradient" || kernel == "lncc")
+    {
+        // The measures rescale the floating image, which is also used as the warped image
+        NiftiImage warpedGradient(createVolume<PrecisionType>(dim, nDims, 5));
+        NiftiImage voxelGradient(warpedGradient, true);
+        reg_tools_multiplyValueToImage(voxelGradient, voxelGradient, 0.0f);
+
+        if (kernel == "lncc")
+        {
+            reg_lncc measure;
+            measure.SetKernelStandardDeviation(0, -5.0f);
+            measure.InitialiseMeasure(reference, floating, &mask[0], floating, warpedGradient, voxelGradient);
+            for (int r=0; r<repeats; r++)
+            {
+                // The local statistics would otherwise be reused
+                measure.SetWarpedImageUpdated();
+                start = benchmarkTime();
+                measure.GetSimilarityMeasureValue();
+                times[r] = benchmarkTime() - start;
+            }
+        }
+        else
+        {
+            reg_nmi measure;
+            measure.SetActiveTimepoint(0);
+            measure.InitialiseMeasure(reference, floating, &mask[0], floating, warpedGradient, voxelGradient);
+            if (kernel == "nmiGradient")
+                measure.GetSimilarityMeasureValue();
+            for (int r=0; r<repeats; r++)
+            {
+                reg_tools_multiplyValueToImage(voxelGradient, voxelGradient, 0.0f);
+                start = benchmarkTime();
+                if (kernel == "nmi")
+                    measure.GetSimilarityMeasureValue();
+                else
+                    measure.GetVoxelBasedSimilarityMeasureGradient();
+                times[r] = benchmarkTime() - start;
+            }
+        }
+    }
+    else if (kernel == "blockMatching")
+    {
+        _reg_blockMatchingParam params;
+        initialise_block_matching_method(reference, &params, 50, 50, 1, &mask[0]);
+        for (int r=0; r<repeats; r++)
+        {
+            start = benchmarkTime();
+            block_matching_method(reference, floating, &params, &mask[0]);
+            times[r] = benchmarkTime() - start;
+        }
+    }
+    else if (kernel == "convolution")
+    {
+        NiftiImage smoothed(reference, true);
+        float sigma = 2.0f;
+        for (int r=0; r<repeats; r++)
+        {
+            memcpy(smoothed->data, reference->data, reference->nvox * reference->nbyper);
+            start = benchmarkTime();
+            reg_tools_kernelConvolution(smoothed, &sigma, 0);
+            times[r] = benchmarkTime() - start;
+        }
+    }
+    else if (kernel == "composeDeformationFields")
+    {
+        NiftiImage original(createVolume<PrecisionType>(dim, nDims, 6));
+        toDeformationField<PrecisionType>(original);
+        NiftiImage updated(original, true);
+        for (int r=0; r<repeats; r++)
+        {
+            memcpy(updated->data, original->data, original->nvox * original->nbyper);
+            start = benchmarkTime();
+            reg_defField_compose(field, updated, &mask[0]);
+            times[r] = benchmarkTime() - start;
+        }
+    }
+    else
+        throw std::runtime_error("Unknown benchmark kernel \"" + kernel + "\"");
+
+    return times;
+}
+
+RcppExport SEXP benchmarkInfo ()
+{
+BEGIN_RCPP
+#ifdef _OPENMP
+    const bool openmp = true;
+    const int threads = omp_get_max_threads();
+#else
+    const bool openmp = false;
+    const int threads = 1;
+#endif
+    return List::create(Named("openmp")=openmp, Named("threads")=threads, Named("simd")=std::string(reg_spline_getTensorProductName()));
+END_RCPP
+}
+
+RcppExport SEXP benchmarkVolume (SEXP _dim, SEXP _seed)
+{
+BEGIN_RCPP
+    NiftiImage image(createVolume<double>(as<std::vector<int> >(_dim), 1, as<int>(_seed)));
+    return image.toArray();
+END_RCPP
+}
+
+RcppExport SEXP benchmarkKernel (SEXP _kernel, SEXP _dim, SEXP _repeats, SEXP _precision)
+{
+BEGIN_RCPP
+    const std::string kernel = as<std::string>(_kernel);
+    const std::vector<int> dim = as<std::vector<int> >(_dim);
+    const int repeats = as<int>(_repeats);
+
+    if (as<int>(_precision) == PRECISION_SINGLE)
+        return timeKernel<float>(kernel, dim, repeats);
+    else
+        return timeKernel<double>(kernel, dim, repeats);
+END_RCPP
+}
+
+#endif // RNIFTYREG_BENCHMARK
@@ -9,7 +9,9 @@
 #include "AffineMatrix.h"
 #include "DeformationField.h"
 
-F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly)
+// Run the "f3d" registration algorithm, working in single or double precision
+template <typename PrecisionType>
+F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly, const int memoryLimit, reg_sharedReference<PrecisionType> *sharedTarget, nifti_image *outputImage)
 {
     // Binarise the mask images
     if (!sourceMaskImage.isNull())
@@ -17,40 +19,41 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
     if (!targetMaskImage.isNull())
         reg_tools_binarise_image(targetMaskImage);
     
-    // Change data types for interpolation precision if necessary
-    if (interpolation != 0)
-    {
-        reg_tools_changeDatatype<double>(sourceImage);
-        if (symmetric)
-            reg_tools_changeDatatype<double>(targetImage);
-    }
-    
     F3dResult result;
+    result.peakMemory = 0.0;
     
     if (nLevels == 0)
     {
+        // The source image is read in its own data type, but interpolated intensities are stored in the working precision
+        const int resultDatatype = (interpolation == 0 ? DT_NONE : (sizeof(PrecisionType) == 4 ? DT_FLOAT32 : DT_FLOAT64));
         if (!initControlPoints.isNull())
         {
             result.forwardTransform = initControlPoints;
             DeformationField deformationField(targetImage, initControlPoints);
-            result.image = deformationField.resampleImage(sourceImage, interpolation);
+            if (outputImage != NULL)
+                deformationField.resampleImage(sourceImage, interpolation, outputImage);
+            else
+                result.image = deformationField.resampleImage(sourceImage, interpolation, resultDatatype);
         }
         else
         {
             DeformationField deformationField(targetImage, initAffine);
             result.forwardTransform = deformationField.getFieldImage();
-            result.image = deformationField.resampleImage(sourceImage, interpolation);
+            if (outputImage != NULL)
+                deformationField.resampleImage(sourceImage, interpolation, outputImage);
+            else
+                result.image = deformationField.resampleImage(sourceImage, interpolation, resultDatatype);
         }
     }
     else
     {
-        reg_f3d<PRECISION_TYPE> *reg = NULL;
+        reg_f3d<PrecisionType> *reg = NULL;
 
         // Create the reg_f3d object
         if (symmetric)
-            reg = new reg_f3d2<PRECISION_TYPE>(targetImage->nt, sourceImage->nt);
+            reg = new reg_f3d2<PrecisionType>(targetImage->nt, sourceImage->nt);
         else
-            reg = new reg_f3d<PRECISION_TYPE>(targetImage->nt, sourceImage->nt);
+            reg = new reg_f3d<PrecisionType>(targetImage->nt, sourceImage->nt);
         
 #ifdef _OPENMP
         const int maxThreadNumber = omp_get_max_threads();
@@ -72,6 +75,10 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
         if (!targetMaskImage.isNull())
             reg->SetReferenceMask(targetMaskImage);
         
+        // Reuse the target pyramids if they have already been computed
+        if (sharedTarget != NULL)
+            reg->SetSharedReference(sharedTarget);
+        
         mat44 affineMatrix;
         if (!initControlPoints.isNull())
             reg->SetControlPointGridImage(initControlPoints);
@@ -88,10 +95,13 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
         reg->SetMaximalIterationNumber(maxIterations);
         
         for (int i = 0; i < 3; i++)
-            reg->SetSpacing(unsigned(i), PRECISION_TYPE(spacing[i]));
+            reg->SetSpacing(unsigned(i), PrecisionType(spacing[i]));
         
         reg->SetLevelNumber(nLevels);
         reg->SetLevelToPerform(nLevels);
+        
+        if (memoryLimit > 0)
+            reg->SetMemoryLimitMB(memoryLimit);
 
         if (interpolation == 3)
             reg->UseCubicSplineInterpolation();
@@ -103,12 +113,23 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
         // Run the registration
         reg->Run();
         
-        if (!estimateOnly)
-            result.image = NiftiImage(reg->GetWarpedImage()[0]);
+        // Write the image into the output buffer if there is one
+        if (!estimateOnly && outputImage != NULL)
+            reg->GetWarpedImage(outputImage);
+        else if (!estimateOnly)
+        {
+            nifti_image **warpedImages = reg->GetWarpedImage();
+            result.image = NiftiImage(warpedImages[0]);
+            if (warpedImages[1] != NULL)
+                nifti_image_free(warpedImages[1]);
+            free(warpedImages);
+        }
         result.forwardTransform = NiftiImage(reg->GetControlPointPositionImage());
         if (symmetric)
             result.reverseTransform = NiftiImage(reg->GetBackwardControlPointPositionImage());
         result.iterations = reg->GetCompletedIterations();
+        result.peakMemory = reg->GetPeakMemoryMB();
+        result.levelMemory = reg->GetLevelPeakMemoryMB();
         
         // Erase the registration object
         delete reg;
@@ -116,3 +137,44 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
     
     return result;
 }
+
+template F3dResult regF3d<float> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly, const int memoryLimit, reg_sharedReference<float> *sharedTarget, nifti_image *outputImage);
+template F3dResult regF3d<double> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly, const int memoryLimit, reg_sharedReference<double> *sharedTarget, nifti_image *outputImage);
+
+// Estimate the peak memory of a registration, in MB, from the image dimensions
+template <typename PrecisionType>
+int estimateF3dMemory (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const std::vector<float> &spacing, const bool symmetric)
+{
+    if (nLevels == 0)
+        return 0;
+    
+    // Only the image headers are needed; a source image with an extra
+    // dimension holds one image per registration
+    NiftiImage sourceHeader(nifti_copy_nim_info(sourceImage));
+    if (sourceImage.nDims() > targetImage.nDims())
+    {
+        sourceHeader->dim[0] = targetImage.nDims();
+        sourceHeader->dim[sourceImage.nDims()] = 1;
+        nifti_update_dims_from_array(sourceHeader);
+    }
+    
+    reg_f3d<PrecisionType> *reg = NULL;
+    if (symmetric)
+        reg = new reg_f3d2<PrecisionType>(targetImage->nt, sourceHeader->nt);
+    else
+        reg = new reg_f3d<PrecisionType>(targetImage->nt, sourceHeader->nt);
+    
+    reg->SetReferenceImage(targetImage);
+    reg->SetFloatingImage(sourceHeader);
+    for (int i = 0; i < 3; i++)
+        reg->SetSpacing(unsigned(i), PrecisionType(spacing[i]));
+    reg->SetLevelNumber(nLevels);
+    reg->SetLevelToPerform(nLevels);
+    
+    const int memory = reg->CheckMemoryMB();
+    delete reg;
+    return memory;
+}
+
+template int estimateF3dMemory<float> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const std::vector<float> &spacing, const bool symmetric);
+template int estimateF3dMemory<double> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const std::vector<float> &spacing, const bool symmetric);
@@ -3,6 +3,9 @@
 
 #include "RNifti.h"
 #include "AffineMatrix.h"
+#include "config.h"
+
+template <class T> class reg_sharedReference;
 
 struct F3dResult
 {
@@ -10,8 +13,14 @@ struct F3dResult
     NiftiImage forwardTransform;
     NiftiImage reverseTransform;
     std::vector<int> iterations;
+    double peakMemory;
+    std::vector<double> levelMemory;
 };
 
-F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly);
+template <typename PrecisionType>
+F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly, const int memoryLimit = 0, reg_sharedReference<PrecisionType> *sharedTarget = NULL, nifti_image *outputImage = NULL);
+
+template <typename PrecisionType>
+int estimateF3dMemory (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const std::vector<float> &spacing, const bool symmetric);
 
 #endif
@@ -4,14 +4,20 @@
 
 #include "config.h"
 #include "DeformationField.h"
+#include "CompiledTransform.h"
 #include "aladin.h"
 #include "f3d.h"
 #include "_reg_nmi.h"
+#include "_reg_sharedReference.h"
 
 // Registration types (degrees of freedom)
 #define TYPE_RIGID  0
 #define TYPE_AFFINE 1
 
+// Working precision of the registration algorithms
+#define PRECISION_DOUBLE    0
+#define PRECISION_SINGLE    1
+
 using namespace Rcpp;
 
 typedef std::vector<float> float_vector;
@@ -86,16 +92,16 @@ BEGIN_RCPP
 END_RCPP
 }
 
-NiftiImage allocateMultiregResult (const NiftiImage &source, const NiftiImage &target, const bool forceDouble)
+NiftiImage allocateMultiregResult (const NiftiImage &source, const NiftiImage &target, const int forceDatatype)
 {
     nifti_image *newStruct = nifti_copy_nim_info(target);
     newStruct->dim[0] = source->dim[0];
     newStruct->dim[source.nDims()] = source->dim[source.nDims()];
     newStruct->pixdim[source.nDims()] = source->pixdim[source.nDims()];
     
-    if (forceDouble)
+    if (forceDatatype != DT_NONE)
     {
-        newStruct->datatype = DT_FLOAT64;
+        newStruct->datatype = forceDatatype;
         nifti_datatype_sizes(newStruct->datatype, &newStruct->nbyper, NULL);
     }
     
@@ -107,27 +113,52 @@ NiftiImage allocateMultiregResult (const NiftiImage &source, const NiftiImage &t
     return NiftiImage(newStruct);
 }
 
-RcppExport SEXP regLinear (SEXP _source, SEXP _target, SEXP _type, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _useBlockPercentage, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal)
+// Header for one slice or volume of a multiple registration result, sharing its data so that the
+// registration can write its resampled image there directly; the data pointer must be reset before freeing
+nifti_image * multiregResultBlock (const NiftiImage &finalImage, const NiftiImage &targetImage, const int index)
 {
-BEGIN_RCPP
-    NiftiImage sourceImage(_source);
-    NiftiImage targetImage(_target);
-    NiftiImage sourceMask(_sourceMask);
-    NiftiImage targetMask(_targetMask);
+    nifti_image *block = nifti_copy_nim_info(targetImage);
+    block->datatype = finalImage->datatype;
+    block->nbyper = finalImage->nbyper;
+    block->data = static_cast<char *>(finalImage->data) + size_t(index) * block->nvox * block->nbyper;
+    return block;
+}
+
+// Owner of target pyramids built for a group of registrations, which frees them when it goes
+// out of scope, including when an error is thrown part of the way through the group
+template <typename PrecisionType>
+class SharedTargetGuard
+{
+private:
+    reg_sharedReference<PrecisionType> *sharedTarget;
     
-    checkImages(sourceImage.drop(), targetImage.drop());
+    // Copies would free the pyramids more than once
+    SharedTargetGuard (const SharedTargetGuard &);
+    SharedTargetGuard & operator= (const SharedTargetGuard &);
     
-    const LinearTransformScope scope = (as<int>(_type) == TYPE_AFFINE ? AffineScope : RigidScope);
-    const int interpolation = as<int>(_interpolation);
-    const bool symmetric = as<bool>(_symmetric);
-    const bool estimateOnly = as<bool>(_estimateOnly);
-    const bool sequentialInit = as<bool>(_sequentialInit);
+public:
+    SharedTargetGuard ()
+        : sharedTarget(NULL) {}
+    
+    ~SharedTargetGuard () { delete sharedTarget; }
     
-    const int internal = as<int>(_internal);
+    reg_sharedReference<PrecisionType> * get () const { return sharedTarget; }
+    
+    reg_sharedReference<PrecisionType> * create (const NiftiImage &targetImage, const NiftiImage &targetMask, const int nLevels)
+    {
+        delete sharedTarget;
+        sharedTarget = new reg_sharedReference<PrecisionType>(targetImage, targetMask, nLevels, nLevels);
+        return sharedTarget;
+    }
+};
+
+// Register one source image, or each slice or volume of a source image with one more dimension, to the target
+template <typename PrecisionType>
+List runLinear (const NiftiImage &sourceImage, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int captureRange, const bool hierarchicalSearch, const int interpolation, const NiftiImage &sourceMask, const NiftiImage &targetMask, const List &init, const bool verbose, const bool estimateOnly, const bool sequentialInit, const int internal, reg_sharedReference<PrecisionType> *sharedTarget)
+{
     const bool internalOutput = (internal == TRUE);
     const bool internalInput = (internal != FALSE);
     
-    List init(_init);
     List returnValue;
     
     if (sourceImage.nDims() == targetImage.nDims())
@@ -138,7 +169,7 @@ BEGIN_RCPP
         else
             initAffine = AffineMatrix(sourceImage, targetImage);
     
-        AladinResult result = regAladin(sourceImage, targetImage, scope, symmetric, as<int>(_nLevels), as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_interpolation), sourceMask, targetMask, initAffine, as<bool>(_verbose), estimateOnly);
+        AladinResult result = regAladin<PrecisionType>(sourceImage, targetImage, scope, symmetric, nLevels, maxIterations, useBlockPercentage, captureRange, hierarchicalSearch, interpolation, sourceMask, targetMask, initAffine, verbose, estimateOnly, sharedTarget);
         
         returnValue["image"] = result.image.toArrayOrPointer(internalOutput, "Result image");
         returnValue["forwardTransforms"] = List::create(result.forwardTransform);
@@ -156,7 +187,15 @@ BEGIN_RCPP
     {
         const int nReps = sourceImage->dim[sourceImage.nDims()];
         List forwardTransforms(nReps), reverseTransforms(nReps), iterations(nReps), sourceImages(nReps);
-        NiftiImage finalImage = allocateMultiregResult(sourceImage, targetImage, interpolation != 0);
+        // Interpolated results have the working precision of the registration
+        const int resultDatatype = (interpolation == 0 ? DT_NONE : (sizeof(PrecisionType) == 4 ? DT_FLOAT32 : DT_FLOAT64));
+        NiftiImage finalImage = allocateMultiregResult(sourceImage, targetImage, resultDatatype);
+        
+        // The target pyramids are the same for every registration
+        SharedTargetGuard<PrecisionType> localTarget;
+        if (sharedTarget == NULL && nLevels > 0 && nReps > 1)
+            sharedTarget = localTarget.create(targetImage, targetMask, nLevels);
+        
         AladinResult result;
         for (int i=0; i<nReps; i++)
         {
@@ -175,9 +214,19 @@ BEGIN_RCPP
             else
                 initAffine = AffineMatrix(currentSource, targetImage);
             
-            result = regAladin(currentSource, targetImage, scope, symmetric, as<int>(_nLevels), as<int>(_maxIterations), as<int>(_useBlockPercentage), interpolation, sourceMask, targetMask, initAffine, as<bool>(_verbose), estimateOnly);
+            // Interpolated results are written straight into the final image
+            nifti_image *resultBlock = NULL;
+            if (interpolation != 0 && !estimateOnly)
+                resultBlock = multiregResultBlock(finalImage, targetImage, i);
             
-            if (sourceImage.nDims() == 3)
+            result = regAladin<PrecisionType>(currentSource, targetImage, scope, symmetric, nLevels, maxIterations, useBlockPercentage, captureRange, hierarchicalSearch, interpolation, sourceMask, targetMask, initAffine, verbose, estimateOnly, sharedTarget, resultBlock);
+            
+            if (resultBlock != NULL)
+            {
+                resultBlock->data = NULL;
+                nifti_image_free(resultBlock);
+            }
+            else if (sourceImage.nDims() == 3)
                 finalImage.slice(i) = result.image;
             else
                 finalImage.volume(i) = result.image;
@@ -207,11 +256,10 @@ BEGIN_RCPP
         throw std::runtime_error(message.str());
     }
     
-    return R_NilValue;
-END_RCPP
+    return returnValue;
 }
 
-RcppExport SEXP regNonlinear (SEXP _source, SEXP _target, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _nBins, SEXP _spacing, SEXP _bendingEnergyWeight, SEXP _linearEnergyWeight, SEXP _jacobianWeight, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal)
+RcppExport SEXP regLinear (SEXP _source, SEXP _target, SEXP _type, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _useBlockPercentage, SEXP _captureRange, SEXP _hierarchicalSearch, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _precision)
 {
 BEGIN_RCPP
     NiftiImage sourceImage(_source);
@@ -221,16 +269,74 @@ BEGIN_RCPP
     
     checkImages(sourceImage.drop(), targetImage.drop());
     
-    const int interpolation = as<int>(_interpolation);
-    const bool symmetric = as<bool>(_symmetric);
-    const bool estimateOnly = as<bool>(_estimateOnly);
-    const bool sequentialInit = as<bool>(_sequentialInit);
+    const LinearTransformScope scope = (as<int>(_type) == TYPE_AFFINE ? AffineScope : RigidScope);
+    
+    if (as<int>(_precision) == PRECISION_SINGLE)
+        return runLinear<float>(sourceImage, targetImage, scope, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_captureRange), as<bool>(_hierarchicalSearch), as<int>(_interpolation), sourceMask, targetMask, List(_init), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal), NULL);
+    else
+        return runLinear<double>(sourceImage, targetImage, scope, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_captureRange), as<bool>(_hierarchicalSearch), as<int>(_interpolation), sourceMask, targetMask, List(_init), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal), NULL);
+END_RCPP
+}
+
+// Register each of a list of source images to the same target, computing the target pyramids only once
+template <typename PrecisionType>
+List runLinearBatch (const List &sources, const NiftiImage &targetImage, const LinearTransformScope scope, const bool symmetric, const int nLevels, const int maxIterations, const int useBlockPercentage, const int captureRange, const bool hierarchicalSearch, const int interpolation, const List &sourceMasks, const NiftiImage &targetMask, const List &inits, const bool verbose, const bool estimateOnly, const bool sequentialInit, const int internal)
+{
+    SharedTargetGuard<PrecisionType> sharedTarget;
+    List returnValue(sources.size());
+    for (int i=0; i<sources.size(); i++)
+    {
+        NiftiImage sourceImage(SEXP(sources[i]));
+        NiftiImage sourceMask(SEXP(sourceMasks[i]));
+        checkImages(sourceImage.drop(), targetImage.drop());
+        
+        if (sharedTarget.get() == NULL && nLevels > 0)
+            sharedTarget.create(targetImage, targetMask, nLevels);
+        
+        returnValue[i] = runLinear<PrecisionType>(sourceImage, targetImage, scope, symmetric, nLevels, maxIterations, useBlockPercentage, captureRange, hierarchicalSearch, interpolation, sourceMask, targetMask, List(SEXP(inits[i])), verbose, estimateOnly, sequentialInit, internal, sharedTarget.get());
+    }
+    
+    return returnValue;
+}
+
+RcppExport SEXP regLinearBatch (SEXP _sources, SEXP _target, SEXP _type, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _useBlockPercentage, SEXP _captureRange, SEXP _hierarchicalSearch, SEXP _interpolation, SEXP _sourceMasks, SEXP _targetMask, SEXP _inits, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _precision)
+{
+BEGIN_RCPP
+    NiftiImage targetImage(_target);
+    NiftiImage targetMask(_targetMask);
+    
+    const LinearTransformScope scope = (as<int>(_type) == TYPE_AFFINE ? AffineScope : RigidScope);
+    
+    if (as<int>(_precision) == PRECISION_SINGLE)
+        return runLinearBatch<float>(List(_sources), targetImage, scope, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_captureRange), as<bool>(_hierarchicalSearch), as<int>(_interpolation), List(_sourceMasks), targetMask, List(_inits), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal));
+    else
+        return runLinearBatch<double>(List(_sources), targetImage, scope, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_captureRange), as<bool>(_hierarchicalSearch), as<int>(_interpolation), List(_sourceMasks), targetMask, List(_inits), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal));
+END_RCPP
+}
+
+// Whether a nonlinear registration in double precision would exceed the
+// memory limit, in MB, so that single precision should be used instead
+static bool exceedsMemoryLimit (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const float_vector &spacing, const bool symmetric, const int memoryLimit, const bool verbose)
+{
+    if (memoryLimit <= 0)
+        return false;
+    
+    const int estimate = estimateF3dMemory<double>(sourceImage, targetImage, nLevels, spacing, symmetric);
+    if (estimate <= memoryLimit)
+        return false;
     
-    const int internal = as<int>(_internal);
+    if (verbose)
+        Rprintf("[NiftyReg F3D] Using single precision, since the estimated peak memory in double precision (%i MB) exceeds the limit\n", estimate);
+    return true;
+}
+
+// Nonlinear counterpart of runLinear()
+template <typename PrecisionType>
+List runNonlinear (const NiftiImage &sourceImage, const NiftiImage &targetImage, const bool symmetric, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMask, const NiftiImage &targetMask, const List &init, const int nBins, const float_vector &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool verbose, const bool estimateOnly, const bool sequentialInit, const int internal, const int memoryLimit, reg_sharedReference<PrecisionType> *sharedTarget)
+{
     const bool internalOutput = (internal == TRUE);
     const bool internalInput = (internal != FALSE);
     
-    List init(_init);
     List returnValue;
     
     if (sourceImage.nDims() == targetImage.nDims())
@@ -249,7 +355,7 @@ BEGIN_RCPP
         else
             initAffine = AffineMatrix(sourceImage, targetImage);
     
-        F3dResult result = regF3d(sourceImage, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+        F3dResult result = regF3d<PrecisionType>(sourceImage, targetImage, nLevels, maxIterations, interpolation, sourceMask, targetMask, initControl, initAffine, nBins, spacing, bendingEnergyWeight, linearEnergyWeight, jacobianWeight, symmetric, verbose, estimateOnly, memoryLimit, sharedTarget);
         
         returnValue["image"] = result.image.toArrayOrPointer(internalOutput, "Result image");
         returnValue["forwardTransforms"] = List::create(result.forwardTransform.toArrayOrPointer(internalInput, "F3D control points"));
@@ -258,6 +364,8 @@ BEGIN_RCPP
         else
             returnValue["reverseTransforms"] = R_NilValue;
         returnValue["iterations"] = List::create(result.iterations);
+        returnValue["peakMemory"] = result.peakMemory;
+        returnValue["levelMemory"] = List::create(result.levelMemory);
         returnValue["source"] = List::create(sourceImage.toArrayOrPointer(internalInput, "Source image"));
         returnValue["target"] = targetImage.toArrayOrPointer(internalInput, "Target image");
         
@@ -266,8 +374,17 @@ BEGIN_RCPP
     else if (sourceImage.nDims() - targetImage.nDims() == 1)
     {
         const int nReps = sourceImage->dim[sourceImage.nDims()];
-        List forwardTransforms(nReps), reverseTransforms(nReps), iterations(nReps), sourceImages(nReps);
-        NiftiImage finalImage = allocateMultiregResult(sourceImage, targetImage, interpolation != 0);
+        List forwardTransforms(nReps), reverseTransforms(nReps), iterations(nReps), levelMemory(nReps), sourceImages(nReps);
+        NumericVector peakMemory(nReps);
+        // Interpolated results have the working precision of the registration
+        const int resultDatatype = (interpolation == 0 ? DT_NONE : (sizeof(PrecisionType) == 4 ? DT_FLOAT32 : DT_FLOAT64));
+        NiftiImage finalImage = allocateMultiregResult(sourceImage, targetImage, resultDatatype);
+        
+        // The target pyramids are the same for every registration
+        SharedTargetGuard<PrecisionType> localTarget;
+        if (sharedTarget == NULL && nLevels > 0 && nReps > 1)
+            sharedTarget = localTarget.create(targetImage, targetMask, nLevels);
+        
         F3dResult result;
         for (int i=0; i<nReps; i++)
         {
@@ -294,9 +411,19 @@ BEGIN_RCPP
             else
                 initAffine = AffineMatrix(currentSource, targetImage);
             
-            result = regF3d(currentSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+            // Interpolated results are written straight into the final image
+            nifti_image *resultBlock = NULL;
+            if (interpolation != 0 && !estimateOnly)
+                resultBlock = multiregResultBlock(finalImage, targetImage, i);
             
-            if (sourceImage.nDims() == 3)
+            result = regF3d<PrecisionType>(currentSource, targetImage, nLevels, maxIterations, interpolation, sourceMask, targetMask, initControl, initAffine, nBins, spacing, bendingEnergyWeight, linearEnergyWeight, jacobianWeight, symmetric, verbose, estimateOnly, memoryLimit, sharedTarget, resultBlock);
+            
+            if (resultBlock != NULL)
+            {
+                resultBlock->data = NULL;
+                nifti_image_free(resultBlock);
+            }
+            else if (sourceImage.nDims() == 3)
                 finalImage.slice(i) = result.image;
             else
                 finalImage.volume(i) = result.image;
@@ -305,6 +432,8 @@ BEGIN_RCPP
             if (symmetric)
                 reverseTransforms[i] = result.reverseTransform.toArrayOrPointer(internalInput, "F3D control points");
             iterations[i] = result.iterations;
+            peakMemory[i] = result.peakMemory;
+            levelMemory[i] = result.levelMemory;
         }
         
         returnValue["image"] = finalImage.toArrayOrPointer(internalOutput, "Result image");
@@ -314,6 +443,8 @@ BEGIN_RCPP
         else
             returnValue["reverseTransforms"] = R_NilValue;
         returnValue["iterations"] = iterations;
+        returnValue["peakMemory"] = peakMemory;
+        returnValue["levelMemory"] = levelMemory;
         returnValue["source"] = sourceImages;
         returnValue["target"] = targetImage.toArrayOrPointer(internalInput, "Target image");
         
@@ -326,7 +457,251 @@ BEGIN_RCPP
         throw std::runtime_error(message.str());
     }
     
-    return R_NilValue;
+    return returnValue;
+}
+
+RcppExport SEXP regNonlinear (SEXP _source, SEXP _target, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _nBins, SEXP _spacing, SEXP _bendingEnergyWeight, SEXP _linearEnergyWeight, SEXP _jacobianWeight, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _memoryLimit, SEXP _precision)
+{
+BEGIN_RCPP
+    NiftiImage sourceImage(_source);
+    NiftiImage targetImage(_target);
+    NiftiImage sourceMask(_sourceMask);
+    NiftiImage targetMask(_targetMask);
+    
+    checkImages(sourceImage.drop(), targetImage.drop());
+    
+    const int memoryLimit = as<int>(_memoryLimit);
+    bool singlePrecision = (as<int>(_precision) == PRECISION_SINGLE);
+    if (!singlePrecision && exceedsMemoryLimit(sourceImage, targetImage, as<int>(_nLevels), as<float_vector>(_spacing), as<bool>(_symmetric), memoryLimit, as<bool>(_verbose)))
+        singlePrecision = true;
+    
+    if (singlePrecision)
+        return runNonlinear<float>(sourceImage, targetImage, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_interpolation), sourceMask, targetMask, List(_init), as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal), memoryLimit, NULL);
+    else
+        return runNonlinear<double>(sourceImage, targetImage, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_interpolation), sourceMask, targetMask, List(_init), as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal), memoryLimit, NULL);
+END_RCPP
+}
+
+// Nonlinear counterpart of runLinearBatch()
+template <typename PrecisionType>
+List runNonlinearBatch (const List &sources, const NiftiImage &targetImage, const bool symmetric, const int nLevels, const int maxIterations, const int interpolation, const List &sourceMasks, const NiftiImage &targetMask, const List &inits, const int nBins, const float_vector &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool verbose, const bool estimateOnly, const bool sequentialInit, const int internal, const int memoryLimit)
+{
+    SharedTargetGuard<PrecisionType> sharedTarget;
+    List returnValue(sources.size());
+    for (int i=0; i<sources.size(); i++)
+    {
+        NiftiImage sourceImage(SEXP(sources[i]));
+        NiftiImage sourceMask(SEXP(sourceMasks[i]));
+        checkImages(sourceImage.drop(), targetImage.drop());
+        
+        if (sharedTarget.get() == NULL && nLevels > 0)
+            sharedTarget.create(targetImage, targetMask, nLevels);
+        
+        returnValue[i] = runNonlinear<PrecisionType>(sourceImage, targetImage, symmetric, nLevels, maxIterations, interpolation, sourceMask, targetMask, List(SEXP(inits[i])), nBins, spacing, bendingEnergyWeight, linearEnergyWeight, jacobianWeight, verbose, estimateOnly, sequentialInit, internal, memoryLimit, sharedTarget.get());
+    }
+    
+    return returnValue;
+}
+
+RcppExport SEXP regNonlinearBatch (SEXP _sources, SEXP _target, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _interpolation, SEXP _sourceMasks, SEXP _targetMask, SEXP _inits, SEXP _nBins, SEXP _spacing, SEXP _bendingEnergyWeight, SEXP _linearEnergyWeight, SEXP _jacobianWeight, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _memoryLimit, SEXP _precision)
+{
+BEGIN_RCPP
+    NiftiImage targetImage(_target);
+    NiftiImage targetMask(_targetMask);
+    
+    // The registrations share a precision, so the largest source decides
+    const int memoryLimit = as<int>(_memoryLimit);
+    const List sources(_sources);
+    bool singlePrecision = (as<int>(_precision) == PRECISION_SINGLE);
+    for (int i=0; memoryLimit > 0 && !singlePrecision && i<sources.size(); i++)
+    {
+        if (exceedsMemoryLimit(NiftiImage(SEXP(sources[i])), targetImage, as<int>(_nLevels), as<float_vector>(_spacing), as<bool>(_symmetric), memoryLimit, as<bool>(_verbose)))
+            singlePrecision = true;
+    }
+    
+    if (singlePrecision)
+        return runNonlinearBatch<float>(List(_sources), targetImage, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_interpolation), List(_sourceMasks), targetMask, List(_inits), as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal), memoryLimit);
+    else
+        return runNonlinearBatch<double>(List(_sources), targetImage, as<bool>(_symmetric), as<int>(_nLevels), as<int>(_maxIterations), as<int>(_interpolation), List(_sourceMasks), targetMask, List(_inits), as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), as<bool>(_verbose), as<bool>(_estimateOnly), as<bool>(_sequentialInit), as<int>(_internal), memoryLimit);
+END_RCPP
+}
+
+// Retrieve the object behind a compiled transform, which does not survive serialisation
+CompiledTransform * getCompiledTransform (SEXP _transform)
+{
+    XPtr<CompiledTransform> compiled(_transform);
+    if (compiled.get() == NULL)
+        throw std::runtime_error("Compiled transform is no longer valid, perhaps because it has been saved and reloaded");
+    return compiled.get();
+}
+
+RcppExport SEXP compileTransform (SEXP _transform, SEXP _jacobian)
+{
+BEGIN_RCPP
+    RObject transform(_transform);
+    NiftiImage targetImage(SEXP(transform.attr("target")), false);
+    CompiledTransform *compiled;
+    
+    if (transform.inherits("affine"))
+        compiled = new CompiledTransform(targetImage, AffineMatrix(_transform), as<bool>(_jacobian));
+    else
+        compiled = new CompiledTransform(targetImage, NiftiImage(_transform), as<bool>(_jacobian));
+    
+    XPtr<CompiledTransform> result(compiled);
+    result.attr("class") = "compiledTransform";
+    result.attr("transform") = transform;
+    result.attr("source") = transform.attr("source");
+    result.attr("target") = transform.attr("target");
+    
+    return result;
+END_RCPP
+}
+
+RcppExport SEXP compiledTransformInfo (SEXP _transform)
+{
+BEGIN_RCPP
+    CompiledTransform *compiled = getCompiledTransform(_transform);
+    return List::create(Named("affine")=compiled->isAffine(), Named("field")=compiled->hasField(), Named("jacobian")=compiled->hasJacobian(), Named("bytes")=double(compiled->memoryUsage()));
+END_RCPP
+}
+
+RcppExport SEXP resampleCompiledTransform (SEXP _transform, SEXP _image, SEXP _interpolation, SEXP _internal)
+{
+BEGIN_RCPP
+    CompiledTransform *compiled = getCompiledTransform(_transform);
+    const DeformationField &field = compiled->getField();
+    const NiftiImage &targetImage = compiled->getTargetImage();
+    NiftiImage sourceImage(_image);
+    const int interpolation = as<int>(_interpolation);
+    
+    checkImages(sourceImage.drop(), targetImage);
+    
+    // As for zero-level registrations, interpolated intensities are stored in double precision
+    const int resultDatatype = (interpolation == 0 ? int(sourceImage->datatype) : DT_FLOAT64);
+    
+    NiftiImage result;
+    if (sourceImage.nDims() == targetImage.nDims())
+        result = field.resampleImage(sourceImage, interpolation, resultDatatype);
+    else if (sourceImage.nDims() - targetImage.nDims() == 1)
+    {
+        // Each slice or volume is resampled straight into the final image
+        const int nReps = sourceImage->dim[sourceImage.nDims()];
+        result = allocateMultiregResult(sourceImage, targetImage, resultDatatype);
+        for (int i=0; i<nReps; i++)
+        {
+            NiftiImage currentSource;
+            if (sourceImage.nDims() == 3)
+                currentSource = sourceImage.slice(i);
+            else
+                currentSource = sourceImage.volume(i);
+            
+            nifti_image *resultBlock = multiregResultBlock(result, targetImage, i);
+            field.resampleImage(currentSource, interpolation, resultBlock);
+            resultBlock->data = NULL;
+            nifti_image_free(resultBlock);
+        }
+    }
+    else
+    {
+        std::ostringstream message;
+        message << "Cannot transform a " << sourceImage.nDims() << "D image into a " << targetImage.nDims() << "D space";
+        throw std::runtime_error(message.str());
+    }
+    
+    return result.toArrayOrPointer(as<int>(_internal) == TRUE, "Result image");
+END_RCPP
+}
+
+RcppExport SEXP resampleImages (SEXP _transform, SEXP _images, SEXP _interpolation, SEXP _internal)
+{
+BEGIN_RCPP
+    RObject transform(_transform);
+    List images(_images);
+    const int interpolation = as<int>(_interpolation);
+    
+    // A compiled transform provides its stored field; otherwise the field is calculated once for all images
+    DeformationField localField;
+    const DeformationField *field = &localField;
+    NiftiImage targetImage;
+    if (transform.inherits("compiledTransform"))
+    {
+        CompiledTransform *compiled = getCompiledTransform(_transform);
+        field = &compiled->getField();
+        targetImage = compiled->getTargetImage();
+    }
+    else
+    {
+        targetImage = NiftiImage(SEXP(transform.attr("target")), false);
+        if (transform.inherits("affine"))
+            localField = DeformationField(targetImage, AffineMatrix(_transform));
+        else
+            localField = DeformationField(targetImage, NiftiImage(_transform));
+    }
+    
+    // Images with one more dimension than the target are split into slices or volumes, which
+    // are resampled along with the other images and then gathered back into one result each
+    std::vector<NiftiImage> fullImages(images.size()), sourceImages;
+    std::vector<size_t> firstBlocks(images.size());
+    for (int i=0; i<images.size(); i++)
+    {
+        fullImages[i] = NiftiImage(SEXP(images[i]));
+        if (fullImages[i].isNull())
+            throw std::runtime_error("Cannot read or retrieve image to transform");
+        checkImages(fullImages[i].drop(), targetImage);
+        // Images resampled together have results of their own data type, so interpolated
+        // images are converted to the double precision used for the other paths
+        if (interpolation != 0)
+            reg_tools_changeDatatype<double>(fullImages[i]);
+        
+        firstBlocks[i] = sourceImages.size();
+        const int nSourceDims = fullImages[i].nDims();
+        if (nSourceDims == targetImage.nDims())
+            sourceImages.push_back(fullImages[i]);
+        else if (nSourceDims - targetImage.nDims() == 1)
+        {
+            const int nReps = fullImages[i]->dim[nSourceDims];
+            for (int j=0; j<nReps; j++)
+            {
+                NiftiImage currentSource;
+                if (nSourceDims == 3)
+                    currentSource = fullImages[i].slice(j);
+                else
+                    currentSource = fullImages[i].volume(j);
+                sourceImages.push_back(currentSource);
+            }
+        }
+        else
+        {
+            std::ostringstream message;
+            message << "Cannot transform a " << nSourceDims << "D image into a " << targetImage.nDims() << "D space";
+            throw std::runtime_error(message.str());
+        }
+    }
+    
+    std::vector<NiftiImage> resultImages = field->resampleImages(sourceImages, interpolation);
+    
+    List result(images.size());
+    for (int i=0; i<images.size(); i++)
+    {
+        const int nSourceDims = fullImages[i].nDims();
+        if (nSourceDims == targetImage.nDims())
+            result[i] = resultImages[firstBlocks[i]].toArrayOrPointer(as<int>(_internal) == TRUE, "Result image");
+        else
+        {
+            const int nReps = fullImages[i]->dim[nSourceDims];
+            NiftiImage finalImage = allocateMultiregResult(fullImages[i], targetImage, resultImages[firstBlocks[i]]->datatype);
+            for (int j=0; j<nReps; j++)
+            {
+                if (nSourceDims == 3)
+                    finalImage.slice(j) = resultImages[firstBlocks[i]+j];
+                else
+                    finalImage.volume(j) = resultImages[firstBlocks[i]+j];
+            }
+            result[i] = finalImage.toArrayOrPointer(as<int>(_internal) == TRUE, "Result image");
+        }
+    }
+    
+    return result;
 END_RCPP
 }
 
@@ -335,6 +710,19 @@ RcppExport SEXP getDeformationField (SEXP _transform, SEXP _jacobian)
 BEGIN_RCPP
     RObject transform(_transform);
     RObject result;
+    
+    // The stored images of a compiled transform are copied, so that they cannot be modified through the result
+    if (transform.inherits("compiledTransform"))
+    {
+        CompiledTransform *compiled = getCompiledTransform(_transform);
+        result = NiftiImage(compiled->getField().getFieldImage(), true).toPointer("Deformation field");
+        result.attr("source") = transform.attr("source");
+        result.attr("target") = transform.attr("target");
+        if (as<bool>(_jacobian))
+            result.attr("jacobian") = NiftiImage(compiled->getJacobian(), true).toPointer("Jacobian of deformation field");
+        return result;
+    }
+    
     NiftiImage targetImage(SEXP(transform.attr("target")));
     DeformationField field;
     
@@ -363,40 +751,28 @@ END_RCPP
 RcppExport SEXP transformPoints (SEXP _transform, SEXP _points, SEXP _nearest)
 {
 BEGIN_RCPP
-    NiftiImage transformationImage(_transform);
     RObject transform(_transform);
-    NiftiImage sourceImage(SEXP(transform.attr("source")), false);
-    NiftiImage targetImage(SEXP(transform.attr("target")), false);
-    DeformationField deformationField(targetImage, transformationImage);
     NumericMatrix points(_points);
-    List result(points.nrow());
     const bool nearest = as<bool>(_nearest);
     
-    if (points.ncol() == 2)
+    // A compiled transform provides its stored field; otherwise the field is calculated for this call
+    DeformationField localField;
+    const DeformationField *deformationField = &localField;
+    if (transform.inherits("compiledTransform"))
+        deformationField = &getCompiledTransform(_transform)->getField();
+    else
     {
-        for (int i=0; i<points.nrow(); i++)
-        {
-            Eigen::Vector2d point;
-            point[0] = points(i, 0);
-            point[1] = points(i, 1);
-            result[i] = deformationField.findPoint(sourceImage, point, nearest);
-        }
+        NiftiImage transformationImage(_transform);
+        NiftiImage targetImage(SEXP(transform.attr("target")), false);
+        localField = DeformationField(targetImage, transformationImage);
     }
+    
+    if (points.ncol() == 2)
+        return deformationField->findPoints<2>(points, nearest);
     else if (points.ncol() == 3)
-    {
-        for (int i=0; i<points.nrow(); i++)
-        {
-            Eigen::Vector3d point;
-            point[0] = points(i, 0);
-            point[1] = points(i, 1);
-            point[2] = points(i, 2);
-            result[i] = deformationField.findPoint(sourceImage, point, nearest);
-        }
-    }
+        return deformationField->findPoints<3>(points, nearest);
     else
         throw std::runtime_error("Points matrix should have 2 or 3 columns");
-    
-    return result;
 END_RCPP
 }
 
@@ -498,7 +874,9 @@ BEGIN_RCPP
         NiftiImage targetImage1(SEXP(transform1.attr("target")));
         NiftiImage targetImage2(SEXP(transform2.attr("target")));
         
-        if (transform1.inherits("affine"))
+        if (transform1.inherits("compiledTransform"))
+            field1 = getCompiledTransform(_transform1)->getField();
+        else if (transform1.inherits("affine"))
         {
             AffineMatrix transformMatrix(_transform1);
             field1 = DeformationField(targetImage1, transformMatrix, true);
@@ -509,7 +887,10 @@ BEGIN_RCPP
             field1 = DeformationField(targetImage1, transformImage, true);
         }
         
-        if (transform2.inherits("affine"))
+        // The second field is modified, so a stored field must be copied
+        if (transform2.inherits("compiledTransform"))
+            field2 = DeformationField(getCompiledTransform(_transform2)->getField(), true);
+        else if (transform2.inherits("affine"))
         {
             AffineMatrix transformMatrix(_transform2);
             field2 = DeformationField(targetImage2, transformMatrix, true);
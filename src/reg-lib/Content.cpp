@@ -127,7 +127,8 @@ void Content::initVars()
 #endif
 }
 /* *************************************************************** */
-void Content::AllocateWarpedImage()
+// The warped image has the floating data type unless another one is specified
+void Content::AllocateWarpedImage(int datatype)
 {
 	if (this->CurrentReference == NULL || this->CurrentFloating == NULL) {
 		reg_print_fct_error( "Content::AllocateWarpedImage()");
@@ -140,8 +141,8 @@ void Content::AllocateWarpedImage()
 	this->CurrentWarped->dim[4] = this->CurrentWarped->nt = this->CurrentFloating->nt;
 	this->CurrentWarped->pixdim[4] = this->CurrentWarped->dt = 1.0;
 	this->CurrentWarped->nvox = (size_t) this->CurrentWarped->nx * (size_t) this->CurrentWarped->ny * (size_t) this->CurrentWarped->nz * (size_t) this->CurrentWarped->nt;
-	this->CurrentWarped->datatype = this->CurrentFloating->datatype;
-	this->CurrentWarped->nbyper = this->CurrentFloating->nbyper;
+	this->CurrentWarped->datatype = (datatype > -1 ? datatype : this->CurrentFloating->datatype);
+	nifti_datatype_sizes(this->CurrentWarped->datatype, &this->CurrentWarped->nbyper, NULL);
 	this->CurrentWarped->data = (void *) calloc(this->CurrentWarped->nvox, this->CurrentWarped->nbyper);
 	this->floatingDatatype = this->CurrentFloating->datatype;
 }
@@ -192,6 +193,20 @@ void Content::setCaptureRange(const int voxelCaptureRangeIn)
 	this->blockMatchingParams->voxelCaptureRange = voxelCaptureRangeIn;
 }
 /* *************************************************************** */
+void Content::setHierarchicalSearch(const bool hierarchicalSearchIn)
+{
+	this->blockMatchingParams->hierarchicalSearch = hierarchicalSearchIn;
+}
+/* *************************************************************** */
+void Content::setBlockMatchingParams(const _reg_blockMatchingParam *precomputed)
+{
+	if (this->blockMatchingParams == NULL)
+		this->blockMatchingParams = new _reg_blockMatchingParam();
+	initialise_block_matching_method(this->CurrentReference,
+												this->blockMatchingParams,
+												precomputed);
+}
+/* *************************************************************** */
 void Content::ClearDeformationField()
 {
 	if (this->CurrentDeformationField != NULL)
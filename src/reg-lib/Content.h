@@ -41,7 +41,7 @@ public:
 	virtual ~Content();
 
 	/* *************************************************************** */
-	void AllocateWarpedImage();
+	void AllocateWarpedImage(int datatype = -1);
 	void ClearWarpedImage();
 	/* *************************************************************** */
 	void AllocateDeformationField(size_t bytes);
@@ -98,6 +98,8 @@ public:
 	}
 	virtual void setCurrentReferenceMask(int *, size_t) {}
 	void setCaptureRange(const int captureRangeIn);
+	void setHierarchicalSearch(const bool hierarchicalSearchIn);
+	void setBlockMatchingParams(const _reg_blockMatchingParam *precomputed);
 
 protected:
 	nifti_image *CurrentDeformationField;
@@ -48,6 +48,7 @@ template<class T> reg_aladin<T>::reg_aladin()
 
 	this->con = NULL;
 	this->blockMatchingParams = NULL;
+	this->sharedReference = NULL;
 	this->platform = NULL;
 
 	this->Verbose = true;
@@ -63,6 +64,8 @@ template<class T> reg_aladin<T>::reg_aladin()
 	this->BlockStepSize = 1;
 	this->BlockPercentage = 50;
 	this->InlierLts = 50;
+	this->captureRangeVox = 3;
+	this->hierarchicalSearch = false;
 
 	this->AlignCentre = 1;
 	this->AlignCentreGravity = 0;
@@ -313,66 +316,21 @@ void reg_aladin<T>::InitialiseRegistration()
 	this->platform = new Platform(this->platformCode);
 	if (this->platformCode == NR_PLATFORM_CL) this->platform->setClIdx(this->clIdx);
 
-	Kernel *convolutionKernel = this->platform->createKernel(ConvolutionKernel::getName(), NULL);
-
 	this->Print();
 
-	// CREATE THE PYRAMID IMAGES
-	this->ReferencePyramid = (nifti_image **) malloc(this->LevelsToPerform * sizeof(nifti_image *));
-	this->FloatingPyramid = (nifti_image **) malloc(this->LevelsToPerform * sizeof(nifti_image *));
-	this->ReferenceMaskPyramid = (int **) malloc(this->LevelsToPerform * sizeof(int *));
-	this->activeVoxelNumber = (int *) malloc(this->LevelsToPerform * sizeof(int));
-
-	// FINEST LEVEL OF REGISTRATION
-	reg_createImagePyramid<T>(this->InputReference, this->ReferencePyramid, this->NumberOfLevels, this->LevelsToPerform);
-	reg_createImagePyramid<T>(this->InputFloating, this->FloatingPyramid, this->NumberOfLevels, this->LevelsToPerform);
-	if (this->InputReferenceMask != NULL)
-		reg_createMaskPyramid<T>(this->InputReferenceMask,
-										 this->ReferenceMaskPyramid,
-										 this->NumberOfLevels,
-										 this->LevelsToPerform,
-										 this->activeVoxelNumber);
-	else {
-		for (unsigned int l = 0; l < this->LevelsToPerform; ++l) {
-			this->activeVoxelNumber[l] = this->ReferencePyramid[l]->nx * this->ReferencePyramid[l]->ny * this->ReferencePyramid[l]->nz;
-			this->ReferenceMaskPyramid[l] = (int *) calloc(activeVoxelNumber[l], sizeof(int));
-		}
-	}
+	// ALLOCATE THE PYRAMIDS, WHOSE LEVELS ARE CREATED WHEN THEY ARE REACHED
+	this->ReferencePyramid = (nifti_image **) calloc(this->LevelsToPerform, sizeof(nifti_image *));
+	this->FloatingPyramid = (nifti_image **) calloc(this->LevelsToPerform, sizeof(nifti_image *));
+	this->ReferenceMaskPyramid = (int **) calloc(this->LevelsToPerform, sizeof(int *));
+	this->activeVoxelNumber = (int *) calloc(this->LevelsToPerform, sizeof(int));
 
-	// SMOOTH THE INPUT IMAGES IF REQUIRED
-	for (unsigned int l = 0; l < this->LevelsToPerform; l++) {
-		if (this->ReferenceSigma != 0.0) {
-			// Only the first image is smoothed
-			bool *active = new bool[this->ReferencePyramid[l]->nt];
-			float *sigma = new float[this->ReferencePyramid[l]->nt];
-			active[0] = true;
-			for (int i = 1; i < this->ReferencePyramid[l]->nt; ++i)
-				active[i] = false;
-			sigma[0] = this->ReferenceSigma;
-			convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->ReferencePyramid[l], sigma, 0, NULL, active);
-			delete[] active;
-			delete[] sigma;
-		}
-		if (this->FloatingSigma != 0.0) {
-			// Only the first image is smoothed
-			bool *active = new bool[this->FloatingPyramid[l]->nt];
-			float *sigma = new float[this->FloatingPyramid[l]->nt];
-			active[0] = true;
-			for (int i = 1; i < this->FloatingPyramid[l]->nt; ++i)
-				active[i] = false;
-			sigma[0] = this->FloatingSigma;
-			convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->FloatingPyramid[l], sigma, 0, NULL, active);
-			delete[] active;
-			delete[] sigma;
-		}
-	}
-
-   // THRESHOLD THE INPUT IMAGES IF REQUIRED
-   for(unsigned int l=0; l<this->LevelsToPerform; l++)
-   {
-      reg_thresholdImage<T>(this->ReferencePyramid[l],this->ReferenceLowerThreshold, this->ReferenceUpperThreshold);
-      reg_thresholdImage<T>(this->FloatingPyramid[l],this->FloatingLowerThreshold, this->FloatingUpperThreshold);
-   }
+	// The reference pyramid levels are copied when they have already been computed
+	if (this->sharedReference != NULL &&
+			!this->sharedReference->IsCompatible(this->InputReference,
+															 this->InputReferenceMask,
+															 this->NumberOfLevels,
+															 this->LevelsToPerform))
+		this->sharedReference = NULL;
 
 	// Initialise the transformation
 	if (this->InputTransformName != NULL)
@@ -429,7 +387,64 @@ void reg_aladin<T>::InitialiseRegistration()
 			this->TransformationMatrix->m[2][3] = floatingRealPosition[2] - referenceRealPosition[2];
 		}
 	}
-	delete convolutionKernel;
+}
+/* *************************************************************** */
+template<class T>
+void reg_aladin<T>::CreatePyramidLevel(unsigned int level)
+{
+	if (this->sharedReference != NULL)
+		this->sharedReference->CopyPyramidLevel(level,
+															 &this->ReferencePyramid[level],
+															 &this->ReferenceMaskPyramid[level],
+															 &this->activeVoxelNumber[level]);
+	else {
+		reg_createImagePyramidLevel<T>(this->InputReference, &this->ReferencePyramid[level], this->NumberOfLevels, level);
+		if (this->InputReferenceMask != NULL)
+			reg_createMaskPyramidLevel<T>(this->InputReferenceMask,
+													&this->ReferenceMaskPyramid[level],
+													this->NumberOfLevels,
+													level,
+													&this->activeVoxelNumber[level]);
+		else {
+			this->activeVoxelNumber[level] = this->ReferencePyramid[level]->nx * this->ReferencePyramid[level]->ny * this->ReferencePyramid[level]->nz;
+			this->ReferenceMaskPyramid[level] = (int *) calloc(activeVoxelNumber[level], sizeof(int));
+		}
+	}
+	reg_createImagePyramidLevel<T>(this->InputFloating, &this->FloatingPyramid[level], this->NumberOfLevels, level);
+
+	// SMOOTH THE INPUT IMAGES IF REQUIRED
+	if (this->ReferenceSigma != 0.0 || this->FloatingSigma != 0.0) {
+		Kernel *convolutionKernel = this->platform->createKernel(ConvolutionKernel::getName(), NULL);
+		if (this->ReferenceSigma != 0.0) {
+			// Only the first image is smoothed
+			bool *active = new bool[this->ReferencePyramid[level]->nt];
+			float *sigma = new float[this->ReferencePyramid[level]->nt];
+			active[0] = true;
+			for (int i = 1; i < this->ReferencePyramid[level]->nt; ++i)
+				active[i] = false;
+			sigma[0] = this->ReferenceSigma;
+			convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->ReferencePyramid[level], sigma, 0, NULL, active);
+			delete[] active;
+			delete[] sigma;
+		}
+		if (this->FloatingSigma != 0.0) {
+			// Only the first image is smoothed
+			bool *active = new bool[this->FloatingPyramid[level]->nt];
+			float *sigma = new float[this->FloatingPyramid[level]->nt];
+			active[0] = true;
+			for (int i = 1; i < this->FloatingPyramid[level]->nt; ++i)
+				active[i] = false;
+			sigma[0] = this->FloatingSigma;
+			convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->FloatingPyramid[level], sigma, 0, NULL, active);
+			delete[] active;
+			delete[] sigma;
+		}
+		delete convolutionKernel;
+	}
+
+   // THRESHOLD THE INPUT IMAGES IF REQUIRED
+   reg_thresholdImage<T>(this->ReferencePyramid[level],this->ReferenceLowerThreshold, this->ReferenceUpperThreshold);
+   reg_thresholdImage<T>(this->FloatingPyramid[level],this->FloatingLowerThreshold, this->FloatingUpperThreshold);
 }
 /* *************************************************************** */
 template<class T>
@@ -547,7 +562,21 @@ void reg_aladin<T>::initContent(nifti_image *ref,
 										  unsigned int inlierLts,
 										  unsigned int blockStepSize)
 {
-	if (this->platformCode == NR_PLATFORM_CPU)
+	// The active blocks only depend on the reference image, so they can be
+	// reused when the shared pyramid has not been smoothed or thresholded
+	if (this->platformCode == NR_PLATFORM_CPU &&
+			this->sharedReference != NULL &&
+			ref == this->ReferencePyramid[this->CurrentLevel] &&
+			this->ReferenceSigma == 0.0 &&
+			this->ReferenceLowerThreshold == -std::numeric_limits<T>::max() &&
+			this->ReferenceUpperThreshold == std::numeric_limits<T>::max()) {
+		this->con = new Content(ref, flo, mask, transMat, bytes);
+		this->con->setBlockMatchingParams(this->sharedReference->GetBlockMatchingParams(this->CurrentLevel,
+																												blockPercentage,
+																												inlierLts,
+																												blockStepSize));
+	}
+	else if (this->platformCode == NR_PLATFORM_CPU)
 		this->con = new Content(ref, flo, mask, transMat, bytes, blockPercentage, inlierLts, blockStepSize);
 #ifdef _USE_CUDA
 	else if(platformCode == NR_PLATFORM_CUDA)
@@ -557,6 +586,8 @@ void reg_aladin<T>::initContent(nifti_image *ref,
 	else if(platformCode == NR_PLATFORM_CL)
 		this->con = new ClContent(ref, flo, mask,transMat, bytes, blockPercentage, inlierLts, blockStepSize);
 #endif
+	this->con->setCaptureRange(this->captureRangeVox);
+	this->con->setHierarchicalSearch(this->hierarchicalSearch);
 	this->blockMatchingParams = this->con->Content::getBlockMatchingParams();
 }
 /* *************************************************************** */
@@ -623,6 +654,8 @@ void reg_aladin<T>::Run()
     
 	//Main loop over the levels:
 	for (this->CurrentLevel = 0; this->CurrentLevel < this->LevelsToPerform; this->CurrentLevel++) {
+		// The level is created from the input images, and freed once it is completed
+		this->CreatePyramidLevel(this->CurrentLevel);
 		this->initContent(this->ReferencePyramid[CurrentLevel], this->FloatingPyramid[CurrentLevel],
 								this->ReferenceMaskPyramid[CurrentLevel], this->TransformationMatrix, sizeof(T), this->BlockPercentage,
 								this->InlierLts, this->BlockStepSize);
@@ -692,9 +725,19 @@ void reg_aladin<T>::Run()
 }
 /* *************************************************************** */
 template<class T>
+int reg_aladin<T>::GetFinalWarpedDatatype()
+{
+	// The input floating image, of any type, is resampled in the working
+	// precision unless nearest neighbour interpolation is used
+	if (this->Interpolation == 0)
+		return this->InputFloating->datatype;
+	return sizeof(T) == sizeof(float) ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64;
+}
+/* *************************************************************** */
+template<class T>
 nifti_image *reg_aladin<T>::GetFinalWarpedImage()
 {
-	int floatingType = this->InputFloating->datatype; //t_dev ask before touching this!
+	int floatingType = this->GetFinalWarpedDatatype(); //t_dev ask before touching this!
 	// The initial images are used
 	if (this->InputReference == NULL || this->InputFloating == NULL || this->TransformationMatrix == NULL) {
 		reg_print_fct_error("reg_aladin::GetFinalWarpedImage()");
@@ -711,18 +754,23 @@ nifti_image *reg_aladin<T>::GetFinalWarpedImage()
 										this->CurrentReferenceMask,
 										this->TransformationMatrix,
 										sizeof(T));
+	if (floatingType != this->InputFloating->datatype) {
+		this->con->ClearWarpedImage();
+		this->con->AllocateWarpedImage(floatingType);
+	}
 	reg_aladin<T>::createKernels();
 
 	reg_aladin<T>::GetWarpedImage(3); // cubic spline interpolation
 	this->CurrentWarped = this->con->getCurrentWarped(floatingType);
 
+	// The warped data are handed over rather than copied
 	nifti_image *resultImage = nifti_copy_nim_info(this->CurrentWarped);
 	resultImage->cal_min = this->InputFloating->cal_min;
 	resultImage->cal_max = this->InputFloating->cal_max;
 	resultImage->scl_slope = this->InputFloating->scl_slope;
 	resultImage->scl_inter = this->InputFloating->scl_inter;
-	resultImage->data = (void *) malloc(resultImage->nvox * resultImage->nbyper);
-	memcpy(resultImage->data, this->CurrentWarped->data, resultImage->nvox * resultImage->nbyper);
+	resultImage->data = this->CurrentWarped->data;
+	this->CurrentWarped->data = NULL;
 
 	reg_aladin<T>::clearKernels();
 	reg_aladin<T>::clearContent();
@@ -730,6 +778,49 @@ nifti_image *reg_aladin<T>::GetFinalWarpedImage()
 }
 /* *************************************************************** */
 template<class T>
+void reg_aladin<T>::GetFinalWarpedImage(nifti_image *resultImage)
+{
+	int floatingType = this->GetFinalWarpedDatatype();
+	// The initial images are used
+	if (this->InputReference == NULL || this->InputFloating == NULL || this->TransformationMatrix == NULL) {
+		reg_print_fct_error("reg_aladin::GetFinalWarpedImage(nifti_image *)");
+		reg_print_msg_error("The reference, floating images and the transformation have to be defined");
+		reg_exit(1);
+	}
+
+	this->CurrentReference = this->InputReference;
+	this->CurrentFloating = this->InputFloating;
+	this->CurrentReferenceMask = NULL;
+
+	reg_aladin<T>::initContent(this->CurrentReference,
+										this->CurrentFloating,
+										this->CurrentReferenceMask,
+										this->TransformationMatrix,
+										sizeof(T));
+	if (floatingType != this->InputFloating->datatype) {
+		this->con->ClearWarpedImage();
+		this->con->AllocateWarpedImage(floatingType);
+	}
+	reg_aladin<T>::createKernels();
+
+	this->CurrentWarped = this->con->getCurrentWarped(floatingType);
+	if (resultImage->nvox != this->CurrentWarped->nvox || resultImage->datatype != this->CurrentWarped->datatype) {
+		reg_print_fct_error("reg_aladin::GetFinalWarpedImage(nifti_image *)");
+		reg_print_msg_error("The output image does not match the warped image in size or type");
+		reg_exit(1);
+	}
+
+	// The resampling kernel writes straight into the output buffer
+	void *warpedData = this->CurrentWarped->data;
+	this->CurrentWarped->data = resultImage->data;
+	reg_aladin<T>::GetWarpedImage(3); // cubic spline interpolation
+	this->CurrentWarped->data = warpedData;
+
+	reg_aladin<T>::clearKernels();
+	reg_aladin<T>::clearContent();
+}
+/* *************************************************************** */
+template<class T>
 void reg_aladin<T>::DebugPrintLevelInfoStart()
 {
 	/* Display some parameters specific to the current level */
@@ -21,6 +21,7 @@
 #include "_reg_nmi.h"
 #include "_reg_ssd.h"
 #include "_reg_tools.h"
+#include "_reg_sharedReference.h"
 #include "float.h"
 #include <limits>
 
@@ -66,6 +67,7 @@ protected:
 	bool ils;
 	bool cusvd;
 	int captureRangeVox;
+	bool hierarchicalSearch;
 
 	int BlockPercentage;
 	int InlierLts;
@@ -86,11 +88,15 @@ protected:
 	T FloatingLowerThreshold;
 	int clIdx;
 
+	reg_sharedReference<T> *sharedReference; // pointer to external
+
 	Platform *platform;
 
 	bool TestMatrixConvergence(mat44 *mat);
 
 	virtual void InitialiseRegistration();
+	/// Creates the images and masks of a pyramid level from the inputs
+	virtual void CreatePyramidLevel(unsigned int level);
 	virtual void SetCurrentImages();
 	virtual void ClearCurrentInputImage();
 	virtual void AllocateWarpedImage();
@@ -99,6 +105,8 @@ protected:
 	virtual void GetDeformationField();
 	virtual void GetWarpedImage(int);
 	virtual void UpdateTransformationMatrix(int);
+	/// Data type of the final warped image
+	int GetFinalWarpedDatatype();
 
 	void (*funcProgressCallback)(float pcntProgress, void *params);
 	void *paramsProgressCallback;
@@ -168,6 +176,13 @@ public:
 		return this->InputReferenceMask;
 	}
 
+	/// @brief Reference pyramids and active blocks computed once for several
+	/// registrations sharing the same reference image and mask
+	void SetSharedReference(reg_sharedReference<T> *shared)
+	{
+		this->sharedReference = shared;
+	}
+
 	void SetInputTransform(const char *filename);
 	mat44 *GetInputTransform()
 	{
@@ -191,6 +206,9 @@ public:
 		return this->TransformationMatrix;
 	}
 	nifti_image *GetFinalWarpedImage();
+	/// @brief Resamples the floating image straight into the data of the
+	/// provided image, which must match the warped image in size and type
+	void GetFinalWarpedImage(nifti_image *resultImage);
 
 	SetMacro(MaxIterations,unsigned int)
 	GetMacro(MaxIterations,unsigned int)
@@ -265,6 +283,10 @@ public:
 	{
 		this->captureRangeVox = captureRangeIn;
 	}
+	void setHierarchicalSearch(bool hierarchicalSearchIn)
+	{
+		this->hierarchicalSearch = hierarchicalSearchIn;
+	}
 
 	void setClIdx(int clIdxIn) {
 		this->clIdx = clIdxIn;
@@ -96,72 +96,9 @@ void reg_aladin_sym<T>::InitialiseRegistration()
 #endif
 
    reg_aladin<T>::InitialiseRegistration();
-   this->FloatingMaskPyramid = (int **) malloc(this->LevelsToPerform*sizeof(int *));
-   this->BackwardActiveVoxelNumber= (int *)malloc(this->LevelsToPerform*sizeof(int));
-   if (this->InputFloatingMask!=NULL)
-   {
-      reg_createMaskPyramid<T>(this->InputFloatingMask,
-                               this->FloatingMaskPyramid,
-                               this->NumberOfLevels,
-                               this->LevelsToPerform,
-                               this->BackwardActiveVoxelNumber);
-   }
-   else
-   {
-      for(unsigned int l=0; l<this->LevelsToPerform; ++l)
-      {
-         this->BackwardActiveVoxelNumber[l]=this->FloatingPyramid[l]->nx*this->FloatingPyramid[l]->ny*this->FloatingPyramid[l]->nz;
-         this->FloatingMaskPyramid[l]=(int *)calloc(this->BackwardActiveVoxelNumber[l],sizeof(int));
-      }
-   }
-
-   // CHECK THE THRESHOLD VALUES TO UPDATE THE MASK
-   if(this->FloatingUpperThreshold!=std::numeric_limits<T>::max())
-   {
-      for(unsigned int l=0; l<this->LevelsToPerform; ++l)
-      {
-         T *refPtr = static_cast<T *>(this->FloatingPyramid[l]->data);
-         int *mskPtr = this->FloatingMaskPyramid[l];
-         size_t removedVoxel=0;
-         for(size_t i=0;
-               i<(size_t)this->FloatingPyramid[l]->nx*this->FloatingPyramid[l]->ny*this->FloatingPyramid[l]->nz;
-               ++i)
-         {
-            if(mskPtr[i]>-1)
-            {
-               if(refPtr[i]>this->FloatingUpperThreshold)
-               {
-                  ++removedVoxel;
-                  mskPtr[i]=-1;
-               }
-            }
-         }
-         this->BackwardActiveVoxelNumber[l] -= removedVoxel;
-      }
-   }
-   if(this->FloatingLowerThreshold!=-std::numeric_limits<T>::max())
-   {
-      for(unsigned int l=0; l<this->LevelsToPerform; ++l)
-      {
-         T *refPtr = static_cast<T *>(this->FloatingPyramid[l]->data);
-         int *mskPtr = this->FloatingMaskPyramid[l];
-         size_t removedVoxel=0;
-         for(size_t i=0;
-               i<(size_t)this->FloatingPyramid[l]->nx*this->FloatingPyramid[l]->ny*this->FloatingPyramid[l]->nz;
-               ++i)
-         {
-            if(mskPtr[i]>-1)
-            {
-               if(refPtr[i]<this->FloatingLowerThreshold)
-               {
-                  ++removedVoxel;
-                  mskPtr[i]=-1;
-               }
-            }
-         }
-         this->BackwardActiveVoxelNumber[l] -= removedVoxel;
-      }
-   }
+   // The floating mask levels are created with the image levels
+   this->FloatingMaskPyramid = (int **) calloc(this->LevelsToPerform,sizeof(int *));
+   this->BackwardActiveVoxelNumber= (int *)calloc(this->LevelsToPerform,sizeof(int));
 
    if(this->AlignCentreGravity && this->InputTransformName==NULL)
    {
@@ -228,6 +165,67 @@ void reg_aladin_sym<T>::InitialiseRegistration()
 }
 /* *************************************************************** */
 template <class T>
+void reg_aladin_sym<T>::CreatePyramidLevel(unsigned int level)
+{
+   reg_aladin<T>::CreatePyramidLevel(level);
+   if (this->InputFloatingMask!=NULL)
+   {
+      reg_createMaskPyramidLevel<T>(this->InputFloatingMask,
+                                    &this->FloatingMaskPyramid[level],
+                                    this->NumberOfLevels,
+                                    level,
+                                    &this->BackwardActiveVoxelNumber[level]);
+   }
+   else
+   {
+      this->BackwardActiveVoxelNumber[level]=this->FloatingPyramid[level]->nx*this->FloatingPyramid[level]->ny*this->FloatingPyramid[level]->nz;
+      this->FloatingMaskPyramid[level]=(int *)calloc(this->BackwardActiveVoxelNumber[level],sizeof(int));
+   }
+
+   // CHECK THE THRESHOLD VALUES TO UPDATE THE MASK
+   if(this->FloatingUpperThreshold!=std::numeric_limits<T>::max())
+   {
+      T *refPtr = static_cast<T *>(this->FloatingPyramid[level]->data);
+      int *mskPtr = this->FloatingMaskPyramid[level];
+      size_t removedVoxel=0;
+      for(size_t i=0;
+            i<(size_t)this->FloatingPyramid[level]->nx*this->FloatingPyramid[level]->ny*this->FloatingPyramid[level]->nz;
+            ++i)
+      {
+         if(mskPtr[i]>-1)
+         {
+            if(refPtr[i]>this->FloatingUpperThreshold)
+            {
+               ++removedVoxel;
+               mskPtr[i]=-1;
+            }
+         }
+      }
+      this->BackwardActiveVoxelNumber[level] -= removedVoxel;
+   }
+   if(this->FloatingLowerThreshold!=-std::numeric_limits<T>::max())
+   {
+      T *refPtr = static_cast<T *>(this->FloatingPyramid[level]->data);
+      int *mskPtr = this->FloatingMaskPyramid[level];
+      size_t removedVoxel=0;
+      for(size_t i=0;
+            i<(size_t)this->FloatingPyramid[level]->nx*this->FloatingPyramid[level]->ny*this->FloatingPyramid[level]->nz;
+            ++i)
+      {
+         if(mskPtr[i]>-1)
+         {
+            if(refPtr[i]<this->FloatingLowerThreshold)
+            {
+               ++removedVoxel;
+               mskPtr[i]=-1;
+            }
+         }
+      }
+      this->BackwardActiveVoxelNumber[level] -= removedVoxel;
+   }
+}
+/* *************************************************************** */
+template <class T>
 void reg_aladin_sym<T>::SetCurrentImages()
 {
    reg_aladin<T>::SetCurrentImages();
@@ -341,6 +339,8 @@ void reg_aladin_sym<T>::initContent(nifti_image *ref,
 	else if (this->platformCode == NR_PLATFORM_CL)
 	this->backCon = new ClContent(flo, ref, this->FloatingMaskPyramid[this->CurrentLevel],this->BackwardTransformationMatrix,bytes, blockPercentage, inlierLts, blockStepSize);
 #endif
+	this->backCon->setCaptureRange(this->captureRangeVox);
+	this->backCon->setHierarchicalSearch(this->hierarchicalSearch);
 	this->BackwardBlockMatchingParams = backCon->Content::getBlockMatchingParams();
 }
 /* *************************************************************** */
@@ -60,6 +60,7 @@ protected:
    virtual void DebugPrintLevelInfoStart();
    virtual void DebugPrintLevelInfoEnd();
    virtual void InitialiseRegistration();
+   virtual void CreatePyramidLevel(unsigned int level);
    virtual void SetCurrentImages();
    virtual void GetWarpedImage(int);
 
@@ -43,6 +43,7 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
    this->inputReference=NULL; // pointer to external
    this->inputFloating=NULL; // pointer to external
    this->maskImage=NULL; // pointer to external
+   this->sharedReference=NULL; // pointer to external
    this->affineTransformation=NULL;  // pointer to external
    this->referenceMask=NULL;
    this->referenceSmoothingSigma=0.;
@@ -72,6 +73,7 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
 
 
    this->initialised=false;
+   this->useSharedReference=false;
    this->referencePyramid=NULL;
    this->floatingPyramid=NULL;
    this->maskPyramid=NULL;
@@ -86,6 +88,10 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
 
    this->interpolation=1;
 
+   this->memoryLimitMB=0;
+   this->currentMemory=0;
+   this->peakMemory=0;
+
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::reg_base");
 #endif
@@ -262,6 +268,15 @@ void reg_base<T>::SetReferenceMask(nifti_image *m)
 }
 /* *************************************************************** */
 template<class T>
+void reg_base<T>::SetSharedReference(reg_sharedReference<T> *s)
+{
+   this->sharedReference = s;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::SetSharedReference");
+#endif
+}
+/* *************************************************************** */
+template<class T>
 void reg_base<T>::SetAffineTransformation(mat44 *a)
 {
    this->affineTransformation=a;
@@ -480,6 +495,99 @@ void reg_base<T>::ClearCurrentInputImage()
 #endif
 }
 /* *************************************************************** */
+template <class T>
+void reg_base<T>::CreatePyramidLevel(unsigned int level)
+{
+   // Without pyramid, the same images are used at every level
+   unsigned int pyramidLevel=this->usePyramid?level:0;
+   unsigned int pyramidLevelNumber=this->usePyramid?this->levelNumber:1;
+   if(this->referencePyramid[pyramidLevel]!=NULL)
+      return;
+
+   if(this->useSharedReference)
+      this->sharedReference->CopyPyramidLevel(pyramidLevel,
+                                              &this->referencePyramid[pyramidLevel],
+                                              &this->maskPyramid[pyramidLevel],
+                                              &this->activeVoxelNumber[pyramidLevel]);
+   else
+   {
+      reg_createImagePyramidLevel<T>(this->inputReference,
+                                     &this->referencePyramid[pyramidLevel],
+                                     pyramidLevelNumber,
+                                     pyramidLevel);
+      if(this->maskImage!=NULL)
+         reg_createMaskPyramidLevel<T>(this->maskImage,
+                                       &this->maskPyramid[pyramidLevel],
+                                       pyramidLevelNumber,
+                                       pyramidLevel,
+                                       &this->activeVoxelNumber[pyramidLevel]);
+      else
+      {
+         nifti_image *reference=this->referencePyramid[pyramidLevel];
+         this->activeVoxelNumber[pyramidLevel]=reference->nx*reference->ny*reference->nz;
+         this->maskPyramid[pyramidLevel]=(int *)calloc(this->activeVoxelNumber[pyramidLevel],sizeof(int));
+      }
+   }
+   reg_createImagePyramidLevel<T>(this->inputFloating,
+                                  &this->floatingPyramid[pyramidLevel],
+                                  pyramidLevelNumber,
+                                  pyramidLevel);
+
+   // SMOOTH THE INPUT IMAGES IF REQUIRED
+   if(this->referenceSmoothingSigma!=0.0)
+   {
+      bool *active = new bool[this->referencePyramid[pyramidLevel]->nt];
+      float *sigma = new float[this->referencePyramid[pyramidLevel]->nt];
+      active[0]=true;
+      for(int i=1; i<this->referencePyramid[pyramidLevel]->nt; ++i)
+         active[i]=false;
+      sigma[0]=this->referenceSmoothingSigma;
+      reg_tools_kernelConvolution(this->referencePyramid[pyramidLevel], sigma, 0, NULL, active);
+      delete []active;
+      delete []sigma;
+   }
+   if(this->floatingSmoothingSigma!=0.0)
+   {
+      // Only the first image is smoothed
+      bool *active = new bool[this->floatingPyramid[pyramidLevel]->nt];
+      float *sigma = new float[this->floatingPyramid[pyramidLevel]->nt];
+      active[0]=true;
+      for(int i=1; i<this->floatingPyramid[pyramidLevel]->nt; ++i)
+         active[i]=false;
+      sigma[0]=this->floatingSmoothingSigma;
+      reg_tools_kernelConvolution(this->floatingPyramid[pyramidLevel], sigma, 0, NULL, active);
+      delete []active;
+      delete []sigma;
+   }
+
+   // THRESHOLD THE INPUT IMAGES IF REQUIRED
+   reg_thresholdImage<T>(this->referencePyramid[pyramidLevel],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
+   reg_thresholdImage<T>(this->floatingPyramid[pyramidLevel],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::CreatePyramidLevel");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::ClearPyramidLevel(unsigned int level)
+{
+   // Without pyramid, the images are kept until the last level is completed
+   unsigned int pyramidLevel=0;
+   if(this->usePyramid)
+      pyramidLevel=level;
+   else if(level!=this->levelToPerform-1)
+      return;
+   nifti_image_free(this->referencePyramid[pyramidLevel]);
+   this->referencePyramid[pyramidLevel]=NULL;
+   nifti_image_free(this->floatingPyramid[pyramidLevel]);
+   this->floatingPyramid[pyramidLevel]=NULL;
+   free(this->maskPyramid[pyramidLevel]);
+   this->maskPyramid[pyramidLevel]=NULL;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::ClearPyramidLevel");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 void reg_base<T>::AllocateWarped()
@@ -502,8 +610,8 @@ void reg_base<T>::AllocateWarped()
       (size_t)this->warped->nt;
    this->warped->scl_slope=1.f;
    this->warped->scl_inter=0.f;
-   this->warped->datatype = this->currentFloating->datatype;
-   this->warped->nbyper = this->currentFloating->nbyper;
+   this->warped->datatype = this->GetWarpedDatatype(this->currentFloating);
+   nifti_datatype_sizes(this->warped->datatype, &this->warped->nbyper, NULL);
    this->warped->data = (void *)calloc(this->warped->nvox, this->warped->nbyper);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::AllocateWarped");
@@ -511,6 +619,16 @@ void reg_base<T>::AllocateWarped()
 }
 /* *************************************************************** */
 template <class T>
+int reg_base<T>::GetWarpedDatatype(nifti_image *image)
+{
+   // The pyramid levels are already in the working precision; nearest
+   // neighbour resampling of the input images keeps their own type
+   if(this->interpolation==0)
+      return image->datatype;
+   return sizeof(T)==sizeof(float) ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64;
+}
+/* *************************************************************** */
+template <class T>
 void reg_base<T>::ClearWarped()
 {
    if(this->warped!=NULL)
@@ -663,6 +781,93 @@ void reg_base<T>::ClearVoxelBasedMeasureGradient()
 #endif
 }
 /* *************************************************************** */
+template <class T>
+void reg_base<T>::SetMemoryLimitMB(int l)
+{
+   this->memoryLimitMB = l;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::SetMemoryLimitMB");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+double reg_base<T>::GetPeakMemoryMB()
+{
+   return double(this->peakMemory) / 1048576.0;
+}
+/* *************************************************************** */
+template <class T>
+std::vector<double> reg_base<T>::GetLevelPeakMemoryMB()
+{
+   std::vector<double> levelPeak(this->levelPeakMemory.size());
+   for(size_t l=0; l<this->levelPeakMemory.size(); ++l)
+      levelPeak[l] = double(this->levelPeakMemory[l]) / 1048576.0;
+   return levelPeak;
+}
+/* *************************************************************** */
+template <class T>
+size_t reg_base<T>::GetImageMemory(nifti_image *image)
+{
+   if(image==NULL || image->data==NULL)
+      return 0;
+   return image->nvox * (size_t)image->nbyper;
+}
+/* *************************************************************** */
+template <class T>
+size_t reg_base<T>::GetMemoryUsage()
+{
+   size_t memory=0;
+   // The levels of the pyramids are only held while they are used
+   unsigned int pyramidalLevelNumber = this->usePyramid?this->levelToPerform:1;
+   for(unsigned int l=0; l<pyramidalLevelNumber; ++l)
+   {
+      if(this->referencePyramid!=NULL && this->referencePyramid[l]!=NULL)
+      {
+         memory += this->GetImageMemory(this->referencePyramid[l]);
+         if(this->maskPyramid!=NULL && this->maskPyramid[l]!=NULL)
+            memory += (size_t)this->referencePyramid[l]->nx *
+                      this->referencePyramid[l]->ny *
+                      this->referencePyramid[l]->nz * sizeof(int);
+      }
+      if(this->floatingPyramid!=NULL)
+         memory += this->GetImageMemory(this->floatingPyramid[l]);
+   }
+   memory += this->GetImageMemory(this->warped);
+   memory += this->GetImageMemory(this->deformationFieldImage);
+   memory += this->GetImageMemory(this->warpedGradientImage);
+   memory += this->GetImageMemory(this->voxelBasedMeasureGradientImage);
+   if(this->optimiser!=NULL)
+      memory += this->optimiser->GetMemoryUsage();
+   return memory;
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::UpdateMemoryUsage(size_t temporaryMemory)
+{
+   this->currentMemory = this->GetMemoryUsage() + temporaryMemory;
+   if(this->currentMemory>this->peakMemory)
+      this->peakMemory = this->currentMemory;
+   if(this->currentLevel<this->levelPeakMemory.size() &&
+         this->currentMemory>this->levelPeakMemory[this->currentLevel])
+      this->levelPeakMemory[this->currentLevel] = this->currentMemory;
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::ApplyMemoryLimit()
+{
+   int estimatedMemory = this->CheckMemoryMB();
+   if(this->memoryLimitMB>0 && estimatedMemory>this->memoryLimitMB)
+   {
+      char text[255];
+      sprintf(text, "The estimated peak memory (%i MB) exceeds the limit of %i MB",
+              estimatedMemory, this->memoryLimitMB);
+      reg_print_msg_warn(text);
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::ApplyMemoryLimit");
+#endif
+}
+/* *************************************************************** */
 template<class T>
 void reg_base<T>::CheckParameters()
 {
@@ -788,21 +993,17 @@ void reg_base<T>::Initialise()
 
    this->CheckParameters();
 
-   // CREATE THE PYRAMIDE IMAGES
-   if(this->usePyramid)
-   {
-      this->referencePyramid = (nifti_image **)malloc(this->levelToPerform*sizeof(nifti_image *));
-      this->floatingPyramid = (nifti_image **)malloc(this->levelToPerform*sizeof(nifti_image *));
-      this->maskPyramid = (int **)malloc(this->levelToPerform*sizeof(int *));
-      this->activeVoxelNumber= (int *)malloc(this->levelToPerform*sizeof(int));
-   }
-   else
-   {
-      this->referencePyramid = (nifti_image **)malloc(sizeof(nifti_image *));
-      this->floatingPyramid = (nifti_image **)malloc(sizeof(nifti_image *));
-      this->maskPyramid = (int **)malloc(sizeof(int *));
-      this->activeVoxelNumber= (int *)malloc(sizeof(int));
-   }
+   // The registration is adapted to the memory limit before any allocation
+   if(this->memoryLimitMB>0)
+      this->ApplyMemoryLimit();
+
+   // ALLOCATE THE PYRAMIDS, WHOSE LEVELS ARE CREATED WHEN THEY ARE REACHED
+   unsigned int pyramidalLevelNumber=1;
+   if(this->usePyramid) pyramidalLevelNumber=this->levelToPerform;
+   this->referencePyramid = (nifti_image **)calloc(pyramidalLevelNumber,sizeof(nifti_image *));
+   this->floatingPyramid = (nifti_image **)calloc(pyramidalLevelNumber,sizeof(nifti_image *));
+   this->maskPyramid = (int **)calloc(pyramidalLevelNumber,sizeof(int *));
+   this->activeVoxelNumber= (int *)calloc(pyramidalLevelNumber,sizeof(int));
 
    // Update the input images threshold if required
    if(this->robustRange==true){
@@ -839,74 +1040,16 @@ void reg_base<T>::Initialise()
       nifti_image_free(temp_floating);
    }
 
-   // FINEST LEVEL OF REGISTRATION
-   if(this->usePyramid)
-   {
-      reg_createImagePyramid<T>(this->inputReference, this->referencePyramid, this->levelNumber, this->levelToPerform);
-      reg_createImagePyramid<T>(this->inputFloating, this->floatingPyramid, this->levelNumber, this->levelToPerform);
-      if (this->maskImage!=NULL)
-         reg_createMaskPyramid<T>(this->maskImage, this->maskPyramid, this->levelNumber, this->levelToPerform, this->activeVoxelNumber);
-      else
-      {
-         for(unsigned int l=0; l<this->levelToPerform; ++l)
-         {
-            this->activeVoxelNumber[l]=this->referencePyramid[l]->nx*this->referencePyramid[l]->ny*this->referencePyramid[l]->nz;
-            this->maskPyramid[l]=(int *)calloc(activeVoxelNumber[l],sizeof(int));
-         }
-      }
-   }
-   else
-   {
-      reg_createImagePyramid<T>(this->inputReference, this->referencePyramid, 1, 1);
-      reg_createImagePyramid<T>(this->inputFloating, this->floatingPyramid, 1, 1);
-      if (this->maskImage!=NULL)
-         reg_createMaskPyramid<T>(this->maskImage, this->maskPyramid, 1, 1, this->activeVoxelNumber);
-      else
-      {
-         this->activeVoxelNumber[0]=this->referencePyramid[0]->nx*this->referencePyramid[0]->ny*this->referencePyramid[0]->nz;
-         this->maskPyramid[0]=(int *)calloc(activeVoxelNumber[0],sizeof(int));
-      }
-   }
-
-   unsigned int pyramidalLevelNumber=1;
-   if(this->usePyramid) pyramidalLevelNumber=this->levelToPerform;
+   // The reference pyramid levels are copied when they have already been computed
+   this->useSharedReference = this->sharedReference!=NULL &&
+         this->sharedReference->IsCompatible(this->inputReference,
+                                             this->maskImage,
+                                             this->usePyramid?this->levelNumber:1,
+                                             this->usePyramid?this->levelToPerform:1);
 
-   // SMOOTH THE INPUT IMAGES IF REQUIRED
-   for(unsigned int l=0; l<this->levelToPerform; l++)
-   {
-      if(this->referenceSmoothingSigma!=0.0)
-      {
-         bool *active = new bool[this->referencePyramid[l]->nt];
-         float *sigma = new float[this->referencePyramid[l]->nt];
-         active[0]=true;
-         for(int i=1; i<this->referencePyramid[l]->nt; ++i)
-            active[i]=false;
-         sigma[0]=this->referenceSmoothingSigma;
-         reg_tools_kernelConvolution(this->referencePyramid[l], sigma, 0, NULL, active);
-         delete []active;
-         delete []sigma;
-      }
-      if(this->floatingSmoothingSigma!=0.0)
-      {
-         // Only the first image is smoothed
-         bool *active = new bool[this->floatingPyramid[l]->nt];
-         float *sigma = new float[this->floatingPyramid[l]->nt];
-         active[0]=true;
-         for(int i=1; i<this->floatingPyramid[l]->nt; ++i)
-            active[i]=false;
-         sigma[0]=this->floatingSmoothingSigma;
-         reg_tools_kernelConvolution(this->floatingPyramid[l], sigma, 0, NULL, active);
-         delete []active;
-         delete []sigma;
-      }
-   }
-
-   // THRESHOLD THE INPUT IMAGES IF REQUIRED
-   for(unsigned int l=0; l<pyramidalLevelNumber; l++)
-   {
-      reg_thresholdImage<T>(this->referencePyramid[l],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
-      reg_thresholdImage<T>(this->floatingPyramid[l],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
-   }
+   // The first level is created, as the transformation is defined on it
+   this->CreatePyramidLevel(0);
+   this->UpdateMemoryUsage();
 
    this->initialised=true;
 #ifndef NDEBUG
@@ -955,6 +1098,39 @@ double reg_base<T>::ComputeSimilarityMeasure()
    return double(this->similarityWeight) * measure;
 }
 /* *************************************************************** */
+template <class T>
+bool reg_base<T>::UseNMIOnly()
+{
+   return this->measure_nmi!=NULL &&
+          this->measure_multichannel_nmi==NULL &&
+          this->measure_ssd==NULL &&
+          this->measure_kld==NULL &&
+          this->measure_lncc==NULL &&
+          this->measure_dti==NULL;
+}
+/* *************************************************************** */
+template <class T>
+double reg_base<T>::WarpAndComputeSimilarityMeasure(int inter)
+{
+   // When NMI is the only measure, the joint histogram is filled while the
+   // floating image is resampled and the warped image is not generated
+   if(this->UseNMIOnly() &&
+         this->measure_nmi->CanUseDeformationField(this->deformationFieldImage,NULL))
+   {
+      this->GetDeformationField();
+      double measure = this->measure_nmi->GetSimilarityMeasureValue(this->deformationFieldImage,
+                                                                   NULL,
+                                                                   inter,
+                                                                   this->warpedPaddingValue);
+#ifndef NDEBUG
+      reg_print_fct_debug("reg_base<T>::WarpAndComputeSimilarityMeasure");
+#endif
+      return double(this->similarityWeight) * measure;
+   }
+   this->WarpFloatingImage(inter);
+   return this->ComputeSimilarityMeasure();
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 void reg_base<T>::GetVoxelBasedGradient()
@@ -1162,6 +1338,9 @@ void reg_base<T>::WarpFloatingImage(int inter)
                         this->measure_dti->GetActiveTimepoints(),
                         this->forwardJacobianMatrix);
    }
+   // The local statistics of the LNCC depend on the warped image
+   if(this->measure_lncc!=NULL)
+      this->measure_lncc->SetWarpedImageUpdated();
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::WarpFloatingImage");
 #endif
@@ -1190,6 +1369,7 @@ void reg_base<T>::Run()
 #ifdef RNIFTYREG
     this->completedIterations.resize(this->levelToPerform, 0);
 #endif
+   this->levelPeakMemory.assign(this->levelToPerform, 0);
 
    // Update the maximal number of iteration to perform per level
    this->maxiterationNumber = this->maxiterationNumber * static_cast<int>(powf(2.0, this->levelToPerform-1));
@@ -1200,7 +1380,8 @@ void reg_base<T>::Run()
          this->currentLevel++)
    {
 
-      // Set the current input images
+      // Create the level from the input images and set the current input images
+      this->CreatePyramidLevel(this->currentLevel);
       if(this->usePyramid)
       {
          this->currentReference = this->referencePyramid[this->currentLevel];
@@ -1236,6 +1417,9 @@ void reg_base<T>::Run()
       // initialise the optimiser
       this->SetOptimiser();
 
+      // Every image and array of the current level is now allocated
+      this->UpdateMemoryUsage();
+
       // Loop over the number of perturbation to do
       for(size_t perturbation=0;
             perturbation<=this->perturbationNumber;
@@ -1314,24 +1498,7 @@ void reg_base<T>::Run()
       this->ClearWarpedGradient();
       this->ClearVoxelBasedMeasureGradient();
       this->ClearTransformationGradient();
-      if(this->usePyramid)
-      {
-         nifti_image_free(this->referencePyramid[this->currentLevel]);
-         this->referencePyramid[this->currentLevel]=NULL;
-         nifti_image_free(this->floatingPyramid[this->currentLevel]);
-         this->floatingPyramid[this->currentLevel]=NULL;
-         free(this->maskPyramid[this->currentLevel]);
-         this->maskPyramid[this->currentLevel]=NULL;
-      }
-      else if(this->currentLevel==this->levelToPerform-1)
-      {
-         nifti_image_free(this->referencePyramid[0]);
-         this->referencePyramid[0]=NULL;
-         nifti_image_free(this->floatingPyramid[0]);
-         this->floatingPyramid[0]=NULL;
-         free(this->maskPyramid[0]);
-         this->maskPyramid[0]=NULL;
-      }
+      this->ClearPyramidLevel(this->currentLevel);
       this->ClearCurrentInputImage();
 
 #ifdef NDEBUG
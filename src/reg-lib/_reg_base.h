@@ -21,12 +21,14 @@
 #include "_reg_KLdivergence.h"
 #include "_reg_lncc.h"
 #include "_reg_tools.h"
+#include "_reg_sharedReference.h"
 #ifndef RNIFTYREG
 #include "_reg_ReadWriteImage.h"
 #endif
 #include "_reg_optimiser.h"
 #include "float.h"
 #include <limits>
+#include <vector>
 
 template <class T>
 class reg_base : public InterfaceOptimiser
@@ -57,6 +59,7 @@ protected:
    nifti_image *inputReference; // pointer to external
    nifti_image *inputFloating; // pointer to external
    nifti_image *maskImage; // pointer to external
+   reg_sharedReference<T> *sharedReference; // pointer to external
    mat44 *affineTransformation; // pointer to external
    int *referenceMask;
    T referenceSmoothingSigma;
@@ -79,6 +82,7 @@ protected:
    int interpolation;
 
    bool initialised;
+   bool useSharedReference;
    nifti_image **referencePyramid;
    nifti_image **floatingPyramid;
    int **maskPyramid;
@@ -101,8 +105,28 @@ protected:
     std::vector<int> completedIterations;
 #endif
 
+   // Memory related variables, in bytes apart from the limit
+   int memoryLimitMB;
+   size_t currentMemory;
+   size_t peakMemory;
+   std::vector<size_t> levelPeakMemory;
+
+   /// Number of bytes of the data of an image, zero if it is not allocated
+   size_t GetImageMemory(nifti_image *image);
+   /// Number of bytes held by the images and arrays of the registration
+   virtual size_t GetMemoryUsage();
+   /// Records the current memory usage, with the number of bytes of any
+   /// temporary allocation, in the overall and level peaks
+   void UpdateMemoryUsage(size_t temporaryMemory=0);
+   /// Adapts the registration to the memory limit, where possible
+   virtual void ApplyMemoryLimit();
+
    virtual void AllocateWarped();
    virtual void ClearWarped();
+   /// Data type of an image warped from the specified one. Interpolated
+   /// intensities are stored in the working precision, so that input images
+   /// of any type can be resampled directly
+   int GetWarpedDatatype(nifti_image *image);
    virtual void AllocateDeformationField();
    virtual void ClearDeformationField();
    virtual void AllocateWarpedGradient();
@@ -114,9 +138,16 @@ protected:
       return 0.;
    }
    virtual void ClearCurrentInputImage();
+   /// Creates the images and masks of a pyramid level from the inputs,
+   /// unless they are already held
+   virtual void CreatePyramidLevel(unsigned int level);
+   /// Frees the images and masks of a pyramid level once it is completed
+   virtual void ClearPyramidLevel(unsigned int level);
 
    virtual void WarpFloatingImage(int);
    virtual double ComputeSimilarityMeasure();
+   virtual double WarpAndComputeSimilarityMeasure(int);
+   bool UseNMIOnly();
    virtual void GetVoxelBasedGradient();
    virtual void SmoothGradient()
    {
@@ -230,6 +261,7 @@ public:
    void SetReferenceImage(nifti_image *);
    void SetFloatingImage(nifti_image *);
    void SetReferenceMask(nifti_image *);
+   void SetSharedReference(reg_sharedReference<T> *);
    void SetAffineTransformation(mat44 *);
    void SetReferenceSmoothingSigma(T);
    void SetFloatingSmoothingSigma(T);
@@ -257,6 +289,16 @@ public:
    }
 #endif
 
+   // Memory related functions
+   void SetMemoryLimitMB(int);
+   /// Estimate of the peak memory, in MB, from the size of the inputs
+   virtual int CheckMemoryMB()
+   {
+      return 0;
+   }
+   double GetPeakMemoryMB();
+   std::vector<double> GetLevelPeakMemoryMB();
+
    virtual void CheckParameters();
    void Run();
    virtual void Initialise();
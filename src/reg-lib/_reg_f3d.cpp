@@ -232,9 +232,13 @@ void reg_f3d<T>::Initialise()
       float spacingInMillimeter[3]= {static_cast<float>(this->spacing[0]),static_cast<float>(this->spacing[1]),static_cast<float>(this->spacing[2])};
       if(this->usePyramid)
       {
-         if(spacingInMillimeter[0]<0) spacingInMillimeter[0] *= -1.0f * this->referencePyramid[this->levelToPerform-1]->dx;
-         if(spacingInMillimeter[1]<0) spacingInMillimeter[1] *= -1.0f * this->referencePyramid[this->levelToPerform-1]->dy;
-         if(spacingInMillimeter[2]<0) spacingInMillimeter[2] *= -1.0f * this->referencePyramid[this->levelToPerform-1]->dz;
+         // The finest level has not been created yet
+         int finestDim[8];
+         float finestPixdim[8];
+         reg_getPyramidLevelDimension(this->inputReference, this->levelNumber, this->levelToPerform-1, finestDim, finestPixdim);
+         if(spacingInMillimeter[0]<0) spacingInMillimeter[0] *= -1.0f * finestPixdim[1];
+         if(spacingInMillimeter[1]<0) spacingInMillimeter[1] *= -1.0f * finestPixdim[2];
+         if(spacingInMillimeter[2]<0) spacingInMillimeter[2] *= -1.0f * finestPixdim[3];
       }
       else
       {
@@ -824,8 +828,7 @@ double reg_f3d<T>::GetObjectiveFunctionValue()
    this->currentWMeasure = 0.0;
    if(this->similarityWeight>0)
    {
-      this->WarpFloatingImage(this->interpolation);
-      this->currentWMeasure = this->ComputeSimilarityMeasure();
+      this->currentWMeasure = this->WarpAndComputeSimilarityMeasure(this->interpolation);
    }
    else
    {
@@ -995,8 +998,9 @@ nifti_image **reg_f3d<T>::GetWarpedImage()
    resultImage[0]->cal_max=this->inputFloating->cal_max;
    resultImage[0]->scl_slope=this->inputFloating->scl_slope;
    resultImage[0]->scl_inter=this->inputFloating->scl_inter;
-   resultImage[0]->data=(void *)malloc(resultImage[0]->nvox*resultImage[0]->nbyper);
-   memcpy(resultImage[0]->data, this->warped->data, resultImage[0]->nvox*resultImage[0]->nbyper);
+   // The warped data are handed over rather than copied
+   resultImage[0]->data=this->warped->data;
+   this->warped->data=NULL;
 
    resultImage[1]=NULL;
 
@@ -1007,6 +1011,48 @@ nifti_image **reg_f3d<T>::GetWarpedImage()
    return resultImage;
 }
 /* *************************************************************** */
+template<class T>
+void reg_f3d<T>::GetWarpedImage(nifti_image *resultImage)
+{
+   // The initial images are used
+   if(this->inputReference==NULL ||
+         this->inputFloating==NULL ||
+         this->controlPointGrid==NULL)
+   {
+      reg_print_fct_error("reg_f3d<T>::GetWarpedImage(nifti_image *)");
+      reg_print_msg_error("The reference, floating and control point grid images have to be defined");
+      reg_exit(1);
+   }
+
+   this->currentReference = this->inputReference;
+   this->currentFloating = this->inputFloating;
+   this->currentMask=NULL;
+
+   this->warpedPaddingValue=0.;
+
+   // The virtual calls also allocate and warp the backward images of the symmetric schemes
+   this->AllocateWarped();
+   this->AllocateDeformationField();
+   if(resultImage->nvox!=this->warped->nvox || resultImage->datatype!=this->warped->datatype)
+   {
+      reg_print_fct_error("reg_f3d<T>::GetWarpedImage(nifti_image *)");
+      reg_print_msg_error("The output image does not match the warped image in size or type");
+      reg_exit(1);
+   }
+
+   // The forward warped image is resampled straight into the output buffer
+   free(this->warped->data);
+   this->warped->data=resultImage->data;
+   this->WarpFloatingImage(3); // cubic spline interpolation
+   this->warped->data=NULL;
+
+   this->ClearDeformationField();
+   this->ClearWarped();
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::GetWarpedImage(nifti_image *)");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template<class T>
 nifti_image * reg_f3d<T>::GetControlPointPositionImage()
@@ -1123,6 +1169,117 @@ void reg_f3d<T>::CorrectTransformation()
 }
 /* *************************************************************** */
 /* *************************************************************** */
+template <class T>
+size_t reg_f3d<T>::GetMemoryUsage()
+{
+   return reg_base<T>::GetMemoryUsage() +
+          this->GetImageMemory(this->controlPointGrid) +
+          this->GetImageMemory(this->transformationGradient);
+}
+/* *************************************************************** */
+template <class T>
+size_t reg_f3d<T>::EstimateLevelMemory(size_t referenceVoxelNumber,
+                                       size_t,
+                                       size_t referenceGridVoxelNumber,
+                                       size_t)
+{
+   size_t dim = this->inputReference->nz>1?3:2;
+   size_t floatingTimePoint = this->inputFloating->nt>1?this->inputFloating->nt:1;
+   // Warped image, deformation field, warped gradient and voxel-based gradient
+   size_t memory = referenceVoxelNumber * (floatingTimePoint + dim +
+                                           dim * floatingTimePoint + dim);
+   // Control point grid, its gradient and the optimiser arrays
+   memory += referenceGridVoxelNumber * dim * (this->useConjGradient?5:3);
+   return memory * sizeof(T);
+}
+/* *************************************************************** */
+// Number of voxels of each level of the pyramid of an image, from the coarsest
+// to the finest
+static std::vector<size_t> reg_f3d_getPyramidVoxelNumber(nifti_image *image,
+                                                         unsigned int levelNumber,
+                                                         unsigned int levelToPerform)
+{
+   std::vector<size_t> voxelNumber(levelToPerform, 0);
+   int dim[8];
+   float pixdim[8];
+   for(unsigned int l=0; l<levelToPerform; ++l)
+   {
+      reg_getPyramidLevelDimension(image, levelNumber, l, dim, pixdim);
+      voxelNumber[l]=(size_t)dim[1]*dim[2]*dim[3];
+   }
+   return voxelNumber;
+}
+/* *************************************************************** */
+// Number of control points of a grid spanning an image, as created by
+// reg_createControlPointGrid
+static size_t reg_f3d_getGridVoxelNumber(nifti_image *image, float *spacing)
+{
+   size_t voxelNumber = static_cast<size_t>(reg_ceil(image->nx*image->dx/spacing[0])+3.f) *
+                        static_cast<size_t>(reg_ceil(image->ny*image->dy/spacing[1])+3.f);
+   if(image->nz>1)
+      voxelNumber *= static_cast<size_t>(reg_ceil(image->nz*image->dz/spacing[2])+3.f);
+   return voxelNumber;
+}
+/* *************************************************************** */
+template <class T>
+int reg_f3d<T>::CheckMemoryMB()
+{
+   if(this->inputReference==NULL || this->inputFloating==NULL)
+      return 0;
+
+   // The number of levels is checked as in CheckParameters()
+   unsigned int levelToPerform = this->levelToPerform;
+   if(levelToPerform==0 || levelToPerform>this->levelNumber)
+      levelToPerform = this->levelNumber;
+   unsigned int pyramidalLevelNumber = this->usePyramid?levelToPerform:1;
+   std::vector<size_t> referenceVoxelNumber =
+      reg_f3d_getPyramidVoxelNumber(this->inputReference, this->usePyramid?this->levelNumber:1, pyramidalLevelNumber);
+   std::vector<size_t> floatingVoxelNumber =
+      reg_f3d_getPyramidVoxelNumber(this->inputFloating, this->usePyramid?this->levelNumber:1, pyramidalLevelNumber);
+   size_t referenceTimePoint = this->inputReference->nt>1?this->inputReference->nt:1;
+   size_t floatingTimePoint = this->inputFloating->nt>1?this->inputFloating->nt:1;
+
+   // Final grid spacing, in millimetres
+   float finalSpacing[3];
+   for(int i=0; i<3; ++i)
+   {
+      if(this->inputControlPointGrid!=NULL)
+         finalSpacing[i] = this->inputControlPointGrid->pixdim[i+1] / powf(2.0f, (float)(levelToPerform-1));
+      else
+      {
+         finalSpacing[i] = static_cast<float>(this->spacing[i]!=this->spacing[i] ? this->spacing[0] : this->spacing[i]);
+         if(finalSpacing[i]<0)
+            finalSpacing[i] *= -1.0f * this->inputReference->pixdim[i+1];
+      }
+   }
+
+   // Only the pyramid level being registered is held with its images
+   size_t peakMemory = 0;
+   for(unsigned int l=0; l<levelToPerform; ++l)
+   {
+      unsigned int pyramidLevel = this->usePyramid?l:0;
+      size_t levelMemory = (referenceVoxelNumber[pyramidLevel]*referenceTimePoint +
+                            floatingVoxelNumber[pyramidLevel]*floatingTimePoint) * sizeof(T) +
+                           referenceVoxelNumber[pyramidLevel] * sizeof(int);
+
+      float levelSpacing[3];
+      float factor = powf(2.0f, (float)(this->gridRefinement ? levelToPerform-1-l : levelToPerform-1));
+      for(int i=0; i<3; ++i)
+         levelSpacing[i] = finalSpacing[i] * factor;
+      levelMemory += this->EstimateLevelMemory(referenceVoxelNumber[pyramidLevel],
+                                               floatingVoxelNumber[pyramidLevel],
+                                               reg_f3d_getGridVoxelNumber(this->inputReference, levelSpacing),
+                                               reg_f3d_getGridVoxelNumber(this->inputFloating, levelSpacing));
+      if(levelMemory>peakMemory)
+         peakMemory = levelMemory;
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::CheckMemoryMB");
+#endif
+   return static_cast<int>(reg_ceil(double(peakMemory) / 1048576.0));
+}
+/* *************************************************************** */
+/* *************************************************************** */
 template class reg_f3d<float>;
 template class reg_f3d<double>;
 #endif
@@ -67,6 +67,14 @@ protected:
 
    virtual void CorrectTransformation();
 
+   virtual size_t GetMemoryUsage();
+   /// Estimated number of bytes allocated for a level, besides the pyramids,
+   /// from the number of voxels of the images and control point grids
+   virtual size_t EstimateLevelMemory(size_t referenceVoxelNumber,
+                                      size_t floatingVoxelNumber,
+                                      size_t referenceGridVoxelNumber,
+                                      size_t floatingGridVoxelNumber);
+
    void (*funcProgressCallback)(float pcntProgress, void *params);
    void *paramsProgressCallback;
 
@@ -114,6 +122,10 @@ public:
    {
       return;
    }
+   virtual void UseCoarseSquaring()
+   {
+      return;
+   }
 
    // F3D_SYM specific options
    virtual void SetFloatingMask(nifti_image *)
@@ -129,16 +141,15 @@ public:
       return NULL;
    }
 
-   // F3D_gpu specific option
-   virtual int CheckMemoryMB()
-   {
-      return EXIT_SUCCESS;
-   }
+   virtual int CheckMemoryMB();
 
    virtual void CheckParameters();
    virtual void Initialise();
    virtual nifti_image *GetControlPointPositionImage();
    virtual nifti_image **GetWarpedImage();
+   /// @brief Resamples the floating image straight into the data of the
+   /// provided image, which must match the warped image in size and type
+   virtual void GetWarpedImage(nifti_image *resultImage);
 
    // Function used for testing
    virtual void reg_test_setControlPointGrid(nifti_image *cpp)
@@ -26,6 +26,7 @@ reg_f3d2<T>::reg_f3d2(int refTimePoint,int floTimePoint)
    this->BCHUpdate=false;
    this->useGradientCumulativeExp=true;
    this->BCHUpdateValue=0;
+   this->useCoarseSquaring=false;
 
 #ifndef NDEBUG
    reg_print_msg_debug("reg_f3d2 constructor called");
@@ -67,6 +68,58 @@ void reg_f3d2<T>::DoNotUseGradientCumulativeExp()
 }
 /* *************************************************************** */
 /* *************************************************************** */
+template <class T>
+void reg_f3d2<T>::UseCoarseSquaring()
+{
+   this->useCoarseSquaring = true;
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+size_t reg_f3d2<T>::EstimateLevelMemory(size_t referenceVoxelNumber,
+                                        size_t floatingVoxelNumber,
+                                        size_t referenceGridVoxelNumber,
+                                        size_t floatingGridVoxelNumber)
+{
+   size_t dim = this->inputReference->nz>1?3:2;
+   size_t fieldVoxelNumber = dim * (referenceVoxelNumber>floatingVoxelNumber ?
+                                    referenceVoxelNumber : floatingVoxelNumber);
+   // The scaling-and-squaring holds the flow field and, unless it is computed
+   // on a coarser grid, a full-size buffer
+   size_t temporaryVoxelNumber = this->useCoarseSquaring ?
+                                 fieldVoxelNumber + 2 * fieldVoxelNumber / (dim==3?8:4) :
+                                 2 * fieldVoxelNumber;
+   // The exponentiation of the gradient holds every intermediate deformation
+   // field of the default six squaring steps, the affine and a gradient
+   if(this->useGradientCumulativeExp)
+   {
+      size_t exponentiationVoxelNumber = (6 + 3) * dim * referenceVoxelNumber;
+      if(exponentiationVoxelNumber>temporaryVoxelNumber)
+         temporaryVoxelNumber = exponentiationVoxelNumber;
+   }
+   return reg_f3d_sym<T>::EstimateLevelMemory(referenceVoxelNumber,
+                                              floatingVoxelNumber,
+                                              referenceGridVoxelNumber,
+                                              floatingGridVoxelNumber) +
+          temporaryVoxelNumber * sizeof(T);
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+void reg_f3d2<T>::ApplyMemoryLimit()
+{
+   // Only the temporary fields are reduced, since the transformation model
+   // and the optimisation are unchanged
+   if(!this->useCoarseSquaring && this->CheckMemoryMB()>this->memoryLimitMB)
+   {
+      this->useCoarseSquaring=true;
+      if(this->verbose)
+         reg_print_info(this->executableName, "The flow fields are squared on a coarser grid to fit the memory limit");
+   }
+   reg_f3d_sym<T>::ApplyMemoryLimit();
+}
+/* *************************************************************** */
+/* *************************************************************** */
 template<class T>
 void reg_f3d2<T>::Initialise()
 {
@@ -85,6 +138,27 @@ void reg_f3d2<T>::Initialise()
 }
 /* *************************************************************** */
 /* *************************************************************** */
+// Number of bytes temporarily allocated by the integration of a velocity grid
+// into a deformation field, following reg_defField_scalingAndSquaring
+static size_t reg_f3d2_getIntegrationMemory(nifti_image *deformationField,
+                                            int squaringNumber,
+                                            bool coarseSquaring)
+{
+   size_t fieldMemory = deformationField->nvox * (size_t)deformationField->nbyper;
+   // The flow field has the size of the deformation field
+   size_t memory = fieldMemory;
+   if(coarseSquaring)
+   {
+      size_t coarseVoxelNumber = (size_t)deformationField->nt * deformationField->nu;
+      for(int i=1; i<=3; ++i)
+         coarseVoxelNumber *= deformationField->dim[i]<2 ? 1 : deformationField->dim[i]/2+1;
+      memory += 2 * coarseVoxelNumber * deformationField->nbyper;
+   }
+   else if(squaringNumber>0 && squaringNumber%2==0)
+      memory += fieldMemory;
+   return memory;
+}
+/* *************************************************************** */
 template <class T>
 void reg_f3d2<T>::GetDeformationField()
 {
@@ -93,6 +167,8 @@ void reg_f3d2<T>::GetDeformationField()
    // The provided step number is used for the final resampling
    if(this->optimiser==NULL)
       updateStepNumber=false;
+   // The squaring may be computed on a coarser grid during the optimisation only
+   bool coarseSquaring=this->useCoarseSquaring && updateStepNumber;
 #ifndef NDEBUG
    char text[255];
    sprintf(text, "Velocity integration forward. Step number update=%i",updateStepNumber);
@@ -101,8 +177,12 @@ void reg_f3d2<T>::GetDeformationField()
    // The forward transformation is computed using the scaling-and-squaring approach
    reg_spline_getDefFieldFromVelocityGrid(this->controlPointGrid,
                                           this->deformationFieldImage,
-                                          updateStepNumber
+                                          updateStepNumber,
+                                          coarseSquaring
                                           );
+   this->UpdateMemoryUsage(reg_f3d2_getIntegrationMemory(this->deformationFieldImage,
+                                                         static_cast<int>(fabsf(this->controlPointGrid->intent_p2)),
+                                                         coarseSquaring));
 #ifndef NDEBUG
    sprintf(text, "Velocity integration backward. Step number update=%i",updateStepNumber);
    reg_print_msg_debug(text);
@@ -112,8 +192,12 @@ void reg_f3d2<T>::GetDeformationField()
    // The backward transformation is computed using the scaling-and-squaring approach
    reg_spline_getDefFieldFromVelocityGrid(this->backwardControlPointGrid,
                                           this->backwardDeformationFieldImage,
-                                          false
+                                          false,
+                                          coarseSquaring
                                           );
+   this->UpdateMemoryUsage(reg_f3d2_getIntegrationMemory(this->backwardDeformationFieldImage,
+                                                         static_cast<int>(fabsf(this->backwardControlPointGrid->intent_p2)),
+                                                         coarseSquaring));
    return;
 }
 /* *************************************************************** */
@@ -198,6 +282,11 @@ void reg_f3d2<T>::ExponentiateGradient()
    nifti_image *tempGrad=nifti_copy_nim_info(this->voxelBasedMeasureGradientImage);
 
    tempGrad->data=(void *)malloc(tempGrad->nvox*tempGrad->nbyper);
+   // The temporary images are included in the memory usage
+   size_t temporaryMemory = this->GetImageMemory(tempGrad) + this->GetImageMemory(affine_disp);
+   for(int i=0; i<=(int)fabsf(this->backwardControlPointGrid->intent_p2); ++i)
+      temporaryMemory += this->GetImageMemory(tempDef[i]);
+   this->UpdateMemoryUsage(temporaryMemory);
    for(int i=0; i<(int)fabsf(this->backwardControlPointGrid->intent_p2); ++i)
    {
       reg_tools_substractImageToImage(tempDef[i],
@@ -260,6 +349,10 @@ void reg_f3d2<T>::ExponentiateGradient()
                                      affine_disp);
       reg_getDisplacementFromDeformation(affine_disp);
    }
+   temporaryMemory = this->GetImageMemory(tempGrad) + this->GetImageMemory(affine_disp);
+   for(int i=0; i<=(int)fabsf(this->controlPointGrid->intent_p2); ++i)
+      temporaryMemory += this->GetImageMemory(tempDef[i]);
+   this->UpdateMemoryUsage(temporaryMemory);
 
    for(int i=0; i<(int)fabsf(this->controlPointGrid->intent_p2); ++i)
    {
@@ -454,24 +547,24 @@ nifti_image **reg_f3d2<T>::GetWarpedImage()
    // Clear the deformation field
    reg_f3d2<T>::ClearDeformationField();
 
-   // Allocate and save the forward transformation warped image
+   // Hand over the forward transformation warped image
    nifti_image **resultImage=(nifti_image **)malloc(2*sizeof(nifti_image *));
    resultImage[0] = nifti_copy_nim_info(this->warped);
    resultImage[0]->cal_min=this->inputFloating->cal_min;
    resultImage[0]->cal_max=this->inputFloating->cal_max;
    resultImage[0]->scl_slope=this->inputFloating->scl_slope;
    resultImage[0]->scl_inter=this->inputFloating->scl_inter;
-   resultImage[0]->data=(void *)malloc(resultImage[0]->nvox*resultImage[0]->nbyper);
-   memcpy(resultImage[0]->data, this->warped->data, resultImage[0]->nvox*resultImage[0]->nbyper);
+   resultImage[0]->data=this->warped->data;
+   this->warped->data=NULL;
 
-   // Allocate and save the backward transformation warped image
+   // Hand over the backward transformation warped image
    resultImage[1] = nifti_copy_nim_info(this->backwardWarped);
    resultImage[1]->cal_min=this->inputReference->cal_min;
    resultImage[1]->cal_max=this->inputReference->cal_max;
    resultImage[1]->scl_slope=this->inputReference->scl_slope;
    resultImage[1]->scl_inter=this->inputReference->scl_inter;
-   resultImage[1]->data=(void *)malloc(resultImage[1]->nvox*resultImage[1]->nbyper);
-   memcpy(resultImage[1]->data, this->backwardWarped->data, resultImage[1]->nvox*resultImage[1]->nbyper);
+   resultImage[1]->data=this->backwardWarped->data;
+   this->backwardWarped->data=NULL;
 
    // Clear the warped images
    reg_f3d2<T>::ClearWarped();
@@ -480,6 +573,48 @@ nifti_image **reg_f3d2<T>::GetWarpedImage()
    return resultImage;
 }
 /* *************************************************************** */
+template <class T>
+void reg_f3d2<T>::GetWarpedImage(nifti_image *resultImage)
+{
+   // The initial images are used
+   if(this->inputReference==NULL ||
+         this->inputFloating==NULL ||
+         this->controlPointGrid==NULL ||
+         this->backwardControlPointGrid==NULL)
+   {
+      reg_print_fct_error("reg_f3d2<T>::GetWarpedImage(nifti_image *)");
+      reg_print_msg_error("The reference, floating and control point grid images have to be defined");
+      reg_exit(1);
+   }
+
+   // Set the input images
+   reg_f3d2<T>::currentReference = this->inputReference;
+   reg_f3d2<T>::currentFloating = this->inputFloating;
+   // No mask is used to perform the final resampling
+   reg_f3d2<T>::currentMask = NULL;
+   reg_f3d2<T>::currentFloatingMask = NULL;
+
+   // Allocate the forward and backward warped images and deformation fields
+   reg_f3d2<T>::AllocateWarped();
+   reg_f3d2<T>::AllocateDeformationField();
+   if(resultImage->nvox!=this->warped->nvox || resultImage->datatype!=this->warped->datatype)
+   {
+      reg_print_fct_error("reg_f3d2<T>::GetWarpedImage(nifti_image *)");
+      reg_print_msg_error("The output image does not match the warped image in size or type");
+      reg_exit(1);
+   }
+
+   // The forward warped image is resampled straight into the output buffer
+   free(this->warped->data);
+   this->warped->data=resultImage->data;
+   reg_f3d2<T>::WarpFloatingImage(3); // cubic spline interpolation
+   this->warped->data=NULL;
+
+   // Clear the deformation fields and the warped images
+   reg_f3d2<T>::ClearDeformationField();
+   reg_f3d2<T>::ClearWarped();
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template class reg_f3d2<float>;
 template class reg_f3d2<double>;
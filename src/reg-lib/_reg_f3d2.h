@@ -21,6 +21,7 @@ protected:
    bool BCHUpdate;
    bool useGradientCumulativeExp;
    int BCHUpdateValue;
+   bool useCoarseSquaring;
 
    virtual void GetDeformationField();
    virtual void GetInverseConsistencyErrorField(bool forceAll);
@@ -31,12 +32,19 @@ protected:
    virtual void UseBCHUpdate(int);
    virtual void UseGradientCumulativeExp();
    virtual void DoNotUseGradientCumulativeExp();
+   virtual void UseCoarseSquaring();
+   virtual size_t EstimateLevelMemory(size_t referenceVoxelNumber,
+                                      size_t floatingVoxelNumber,
+                                      size_t referenceGridVoxelNumber,
+                                      size_t floatingGridVoxelNumber);
+   virtual void ApplyMemoryLimit();
 
 public:
    reg_f3d2(int refTimePoint,int floTimePoint);
    ~reg_f3d2();
    virtual void Initialise();
    virtual nifti_image **GetWarpedImage();
+   virtual void GetWarpedImage(nifti_image *resultImage);
 };
 
 //#include "_reg_f3d2.cpp"
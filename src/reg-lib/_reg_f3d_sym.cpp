@@ -166,12 +166,59 @@ template <class T>
 void reg_f3d_sym<T>::ClearCurrentInputImage()
 {
    reg_f3d<T>::ClearCurrentInputImage();
+   this->currentFloatingMask=NULL;
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::ClearCurrentInputImage");
 #endif
    return;
 }
 /* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::CreatePyramidLevel(unsigned int level)
+{
+   reg_f3d<T>::CreatePyramidLevel(level);
+
+   // The floating mask pyramid is only allocated once the base class is initialised
+   unsigned int pyramidLevel=this->usePyramid?level:0;
+   if(this->floatingMaskPyramid==NULL || this->floatingMaskPyramid[pyramidLevel]!=NULL)
+      return;
+   if(this->floatingMaskImage!=NULL)
+      reg_createMaskPyramidLevel<T>(this->floatingMaskImage,
+                                    &this->floatingMaskPyramid[pyramidLevel],
+                                    this->usePyramid?this->levelNumber:1,
+                                    pyramidLevel,
+                                    &this->backwardActiveVoxelNumber[pyramidLevel]);
+   else
+   {
+      nifti_image *floating=this->floatingPyramid[pyramidLevel];
+      this->backwardActiveVoxelNumber[pyramidLevel]=floating->nx*floating->ny*floating->nz;
+      this->floatingMaskPyramid[pyramidLevel]=(int *)calloc(this->backwardActiveVoxelNumber[pyramidLevel],sizeof(int));
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::CreatePyramidLevel");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::ClearPyramidLevel(unsigned int level)
+{
+   reg_f3d<T>::ClearPyramidLevel(level);
+   // The floating mask of the completed level is not used anymore
+   if(this->usePyramid)
+   {
+      free(this->floatingMaskPyramid[level]);
+      this->floatingMaskPyramid[level]=NULL;
+   }
+   else if(level==this->levelToPerform-1)
+   {
+      free(this->floatingMaskPyramid[0]);
+      this->floatingMaskPyramid[0]=NULL;
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::ClearPyramidLevel");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 void reg_f3d_sym<T>::AllocateWarped()
@@ -194,8 +241,8 @@ void reg_f3d_sym<T>::AllocateWarped()
          (size_t)this->backwardWarped->ny *
          (size_t)this->backwardWarped->nz *
          (size_t)this->backwardWarped->nt;
-   this->backwardWarped->datatype = this->currentReference->datatype;
-   this->backwardWarped->nbyper = this->currentReference->nbyper;
+   this->backwardWarped->datatype = this->GetWarpedDatatype(this->currentReference);
+   nifti_datatype_sizes(this->backwardWarped->datatype, &this->backwardWarped->nbyper, NULL);
    this->backwardWarped->data = (void *)calloc(this->backwardWarped->nvox, this->backwardWarped->nbyper);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::AllocateWarped");
@@ -524,45 +571,11 @@ void reg_f3d_sym<T>::Initialise()
       }
    }
 
-   // Set the floating mask image pyramid
-   if(this->usePyramid)
-   {
-      this->floatingMaskPyramid = (int **)malloc(this->levelToPerform*sizeof(int *));
-      this->backwardActiveVoxelNumber= (int *)malloc(this->levelToPerform*sizeof(int));
-   }
-   else
-   {
-      this->floatingMaskPyramid = (int **)malloc(sizeof(int *));
-      this->backwardActiveVoxelNumber= (int *)malloc(sizeof(int));
-   }
-
-   if(this->usePyramid)
-   {
-      if (this->floatingMaskImage!=NULL)
-         reg_createMaskPyramid<T>(this->floatingMaskImage,
-                                  this->floatingMaskPyramid,
-                                  this->levelNumber,
-                                  this->levelToPerform,
-                                  this->backwardActiveVoxelNumber);
-      else
-      {
-         for(unsigned int l=0; l<this->levelToPerform; ++l)
-         {
-            this->backwardActiveVoxelNumber[l]=this->floatingPyramid[l]->nx*this->floatingPyramid[l]->ny*this->floatingPyramid[l]->nz;
-            this->floatingMaskPyramid[l]=(int *)calloc(backwardActiveVoxelNumber[l],sizeof(int));
-         }
-      }
-   }
-   else  // no pyramid
-   {
-      if (this->floatingMaskImage!=NULL)
-         reg_createMaskPyramid<T>(this->floatingMaskImage, this->floatingMaskPyramid, 1, 1, this->backwardActiveVoxelNumber);
-      else
-      {
-         this->backwardActiveVoxelNumber[0]=this->floatingPyramid[0]->nx*this->floatingPyramid[0]->ny*this->floatingPyramid[0]->nz;
-         this->floatingMaskPyramid[0]=(int *)calloc(backwardActiveVoxelNumber[0],sizeof(int));
-      }
-   }
+   // Allocate the floating mask pyramid, whose levels are created when they are reached
+   unsigned int pyramidalLevelNumber=this->usePyramid?this->levelToPerform:1;
+   this->floatingMaskPyramid = (int **)calloc(pyramidalLevelNumber,sizeof(int *));
+   this->backwardActiveVoxelNumber= (int *)calloc(pyramidalLevelNumber,sizeof(int));
+   this->CreatePyramidLevel(0);
 
 #ifdef NDEBUG
    if(this->verbose)
@@ -660,12 +673,38 @@ void reg_f3d_sym<T>::WarpFloatingImage(int inter)
                         this->measure_dti->GetActiveTimepoints(),
                         this->backwardJacobianMatrix);
    }
+   // The local statistics of the LNCC depend on the warped images
+   if(this->measure_lncc!=NULL)
+      this->measure_lncc->SetWarpedImageUpdated();
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::WarpFloatingImage");
 #endif
    return;
 }
 /* *************************************************************** */
+template <class T>
+double reg_f3d_sym<T>::WarpAndComputeSimilarityMeasure(int inter)
+{
+   // When NMI is the only measure, both joint histograms are filled while the
+   // floating and reference images are resampled, no warped image is generated
+   if(this->UseNMIOnly() &&
+         this->measure_nmi->CanUseDeformationField(this->deformationFieldImage,
+                                                   this->backwardDeformationFieldImage))
+   {
+      this->GetDeformationField();
+      double measure = this->measure_nmi->GetSimilarityMeasureValue(this->deformationFieldImage,
+                                                                   this->backwardDeformationFieldImage,
+                                                                   inter,
+                                                                   this->warpedPaddingValue);
+#ifndef NDEBUG
+      reg_print_fct_debug("reg_f3d_sym<T>::WarpAndComputeSimilarityMeasure");
+#endif
+      return double(this->similarityWeight) * measure;
+   }
+   this->WarpFloatingImage(inter);
+   return this->ComputeSimilarityMeasure();
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 double reg_f3d_sym<T>::ComputeJacobianBasedPenaltyTerm(int type)
@@ -1260,8 +1299,10 @@ double reg_f3d_sym<T>::GetInverseConsistencyPenaltyTerm()
          }
       }
    }
-   double error = ferror/double(this->activeVoxelNumber[this->currentLevel])
-         + berror / (double)(this->backwardActiveVoxelNumber[this->currentLevel]);
+   // Without pyramid, a single level is held
+   unsigned int pyramidLevel=this->usePyramid?this->currentLevel:0;
+   double error = ferror/double(this->activeVoxelNumber[pyramidLevel])
+         + berror / (double)(this->backwardActiveVoxelNumber[pyramidLevel]);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetInverseConsistencyPenaltyTerm");
 #endif
@@ -1561,8 +1602,7 @@ double reg_f3d_sym<T>::GetObjectiveFunctionValue()
    this->currentWMeasure = 0.0;
    if(this->similarityWeight>0)
    {
-      this->WarpFloatingImage(this->interpolation);
-      this->currentWMeasure = this->ComputeSimilarityMeasure();
+      this->currentWMeasure = this->WarpAndComputeSimilarityMeasure(this->interpolation);
    }
 
    // Compute the Inverse consistency penalty term if required
@@ -1716,16 +1756,16 @@ nifti_image **reg_f3d_sym<T>::GetWarpedImage()
    resultImage[0]->cal_max=this->inputFloating->cal_max;
    resultImage[0]->scl_slope=this->inputFloating->scl_slope;
    resultImage[0]->scl_inter=this->inputFloating->scl_inter;
-   resultImage[0]->data=(void *)malloc(resultImage[0]->nvox*resultImage[0]->nbyper);
-   memcpy(resultImage[0]->data, this->warped->data, resultImage[0]->nvox*resultImage[0]->nbyper);
+   resultImage[0]->data=this->warped->data;
+   this->warped->data=NULL;
 
    resultImage[1] = nifti_copy_nim_info(this->backwardWarped);
    resultImage[1]->cal_min=this->inputReference->cal_min;
    resultImage[1]->cal_max=this->inputReference->cal_max;
    resultImage[1]->scl_slope=this->inputReference->scl_slope;
    resultImage[1]->scl_inter=this->inputReference->scl_inter;
-   resultImage[1]->data=(void *)malloc(resultImage[1]->nvox*resultImage[1]->nbyper);
-   memcpy(resultImage[1]->data, this->backwardWarped->data, resultImage[1]->nvox*resultImage[1]->nbyper);
+   resultImage[1]->data=this->backwardWarped->data;
+   this->backwardWarped->data=NULL;
 
    reg_f3d_sym<T>::ClearWarped();
 #ifndef NDEBUG
@@ -1734,6 +1774,20 @@ nifti_image **reg_f3d_sym<T>::GetWarpedImage()
    return resultImage;
 }
 /* *************************************************************** */
+template<class T>
+void reg_f3d_sym<T>::GetWarpedImage(nifti_image *resultImage)
+{
+   if(this->backwardControlPointGrid==NULL)
+   {
+      reg_print_fct_error("reg_f3d_sym<T>::GetWarpedImage(nifti_image *)");
+      reg_print_msg_error("The backward control point grid image has to be defined");
+      reg_exit(1);
+   }
+   // No mask is used to perform the final resampling
+   this->currentFloatingMask = NULL;
+   reg_f3d<T>::GetWarpedImage(resultImage);
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template<class T>
 nifti_image * reg_f3d_sym<T>::GetBackwardControlPointPositionImage()
@@ -1753,6 +1807,50 @@ nifti_image * reg_f3d_sym<T>::GetBackwardControlPointPositionImage()
 }
 /* *************************************************************** */
 /* *************************************************************** */
+template <class T>
+size_t reg_f3d_sym<T>::GetMemoryUsage()
+{
+   size_t memory = reg_f3d<T>::GetMemoryUsage();
+   if(this->floatingMaskPyramid!=NULL && this->floatingPyramid!=NULL)
+   {
+      unsigned int pyramidalLevelNumber = this->usePyramid?this->levelToPerform:1;
+      for(unsigned int l=0; l<pyramidalLevelNumber; ++l)
+      {
+         if(this->floatingMaskPyramid[l]!=NULL && this->floatingPyramid[l]!=NULL)
+            memory += (size_t)this->floatingPyramid[l]->nx *
+                      this->floatingPyramid[l]->ny *
+                      this->floatingPyramid[l]->nz * sizeof(int);
+      }
+   }
+   memory += this->GetImageMemory(this->backwardControlPointGrid);
+   memory += this->GetImageMemory(this->backwardDeformationFieldImage);
+   memory += this->GetImageMemory(this->backwardWarped);
+   memory += this->GetImageMemory(this->backwardWarpedGradientImage);
+   memory += this->GetImageMemory(this->backwardVoxelBasedMeasureGradientImage);
+   memory += this->GetImageMemory(this->backwardTransformationGradient);
+   return memory;
+}
+/* *************************************************************** */
+template <class T>
+size_t reg_f3d_sym<T>::EstimateLevelMemory(size_t referenceVoxelNumber,
+                                           size_t floatingVoxelNumber,
+                                           size_t referenceGridVoxelNumber,
+                                           size_t floatingGridVoxelNumber)
+{
+   size_t dim = this->inputReference->nz>1?3:2;
+   size_t referenceTimePoint = this->inputReference->nt>1?this->inputReference->nt:1;
+   // Backward counterparts of the images and arrays of the forward transformation
+   size_t memory = floatingVoxelNumber * (referenceTimePoint + dim +
+                                          dim * referenceTimePoint + dim);
+   memory += floatingGridVoxelNumber * dim * (this->useConjGradient?5:3);
+   return reg_f3d<T>::EstimateLevelMemory(referenceVoxelNumber,
+                                          floatingVoxelNumber,
+                                          referenceGridVoxelNumber,
+                                          floatingGridVoxelNumber) +
+          memory * sizeof(T) + floatingVoxelNumber * sizeof(int);
+}
+/* *************************************************************** */
+/* *************************************************************** */
 template class reg_f3d_sym<float>;
 template class reg_f3d_sym<double>;
 #endif
@@ -55,12 +55,15 @@ protected:
    virtual void ClearTransformationGradient();
    virtual T InitialiseCurrentLevel();
    virtual void ClearCurrentInputImage();
+   virtual void CreatePyramidLevel(unsigned int level);
+   virtual void ClearPyramidLevel(unsigned int level);
 
    virtual double ComputeJacobianBasedPenaltyTerm(int);
    virtual double ComputeBendingEnergyPenaltyTerm();
    virtual double ComputeLinearEnergyPenaltyTerm();
    virtual void GetDeformationField();
    virtual void WarpFloatingImage(int);
+   virtual double WarpAndComputeSimilarityMeasure(int);
    virtual void GetVoxelBasedGradient();
    virtual void GetSimilarityMeasureGradient();
    virtual void GetObjectiveFunctionGradient();
@@ -81,6 +84,12 @@ protected:
    virtual double GetInverseConsistencyPenaltyTerm();
    virtual void GetInverseConsistencyGradient();
 
+   virtual size_t GetMemoryUsage();
+   virtual size_t EstimateLevelMemory(size_t referenceVoxelNumber,
+                                      size_t floatingVoxelNumber,
+                                      size_t referenceGridVoxelNumber,
+                                      size_t floatingGridVoxelNumber);
+
    virtual void UpdateParameters(float);
    virtual void InitialiseSimilarity();
 
@@ -94,6 +103,7 @@ public:
    void Initialise();
    nifti_image *GetBackwardControlPointPositionImage();
    nifti_image **GetWarpedImage();
+   void GetWarpedImage(nifti_image *resultImage);
    bool GetSymmetricStatus()
    {
       return true;
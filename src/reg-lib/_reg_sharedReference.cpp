@@ -0,0 +1,162 @@
+/*
+ *  _reg_sharedReference.cpp
+ *
+ *  Copyright (c) 2009, University College London. All rights reserved.
+ *  Centre for Medical Image Computing (CMIC)
+ *  See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+
+#ifndef _REG_SHAREDREFERENCE_CPP
+#define _REG_SHAREDREFERENCE_CPP
+
+#include "_reg_sharedReference.h"
+
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+reg_sharedReference<T>::reg_sharedReference(nifti_image *reference,
+                                            nifti_image *mask,
+                                            unsigned int levelNumber,
+                                            unsigned int levelToPerform)
+{
+   if(reference==NULL || levelToPerform==0 || levelToPerform>levelNumber)
+   {
+      reg_print_fct_error("reg_sharedReference<T>::reg_sharedReference");
+      reg_print_msg_error("A reference image and a valid number of levels are expected");
+      reg_exit(1);
+   }
+   this->inputReference=reference;
+   this->inputMask=mask;
+   this->levelNumber=levelNumber;
+   this->levelToPerform=levelToPerform;
+
+   this->referencePyramid=(nifti_image **)malloc(levelToPerform*sizeof(nifti_image *));
+   this->maskPyramid=(int **)malloc(levelToPerform*sizeof(int *));
+   this->activeVoxelNumber=(int *)malloc(levelToPerform*sizeof(int));
+
+   reg_createImagePyramid<T>(reference, this->referencePyramid, levelNumber, levelToPerform);
+   if(mask!=NULL)
+      reg_createMaskPyramid<T>(mask, this->maskPyramid, levelNumber, levelToPerform, this->activeVoxelNumber);
+   else
+   {
+      for(unsigned int l=0; l<levelToPerform; ++l)
+      {
+         this->activeVoxelNumber[l]=this->referencePyramid[l]->nx*this->referencePyramid[l]->ny*this->referencePyramid[l]->nz;
+         this->maskPyramid[l]=(int *)calloc(this->activeVoxelNumber[l],sizeof(int));
+      }
+   }
+
+   this->blockMatchingParams=NULL;
+   this->blockPercentage=0;
+   this->inlierLts=0;
+   this->blockStepSize=0;
+#ifndef NDEBUG
+   reg_print_msg_debug("reg_sharedReference constructor called");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+reg_sharedReference<T>::~reg_sharedReference()
+{
+   this->ClearBlockMatchingParams();
+   for(unsigned int l=0; l<this->levelToPerform; ++l)
+   {
+      nifti_image_free(this->referencePyramid[l]);
+      free(this->maskPyramid[l]);
+   }
+   free(this->referencePyramid);
+   free(this->maskPyramid);
+   free(this->activeVoxelNumber);
+#ifndef NDEBUG
+   reg_print_msg_debug("reg_sharedReference destructor called");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_sharedReference<T>::ClearBlockMatchingParams()
+{
+   if(this->blockMatchingParams!=NULL)
+   {
+      for(unsigned int l=0; l<this->levelToPerform; ++l)
+      {
+         if(this->blockMatchingParams[l]!=NULL)
+            delete this->blockMatchingParams[l];
+      }
+      free(this->blockMatchingParams);
+   }
+   this->blockMatchingParams=NULL;
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+bool reg_sharedReference<T>::IsCompatible(nifti_image *reference,
+                                          nifti_image *mask,
+                                          unsigned int levelNumber,
+                                          unsigned int levelToPerform)
+{
+   return reference==this->inputReference &&
+          mask==this->inputMask &&
+          levelNumber==this->levelNumber &&
+          levelToPerform==this->levelToPerform;
+}
+/* *************************************************************** */
+template <class T>
+void reg_sharedReference<T>::CopyPyramidLevel(unsigned int level,
+                                              nifti_image **referenceImage,
+                                              int **mask,
+                                              int *activeVoxelNumber)
+{
+   nifti_image *image=this->referencePyramid[level];
+   *referenceImage=nifti_copy_nim_info(image);
+   (*referenceImage)->data=(void *)malloc(image->nvox*image->nbyper);
+   memcpy((*referenceImage)->data, image->data, image->nvox*image->nbyper);
+
+   size_t voxelNumber=(size_t)image->nx*image->ny*image->nz;
+   *mask=(int *)malloc(voxelNumber*sizeof(int));
+   memcpy(*mask, this->maskPyramid[level], voxelNumber*sizeof(int));
+
+   *activeVoxelNumber=this->activeVoxelNumber[level];
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_sharedReference<T>::CopyPyramidLevel");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+_reg_blockMatchingParam *reg_sharedReference<T>::GetBlockMatchingParams(unsigned int level,
+                                                                       int blockPercentage,
+                                                                       int inlierLts,
+                                                                       int blockStepSize)
+{
+   // The active blocks depend on the block matching settings
+   if(this->blockMatchingParams!=NULL &&
+         (blockPercentage!=this->blockPercentage ||
+          inlierLts!=this->inlierLts ||
+          blockStepSize!=this->blockStepSize))
+      this->ClearBlockMatchingParams();
+   if(this->blockMatchingParams==NULL)
+   {
+      this->blockMatchingParams=(_reg_blockMatchingParam **)
+            calloc(this->levelToPerform,sizeof(_reg_blockMatchingParam *));
+      this->blockPercentage=blockPercentage;
+      this->inlierLts=inlierLts;
+      this->blockStepSize=blockStepSize;
+   }
+   if(this->blockMatchingParams[level]==NULL)
+   {
+      this->blockMatchingParams[level]=new _reg_blockMatchingParam();
+      initialise_block_matching_method(this->referencePyramid[level],
+                                       this->blockMatchingParams[level],
+                                       blockPercentage,
+                                       inlierLts,
+                                       blockStepSize,
+                                       this->maskPyramid[level],
+                                       false);
+   }
+   return this->blockMatchingParams[level];
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template class reg_sharedReference<float>;
+template class reg_sharedReference<double>;
+#endif // _REG_SHAREDREFERENCE_CPP
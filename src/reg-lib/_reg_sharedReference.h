@@ -0,0 +1,89 @@
+/**
+ * @file _reg_sharedReference.h
+ * @brief Reference-side data shared by several registrations to the same
+ * reference image
+ *
+ * Copyright (c) 2009, University College London. All rights reserved.
+ * Centre for Medical Image Computing (CMIC)
+ * See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+
+#ifndef _REG_SHAREDREFERENCE_H
+#define _REG_SHAREDREFERENCE_H
+
+#include "_reg_tools.h"
+#include "_reg_blockMatching.h"
+
+/* *************************************************************** */
+/** @class reg_sharedReference
+ * @brief Holds the reference image and mask pyramids, and optionally the
+ * active block selection of each level, so that they are computed only once
+ * when many floating images are registered to the same reference image.
+ * The registration objects take a copy of each pyramid level when they reach
+ * it, as the levels are modified and released during a registration.
+ */
+template <class T>
+class reg_sharedReference
+{
+public:
+   /// @brief Creates the pyramids of the reference image and of its mask,
+   /// which may be NULL
+   reg_sharedReference(nifti_image *reference,
+                       nifti_image *mask,
+                       unsigned int levelNumber,
+                       unsigned int levelToPerform);
+   ~reg_sharedReference();
+
+   /// @brief Returns true if the shared data has been created from the
+   /// specified images with the specified number of levels
+   bool IsCompatible(nifti_image *reference,
+                     nifti_image *mask,
+                     unsigned int levelNumber,
+                     unsigned int levelToPerform);
+   /// @brief Returns copies of the reference image and mask of the
+   /// specified pyramid level
+   void CopyPyramidLevel(unsigned int level,
+                         nifti_image **referenceImage,
+                         int **mask,
+                         int *activeVoxelNumber);
+   /// @brief Returns the block matching parameters of the specified level,
+   /// which are only computed the first time they are requested
+   _reg_blockMatchingParam *GetBlockMatchingParams(unsigned int level,
+                                                   int blockPercentage,
+                                                   int inlierLts,
+                                                   int blockStepSize);
+
+   unsigned int GetLevelToPerform()
+   {
+      return this->levelToPerform;
+   }
+   nifti_image *GetReferencePyramid(unsigned int level)
+   {
+      return this->referencePyramid[level];
+   }
+   int *GetMaskPyramid(unsigned int level)
+   {
+      return this->maskPyramid[level];
+   }
+
+protected:
+   nifti_image *inputReference; // pointer to external
+   nifti_image *inputMask; // pointer to external
+   unsigned int levelNumber;
+   unsigned int levelToPerform;
+
+   nifti_image **referencePyramid;
+   int **maskPyramid;
+   int *activeVoxelNumber;
+
+   _reg_blockMatchingParam **blockMatchingParams;
+   int blockPercentage;
+   int inlierLts;
+   int blockStepSize;
+
+   void ClearBlockMatchingParams();
+};
+/* *************************************************************** */
+
+#endif
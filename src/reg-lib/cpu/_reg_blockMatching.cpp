@@ -12,10 +12,15 @@
 #include "_reg_blockMatching.h"
 #include "_reg_globalTrans.h"
 #include <map>
+#include <algorithm>
 #include <iostream>
 #include <limits>
 #include <cmath>
 
+/// Number of displacements of the coarse hierarchical search whose
+/// neighbourhood is searched exhaustively
+#define BLOCK_MATCHING_REFINED_CANDIDATES 8
+
 /* *************************************************************** */
 /* *************************************************************** */
 //is it square distance or just distance?
@@ -34,75 +39,93 @@ template<class DTYPE>
 void _reg_set_active_blocks(nifti_image *targetImage, _reg_blockMatchingParam *params, int *mask, bool runningOnGPU) {
 	const size_t totalBlockNumber = params->blockNumber[0] * params->blockNumber[1] * params->blockNumber[2];
 	float *varianceArray = (float *) malloc(totalBlockNumber * sizeof(float));
-	int *indexArray = (int *) malloc(totalBlockNumber * sizeof(int));
 
 	int *maskPtr = &mask[0];
 
 	int unusableBlock = 0;
-	size_t index;
 
-	DTYPE *targetValues = (DTYPE *) malloc(BLOCK_SIZE * sizeof(DTYPE));
 	DTYPE *targetPtr = static_cast<DTYPE *>(targetImage->data);
-	int blockIndex = 0;
+	int *blockNumber = params->blockNumber;
+	// The rows of blocks along x are processed in parallel. Each block is
+	// handled as before, so that the variances do not depend on the threads
+	int blockRowNumber = blockNumber[1] * blockNumber[2];
+	int row;
 
 	if (targetImage->nz > 1) {
 		// Version using 3D blocks
-		for (int k = 0; k < params->blockNumber[2]; k++) {
-			for (int j = 0; j < params->blockNumber[1]; j++) {
-				for (int i = 0; i < params->blockNumber[0]; i++) {
-					for (unsigned int n = 0; n < BLOCK_SIZE; n++)
-						targetValues[n] = (DTYPE) std::numeric_limits<float>::quiet_NaN();
-					float mean = 0.0f;
-					float voxelNumber = 0.0f;
-					int coord = 0;
-					for (int z = k * BLOCK_WIDTH; z < (k + 1) * BLOCK_WIDTH; z++) {
-						if (z < targetImage->nz) {
-							index = z * targetImage->nx * targetImage->ny;
-							DTYPE *targetPtrZ = &targetPtr[index];
-							int *maskPtrZ = &maskPtr[index];
-							for (int y = j * BLOCK_WIDTH; y < (j + 1) * BLOCK_WIDTH; y++) {
-								if (y < targetImage->ny) {
-									index = y * targetImage->nx + i * BLOCK_WIDTH;
-									DTYPE *targetPtrXYZ = &targetPtrZ[index];
-									int *maskPtrXYZ = &maskPtrZ[index];
-									for (int x = i * BLOCK_WIDTH; x < (i + 1) * BLOCK_WIDTH; x++) {
-										if (x < targetImage->nx) {
-											targetValues[coord] = *targetPtrXYZ;
-											if (targetValues[coord] == targetValues[coord] && targetValues[coord] != 0. && *maskPtrXYZ > -1) {
-												mean += (float) targetValues[coord];
-												voxelNumber++;
-											}
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+	shared(targetImage, targetPtr, maskPtr, blockNumber, blockRowNumber, varianceArray) \
+	private(row) \
+	reduction(+:unusableBlock)
+#endif
+		for (row = 0; row < blockRowNumber; row++) {
+			int j = row % blockNumber[1];
+			int k = row / blockNumber[1];
+			DTYPE targetValues[BLOCK_SIZE];
+			size_t index;
+			for (int i = 0; i < blockNumber[0]; i++) {
+				int blockIndex = row * blockNumber[0] + i;
+				for (unsigned int n = 0; n < BLOCK_SIZE; n++)
+					targetValues[n] = (DTYPE) std::numeric_limits<float>::quiet_NaN();
+				float mean = 0.0f;
+				float voxelNumber = 0.0f;
+				int coord = 0;
+				for (int z = k * BLOCK_WIDTH; z < (k + 1) * BLOCK_WIDTH; z++) {
+					if (z < targetImage->nz) {
+						index = z * targetImage->nx * targetImage->ny;
+						DTYPE *targetPtrZ = &targetPtr[index];
+						int *maskPtrZ = &maskPtr[index];
+						for (int y = j * BLOCK_WIDTH; y < (j + 1) * BLOCK_WIDTH; y++) {
+							if (y < targetImage->ny) {
+								index = y * targetImage->nx + i * BLOCK_WIDTH;
+								DTYPE *targetPtrXYZ = &targetPtrZ[index];
+								int *maskPtrXYZ = &maskPtrZ[index];
+								for (int x = i * BLOCK_WIDTH; x < (i + 1) * BLOCK_WIDTH; x++) {
+									if (x < targetImage->nx) {
+										targetValues[coord] = *targetPtrXYZ;
+										if (targetValues[coord] == targetValues[coord] && targetValues[coord] != 0. && *maskPtrXYZ > -1) {
+											mean += (float) targetValues[coord];
+											voxelNumber++;
 										}
-										targetPtrXYZ++;
-										maskPtrXYZ++;
-										coord++;
 									}
+									targetPtrXYZ++;
+									maskPtrXYZ++;
+									coord++;
 								}
 							}
 						}
 					}
-					if (voxelNumber > BLOCK_SIZE / 2) {
-						float variance = 0.0f;
-						for (int i = 0; i < BLOCK_SIZE; i++) {
-							if (targetValues[i] == targetValues[i])
-								variance += (mean - (float) targetValues[i]) * (mean - (float) targetValues[i]);
-						}
-
-						variance /= voxelNumber;
-						varianceArray[blockIndex] = variance;
-					} else {
-						varianceArray[blockIndex] = -1;
-						unusableBlock++;
+				}
+				if (voxelNumber > BLOCK_SIZE / 2) {
+					float variance = 0.0f;
+					for (int n = 0; n < BLOCK_SIZE; n++) {
+						if (targetValues[n] == targetValues[n])
+							variance += (mean - (float) targetValues[n]) * (mean - (float) targetValues[n]);
 					}
-					indexArray[blockIndex] = blockIndex;
-					blockIndex++;
+
+					variance /= voxelNumber;
+					varianceArray[blockIndex] = variance;
+				} else {
+					varianceArray[blockIndex] = -1;
+					unusableBlock++;
 				}
 			}
 		}
 	} else {
 		// Version using 2D blocks
-		for (int j = 0; j < params->blockNumber[1]; j++) {
-			for (int i = 0; i < params->blockNumber[0]; i++) {
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+	shared(targetImage, targetPtr, maskPtr, blockNumber, blockRowNumber, varianceArray) \
+	private(row) \
+	reduction(+:unusableBlock)
+#endif
+		for (row = 0; row < blockRowNumber; row++) {
+			int j = row;
+			DTYPE targetValues[BLOCK_2D_SIZE];
+			size_t index;
+			for (int i = 0; i < blockNumber[0]; i++) {
+				int blockIndex = row * blockNumber[0] + i;
 
 				for (unsigned int n = 0; n < BLOCK_2D_SIZE; n++)
 					targetValues[n] = (DTYPE) std::numeric_limits<float>::quiet_NaN();
@@ -131,9 +154,9 @@ void _reg_set_active_blocks(nifti_image *targetImage, _reg_blockMatchingParam *p
 				}
 				if (voxelNumber > BLOCK_2D_SIZE / 2) {
 					float variance = 0.0f;
-					for (int i = 0; i < BLOCK_2D_SIZE; i++) {
-						if (targetValues[i] == targetValues[i])
-							variance += (mean - (float) targetValues[i]) * (mean - (float) targetValues[i]);
+					for (int n = 0; n < BLOCK_2D_SIZE; n++) {
+						if (targetValues[n] == targetValues[n])
+							variance += (mean - (float) targetValues[n]) * (mean - (float) targetValues[n]);
 					}
 
 					variance /= voxelNumber;
@@ -142,24 +165,28 @@ void _reg_set_active_blocks(nifti_image *targetImage, _reg_blockMatchingParam *p
 					varianceArray[blockIndex] = -1;
 					unusableBlock++;
 				}
-				indexArray[blockIndex] = blockIndex;
-				blockIndex++;
 			}
 		}
 	}
-	free(targetValues);
 
 	params->activeBlockNumber = params->activeBlockNumber < ((int) totalBlockNumber - unusableBlock) ? params->activeBlockNumber : (totalBlockNumber - unusableBlock);
 
-	reg_heapSort(varianceArray, indexArray, totalBlockNumber);
-
-	int *indexArrayPtr = &indexArray[totalBlockNumber - 1];
+	// The blocks with the largest variance are selected in linear time, rather
+	// than sorting all of them. Ties are broken by block index
+	std::vector<std::pair<float, int> > rankArray(totalBlockNumber);
+	for (size_t i = 0; i < totalBlockNumber; ++i)
+		rankArray[i] = std::pair<float, int>(-varianceArray[i], (int) i);
+	std::nth_element(rankArray.begin(), rankArray.begin() + params->activeBlockNumber, rankArray.end());
+
+	// The active blocks are numbered in block order
+	for (size_t i = 0; i < totalBlockNumber; ++i)
+		params->activeBlock[i] = -1;
+	for (int i = 0; i < params->activeBlockNumber; i++)
+		params->activeBlock[rankArray[i].second] = 0;
 	int count = 0;
-	for (int i = 0; i < params->activeBlockNumber; i++) {
-		params->activeBlock[*indexArrayPtr--] = count++;
-	}
-	for (size_t i = params->activeBlockNumber; i < totalBlockNumber; ++i) {
-		params->activeBlock[*indexArrayPtr--] = -1;
+	for (size_t i = 0; i < totalBlockNumber; ++i) {
+		if (params->activeBlock[i] != -1)
+			params->activeBlock[i] = count++;
 	}
 
 	count = 0;
@@ -174,7 +201,6 @@ void _reg_set_active_blocks(nifti_image *targetImage, _reg_blockMatchingParam *p
 	}
 
 	free(varianceArray);
-	free(indexArray);
 }
 /* *************************************************************** */
 void initialise_block_matching_method(nifti_image * target, _reg_blockMatchingParam *params, int percentToKeep_block, int percentToKeep_opt, int stepSize_block, int *mask, bool runningOnGPU) {
@@ -192,6 +218,7 @@ void initialise_block_matching_method(nifti_image * target, _reg_blockMatchingPa
 	}
 
 	params->voxelCaptureRange = 3;
+	params->hierarchicalSearch = false;
 	params->blockNumber[0] = (int) reg_ceil((float) target->nx / (float) BLOCK_WIDTH);
 	params->blockNumber[1] = (int) reg_ceil((float) target->ny / (float) BLOCK_WIDTH);
 	if (target->nz > 1)
@@ -241,6 +268,46 @@ void initialise_block_matching_method(nifti_image * target, _reg_blockMatchingPa
 #endif
 }
 /* *************************************************************** */
+void initialise_block_matching_method(nifti_image * target, _reg_blockMatchingParam *params, const _reg_blockMatchingParam *precomputed) {
+	if (params->activeBlock != NULL) {
+		free(params->activeBlock);
+		params->activeBlock = NULL;
+	}
+	if (params->targetPosition != NULL) {
+		free(params->targetPosition);
+		params->targetPosition = NULL;
+	}
+	if (params->resultPosition != NULL) {
+		free(params->resultPosition);
+		params->resultPosition = NULL;
+	}
+
+	params->voxelCaptureRange = precomputed->voxelCaptureRange;
+	params->hierarchicalSearch = precomputed->hierarchicalSearch;
+	params->blockNumber[0] = precomputed->blockNumber[0];
+	params->blockNumber[1] = precomputed->blockNumber[1];
+	params->blockNumber[2] = precomputed->blockNumber[2];
+	params->stepSize = precomputed->stepSize;
+	params->percent_to_keep = precomputed->percent_to_keep;
+	params->activeBlockNumber = precomputed->activeBlockNumber;
+	params->definedActiveBlock = precomputed->definedActiveBlock;
+
+	size_t blockNumber = (size_t) params->blockNumber[0] * params->blockNumber[1] * params->blockNumber[2];
+	params->activeBlock = (int *) malloc(blockNumber * sizeof(int));
+	memcpy(params->activeBlock, precomputed->activeBlock, blockNumber * sizeof(int));
+
+	if (target->nz > 1) {
+		params->targetPosition = (float *) malloc(params->activeBlockNumber * 3 * sizeof(float));
+		params->resultPosition = (float *) malloc(params->activeBlockNumber * 3 * sizeof(float));
+	} else {
+		params->targetPosition = (float *) malloc(params->activeBlockNumber * 2 * sizeof(float));
+		params->resultPosition = (float *) malloc(params->activeBlockNumber * 2 * sizeof(float));
+	}
+#ifndef NDEBUG
+	reg_print_msg_debug("block matching initialisation copied.");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template<typename PrecisionTYPE, typename TargetImageType, typename ResultImageType>
 void block_matching_method2D(nifti_image * target, nifti_image * result, _reg_blockMatchingParam *params, int *mask) {
@@ -417,6 +484,94 @@ void block_matching_method2D(nifti_image * target, nifti_image * result, _reg_bl
 	free(resultOverlap);
 }
 /* *************************************************************** */
+// Returns the absolute normalised cross-correlation between the target block
+// and the result block found at the shift (l, m, n) of the search window, or
+// NaN when it is not defined
+template<typename DTYPE>
+double block_matching_compareBlock3D(int l, int m, int n,
+		DTYPE *window, int windowWidth, int shiftNumber,
+		bool fullTarget, double *centredTarget, double targetSqSum,
+		double *sumZ, double *sumSqZ, int *countZ,
+		DTYPE *targetValues, bool *targetOverlap,
+		DTYPE *resultValues, bool *resultOverlap) {
+	DTYPE *windowPtr;
+	int a, b, c;
+	int index = (n * shiftNumber + m) * shiftNumber + l;
+	if (fullTarget && countZ[index] == BLOCK_SIZE) {
+		// Both blocks are fully defined: only the cross term is computed,
+		// one row of the block at a time
+		double crossLane[BLOCK_WIDTH];
+		for (a = 0; a < BLOCK_WIDTH; a++)
+			crossLane[a] = 0.0;
+		int targetIndex = 0;
+		for (c = 0; c < BLOCK_WIDTH; c++) {
+			for (b = 0; b < BLOCK_WIDTH; b++) {
+				windowPtr = &window[((n + c) * windowWidth + m + b) * windowWidth + l];
+				for (a = 0; a < BLOCK_WIDTH; a++)
+					crossLane[a] += centredTarget[targetIndex + a] * windowPtr[a];
+				targetIndex += BLOCK_WIDTH;
+			}
+		}
+		double crossSum = 0.0;
+		for (a = 0; a < BLOCK_WIDTH; a++)
+			crossSum += crossLane[a];
+		double resultSum = sumZ[index];
+		double resultSumVar = sumSqZ[index] - resultSum * resultSum / (double) BLOCK_SIZE;
+		// Result blocks that are almost flat are discarded, as their
+		// correlation is not reliable
+		if (resultSumVar > 1.0e-10 * sumSqZ[index])
+			return fabs(crossSum / sqrt(targetSqSum * resultSumVar));
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	// Partial overlap between the blocks
+	int resultIndex = 0;
+	DTYPE value;
+	for (c = 0; c < BLOCK_WIDTH; c++) {
+		for (b = 0; b < BLOCK_WIDTH; b++) {
+			windowPtr = &window[((n + c) * windowWidth + m + b) * windowWidth + l];
+			for (a = 0; a < BLOCK_WIDTH; a++) {
+				value = windowPtr[a];
+				resultValues[resultIndex] = value;
+				resultOverlap[resultIndex] = value == value;
+				resultIndex++;
+			}
+		}
+	}
+	DTYPE targetMean = 0.0;
+	DTYPE resultMean = 0.0;
+	DTYPE voxelNumber = 0.0;
+	for (a = 0; a < BLOCK_SIZE; a++) {
+		if (targetOverlap[a] && resultOverlap[a]) {
+			targetMean += targetValues[a];
+			resultMean += resultValues[a];
+			voxelNumber++;
+		}
+	}
+	if (voxelNumber <= BLOCK_SIZE / 2)
+		return std::numeric_limits<double>::quiet_NaN();
+
+	targetMean /= voxelNumber;
+	resultMean /= voxelNumber;
+
+	DTYPE targetVar = 0.0;
+	DTYPE resultVar = 0.0;
+	DTYPE localCC = 0.0;
+	DTYPE targetTemp, resultTemp;
+
+	for (a = 0; a < BLOCK_SIZE; a++) {
+		if (targetOverlap[a] && resultOverlap[a]) {
+			targetTemp = (targetValues[a] - targetMean);
+			resultTemp = (resultValues[a] - resultMean);
+			targetVar += (targetTemp) * (targetTemp);
+			resultVar += (resultTemp) * (resultTemp);
+			localCC += (targetTemp) * (resultTemp);
+		}
+	}
+
+	localCC = fabs(localCC / sqrt(targetVar * resultVar));
+	return localCC;
+}
+/* *************************************************************** */
 template<typename DTYPE>
 void block_matching_method3D(nifti_image * target, nifti_image * result, _reg_blockMatchingParam *params, int *mask) {
 	DTYPE *targetPtr = static_cast<DTYPE *>(target->data);
@@ -428,230 +583,291 @@ void block_matching_method3D(nifti_image * target, nifti_image * result, _reg_bl
 	else
 		targetMatrix_xyz = &(target->qto_xyz);
 
-	int targetIndex_start_x;
-	int targetIndex_start_y;
-	int targetIndex_start_z;
-	int targetIndex_end_x;
-	int targetIndex_end_y;
-	int targetIndex_end_z;
-	int resultIndex_start_x;
-	int resultIndex_start_y;
-	int resultIndex_start_z;
-	int resultIndex_end_x;
-	int resultIndex_end_y;
-	int resultIndex_end_z;
-
-	int index, i, j, k, l, m, n, x, y, z;
-	int *maskPtr_Z, *maskPtr_XYZ;
-	DTYPE *targetPtr_Z, *targetPtr_XYZ, *resultPtr_Z, *resultPtr_XYZ;
-	DTYPE value, bestCC, targetMean, resultMean, targetVar, resultVar;
-	DTYPE voxelNumber, localCC, targetTemp, resultTemp;
-	float bestDisplacement[3], targetPosition_temp[3], tempPosition[3];
-	size_t targetIndex, resultIndex, blockIndex, tid = 0;
+	int i, j;
+	int activeBlockIndex;
 	params->definedActiveBlock = 0;
-#if defined (_OPENMP)
-	int threadNumber = omp_get_max_threads();
-	if(threadNumber>16)
-	omp_set_num_threads(16);
-	DTYPE targetValues[16][BLOCK_SIZE];
-	DTYPE resultValues[16][BLOCK_SIZE];
-	bool targetOverlap[16][BLOCK_SIZE];
-	bool resultOverlap[16][BLOCK_SIZE];
-#else
-	DTYPE targetValues[1][BLOCK_SIZE];
-	DTYPE resultValues[1][BLOCK_SIZE];
-	bool targetOverlap[1][BLOCK_SIZE];
-	bool resultOverlap[1][BLOCK_SIZE];
-#endif
 
 	float *temp_target_position = (float *) malloc(3 * params->activeBlockNumber * sizeof(float));
 	float *temp_result_position = (float *) malloc(3 * params->activeBlockNumber * sizeof(float));
 	for (i = 0; i < 3 * params->activeBlockNumber; i += 3)
 		temp_target_position[i] = std::numeric_limits<float>::quiet_NaN();
 
+	// Flat list of the active blocks, so that the work is shared evenly
+	// between threads whatever the number of blocks along each axis
+	const size_t totalBlockNumber = (size_t) params->blockNumber[0] * params->blockNumber[1] * params->blockNumber[2];
+	int *activeBlockList = (int *) malloc(totalBlockNumber * sizeof(int));
+	int activeBlockCount = 0;
+	for (size_t blockIndex = 0; blockIndex < totalBlockNumber; blockIndex++) {
+		if (params->activeBlock[blockIndex] > -1)
+			activeBlockList[activeBlockCount++] = (int) blockIndex;
+	}
+
+	// Each block is compared with the result blocks found within the capture
+	// range. The result voxels covered by all of them form a search window,
+	// which is fetched once per block. Box sums of the window values, of their
+	// squares and of the number of defined voxels are then accumulated along
+	// each axis in turn, so that the mean and variance of every result block
+	// are available in constant time. Only the cross term with the centred
+	// target block is left to compute for each displacement.
+	int captureRange = params->voxelCaptureRange;
+	int stepSize = params->stepSize;
+	int windowWidth = BLOCK_WIDTH + 2 * captureRange;
+	int shiftNumber = 2 * captureRange + 1;
+
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
+#pragma omp parallel default(none) \
    shared(params, target, result, targetPtr, resultPtr, mask, targetMatrix_xyz, \
-          targetOverlap, resultOverlap, targetValues, resultValues, \
-          temp_target_position, temp_result_position) \
-   private(i, j, k, l, m, n, x, y, z, blockIndex, targetIndex, \
-           index, tid, targetPtr_Z, targetPtr_XYZ, resultPtr_Z, resultPtr_XYZ, \
-           maskPtr_Z, maskPtr_XYZ, value, bestCC, bestDisplacement, \
-           targetIndex_start_x, targetIndex_start_y, targetIndex_start_z, \
-           targetIndex_end_x, targetIndex_end_y, targetIndex_end_z, \
-           resultIndex_start_x, resultIndex_start_y, resultIndex_start_z, \
-           resultIndex_end_x, resultIndex_end_y, resultIndex_end_z, \
-           resultIndex, targetPosition_temp, tempPosition, targetTemp, resultTemp, \
-           targetMean, targetVar, resultMean, resultVar, voxelNumber,localCC)
+          temp_target_position, temp_result_position, activeBlockList, activeBlockCount, \
+          captureRange, stepSize, windowWidth, shiftNumber) \
+   private(activeBlockIndex)
 #endif
-   for (k = 0; k < params->blockNumber[2]; k++) {
+	{
+		// Per-thread scratch space
+		DTYPE targetValues[BLOCK_SIZE];
+		DTYPE resultValues[BLOCK_SIZE];
+		bool targetOverlap[BLOCK_SIZE];
+		bool resultOverlap[BLOCK_SIZE];
+		double centredTarget[BLOCK_SIZE];
+		DTYPE *window = (DTYPE *) malloc(windowWidth * windowWidth * windowWidth * sizeof(DTYPE));
+		int sumSizeX = windowWidth * windowWidth * shiftNumber;
+		int sumSizeY = windowWidth * shiftNumber * shiftNumber;
+		double *sumBuffer = (double *) malloc(2 * (sumSizeX + sumSizeY + shiftNumber * shiftNumber * shiftNumber) * sizeof(double));
+		double *sumX = sumBuffer, *sumSqX = &sumX[sumSizeX];
+		double *sumY = &sumSqX[sumSizeX], *sumSqY = &sumY[sumSizeY];
+		double *sumZ = &sumSqY[sumSizeY], *sumSqZ = &sumZ[shiftNumber * shiftNumber * shiftNumber];
+		int *countBuffer = (int *) malloc((sumSizeX + sumSizeY + shiftNumber * shiftNumber * shiftNumber) * sizeof(int));
+		int *countX = countBuffer, *countY = &countX[sumSizeX], *countZ = &countY[sumSizeY];
+
+		int i, j, k, l, m, n, x, y, z, a, b, c, index;
+		int targetIndex_start_x, targetIndex_start_y, targetIndex_start_z;
+		int coarseStep, shiftStart[3], shiftEnd[3];
+		int candidateNumber, candidate, candidateShift[BLOCK_MATCHING_REFINED_CANDIDATES][3];
+		double candidateCC[BLOCK_MATCHING_REFINED_CANDIDATES];
+		size_t blockIndex, imageIndex;
+		int targetIndex, targetVoxelNumber;
+		DTYPE value;
+		double bestCC, targetSum, targetSqSum, resultSum, resultSqSum, correlation;
+		float bestDisplacement[3], targetPosition_temp[3], tempPosition[3];
+		DTYPE *windowPtr;
+
 #if defined (_OPENMP)
-      tid = omp_get_thread_num();
+#pragma omp for schedule(guided)
 #endif
-		blockIndex = k * params->blockNumber[0] * params->blockNumber[1];
-		targetIndex_start_z = k * BLOCK_WIDTH;
-		targetIndex_end_z = targetIndex_start_z + BLOCK_WIDTH;
+		for (activeBlockIndex = 0; activeBlockIndex < activeBlockCount; activeBlockIndex++) {
+			blockIndex = activeBlockList[activeBlockIndex];
+			i = blockIndex % params->blockNumber[0];
+			j = (blockIndex / params->blockNumber[0]) % params->blockNumber[1];
+			k = blockIndex / (params->blockNumber[0] * params->blockNumber[1]);
 
-		for (j = 0; j < params->blockNumber[1]; j++) {
+			targetIndex_start_z = k * BLOCK_WIDTH;
 			targetIndex_start_y = j * BLOCK_WIDTH;
-			targetIndex_end_y = targetIndex_start_y + BLOCK_WIDTH;
-
-			for (i = 0; i < params->blockNumber[0]; i++) {
-				targetIndex_start_x = i * BLOCK_WIDTH;
-				targetIndex_end_x = targetIndex_start_x + BLOCK_WIDTH;
-
-				if (params->activeBlock[blockIndex] > -1) {
-					targetIndex = 0;
-					memset(targetOverlap[tid], 0, BLOCK_SIZE * sizeof(bool));
-					for (z = targetIndex_start_z; z < targetIndex_end_z; z++) {
-						if (-1 < z && z < target->nz) {
-							index = z * target->nx * target->ny;
-							targetPtr_Z = &targetPtr[index];
-							maskPtr_Z = &mask[index];
-							for (y = targetIndex_start_y; y < targetIndex_end_y; y++) {
-								if (-1 < y && y < target->ny) {
-									index = y * target->nx + targetIndex_start_x;
-									targetPtr_XYZ = &targetPtr_Z[index];
-									maskPtr_XYZ = &maskPtr_Z[index];
-									for (x = targetIndex_start_x; x < targetIndex_end_x; x++) {
-										if (-1 < x && x < target->nx) {
-											value = *targetPtr_XYZ;
-											if (value == value && *maskPtr_XYZ > -1) {
-												targetValues[tid][targetIndex] = value;
-												targetOverlap[tid][targetIndex] = 1;
-											}
-										}
-										targetPtr_XYZ++;
-										maskPtr_XYZ++;
-										targetIndex++;
-									}
-								} else
-									targetIndex += BLOCK_WIDTH;
+			targetIndex_start_x = i * BLOCK_WIDTH;
+
+			// Fetch the target block
+			targetIndex = 0;
+			targetVoxelNumber = 0;
+			memset(targetOverlap, 0, BLOCK_SIZE * sizeof(bool));
+			for (z = targetIndex_start_z; z < targetIndex_start_z + BLOCK_WIDTH; z++) {
+				for (y = targetIndex_start_y; y < targetIndex_start_y + BLOCK_WIDTH; y++) {
+					for (x = targetIndex_start_x; x < targetIndex_start_x + BLOCK_WIDTH; x++) {
+						if (z < target->nz && y < target->ny && x < target->nx) {
+							imageIndex = ((size_t) z * target->ny + y) * target->nx + x;
+							value = targetPtr[imageIndex];
+							if (value == value && mask[imageIndex] > -1) {
+								targetValues[targetIndex] = value;
+								targetOverlap[targetIndex] = 1;
+								targetVoxelNumber++;
 							}
-						} else
-							targetIndex += BLOCK_WIDTH * BLOCK_WIDTH;
+						}
+						targetIndex++;
 					}
-					bestCC = params->voxelCaptureRange > 3 ? 0.9 : 0.0; //only when misaligned images are registered
-					bestDisplacement[0] = std::numeric_limits<float>::quiet_NaN();
-					bestDisplacement[1] = 0.f;
-					bestDisplacement[2] = 0.f;
-
-					// iteration over the result blocks
-					for (n = -1 * params->voxelCaptureRange; n <= params->voxelCaptureRange; n += params->stepSize) {
-						resultIndex_start_z = targetIndex_start_z + n;
-						resultIndex_end_z = resultIndex_start_z + BLOCK_WIDTH;
-						for (m = -1 * params->voxelCaptureRange; m <= params->voxelCaptureRange; m += params->stepSize) {
-							resultIndex_start_y = targetIndex_start_y + m;
-							resultIndex_end_y = resultIndex_start_y + BLOCK_WIDTH;
-							for (l = -1 * params->voxelCaptureRange; l <= params->voxelCaptureRange; l += params->stepSize) {
-
-								resultIndex_start_x = targetIndex_start_x + l;
-								resultIndex_end_x = resultIndex_start_x + BLOCK_WIDTH;
-								resultIndex = 0;
-								memset(resultOverlap[tid], 0, BLOCK_SIZE * sizeof(bool));
-								for (z = resultIndex_start_z; z < resultIndex_end_z; z++) {
-									if (-1 < z && z < result->nz) {
-										index = z * result->nx * result->ny;
-										resultPtr_Z = &resultPtr[index];
-										int *maskPtr_Z = &mask[index];
-										for (y = resultIndex_start_y; y < resultIndex_end_y; y++) {
-											if (-1 < y && y < result->ny) {
-												index = y * result->nx + resultIndex_start_x;
-												resultPtr_XYZ = &resultPtr_Z[index];
-												int *maskPtr_XYZ = &maskPtr_Z[index];
-												for (x = resultIndex_start_x; x < resultIndex_end_x; x++) {
-													if (-1 < x && x < result->nx) {
-														value = *resultPtr_XYZ;
-														if (value == value && *maskPtr_XYZ > -1) {
-															resultValues[tid][resultIndex] = value;
-															resultOverlap[tid][resultIndex] = 1;
-														}
-													}
-													resultPtr_XYZ++;
-													resultIndex++;
-													maskPtr_XYZ++;
-												}
-											} else
-												resultIndex += BLOCK_WIDTH;
-										}
-									} else
-										resultIndex += BLOCK_WIDTH * BLOCK_WIDTH;
-								}
-								targetMean = 0.0;
-								resultMean = 0.0;
-								voxelNumber = 0.0;
-								for (int a = 0; a < BLOCK_SIZE; a++) {
-									if (targetOverlap[tid][a] && resultOverlap[tid][a]) {
-										targetMean += targetValues[tid][a];
-										resultMean += resultValues[tid][a];
-										voxelNumber++;
-									}
-								}
-
-								if (voxelNumber > BLOCK_SIZE / 2) {
-									targetMean /= voxelNumber;
-									resultMean /= voxelNumber;
-
-									targetVar = 0.0;
-									resultVar = 0.0;
-									localCC = 0.0;
-
-									for (int a = 0; a < BLOCK_SIZE; a++) {
-										if (targetOverlap[tid][a] && resultOverlap[tid][a]) {
-											targetTemp = (targetValues[tid][a] - targetMean);
-											resultTemp = (resultValues[tid][a] - resultMean);
-											targetVar += (targetTemp) * (targetTemp);
-											resultVar += (resultTemp) * (resultTemp);
-											localCC += (targetTemp) * (resultTemp);
-										}
-									}
+				}
+			}
+			// The constant time statistics require a fully defined target block
+			bool fullTarget = targetVoxelNumber == BLOCK_SIZE;
+			targetSqSum = 0.0;
+			if (fullTarget) {
+				targetSum = 0.0;
+				for (a = 0; a < BLOCK_SIZE; a++)
+					targetSum += targetValues[a];
+				targetSum /= (double) BLOCK_SIZE;
+				for (a = 0; a < BLOCK_SIZE; a++) {
+					centredTarget[a] = targetValues[a] - targetSum;
+					targetSqSum += centredTarget[a] * centredTarget[a];
+				}
+			}
 
-									localCC = fabs(localCC / sqrt(targetVar * resultVar));
-									/*bool predicate = i * BLOCK_WIDTH == 16 && j * BLOCK_WIDTH == 24 && k * BLOCK_WIDTH == 24;
-									 if (predicate && 0.981295 - localCC < 0.04 && fabs(0.981295 - localCC) >= 0)
-									 printf("C|%d-%d-%d|%.0f|TMN:%f|TVR:%f|RMN:%f|RVR:%f|LCC:%lf|BCC:%lf\n", l, m, n, voxelNumber, targetMean, targetVar, resultMean, resultVar, localCC, bestCC);
-									 //*/
-
-									//hack for Marc's integration tests
-//									if (localCC > bestCC || (fabs(localCC - 0.981295)<0.000001 && fabs(bestCC-0.981295)<0.000001)) {
-									if (localCC > bestCC) {
-										bestCC = localCC;
-										bestDisplacement[0] = (float) l;
-										bestDisplacement[1] = (float) m;
-										bestDisplacement[2] = (float) n;
-									}
-									/*bool predicate = i * BLOCK_WIDTH == 16 && j * BLOCK_WIDTH == 24 && k * BLOCK_WIDTH == 24;
-									 if (predicate )
-									 printf("C|%d-%d-%d|%f-%f-%f\n", l, m, n, bestDisplacement[0], bestDisplacement[1], bestDisplacement[2]);*/
+			// Fetch the search window, undefined voxels are set to NaN
+			windowPtr = window;
+			for (z = targetIndex_start_z - captureRange; z < targetIndex_start_z - captureRange + windowWidth; z++) {
+				for (y = targetIndex_start_y - captureRange; y < targetIndex_start_y - captureRange + windowWidth; y++) {
+					for (x = targetIndex_start_x - captureRange; x < targetIndex_start_x - captureRange + windowWidth; x++) {
+						*windowPtr = std::numeric_limits<DTYPE>::quiet_NaN();
+						if (-1 < z && z < result->nz && -1 < y && y < result->ny && -1 < x && x < result->nx) {
+							imageIndex = ((size_t) z * result->ny + y) * result->nx + x;
+							if (mask[imageIndex] > -1)
+								*windowPtr = resultPtr[imageIndex];
+						}
+						windowPtr++;
+					}
+				}
+			}
 
+			if (fullTarget) {
+				// Box sums along the x, y and z axes in turn
+				index = 0;
+				for (z = 0; z < windowWidth; z++) {
+					for (y = 0; y < windowWidth; y++) {
+						windowPtr = &window[(z * windowWidth + y) * windowWidth];
+						for (l = 0; l < shiftNumber; l++) {
+							resultSum = resultSqSum = 0.0;
+							n = 0;
+							for (a = l; a < l + BLOCK_WIDTH; a++) {
+								value = windowPtr[a];
+								if (value == value) {
+									resultSum += value;
+									resultSqSum += (double) value * value;
+									n++;
 								}
 							}
+							sumX[index] = resultSum;
+							sumSqX[index] = resultSqSum;
+							countX[index] = n;
+							index++;
 						}
 					}
-					if (bestDisplacement[0] == bestDisplacement[0]) {
-						targetPosition_temp[0] = (float) (i * BLOCK_WIDTH);
-						targetPosition_temp[1] = (float) (j * BLOCK_WIDTH);
-						targetPosition_temp[2] = (float) (k * BLOCK_WIDTH);
-
-						bestDisplacement[0] += targetPosition_temp[0];
-						bestDisplacement[1] += targetPosition_temp[1];
-						bestDisplacement[2] += targetPosition_temp[2];
-
-						reg_mat44_mul(targetMatrix_xyz, targetPosition_temp, tempPosition);
-						z = 3 * params->activeBlock[blockIndex];
-						temp_target_position[z] = tempPosition[0];
-						temp_target_position[z + 1] = tempPosition[1];
-						temp_target_position[z + 2] = tempPosition[2];
-						reg_mat44_mul(targetMatrix_xyz, bestDisplacement, tempPosition);
-						temp_result_position[z] = tempPosition[0];
-						temp_result_position[z + 1] = tempPosition[1];
-						temp_result_position[z + 2] = tempPosition[2];
+				}
+				index = 0;
+				for (z = 0; z < windowWidth; z++) {
+					for (m = 0; m < shiftNumber; m++) {
+						for (l = 0; l < shiftNumber; l++) {
+							resultSum = resultSqSum = 0.0;
+							n = 0;
+							for (b = m; b < m + BLOCK_WIDTH; b++) {
+								imageIndex = (z * windowWidth + b) * shiftNumber + l;
+								resultSum += sumX[imageIndex];
+								resultSqSum += sumSqX[imageIndex];
+								n += countX[imageIndex];
+							}
+							sumY[index] = resultSum;
+							sumSqY[index] = resultSqSum;
+							countY[index] = n;
+							index++;
+						}
+					}
+				}
+				index = 0;
+				for (n = 0; n < shiftNumber; n++) {
+					for (m = 0; m < shiftNumber; m++) {
+						for (l = 0; l < shiftNumber; l++) {
+							resultSum = resultSqSum = 0.0;
+							x = 0;
+							for (c = n; c < n + BLOCK_WIDTH; c++) {
+								imageIndex = (c * shiftNumber + m) * shiftNumber + l;
+								resultSum += sumY[imageIndex];
+								resultSqSum += sumSqY[imageIndex];
+								x += countY[imageIndex];
+							}
+							sumZ[index] = resultSum;
+							sumSqZ[index] = resultSqSum;
+							countZ[index] = x;
+							index++;
+						}
 					}
 				}
-				blockIndex++;
+			}
+
+			bestCC = 0.0;
+			bestDisplacement[0] = std::numeric_limits<float>::quiet_NaN();
+			bestDisplacement[1] = 0.f;
+			bestDisplacement[2] = 0.f;
+
+			// The exhaustive search visits every displacement of the capture
+			// range. The hierarchical search only visits every other one along
+			// each axis, then refines around the best displacements found
+			coarseStep = params->hierarchicalSearch ? 2 * stepSize : stepSize;
+			candidateNumber = 0;
+			for (n = -1 * captureRange; n <= captureRange; n += coarseStep) {
+				for (m = -1 * captureRange; m <= captureRange; m += coarseStep) {
+					for (l = -1 * captureRange; l <= captureRange; l += coarseStep) {
+						correlation = block_matching_compareBlock3D<DTYPE>(l + captureRange, m + captureRange, n + captureRange,
+								window, windowWidth, shiftNumber, fullTarget, centredTarget, targetSqSum,
+								sumZ, sumSqZ, countZ, targetValues, targetOverlap, resultValues, resultOverlap);
+						if (correlation > bestCC) {
+							bestCC = correlation;
+							bestDisplacement[0] = (float) l;
+							bestDisplacement[1] = (float) m;
+							bestDisplacement[2] = (float) n;
+						}
+						// Sorted list of the best coarse displacements
+						if (params->hierarchicalSearch && correlation > 0 &&
+								(candidateNumber < BLOCK_MATCHING_REFINED_CANDIDATES || correlation > candidateCC[candidateNumber - 1])) {
+							if (candidateNumber < BLOCK_MATCHING_REFINED_CANDIDATES)
+								candidateNumber++;
+							for (candidate = candidateNumber - 1; candidate > 0 && candidateCC[candidate - 1] < correlation; candidate--) {
+								candidateCC[candidate] = candidateCC[candidate - 1];
+								memcpy(candidateShift[candidate], candidateShift[candidate - 1], 3 * sizeof(int));
+							}
+							candidateCC[candidate] = correlation;
+							candidateShift[candidate][0] = l;
+							candidateShift[candidate][1] = m;
+							candidateShift[candidate][2] = n;
+						}
+					}
+				}
+			}
+			for (candidate = 0; candidate < candidateNumber; candidate++) {
+				for (a = 0; a < 3; a++) {
+					shiftStart[a] = candidateShift[candidate][a] - stepSize < -captureRange ? -captureRange : candidateShift[candidate][a] - stepSize;
+					shiftEnd[a] = candidateShift[candidate][a] + stepSize > captureRange ? captureRange : candidateShift[candidate][a] + stepSize;
+				}
+				for (n = shiftStart[2]; n <= shiftEnd[2]; n += stepSize) {
+					for (m = shiftStart[1]; m <= shiftEnd[1]; m += stepSize) {
+						for (l = shiftStart[0]; l <= shiftEnd[0]; l += stepSize) {
+							if (l == candidateShift[candidate][0] && m == candidateShift[candidate][1] && n == candidateShift[candidate][2])
+								continue;
+							correlation = block_matching_compareBlock3D<DTYPE>(l + captureRange, m + captureRange, n + captureRange,
+									window, windowWidth, shiftNumber, fullTarget, centredTarget, targetSqSum,
+									sumZ, sumSqZ, countZ, targetValues, targetOverlap, resultValues, resultOverlap);
+							if (correlation > bestCC) {
+								bestCC = correlation;
+								bestDisplacement[0] = (float) l;
+								bestDisplacement[1] = (float) m;
+								bestDisplacement[2] = (float) n;
+							}
+						}
+					}
+				}
+			}
+			// The threshold only applies to the final displacement, so that the
+			// coarse search does not discard the neighbourhood of the best one
+			if (bestCC <= (params->voxelCaptureRange > 3 ? 0.9 : 0.0)) //only when misaligned images are registered
+				bestDisplacement[0] = std::numeric_limits<float>::quiet_NaN();
+			if (bestDisplacement[0] == bestDisplacement[0]) {
+				targetPosition_temp[0] = (float) (i * BLOCK_WIDTH);
+				targetPosition_temp[1] = (float) (j * BLOCK_WIDTH);
+				targetPosition_temp[2] = (float) (k * BLOCK_WIDTH);
+
+				bestDisplacement[0] += targetPosition_temp[0];
+				bestDisplacement[1] += targetPosition_temp[1];
+				bestDisplacement[2] += targetPosition_temp[2];
+
+				reg_mat44_mul(targetMatrix_xyz, targetPosition_temp, tempPosition);
+				z = 3 * params->activeBlock[blockIndex];
+				temp_target_position[z] = tempPosition[0];
+				temp_target_position[z + 1] = tempPosition[1];
+				temp_target_position[z + 2] = tempPosition[2];
+				reg_mat44_mul(targetMatrix_xyz, bestDisplacement, tempPosition);
+				temp_result_position[z] = tempPosition[0];
+				temp_result_position[z + 1] = tempPosition[1];
+				temp_result_position[z + 2] = tempPosition[2];
 			}
 		}
+		free(window);
+		free(sumBuffer);
+		free(countBuffer);
 	}
+	free(activeBlockList);
 
 	// Removing the NaNs and defining the number of active block
 	params->definedActiveBlock = 0;
@@ -670,10 +886,6 @@ void block_matching_method3D(nifti_image * target, nifti_image * result, _reg_bl
 	}
 	free(temp_target_position);
 	free(temp_result_position);
-
-#if defined (_OPENMP)
-	omp_set_num_threads(threadNumber);
-#endif
 }
 /* *************************************************************** */
 // Block matching interface function
@@ -930,108 +1142,119 @@ void estimate_affine_transformation2D(std::vector<_reg_sorted_point2D> &points,
 
 // estimate an affine transformation using least square
 void estimate_affine_transformation3D(std::vector<_reg_sorted_point3D> &points,
-                                      mat44 * transformation,
-                                      float **A,
-                                      float *  w,
-                                      float **v,
-                                      float **r,
-                                      float *  b)
+                                      mat44 * transformation)
 {
-   // Create our A matrix
-   // we need at least 4 points. Assuming we have that here.
-   int num_equations = points.size() * 3;
-   unsigned c = 0;
-   for (unsigned k = 0; k < points.size(); ++k)
+   // Each row of the affine matrix is the least square solution of
+   // [x y z 1] . row = result, over all the points. The three problems
+   // share the same 4x4 normal matrix, which is accumulated in double
+   // on the fly rather than building the full 3N x 12 system
+   double normal[4][4], rhs[4][3], point[4];
+   unsigned i, j, k;
+   for (i = 0; i < 4; ++i)
    {
-      c = k * 3;
-      A[c][0] = points[k].target[0];
-      A[c][1] = points[k].target[1];
-      A[c][2] = points[k].target[2];
-      A[c][3] = A[c][4] = A[c][5] = A[c][6] = A[c][7] = A[c][8] = A[c][10] = A[c][11] = 0.0f;
-      A[c][9] = 1.0f;
-
-      A[c+1][3] = points[k].target[0];
-      A[c+1][4] = points[k].target[1];
-      A[c+1][5] = points[k].target[2];
-      A[c+1][0] = A[c+1][1] = A[c+1][2] = A[c+1][6] = A[c+1][7] = A[c+1][8] = A[c+1][9] = A[c+1][11] = 0.0f;
-      A[c+1][10] = 1.0f;
-
-      A[c+2][6] = points[k].target[0];
-      A[c+2][7] = points[k].target[1];
-      A[c+2][8] = points[k].target[2];
-      A[c+2][0] = A[c+2][1] = A[c+2][2] = A[c+2][3] = A[c+2][4] = A[c+2][5] = A[c+2][9] = A[c+2][10] = 0.0f;
-      A[c+2][11] = 1.0f;
+      for (j = 0; j < 4; ++j) normal[i][j] = 0.0;
+      for (j = 0; j < 3; ++j) rhs[i][j] = 0.0;
    }
-
-   // Now we can compute our svd
-   svd(A, num_equations, 12, w, v);
-
-   // First we make sure that the really small singular values
-   // are set to 0. and compute the inverse by taking the reciprocal
-   // of the entries
-   for (unsigned k = 0; k < 12; ++k)
+   for (k = 0; k < points.size(); ++k)
    {
-      if (w[k] < 0.0001)
-      {
-         w[k] = 0.0f;
-      }
-      else
+      point[0] = points[k].target[0];
+      point[1] = points[k].target[1];
+      point[2] = points[k].target[2];
+      point[3] = 1.0;
+      for (i = 0; i < 4; ++i)
       {
-         w[k] = static_cast<float>(1.0/static_cast<double>(w[k]));
+         for (j = i; j < 4; ++j)
+            normal[i][j] += point[i] * point[j];
+         for (j = 0; j < 3; ++j)
+            rhs[i][j] += point[i] * static_cast<double>(points[k].result[j]);
       }
    }
+   for (i = 1; i < 4; ++i)
+      for (j = 0; j < i; ++j)
+         normal[i][j] = normal[j][i];
+
+   // The normal matrix is symmetric: its singular values are the squares of
+   // the singular values of the full system. The ones below 0.0001^2 are
+   // discarded, as were the singular values below 0.0001 of the full system
+   double vData[4][4], w[4];
+   double *u[4] = {normal[0], normal[1], normal[2], normal[3]};
+   double *v[4] = {vData[0], vData[1], vData[2], vData[3]};
+   svd(u, 4, 4, w, v);
+   for (k = 0; k < 4; ++k)
+   {
+      if (w[k] < 1.e-8)
+         w[k] = 0.0;
+      else w[k] = 1.0 / w[k];
+   }
 
-   // Now we can compute the pseudoinverse which is given by
-   // V*inv(W)*U'
-   // First compute the V * inv(w) in place.
-   // Simply scale each column by the corresponding singular value
-   for (unsigned k = 0; k < 12; ++k)
+   // Pseudoinverse = V * inv(W) * U', applied to the right hand sides
+   double projection[4], transform[4][3];
+   for (j = 0; j < 3; ++j)
    {
-      for (unsigned j = 0; j < 12; ++j)
+      for (k = 0; k < 4; ++k)
+      {
+         projection[k] = 0.0;
+         for (i = 0; i < 4; ++i)
+            projection[k] += u[i][k] * rhs[i][j];
+         projection[k] *= w[k];
+      }
+      for (i = 0; i < 4; ++i)
       {
-         v[j][k] = static_cast<float>(static_cast<double>(v[j][k]) * static_cast<double>(w[k]));
+         transform[i][j] = 0.0;
+         for (k = 0; k < 4; ++k)
+            transform[i][j] += v[i][k] * projection[k];
       }
    }
 
-   // Now multiply the matrices together
-   // Pseudoinverse = v * e * A(transpose)
-   mul_matrices(v, A, 12, 12, num_equations, r, true);
-   // Now r contains the pseudoinverse
-   // Create vector b and then multiple rb to get the affine paramsA
-   for (unsigned k = 0; k < points.size(); ++k)
+   for (j = 0; j < 3; ++j)
    {
-      c = k * 3;
-      b[c] = 		points[k].result[0];
-      b[c+1] = 	points[k].result[1];
-      b[c+2] = 	points[k].result[2];
+      transformation->m[j][0] = static_cast<float>(transform[0][j]);
+      transformation->m[j][1] = static_cast<float>(transform[1][j]);
+      transformation->m[j][2] = static_cast<float>(transform[2][j]);
+      transformation->m[j][3] = static_cast<float>(transform[3][j]);
    }
 
-   float * transform = new float[12];
-   mul_matvec(r, 12, num_equations, b, transform);
-
-   transformation->m[0][0] = transform[0];
-   transformation->m[0][1] = transform[1];
-   transformation->m[0][2] = transform[2];
-   transformation->m[0][3] = transform[9];
-
-   transformation->m[1][0] = transform[3];
-   transformation->m[1][1] = transform[4];
-   transformation->m[1][2] = transform[5];
-   transformation->m[1][3] = transform[10];
-
-   transformation->m[2][0] = transform[6];
-   transformation->m[2][1] = transform[7];
-   transformation->m[2][2] = transform[8];
-   transformation->m[2][3] = transform[11];
-
    transformation->m[3][0] = 0.0f;
    transformation->m[3][1] = 0.0f;
    transformation->m[3][2] = 0.0f;
    transformation->m[3][3] = 1.0f;
-
-   delete[] transform;
 }
+/* *************************************************************** */
+// Keep the correspondences with the smallest squared distance once the target
+// positions are transformed. The selection runs in linear time; ties are broken
+// by block index, which keeps the same points as sorting by distance would.
+// The returned value is the sum of the kept distances
+double select_closest_points3D(_reg_blockMatchingParam *params,
+                               mat44 *transformation,
+                               std::vector<std::pair<double, unsigned> > &distances,
+                               unsigned long num_to_keep,
+                               std::vector<_reg_sorted_point3D> &top_points)
+{
+   const unsigned num_points = params->definedActiveBlock;
+   float newResultPosition[3];
+   for (unsigned j = 0; j < num_points; ++j)
+   {
+      reg_mat44_mul(transformation, &(params->targetPosition[3*j]), newResultPosition);
+      distances[j] = std::pair<double, unsigned>(get_square_distance3D(newResultPosition,
+                                                                       &(params->resultPosition[3*j])),
+                                                 j);
+   }
+   if (num_to_keep > num_points) num_to_keep = num_points;
+   std::nth_element(distances.begin(), distances.begin() + num_to_keep, distances.end());
 
+   double distance = 0.0;
+   top_points.clear();
+   for (unsigned long i = 0; i < num_to_keep; ++i)
+   {
+      const unsigned j = 3 * distances[i].second;
+      top_points.push_back(_reg_sorted_point3D(&(params->targetPosition[j]),
+                                               &(params->resultPosition[j]),
+                                               distances[i].first));
+      distance += distances[i].first;
+   }
+   return distance;
+}
+/* *************************************************************** */
 void optimize_affine2D(_reg_blockMatchingParam * params,
                        mat44 * final)
 {
@@ -1194,39 +1417,10 @@ void optimize_affine3D(_reg_blockMatchingParam *params,
    reg_mat44_eye(final);
 
    const unsigned num_points = params->definedActiveBlock;
-   unsigned long num_equations = num_points * 3;
-   std::multimap<double, _reg_sorted_point3D> queue;
+   std::vector<std::pair<double, unsigned> > distances(num_points);
    std::vector<_reg_sorted_point3D> top_points;
    double distance = 0.0;
    double lastDistance = std::numeric_limits<double>::max();
-   unsigned long i;
-
-   // massive left hand side matrix
-   float **a = new float *[num_equations];
-   for (unsigned k = 0; k < num_equations; ++k)
-   {
-      a[k] = new float[12]; // full affine
-   }
-
-   // The array of singular values returned by svd
-   float *w = new float[12];
-
-   // v will be n x n
-   float **v = new float *[12];
-   for (unsigned k = 0; k < 12; ++k)
-   {
-      v[k] = new float[12];
-   }
-
-   // Allocate memory for pseudoinverse
-   float **r = new float *[12];
-   for (unsigned k = 0; k < 12; ++k)
-   {
-      r[k] = new float[num_equations];
-   }
-
-   // Allocate memory for RHS vector
-   float *b = new float[num_equations];
 
    // The initial vector with all the input points
    for (unsigned j = 0; j < num_points*3; j+=3)
@@ -1237,77 +1431,18 @@ void optimize_affine3D(_reg_blockMatchingParam *params,
    }
 
    // estimate the optimal transformation while considering all the points
-   estimate_affine_transformation3D(top_points, final, a, w, v, r, b);
-
-   // Delete a, b and r. w and v will not change size in subsequent svd operations.
-   for (unsigned int k = 0; k < num_equations; ++k)
-   {
-      delete[] a[k];
-   }
-   delete[] a;
-   delete[] b;
-
-   for (unsigned k = 0; k < 12; ++k)
-   {
-      delete[] r[k];
-   }
-   delete [] r;
-
+   estimate_affine_transformation3D(top_points, final);
 
    // The LS in the iterations is done on subsample of the input data
-   float * newResultPosition = new float[num_points*3];
    const unsigned long num_to_keep = (unsigned long)(num_points * (params->percent_to_keep/100.0f));
-   num_equations = num_to_keep*3;
-
-   // The LHS matrix
-   a = new float *[num_equations];
-   for (unsigned k = 0; k < num_equations; ++k)
-   {
-      a[k] = new float[12]; // full affine
-   }
-
-   // Allocate memory for pseudoinverse
-   r = new float *[12];
-   for (unsigned k = 0; k < 12; ++k)
-   {
-      r[k] = new float[num_equations];
-   }
-
-   // Allocate memory for RHS vector
-   b = new float[num_equations];
+   top_points.reserve(num_to_keep);
    mat44 lastTransformation;
    memset(&lastTransformation,0,sizeof(mat44));
 
    for (unsigned count = 0; count < MAX_ITERATIONS; ++count)
    {
-      // Transform the points in the target
-      for (unsigned j = 0; j < num_points * 3; j+=3)
-      {
-         reg_mat44_mul(final, &(params->targetPosition[j]), &newResultPosition[j]);
-      }
-
-      queue = std::multimap<double, _reg_sorted_point3D> ();
-      for (unsigned j = 0; j < num_points * 3; j+=3)
-      {
-         distance = get_square_distance3D(&newResultPosition[j], &(params->resultPosition[j]));
-         queue.insert(std::pair<double,
-                      _reg_sorted_point3D>(distance,
-                                           _reg_sorted_point3D(&(params->targetPosition[j]),
-                                                               &(params->resultPosition[j]),
-                                                               distance)));
-      }
-
-      distance = 0.0;
-      i = 0;
-      top_points.clear();
-
-      for (std::multimap<double, _reg_sorted_point3D>::iterator it = queue.begin();
-            it != queue.end(); ++it, ++i)
-      {
-         if (i >= num_to_keep) break;
-         top_points.push_back((*it).second);
-         distance += (*it).first;
-      }
+      // Keep the points that are the closest after the current transformation
+      distance = select_closest_points3D(params, final, distances, num_to_keep, top_points);
 
       // If the change is not substantial or we are getting worst, we return
       if ((distance >= lastDistance) || (lastDistance - distance) < TOLERANCE)
@@ -1318,29 +1453,8 @@ void optimize_affine3D(_reg_blockMatchingParam *params,
       }
       lastDistance = distance;
       memcpy(&lastTransformation, final, sizeof(mat44));
-      estimate_affine_transformation3D(top_points, final, a, w, v, r, b);
-   }
-   delete[] newResultPosition;
-   delete[] b;
-   for (unsigned k = 0; k < 12; ++k)
-   {
-      delete[] r[k];
-   }
-   delete [] r;
-
-   // free the memory
-   for (unsigned int k = 0; k < num_equations; ++k)
-   {
-      delete[] a[k];
+      estimate_affine_transformation3D(top_points, final);
    }
-   delete[] a;
-
-   delete[] w;
-   for (int k = 0; k < 12; ++k)
-   {
-      delete[] v[k];
-   }
-   delete [] v;
 }
 void estimate_rigid_transformation2D(  std::vector<_reg_sorted_point2D> &points,
                                        mat44 * transformation)
@@ -1466,28 +1580,26 @@ void estimate_rigid_transformation2D(  std::vector<_reg_sorted_point2D> &points,
 void estimate_rigid_transformation3D(std::vector<_reg_sorted_point3D> &points,
                                      mat44 * transformation)
 {
-   float centroid_target[3] = {0.0f};
-   float centroid_result[3] = {0.0f};
-
-
+   // The sums are accumulated in double, so that the estimate does not
+   // depend on the order of the points
+   double centroid_sum[6] = {0.0};
    for (unsigned j = 0; j < points.size(); ++j)
    {
-      centroid_target[0] += points[j].target[0];
-      centroid_target[1] += points[j].target[1];
-      centroid_target[2] += points[j].target[2];
+      centroid_sum[0] += points[j].target[0];
+      centroid_sum[1] += points[j].target[1];
+      centroid_sum[2] += points[j].target[2];
 
-      centroid_result[0] += points[j].result[0];
-      centroid_result[1] += points[j].result[1];
-      centroid_result[2] += points[j].result[2];
+      centroid_sum[3] += points[j].result[0];
+      centroid_sum[4] += points[j].result[1];
+      centroid_sum[5] += points[j].result[2];
    }
 
-   centroid_target[0] /= (float)(points.size());
-   centroid_target[1] /= (float)(points.size());
-   centroid_target[2] /= (float)(points.size());
-
-   centroid_result[0] /= (float)(points.size());
-   centroid_result[1] /= (float)(points.size());
-   centroid_result[2] /= (float)(points.size());
+   float centroid_target[3], centroid_result[3];
+   for (unsigned i = 0; i < 3; ++i)
+   {
+      centroid_target[i] = static_cast<float>(centroid_sum[i] / (double)(points.size()));
+      centroid_result[i] = static_cast<float>(centroid_sum[i+3] / (double)(points.size()));
+   }
 
    float **u = new float*[3];
    float * w = new float[3];
@@ -1512,6 +1624,7 @@ void estimate_rigid_transformation3D(std::vector<_reg_sorted_point3D> &points,
    }
 
    // Demean the input points
+   double u_sum[3][3] = {{0.0}};
    for (unsigned j = 0; j < points.size(); ++j)
    {
       points[j].target[0] -= centroid_target[0];
@@ -1522,19 +1635,22 @@ void estimate_rigid_transformation3D(std::vector<_reg_sorted_point3D> &points,
       points[j].result[1] -= centroid_result[1];
       points[j].result[2] -= centroid_result[2];
 
-      u[0][0] += points[j].target[0] * points[j].result[0];
-      u[0][1] += points[j].target[0] * points[j].result[1];
-      u[0][2] += points[j].target[0] * points[j].result[2];
+      u_sum[0][0] += points[j].target[0] * points[j].result[0];
+      u_sum[0][1] += points[j].target[0] * points[j].result[1];
+      u_sum[0][2] += points[j].target[0] * points[j].result[2];
 
-      u[1][0] += points[j].target[1] * points[j].result[0];
-      u[1][1] += points[j].target[1] * points[j].result[1];
-      u[1][2] += points[j].target[1] * points[j].result[2];
+      u_sum[1][0] += points[j].target[1] * points[j].result[0];
+      u_sum[1][1] += points[j].target[1] * points[j].result[1];
+      u_sum[1][2] += points[j].target[1] * points[j].result[2];
 
-      u[2][0] += points[j].target[2] * points[j].result[0];
-      u[2][1] += points[j].target[2] * points[j].result[1];
-      u[2][2] += points[j].target[2] * points[j].result[2];
+      u_sum[2][0] += points[j].target[2] * points[j].result[0];
+      u_sum[2][1] += points[j].target[2] * points[j].result[1];
+      u_sum[2][2] += points[j].target[2] * points[j].result[2];
 
    }
+   for (unsigned i = 0; i < 3; ++i)
+      for (unsigned k = 0; k < 3; ++k)
+         u[i][k] = static_cast<float>(u_sum[i][k]);
 
    svd(u, 3, 3, w, v);
 
@@ -1698,12 +1814,11 @@ void optimize_rigid3D(_reg_blockMatchingParam *params,
                       mat44 *final)
 {
    const unsigned num_points = params->definedActiveBlock;
-   // Keep a sorted list of the distance measure
-   std::multimap<double, _reg_sorted_point3D> queue;
+   // Distances of the correspondences, from which the closest ones are selected
+   std::vector<std::pair<double, unsigned> > distances(num_points);
    std::vector<_reg_sorted_point3D> top_points;
    double distance = 0.0;
    double lastDistance = std::numeric_limits<double>::max();
-   unsigned long i;
 
    // Set the current transformation to identity
    reg_mat44_eye(final);
@@ -1717,38 +1832,14 @@ void optimize_rigid3D(_reg_blockMatchingParam *params,
 
    estimate_rigid_transformation3D(top_points, final);
    unsigned long num_to_keep = (unsigned long)(num_points * (params->percent_to_keep/100.0f));
-   float * newResultPosition = new float[num_points*3];
 
    mat44 lastTransformation;
    memset(&lastTransformation,0,sizeof(mat44));
 
    for (unsigned count = 0; count < MAX_ITERATIONS; ++count)
    {
-      // Transform the points in the target
-      for (unsigned j = 0; j < num_points * 3; j+=3)
-      {
-         reg_mat44_mul(final, &(params->targetPosition[j]), &newResultPosition[j]);
-      }
-      queue = std::multimap<double, _reg_sorted_point3D>();
-      for (unsigned j = 0; j < num_points * 3; j+= 3)
-      {
-         distance = get_square_distance3D(&newResultPosition[j], &(params->resultPosition[j]));
-         queue.insert(std::pair<double,
-                      _reg_sorted_point3D>(distance,
-                                           _reg_sorted_point3D(&(params->targetPosition[j]),
-                                                               &(params->resultPosition[j]),
-                                                               distance)));
-      }
-
-      distance = 0.0;
-      i = 0;
-      top_points.clear();
-      for (std::multimap<double, _reg_sorted_point3D>::iterator it = queue.begin();it != queue.end(); ++it, ++i)
-      {
-         if (i >= num_to_keep) break;
-         top_points.push_back((*it).second);
-         distance += (*it).first;
-      }
+      // Keep the points that are the closest after the current transformation
+      distance = select_closest_points3D(params, final, distances, num_to_keep, top_points);
 
       // If the change is not substantial, we return
       if ((distance > lastDistance) || (lastDistance - distance) < TOLERANCE)
@@ -1760,7 +1851,6 @@ void optimize_rigid3D(_reg_blockMatchingParam *params,
       memcpy(&lastTransformation, final, sizeof(mat44));
       estimate_rigid_transformation3D(top_points, final);
    }
-   delete [] newResultPosition;
 }
 
 
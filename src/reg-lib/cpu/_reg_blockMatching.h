@@ -74,6 +74,7 @@ struct _reg_blockMatchingParam
    int voxelCaptureRange;
 
    int stepSize;
+   bool hierarchicalSearch;
    bool cusvd;
 
    _reg_blockMatchingParam()
@@ -84,7 +85,8 @@ struct _reg_blockMatchingParam
         activeBlock(0),
         definedActiveBlock(0),
         voxelCaptureRange(0),
-        stepSize(0)
+        stepSize(0),
+        hierarchicalSearch(false)
    {}
 
    ~_reg_blockMatchingParam()
@@ -119,6 +121,19 @@ void initialise_block_matching_method(nifti_image * referenceImage,
                                       int *mask,
                                       bool runningOnGPU = false);
 
+/** @brief This function initialise a _reg_blockMatchingParam structure
+ * from a structure that has already been initialised for the same reference
+ * image and mask, which avoids recomputing the active blocks
+ * @param referenceImage Reference image where the blocks are defined
+ * @param params Block matching parameter structure that will be populated
+ * @param precomputed Block matching parameter structure to copy the block
+ * definition and active blocks from
+ */
+extern "C++"
+void initialise_block_matching_method(nifti_image * referenceImage,
+                                      _reg_blockMatchingParam *params,
+                                      const _reg_blockMatchingParam *precomputed);
+
 /** @brief Interface for the block matching algorithm.
  * @param referenceImage Reference image in the currrent registration task
  * @param warpedImage Warped floating image in the currrent registration task
@@ -31,6 +31,9 @@ reg_lncc::reg_lncc()
    this->warpedReferenceMeanImage=NULL;
    this->warpedReferenceSdevImage=NULL;
 
+   this->forwardStatUpToDate=false;
+   this->backwardStatUpToDate=false;
+
    // Gaussian kernel is used by default
    this->kernelType=0;
 
@@ -82,7 +85,9 @@ template <class DTYPE>
 void reg_lncc::UpdateLocalStatImages(nifti_image *originalImage,
                                      nifti_image *meanImage,
                                      nifti_image *stdDevImage,
-                                     int *mask)
+                                     int *mask,
+                                     nifti_image *referenceImage,
+                                     nifti_image *correlationImage)
 {
    DTYPE *origPtr = static_cast<DTYPE *>(originalImage->data);
    DTYPE *meanPtr = static_cast<DTYPE *>(meanImage->data);
@@ -90,8 +95,16 @@ void reg_lncc::UpdateLocalStatImages(nifti_image *originalImage,
    memcpy(meanPtr, origPtr, originalImage->nvox*originalImage->nbyper);
    memcpy(sdevPtr, origPtr, originalImage->nvox*originalImage->nbyper);
    reg_tools_multiplyImageToImage(stdDevImage, stdDevImage, stdDevImage);
-   reg_tools_kernelConvolution(meanImage, this->kernelStandardDeviation, this->kernelType, mask, this->activeTimePoint);
-   reg_tools_kernelConvolution(stdDevImage, this->kernelStandardDeviation, this->kernelType, mask, this->activeTimePoint);
+   // The moments are smoothed in a single pass, which shares the kernel
+   // and the normalisation across the images
+   nifti_image *images[3]= {meanImage, stdDevImage, correlationImage};
+   int imageNumber=2;
+   if(referenceImage!=NULL && correlationImage!=NULL)
+   {
+      reg_tools_multiplyImageToImage(referenceImage, originalImage, correlationImage);
+      imageNumber=3;
+   }
+   reg_tools_kernelConvolution(images, imageNumber, this->kernelStandardDeviation, this->kernelType, mask, this->activeTimePoint);
 
 #if defined(_WIN32) && !defined(__GNUC__)
    long voxel;
@@ -116,6 +129,50 @@ void reg_lncc::UpdateLocalStatImages(nifti_image *originalImage,
 }
 /* *************************************************************** */
 /* *************************************************************** */
+void reg_lncc::UpdateWarpedLocalStatImages(bool backward)
+{
+   nifti_image *referenceImage=this->referenceImagePointer;
+   nifti_image *warpedImage=this->warpedFloatingImagePointer;
+   nifti_image *meanImage=this->warpedFloatingMeanImage;
+   nifti_image *sdevImage=this->warpedFloatingSdevImage;
+   nifti_image *correlationImage=this->forwardCorrelationImage;
+   int *mask=this->referenceMaskPointer;
+   bool *upToDate=&this->forwardStatUpToDate;
+   if(backward)
+   {
+      referenceImage=this->floatingImagePointer;
+      warpedImage=this->warpedReferenceImagePointer;
+      meanImage=this->warpedReferenceMeanImage;
+      sdevImage=this->warpedReferenceSdevImage;
+      correlationImage=this->backwardCorrelationImage;
+      mask=this->floatingMaskPointer;
+      upToDate=&this->backwardStatUpToDate;
+   }
+   // The statistics are kept when the warped image was not regenerated since
+   // they were computed, as when the gradient is required after the measure value
+   if(*upToDate)
+      return;
+   switch(referenceImage->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      this->UpdateLocalStatImages<float>(warpedImage,
+                                         meanImage,
+                                         sdevImage,
+                                         mask,
+                                         referenceImage,
+                                         correlationImage);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      this->UpdateLocalStatImages<double>(warpedImage,
+                                          meanImage,
+                                          sdevImage,
+                                          mask,
+                                          referenceImage,
+                                          correlationImage);
+      break;
+   }
+   *upToDate=true;
+}
 void reg_lncc::InitialiseMeasure(nifti_image *refImgPtr,
                                  nifti_image *floImgPtr,
                                  int *maskRefPtr,
@@ -184,6 +241,8 @@ void reg_lncc::InitialiseMeasure(nifti_image *refImgPtr,
    if(this->warpedReferenceSdevImage!=NULL)
       nifti_image_free(this->warpedReferenceSdevImage);
    this->warpedReferenceSdevImage=NULL;
+   this->forwardStatUpToDate=false;
+   this->backwardStatUpToDate=false;
    // Allocate the required image to store mean and Sdev dev of the reference image
    this->forwardCorrelationImage=nifti_copy_nim_info(this->referenceImagePointer);
    this->forwardCorrelationImage->data=(void *)malloc(this->forwardCorrelationImage->nvox *
@@ -204,6 +263,7 @@ void reg_lncc::InitialiseMeasure(nifti_image *refImgPtr,
    this->warpedFloatingSdevImage=nifti_copy_nim_info(this->warpedFloatingImagePointer);
    this->warpedFloatingSdevImage->data=(void *)malloc(this->warpedFloatingSdevImage->nvox *
                                        this->warpedFloatingSdevImage->nbyper);
+
    // Compute local mean and reference image
    switch(this->referenceImagePointer->datatype)
    {
@@ -241,6 +301,7 @@ void reg_lncc::InitialiseMeasure(nifti_image *refImgPtr,
       this->warpedReferenceSdevImage=nifti_copy_nim_info(this->warpedReferenceImagePointer);
       this->warpedReferenceSdevImage->data=(void *)malloc(this->warpedReferenceSdevImage->nvox *
                                            this->warpedReferenceSdevImage->nbyper);
+
       // Compute local mean and floating image
       switch(this->floatingImagePointer->datatype)
       {
@@ -275,18 +336,11 @@ double reg_getLNCCValue(nifti_image *referenceImage,
                         nifti_image *referenceMeanImage,
                         nifti_image *referenceSdevImage,
                         int *refMask,
-                        nifti_image *warpedImage,
                         nifti_image *warpedMeanImage,
                         nifti_image *warpedSdevImage,
-                        float *kernelStandardDeviation,
                         bool *activeTimePoint,
-                        nifti_image *correlationImage,
-                        int kernelType)
+                        nifti_image *correlationImage)
 {
-   // Compute the local correlation
-   reg_tools_multiplyImageToImage(referenceImage, warpedImage, correlationImage);
-   reg_tools_kernelConvolution(correlationImage, kernelStandardDeviation, kernelType, refMask, activeTimePoint);
-
    double lncc_value_sum  = 0., lncc_value;
    double activeVoxel_num = 0.;
 
@@ -356,21 +410,7 @@ double reg_lncc::GetSimilarityMeasureValue()
 {
    double lncc_value=0.f;
    // Update the local statistic images - Forward
-   switch(this->referenceImagePointer->datatype)
-   {
-   case NIFTI_TYPE_FLOAT32:
-      this->UpdateLocalStatImages<float>(this->warpedFloatingImagePointer,
-                                         this->warpedFloatingMeanImage,
-                                         this->warpedFloatingSdevImage,
-                                         this->referenceMaskPointer);
-      break;
-   case NIFTI_TYPE_FLOAT64:
-      this->UpdateLocalStatImages<double>(this->warpedFloatingImagePointer,
-                                          this->warpedFloatingMeanImage,
-                                          this->warpedFloatingSdevImage,
-                                          this->referenceMaskPointer);
-      break;
-   }
+   this->UpdateWarpedLocalStatImages(false);
    // Compute the LNCC - Forward
    switch(this->referenceImagePointer->datatype)
    {
@@ -379,46 +419,26 @@ double reg_lncc::GetSimilarityMeasureValue()
                                             this->referenceMeanImage,
                                             this->referenceSdevImage,
                                             this->referenceMaskPointer,
-                                            this->warpedFloatingImagePointer,
                                             this->warpedFloatingMeanImage,
                                             this->warpedFloatingSdevImage,
-                                            this->kernelStandardDeviation,
                                             this->activeTimePoint,
-                                            this->forwardCorrelationImage,
-                                            this->kernelType);
+                                            this->forwardCorrelationImage);
       break;
    case NIFTI_TYPE_FLOAT64:
       lncc_value += reg_getLNCCValue<double>(this->referenceImagePointer,
                                              this->referenceMeanImage,
                                              this->referenceSdevImage,
                                              this->referenceMaskPointer,
-                                             this->warpedFloatingImagePointer,
                                              this->warpedFloatingMeanImage,
                                              this->warpedFloatingSdevImage,
-                                             this->kernelStandardDeviation,
                                              this->activeTimePoint,
-                                             this->forwardCorrelationImage,
-                                             this->kernelType);
+                                             this->forwardCorrelationImage);
       break;
    }
    if(this->isSymmetric)
    {
       // Update the local statistic images - Backward
-      switch(this->floatingImagePointer->datatype)
-      {
-      case NIFTI_TYPE_FLOAT32:
-         this->UpdateLocalStatImages<float>(this->warpedReferenceImagePointer,
-                                            this->warpedReferenceMeanImage,
-                                            this->warpedReferenceSdevImage,
-                                            this->floatingMaskPointer);
-         break;
-      case NIFTI_TYPE_FLOAT64:
-         this->UpdateLocalStatImages<double>(this->warpedReferenceImagePointer,
-                                             this->warpedReferenceMeanImage,
-                                             this->warpedReferenceSdevImage,
-                                             this->floatingMaskPointer);
-         break;
-      }
+      this->UpdateWarpedLocalStatImages(true);
       // Compute the LNCC - Backward
       switch(this->floatingImagePointer->datatype)
       {
@@ -427,26 +447,20 @@ double reg_lncc::GetSimilarityMeasureValue()
                                                this->floatingMeanImage,
                                                this->floatingSdevImage,
                                                this->floatingMaskPointer,
-                                               this->warpedReferenceImagePointer,
                                                this->warpedReferenceMeanImage,
                                                this->warpedReferenceSdevImage,
-                                               this->kernelStandardDeviation,
                                                this->activeTimePoint,
-                                               this->backwardCorrelationImage,
-                                               this->kernelType);
+                                               this->backwardCorrelationImage);
          break;
       case NIFTI_TYPE_FLOAT64:
          lncc_value += reg_getLNCCValue<double>(this->floatingImagePointer,
                                                 this->floatingMeanImage,
                                                 this->floatingSdevImage,
                                                 this->floatingMaskPointer,
-                                                this->warpedReferenceImagePointer,
                                                 this->warpedReferenceMeanImage,
                                                 this->warpedReferenceSdevImage,
-                                                this->kernelStandardDeviation,
                                                 this->activeTimePoint,
-                                                this->backwardCorrelationImage,
-                                                this->kernelType);
+                                                this->backwardCorrelationImage);
          break;
       }
    }
@@ -469,10 +483,6 @@ void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
                                    nifti_image *lnccGradientImage,
                                    int kernelType)
 {
-   // Compute the local correlation
-   reg_tools_multiplyImageToImage(referenceImage, warpedImage, correlationImage);
-   reg_tools_kernelConvolution(correlationImage, kernelStandardDeviation, kernelType, refMask, activeTimePoint);
-
    DTYPE *refImagePtr=static_cast<DTYPE *>(referenceImage->data);
    DTYPE *warImagePtr=static_cast<DTYPE *>(warpedImage->data);
    DTYPE *refMeanPtr=static_cast<DTYPE *>(referenceMeanImage->data);
@@ -566,10 +576,9 @@ void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
          else warMeanPtr0[voxel]=warSdevPtr0[voxel]=correlaPtr0[voxel]=0.;
       }
    }
-   // Smooth the newly computed values
-   reg_tools_kernelConvolution(warpedMeanImage, kernelStandardDeviation, kernelType, refMask, activeTimePoint);
-   reg_tools_kernelConvolution(warpedSdevImage, kernelStandardDeviation, kernelType, refMask, activeTimePoint);
-   reg_tools_kernelConvolution(correlationImage, kernelStandardDeviation, kernelType, refMask, activeTimePoint);
+   // Smooth the newly computed values, in a single pass
+   nifti_image *smoothedImages[3]= {warpedMeanImage, warpedSdevImage, correlationImage};
+   reg_tools_kernelConvolution(smoothedImages, 3, kernelStandardDeviation, kernelType, refMask, activeTimePoint);
 
    // Iteration over all time points to compute new values
    for(int t=0; t<referenceImage->nt; ++t)
@@ -634,22 +643,10 @@ void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
 void reg_lncc::GetVoxelBasedSimilarityMeasureGradient()
 {
    // Update the local statistic images - Forward
-   switch(this->referenceImagePointer->datatype)
-   {
-   case NIFTI_TYPE_FLOAT32:
-      this->UpdateLocalStatImages<float>(this->warpedFloatingImagePointer,
-                                         this->warpedFloatingMeanImage,
-                                         this->warpedFloatingSdevImage,
-                                         this->referenceMaskPointer);
-      break;
-   case NIFTI_TYPE_FLOAT64:
-      this->UpdateLocalStatImages<double>(this->warpedFloatingImagePointer,
-                                          this->warpedFloatingMeanImage,
-                                          this->warpedFloatingSdevImage,
-                                          this->referenceMaskPointer);
-      break;
-   }
+   this->UpdateWarpedLocalStatImages(false);
    // Compute the LNCC gradient - Forward
+   // The local statistics are overwritten by the gradient computation
+   this->forwardStatUpToDate=false;
    switch(this->referenceImagePointer->datatype)
    {
    case NIFTI_TYPE_FLOAT32:
@@ -686,22 +683,9 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient()
    if(this->isSymmetric)
    {
       // Update the local statistic images - Backward
-      switch(this->floatingImagePointer->datatype)
-      {
-      case NIFTI_TYPE_FLOAT32:
-         this->UpdateLocalStatImages<float>(this->warpedReferenceImagePointer,
-                                            this->warpedReferenceMeanImage,
-                                            this->warpedReferenceSdevImage,
-                                            this->floatingMaskPointer);
-         break;
-      case NIFTI_TYPE_FLOAT64:
-         this->UpdateLocalStatImages<double>(this->warpedReferenceImagePointer,
-                                             this->warpedReferenceMeanImage,
-                                             this->warpedReferenceSdevImage,
-                                             this->floatingMaskPointer);
-         break;
-      }
+      this->UpdateWarpedLocalStatImages(true);
       // Compute the LNCC gradient - Backward
+      this->backwardStatUpToDate=false;
       switch(this->floatingImagePointer->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
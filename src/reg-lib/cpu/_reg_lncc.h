@@ -49,6 +49,13 @@ public:
    {
       this->kernelType=t;
    }
+   /// @brief Marks the local statistics of the warped images as outdated.
+   /// It has to be called whenever the warped images are regenerated
+   void SetWarpedImageUpdated()
+   {
+      this->forwardStatUpToDate=false;
+      this->backwardStatUpToDate=false;
+   }
 protected:
    float kernelStandardDeviation[255];
    nifti_image *forwardCorrelationImage;
@@ -63,23 +70,41 @@ protected:
    nifti_image *warpedReferenceMeanImage;
    nifti_image *warpedReferenceSdevImage;
 
+   /// Whether the local statistics of the warped images are up to date, so
+   /// that they are not recomputed until the warped images are regenerated
+   bool forwardStatUpToDate;
+   bool backwardStatUpToDate;
+
    int kernelType;
 
+   /// @brief Computes the local mean and standard deviation of an image and,
+   /// if a reference image is given, the local mean of its product with the
+   /// reference. The three images are smoothed together, in a single pass
    template <class DTYPE>
    void UpdateLocalStatImages(nifti_image *imag,
                               nifti_image *mean,
                               nifti_image *sdev,
-                              int *mask);
+                              int *mask,
+                              nifti_image *reference = NULL,
+                              nifti_image *correlation = NULL);
+   /// @brief Updates the local statistics of the forward or backward warped
+   /// image, unless they were already computed for the current warped intensities
+   void UpdateWarpedLocalStatImages(bool backward);
 };
 /* *************************************************************** */
 /* *************************************************************** */
 /** @brief Copmutes and returns the LNCC between two input image
- * @param targetImage First input image to use to compute the metric
- * @param resultImage Second input image to use to compute the metric
- * @param gaussianStandardDeviation Standard deviation of the Gaussian kernel
- * to use.
+ * The local statistics of both images, including the local mean of their
+ * product stored in the correlation image, are expected to be up to date
+ * @param referenceImage First input image to use to compute the metric
+ * @param referenceMeanImage Local mean of the first input image
+ * @param referenceStdDevImage Local standard deviation of the first image
  * @param mask Array that contains a mask to specify which voxel
  * should be considered. If set to NULL, all voxels are considered
+ * @param warpedMeanImage Local mean of the second input image
+ * @param warpedStdDevImage Local standard deviation of the second image
+ * @param activeTimePoint Array that specifies which time points are used
+ * @param correlationImage Local mean of the product of both images
  * @return Returns the computed LNCC
  */
 extern "C++" template<class DTYPE>
@@ -87,16 +112,15 @@ double reg_getLNCCValue(nifti_image *referenceImage,
                         nifti_image *referenceMeanImage,
                         nifti_image *referenceStdDevImage,
                         int *mask,
-                        nifti_image *warpedImage,
                         nifti_image *warpedMeanImage,
                         nifti_image *warpedStdDevImage,
-                        float *kernelStdDev,
                         bool *activeTimePoint,
-                        nifti_image *correlationImage,
-                        int kernelType);
+                        nifti_image *correlationImage);
 
 /* *************************************************************** */
 /** @brief Compute a voxel based gradient of the LNCC.
+ *  The local statistics are expected to be up to date, as for
+ *  reg_getLNCCValue. They are overwritten by the computation.
  *  @param targetImage First input image to use to compute the metric
  *  @param resultImage Second input image to use to compute the metric
  *  @param resultImageGradient Spatial gradient of the input result image
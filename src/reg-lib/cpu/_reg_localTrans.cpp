@@ -13,6 +13,7 @@
 #define _REG_LOCALTRANS_CPP
 
 #include "_reg_localTrans.h"
+#include "_reg_localTrans_simd.h"
 
 /* *************************************************************** */
 /* *************************************************************** */
@@ -1070,6 +1071,171 @@ void reg_spline_getDeformationField2D(nifti_image *splineControlPoint,
    return;
 }
 /* *************************************************************** */
+/** Evaluates a dense deformation field from a control point grid that is
+ * aligned with the field, as three successive one-dimensional passes: the
+ * grid is first reduced along z for each slice, then along y for each row,
+ * and the resulting row of values is finally interpolated along x. The
+ * basis values only depend on the voxel position along each axis and are
+ * tabulated once. Returns false, without modifying the field, if some
+ * voxels depend on control points outside of the grid, in which case the
+ * per-voxel evaluation, which slides the grid outwards, has to be used.
+ */
+template<class DTYPE>
+bool reg_spline_getDeformationField3D_separable(nifti_image *splineControlPoint,
+                                                nifti_image *deformationField,
+                                                int *mask,
+                                                bool bspline)
+{
+   const DTYPE gridVoxelSpacing[3]=
+   {
+      splineControlPoint->dx / deformationField->dx,
+      splineControlPoint->dy / deformationField->dy,
+      splineControlPoint->dz / deformationField->dz
+   };
+   const int fieldDim[3]= {deformationField->nx, deformationField->ny, deformationField->nz};
+
+   // The first control point of each voxel and the basis values are tabulated
+   // along each axis, using the same expressions as the per-voxel evaluation
+   int *pre[3];
+   DTYPE *basisValues[3];
+   DTYPE basis;
+   int i;
+   for(int axis=0; axis<3; ++axis)
+   {
+      pre[axis]=(int *)malloc(fieldDim[axis]*sizeof(int));
+      basisValues[axis]=(DTYPE *)malloc(4*fieldDim[axis]*sizeof(DTYPE));
+      for(i=0; i<fieldDim[axis]; ++i)
+      {
+         pre[axis][i]=static_cast<int>(static_cast<DTYPE>(i)/gridVoxelSpacing[axis]);
+         basis=static_cast<DTYPE>(i)/gridVoxelSpacing[axis]-static_cast<DTYPE>(pre[axis][i]);
+         if(basis<0.0) basis=0.0; //rounding error
+         if(bspline) get_BSplineBasisValues<DTYPE>(basis, &basisValues[axis][4*i]);
+         else Get_SplineBasisValues<DTYPE>(basis, &basisValues[axis][4*i]);
+      }
+   }
+
+   // Only the control points that are used are reduced
+   int usedNodeX=pre[0][fieldDim[0]-1]+4;
+   int usedNodeY=pre[1][fieldDim[1]-1]+4;
+   int usedNodeZ=pre[2][fieldDim[2]-1]+4;
+   if(pre[0][0]<0 || pre[1][0]<0 || pre[2][0]<0 ||
+         usedNodeX>splineControlPoint->nx ||
+         usedNodeY>splineControlPoint->ny ||
+         usedNodeZ>splineControlPoint->nz)
+   {
+      for(int axis=0; axis<3; ++axis)
+      {
+         free(pre[axis]);
+         free(basisValues[axis]);
+      }
+      return false;
+   }
+
+   size_t nodeNumber=(size_t)splineControlPoint->nx*splineControlPoint->ny*splineControlPoint->nz;
+   size_t nodePlane=(size_t)splineControlPoint->nx*splineControlPoint->ny;
+   size_t voxelNumber=(size_t)deformationField->nx*deformationField->ny*deformationField->nz;
+   DTYPE *controlPointPtr=static_cast<DTYPE *>(splineControlPoint->data);
+   DTYPE *fieldPtr=static_cast<DTYPE *>(deformationField->data);
+
+   // Each thread holds one reduced slice and one reduced row per component
+   size_t sliceSize=(size_t)usedNodeX*usedNodeY;
+   size_t bufferSize=3*(sliceSize+usedNodeX);
+   int threadNumber=1;
+#if defined (_OPENMP)
+   threadNumber=omp_get_max_threads();
+#endif
+   DTYPE *buffers=(DTYPE *)malloc(threadNumber*bufferSize*sizeof(DTYPE));
+
+   int *xPre=pre[0], *yPre=pre[1], *zPre=pre[2];
+   DTYPE *xBasis=basisValues[0], *yBasis=basisValues[1], *zBasis=basisValues[2];
+   int x, y, z, a, n, component;
+   size_t index, nodeIndex;
+   DTYPE *slice, *row, *nodePtr, *slicePtr, *fieldComponentPtr;
+   DTYPE value;
+
+#if defined (_OPENMP)
+#pragma omp parallel default(none) num_threads(threadNumber) \
+   private(x, y, z, a, n, component, index, nodeIndex, slice, row, nodePtr, slicePtr, \
+   fieldComponentPtr, value) \
+   shared(buffers, bufferSize, sliceSize, usedNodeX, usedNodeY, nodeNumber, nodePlane, \
+   voxelNumber, xPre, yPre, zPre, xBasis, yBasis, zBasis, controlPointPtr, fieldPtr, \
+   mask, splineControlPoint, deformationField)
+#endif // _OPENMP
+   {
+#if defined (_OPENMP)
+      slice=&buffers[omp_get_thread_num()*bufferSize];
+#else
+      slice=buffers;
+#endif
+      row=&slice[3*sliceSize];
+#if defined (_OPENMP)
+#pragma omp for schedule(static)
+#endif // _OPENMP
+      for(z=0; z<deformationField->nz; z++)
+      {
+         // Reduction of the four surrounding grid slices along z
+         for(component=0; component<3; ++component)
+         {
+            slicePtr=&slice[component*sliceSize];
+            for(y=0; y<usedNodeY; ++y)
+            {
+               nodeIndex=component*nodeNumber+zPre[z]*nodePlane+(size_t)y*splineControlPoint->nx;
+               for(x=0; x<usedNodeX; ++x)
+                  slicePtr[y*usedNodeX+x]=0;
+               for(a=0; a<4; ++a)
+               {
+                  value=zBasis[4*z+a];
+                  nodePtr=&controlPointPtr[nodeIndex+a*nodePlane];
+                  for(x=0; x<usedNodeX; ++x)
+                     slicePtr[y*usedNodeX+x] += value * nodePtr[x];
+               }
+            }
+         }
+         index=(size_t)z*deformationField->nx*deformationField->ny;
+         for(y=0; y<deformationField->ny; y++)
+         {
+            // Reduction of the four surrounding rows of the slice along y
+            for(component=0; component<3; ++component)
+            {
+               slicePtr=&slice[component*sliceSize+(size_t)yPre[y]*usedNodeX];
+               for(x=0; x<usedNodeX; ++x)
+               {
+                  value=0;
+                  for(a=0; a<4; ++a)
+                     value += yBasis[4*y+a] * slicePtr[a*usedNodeX+x];
+                  row[component*usedNodeX+x]=value;
+               }
+            }
+            // Interpolation of the row along x
+            for(component=0; component<3; ++component)
+            {
+               fieldComponentPtr=&fieldPtr[component*voxelNumber+index];
+               for(x=0; x<deformationField->nx; x++)
+               {
+                  value=0;
+                  if(mask[index+x]>-1)
+                  {
+                     n=component*usedNodeX+xPre[x];
+                     for(a=0; a<4; ++a)
+                        value += xBasis[4*x+a] * row[n+a];
+                  }
+                  fieldComponentPtr[x]=value;
+               }
+            }
+            index+=deformationField->nx;
+         } // y
+      } // z
+   }
+
+   free(buffers);
+   for(int axis=0; axis<3; ++axis)
+   {
+      free(pre[axis]);
+      free(basisValues[axis]);
+   }
+   return true;
+}
+/* *************************************************************** */
 template<class DTYPE>
 void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
                                       nifti_image *deformationField,
@@ -1078,61 +1244,16 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
                                       bool bspline
                                       )
 {
-#if _USE_SSE
-   union
-   {
-      __m128 m;
-      float f[4];
-   } val;
-   __m128 tempX, tempY, tempZ, tempCurrent;
-   __m128 xBasis_sse, yBasis_sse, zBasis_sse, temp_basis_sse, basis_sse;
-
-#if defined(_WIN32) && !defined(__GNUC__)
-   __declspec(align(16)) DTYPE temp[4];
-   __declspec(align(16)) DTYPE zBasis[4];
-   union
-   {
-      __m128 m[16];
-      __declspec(align(16)) DTYPE f[16];
-   } xControlPointCoordinates;
-   union
-   {
-      __m128 m[16];
-      __declspec(align(16)) DTYPE f[16];
-   } yControlPointCoordinates;
-   union
-   {
-      __m128 m[16];
-      __declspec(align(16)) DTYPE f[16];
-   } zControlPointCoordinates;
-#else // _WIN32
-   DTYPE temp[4] __attribute__((aligned(16)));
-   DTYPE zBasis[4] __attribute__((aligned(16)));
-   union
-   {
-      __m128 m[16];
-      DTYPE f[16] __attribute__((aligned(16)));
-   } xControlPointCoordinates;
-   union
-   {
-      __m128 m[16];
-      DTYPE f[16] __attribute__((aligned(16)));
-   } yControlPointCoordinates;
-   union
-   {
-      __m128 m[16];
-      DTYPE f[16] __attribute__((aligned(16)));
-   } zControlPointCoordinates;
-#endif // _WIN32
-#else // _USE_SSE
    DTYPE temp[4];
    DTYPE zBasis[4];
+   DTYPE yzBasis[16];
    DTYPE xControlPointCoordinates[64];
    DTYPE yControlPointCoordinates[64];
    DTYPE zControlPointCoordinates[64];
    int coord;
-#endif // _USE_SSE
 
+   // The tensor products are evaluated by the implementation that suits the host CPU
+   typename reg_splineTensorProduct<DTYPE>::Function tensorProduct=reg_spline_getTensorProduct<DTYPE>();
 
    DTYPE *controlPointPtrX = static_cast<DTYPE *>(splineControlPoint->data);
    DTYPE *controlPointPtrY = &controlPointPtrX[splineControlPoint->nx*splineControlPoint->ny*splineControlPoint->nz];
@@ -1144,7 +1265,7 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
 
    DTYPE basis, oldBasis=(DTYPE)(1.1);
 
-   int x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, index;
+   int x, y, z, a, b, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, index;
    DTYPE real[3];
 
    if(composition)  // Composition of deformation fields
@@ -1155,40 +1276,18 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
       if(splineControlPoint->sform_code>0)
          referenceMatrix_real_to_voxel=(splineControlPoint->sto_ijk);
       else referenceMatrix_real_to_voxel=(splineControlPoint->qto_ijk);
-#ifdef _USE_SSE
-#if defined(_WIN32) && !defined(__GNUC__)
-      __declspec(align(16)) DTYPE xBasis[4];
-      __declspec(align(16)) DTYPE yBasis[4];
-#else
-      DTYPE xBasis[4] __attribute__((aligned(16)));
-      DTYPE yBasis[4] __attribute__((aligned(16)));
-#endif
-#else // _USE_SSE
       DTYPE xBasis[4], yBasis[4];
-#endif // _USE_SSE
 
       DTYPE voxel[3];
 
 #if defined (_OPENMP)
-#ifdef _USE_SSE
 #pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
-   index, voxel, basis, xBasis, yBasis, zBasis, xControlPointCoordinates, \
-   yControlPointCoordinates, zControlPointCoordinates,  \
-   tempX, tempY, tempZ, xBasis_sse, yBasis_sse, zBasis_sse, \
-   temp_basis_sse, basis_sse, val) \
-   shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, referenceMatrix_real_to_voxel, \
-   bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ, \
-   splineControlPoint, mask)
-#else
-#pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
-   index, voxel, basis, xBasis, yBasis, zBasis, xControlPointCoordinates, \
+   private(x, y, z, a, b, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
+   index, voxel, basis, xBasis, yBasis, zBasis, yzBasis, xControlPointCoordinates, \
    yControlPointCoordinates, zControlPointCoordinates, coord) \
    shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, referenceMatrix_real_to_voxel, \
    bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ, \
-   splineControlPoint, mask)
-#endif // _USE_SSE
+   splineControlPoint, mask, tensorProduct)
 #endif // _OPENMP
       for(z=0; z<deformationField->nz; z++)
       {
@@ -1252,21 +1351,6 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
                   // The control point postions are extracted
                   if(xPre!=oldPreX || yPre!=oldPreY || zPre!=oldPreZ)
                   {
-#ifdef _USE_SSE
-                     get_GridValues<DTYPE>(xPre,
-                                           yPre,
-                                           zPre,
-                                           splineControlPoint,
-                                           controlPointPtrX,
-                                           controlPointPtrY,
-                                           controlPointPtrZ,
-                                           xControlPointCoordinates.f,
-                                           yControlPointCoordinates.f,
-                                           zControlPointCoordinates.f,
-                                           false, // no approximation
-                                           false // not a deformation field
-                                           );
-#else // _USE_SSE
                      get_GridValues<DTYPE>(xPre,
                                            yPre,
                                            zPre,
@@ -1280,64 +1364,23 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
                                            false, // no approximation
                                            false // not a deformation field
                                            );
-#endif // _USE_SSE
                      oldPreX=xPre;
                      oldPreY=yPre;
                      oldPreZ=zPre;
                   }
 
-#if _USE_SSE
-                  tempX =  _mm_set_ps1(0.0);
-                  tempY =  _mm_set_ps1(0.0);
-                  tempZ =  _mm_set_ps1(0.0);
-                  val.f[0] = xBasis[0];
-                  val.f[1] = xBasis[1];
-                  val.f[2] = xBasis[2];
-                  val.f[3] = xBasis[3];
-                  xBasis_sse = val.m;
-
-                  //addition and multiplication of the 16 basis value and CP position for each axis
-                  for(c=0; c<4; c++)
-                  {
-                     for(b=0; b<4; b++)
-                     {
-                        yBasis_sse  = _mm_set_ps1(yBasis[b]);
-                        zBasis_sse  = _mm_set_ps1(zBasis[c]);
-                        temp_basis_sse = _mm_mul_ps(yBasis_sse, zBasis_sse);
-                        basis_sse = _mm_mul_ps(temp_basis_sse, xBasis_sse);
-
-                        tempX = _mm_add_ps(_mm_mul_ps(basis_sse, xControlPointCoordinates.m[c*4+b]), tempX );
-                        tempY = _mm_add_ps(_mm_mul_ps(basis_sse, yControlPointCoordinates.m[c*4+b]), tempY );
-                        tempZ = _mm_add_ps(_mm_mul_ps(basis_sse, zControlPointCoordinates.m[c*4+b]), tempZ );
-                     }
-                  }
-                  //the values stored in SSE variables are transfered to normal float
-                  val.m = tempX;
-                  real[0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY;
-                  real[1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ;
-                  real[2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-#else
-                  real[0]=0.0;
-                  real[1]=0.0;
-                  real[2]=0.0;
                   coord=0;
-                  for(c=0; c<4; c++)
+                  for(a=0; a<4; a++)
                   {
                      for(b=0; b<4; b++)
-                     {
-                        for(a=0; a<4; a++)
-                        {
-                           DTYPE tempValue = xBasis[a] * yBasis[b] * zBasis[c];
-                           real[0] += xControlPointCoordinates[coord] * tempValue;
-                           real[1] += yControlPointCoordinates[coord] * tempValue;
-                           real[2] += zControlPointCoordinates[coord] * tempValue;
-                           coord++;
-                        }
-                     }
+                        yzBasis[coord++]=yBasis[b]*zBasis[a];
                   }
-#endif
+                  tensorProduct(xBasis,
+                                yzBasis,
+                                xControlPointCoordinates,
+                                yControlPointCoordinates,
+                                zControlPointCoordinates,
+                                real);
                   fieldPtrX[index] = real[0];
                   fieldPtrY[index] = real[1];
                   fieldPtrZ[index] = real[2];
@@ -1349,56 +1392,27 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
    }//Composition of deformation
    else  // !composition
    {
+      // The grid is aligned with the field, which can then be evaluated one
+      // axis at a time, unless the grid does not cover the field
+      if(reg_spline_getDeformationField3D_separable<DTYPE>(splineControlPoint,
+                                                           deformationField,
+                                                           mask,
+                                                           bspline))
+         return;
+
       DTYPE gridVoxelSpacing[3];
       gridVoxelSpacing[0] = splineControlPoint->dx / deformationField->dx;
       gridVoxelSpacing[1] = splineControlPoint->dy / deformationField->dy;
       gridVoxelSpacing[2] = splineControlPoint->dz / deformationField->dz;
-#ifdef _USE_SSE
-#if defined(_WIN32) && !defined(__GNUC__)
-      union u1
-      {
-         __m128 m[4];
-         __declspec(align(16)) DTYPE f[16];
-      } yzBasis;
-      union u2
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } xyzBasis;
-#else // _WIN32
-      union
-      {
-         __m128 m[4];
-         DTYPE f[16] __attribute__((aligned(16)));
-      } yzBasis;
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } xyzBasis;
-#endif // _WIN32
-#else // _USE_SSE
-      DTYPE yzBasis[16], xyzBasis[64];
-#endif // _USE_SSE
 
 #if defined (_OPENMP)
-#ifdef _USE_SSE
-#pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
-   index, basis, xyzBasis, yzBasis, zBasis, temp, xControlPointCoordinates, \
-   yControlPointCoordinates, zControlPointCoordinates, oldBasis, \
-   tempX, tempY, tempZ, xBasis_sse, yBasis_sse, zBasis_sse, \
-   temp_basis_sse, basis_sse, val, tempCurrent) \
-   shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, splineControlPoint, mask, \
-   gridVoxelSpacing, bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ)
-#else //  _USE_SSE
 #pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
-   index, basis, xyzBasis, yzBasis, zBasis, temp, xControlPointCoordinates, \
+   private(x, y, z, a, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
+   index, basis, yzBasis, zBasis, temp, xControlPointCoordinates, \
    yControlPointCoordinates, zControlPointCoordinates, oldBasis, coord) \
    shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, splineControlPoint, mask, \
-   gridVoxelSpacing, bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ)
-#endif // _USE_SSE
+   gridVoxelSpacing, bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ, \
+   tensorProduct)
 #endif // _OPENMP
       for(z=0; z<deformationField->nz; z++)
       {
@@ -1420,18 +1434,6 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
             if(basis<0.0) basis=0.0; //rounding error
             if(bspline) get_BSplineBasisValues<DTYPE>(basis, temp);
             else Get_SplineBasisValues<DTYPE>(basis, temp);
-#if _USE_SSE
-            val.f[0] = temp[0];
-            val.f[1] = temp[1];
-            val.f[2] = temp[2];
-            val.f[3] = temp[3];
-            tempCurrent=val.m;
-            for(a=0; a<4; a++)
-            {
-               val.m=_mm_set_ps1(zBasis[a]);
-               yzBasis.m[a] = _mm_mul_ps(tempCurrent,val.m);
-            }
-#else
             coord=0;
             for(a=0; a<4; a++)
             {
@@ -1440,7 +1442,6 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
                yzBasis[coord++]=temp[2]*zBasis[a];
                yzBasis[coord++]=temp[3]*zBasis[a];
             }
-#endif
 
             for(x=0; x<deformationField->nx; x++)
             {
@@ -1450,45 +1451,8 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
                if(basis<0.0) basis=0.0; //rounding error
                if(bspline) get_BSplineBasisValues<DTYPE>(basis, temp);
                else Get_SplineBasisValues<DTYPE>(basis, temp);
-#if _USE_SSE
-
-               val.f[0] = temp[0];
-               val.f[1] = temp[1];
-               val.f[2] = temp[2];
-               val.f[3] = temp[3];
-               tempCurrent=val.m;
-               for(a=0; a<16; ++a)
-               {
-                  val.m=_mm_set_ps1(yzBasis.f[a]);
-                  xyzBasis.m[a]=_mm_mul_ps(tempCurrent,val.m);
-               }
-#else
-               coord=0;
-               for(a=0; a<16; a++)
-               {
-                  xyzBasis[coord++]=temp[0]*yzBasis[a];
-                  xyzBasis[coord++]=temp[1]*yzBasis[a];
-                  xyzBasis[coord++]=temp[2]*yzBasis[a];
-                  xyzBasis[coord++]=temp[3]*yzBasis[a];
-               }
-#endif
                if(basis<=oldBasis || x==0)
                {
-#ifdef _USE_SSE
-                  get_GridValues<DTYPE>(xPre,
-                                        yPre,
-                                        zPre,
-                                        splineControlPoint,
-                                        controlPointPtrX,
-                                        controlPointPtrY,
-                                        controlPointPtrZ,
-                                        xControlPointCoordinates.f,
-                                        yControlPointCoordinates.f,
-                                        zControlPointCoordinates.f,
-                                        false, // no approximation
-                                        false // not a deformation field
-                                        );
-#else // _USE_SSE
                   get_GridValues<DTYPE>(xPre,
                                         yPre,
                                         zPre,
@@ -1502,7 +1466,6 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
                                         false, // no approximation
                                         false // not a deformation field
                                         );
-#endif // _USE_SSE
                }
                oldBasis=basis;
 
@@ -1512,32 +1475,12 @@ void reg_spline_getDeformationField3D(nifti_image *splineControlPoint,
 
                if(mask[index]>-1)
                {
-#if _USE_SSE
-                  tempX =  _mm_set_ps1(0.0);
-                  tempY =  _mm_set_ps1(0.0);
-                  tempZ =  _mm_set_ps1(0.0);
-                  //addition and multiplication of the 64 basis value and CP displacement for each axis
-                  for(a=0; a<16; a++)
-                  {
-                     tempX = _mm_add_ps(_mm_mul_ps(xyzBasis.m[a], xControlPointCoordinates.m[a]), tempX );
-                     tempY = _mm_add_ps(_mm_mul_ps(xyzBasis.m[a], yControlPointCoordinates.m[a]), tempY );
-                     tempZ = _mm_add_ps(_mm_mul_ps(xyzBasis.m[a], zControlPointCoordinates.m[a]), tempZ );
-                  }
-                  //the values stored in SSE variables are transfered to normal float
-                  val.m=tempX;
-                  real[0]=val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m=tempY;
-                  real[1]= val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m=tempZ;
-                  real[2]= val.f[0]+val.f[1]+val.f[2]+val.f[3];
-#else
-                  for(a=0; a<64; a++)
-                  {
-                     real[0] += xControlPointCoordinates[a] * xyzBasis[a];
-                     real[1] += yControlPointCoordinates[a] * xyzBasis[a];
-                     real[2] += zControlPointCoordinates[a] * xyzBasis[a];
-                  }
-#endif
+                  tensorProduct(temp,
+                                yzBasis,
+                                xControlPointCoordinates,
+                                yControlPointCoordinates,
+                                zControlPointCoordinates,
+                                real);
                }// mask
                fieldPtrX[index] = real[0];
                fieldPtrY[index] = real[1];
@@ -3253,6 +3196,151 @@ static void optimize(gsl_multimin_function *f, double *start, void *data, double
    nmsimplex_calc_center (&t, start);
 }
 /* *************************************************************** */
+/// Maximal number of Newton iterations used to invert the deformation at one voxel
+#define DEFFIELD_INVERT_MAX_ITERATION 20
+/// Number of lines of a slice that are inverted as one task. Each line is
+/// initialised from the solution at the start of the previous one
+#define DEFFIELD_INVERT_TILE_LINES 8
+/// Tolerance, in mm, used when none is specified
+#define DEFFIELD_INVERT_TOLERANCE 0.001
+/* *************************************************************** */
+/* internal routine : deform one point as FastWarp does, and compute the      */
+/* Jacobian matrix of the trilinearly interpolated deformation with respect   */
+/* to the real-world coordinates of the point                                 */
+/* *************************************************************** */
+template<class FieldTYPE>
+static void inline FastWarpJacobian(const double *point,
+                                    nifti_image *deformationField,
+                                    mat44 *deformationFieldIJKMatrix,
+                                    double *warped,
+                                    double jacobian[3][3])
+{
+   FieldTYPE *warpdata = static_cast<FieldTYPE *>(deformationField->data);
+   int dxw = deformationField->nx;
+   int dxyw = dxw * deformationField->ny;
+   int dxyzw = dxyw * deformationField->nz;
+
+   double world[4], position[4];
+   world[0] = point[0];
+   world[1] = point[1];
+   world[2] = point[2];
+   world[3] = 1;
+   reg_mat44_mul(deformationFieldIJKMatrix, world, position);
+
+   int xw = (int)position[0];
+   int yw = (int)position[1];
+   int zw = (int)position[2];
+   if (xw<0) xw=0;
+   if (yw<0) yw=0;
+   if (zw<0) zw=0;
+   if (xw>deformationField->nx-2) xw = deformationField->nx-2;
+   if (yw>deformationField->ny-2) yw = deformationField->ny-2;
+   if (zw>deformationField->nz-2) zw = deformationField->nz-2;
+
+   double wxf = position[0]-xw;
+   double wyf = position[1]-yw;
+   double wzf = position[2]-zw;
+
+   FieldTYPE *wp = warpdata + zw*dxyw + yw*dxw + xw;
+   double wa, wb, wc, wd, we, wf, wg, wh, wf3, indexJacobian[3];
+   for(int c=0; c<3; ++c)
+   {
+      wf3 = wp[dxw+1];
+      wa  = wp[0];
+      wb  = wp[1]      - wa;
+      wc  = wp[dxw]    - wa;
+      wd  = wp[dxyw]   - wa;
+      we  = wp[dxyw + dxw] - wa - wc - wd;
+      wf  = wp[dxyw + 1 ]  - wa - wb - wd;
+      wg  = wf3            - wa - wb - wc;
+      wh  = wp[dxyw + dxw + 1] - wf3 - wd - we - wf;
+
+      warped[c] = wa + wb*wxf + wc*wyf + wd*wzf + we*wyf*wzf + wf*wxf*wzf + wg*wxf*wyf + wh*wxf*wyf*wzf;
+
+      // derivatives with respect to the voxel coordinates, then to the real-world ones
+      indexJacobian[0] = wb + wf*wzf + wg*wyf + wh*wyf*wzf;
+      indexJacobian[1] = wc + we*wzf + wg*wxf + wh*wxf*wzf;
+      indexJacobian[2] = wd + we*wyf + wf*wxf + wh*wxf*wyf;
+      for(int j=0; j<3; ++j)
+         jacobian[c][j] = indexJacobian[0] * deformationFieldIJKMatrix->m[0][j] +
+               indexJacobian[1] * deformationFieldIJKMatrix->m[1][j] +
+               indexJacobian[2] * deformationFieldIJKMatrix->m[2][j];
+      wp += dxyzw;
+   }
+}
+/* *************************************************************** */
+/* Internal Newton solver: updates position so that it is deformed onto the  */
+/* target. The step is halved until it reduces the distance to the target.   */
+/* Returns false if the distance could not be brought below the tolerance,   */
+/* in which case position holds the closest point found                      */
+/* *************************************************************** */
+template<class FieldTYPE>
+static bool reg_defFieldInvert_newton(double *position,
+                                      const double *target,
+                                      nifti_image *deformationField,
+                                      mat44 *deformationFieldIJKMatrix,
+                                      double tolerance)
+{
+   double warped[3], jacobian[3][3], adjugate[3][3], residual[3], step[3];
+   double trial[3], trialWarped[3], trialJacobian[3][3];
+   double error, trialError=0, determinant, scale;
+   double squaredTolerance = tolerance * tolerance;
+   int i, j;
+
+   FastWarpJacobian<FieldTYPE>(position, deformationField, deformationFieldIJKMatrix, warped, jacobian);
+   error = 0;
+   for(i=0; i<3; ++i)
+   {
+      residual[i] = warped[i] - target[i];
+      error += residual[i] * residual[i];
+   }
+
+   for(int iteration=0; iteration<DEFFIELD_INVERT_MAX_ITERATION && error>squaredTolerance; ++iteration)
+   {
+      adjugate[0][0] = jacobian[1][1]*jacobian[2][2] - jacobian[1][2]*jacobian[2][1];
+      adjugate[0][1] = jacobian[0][2]*jacobian[2][1] - jacobian[0][1]*jacobian[2][2];
+      adjugate[0][2] = jacobian[0][1]*jacobian[1][2] - jacobian[0][2]*jacobian[1][1];
+      adjugate[1][0] = jacobian[1][2]*jacobian[2][0] - jacobian[1][0]*jacobian[2][2];
+      adjugate[1][1] = jacobian[0][0]*jacobian[2][2] - jacobian[0][2]*jacobian[2][0];
+      adjugate[1][2] = jacobian[0][2]*jacobian[1][0] - jacobian[0][0]*jacobian[1][2];
+      adjugate[2][0] = jacobian[1][0]*jacobian[2][1] - jacobian[1][1]*jacobian[2][0];
+      adjugate[2][1] = jacobian[0][1]*jacobian[2][0] - jacobian[0][0]*jacobian[2][1];
+      adjugate[2][2] = jacobian[0][0]*jacobian[1][1] - jacobian[0][1]*jacobian[1][0];
+      determinant = jacobian[0][0]*adjugate[0][0] +
+            jacobian[0][1]*adjugate[1][0] +
+            jacobian[0][2]*adjugate[2][0];
+      if(determinant==0 || determinant!=determinant)
+         return false;
+      for(i=0; i<3; ++i)
+         step[i] = (adjugate[i][0]*residual[0] +
+                    adjugate[i][1]*residual[1] +
+                    adjugate[i][2]*residual[2]) / determinant;
+
+      for(scale=1.0; scale>=1.0/64.0; scale*=0.5)
+      {
+         for(i=0; i<3; ++i)
+            trial[i] = position[i] - scale * step[i];
+         FastWarpJacobian<FieldTYPE>(trial, deformationField, deformationFieldIJKMatrix, trialWarped, trialJacobian);
+         trialError = 0;
+         for(i=0; i<3; ++i)
+            trialError += (trialWarped[i]-target[i]) * (trialWarped[i]-target[i]);
+         if(trialError<error) break;
+      }
+      if(!(trialError<error))
+         return false;
+
+      error = trialError;
+      for(i=0; i<3; ++i)
+      {
+         position[i] = trial[i];
+         residual[i] = trialWarped[i] - target[i];
+         for(j=0; j<3; ++j)
+            jacobian[i][j] = trialJacobian[i][j];
+      }
+   }
+   return error<=squaredTolerance;
+}
+/* *************************************************************** */
 template <class DTYPE>
 void reg_defFieldInvert3D(nifti_image *inputDeformationField,
                           nifti_image *outputDeformationField,
@@ -3268,10 +3356,17 @@ void reg_defFieldInvert3D(nifti_image *inputDeformationField,
    else OutXYZMatrix=&(outputDeformationField->qto_xyz);
 
    // added:
-   mat44 *InXYZMatrix;
+   mat44 *InXYZMatrix, *InIJKMatrix;
    if(inputDeformationField->sform_code>0)
+   {
       InXYZMatrix=&(inputDeformationField->sto_xyz);
-   else InXYZMatrix=&(inputDeformationField->qto_xyz);
+      InIJKMatrix=&(inputDeformationField->sto_ijk);
+   }
+   else
+   {
+      InXYZMatrix=&(inputDeformationField->qto_xyz);
+      InIJKMatrix=&(inputDeformationField->qto_ijk);
+   }
    float center[4], center2[4];
    double centerout[4], delta[4];
    center[0] = inputDeformationField->nx / 2;
@@ -3279,34 +3374,50 @@ void reg_defFieldInvert3D(nifti_image *inputDeformationField,
    center[2] = inputDeformationField->nz / 2;
    center[3] = 1;
    reg_mat44_mul(InXYZMatrix, center, center2);
-   FastWarp<float>(center2[0], center2[1], center2[2], inputDeformationField, &centerout[0], &centerout[1], &centerout[2]);
+   FastWarp<DTYPE>(center2[0], center2[1], center2[2], inputDeformationField, &centerout[0], &centerout[1], &centerout[2]);
    delta[0] = center2[0]-centerout[0];
    delta[1] = center2[1]-centerout[1];
    delta[2] = center2[2]-centerout[2];
    // end added
 
+   if(tolerance!=tolerance)
+      tolerance = DEFFIELD_INVERT_TOLERANCE;
+
+   // The lines of each slice are grouped into tiles, which are distributed
+   // dynamically since the cost of the inversion varies across the field
+   int tileNumberY = (outputDeformationField->ny + DEFFIELD_INVERT_TILE_LINES - 1) / DEFFIELD_INVERT_TILE_LINES;
+   int tileNumber = tileNumberY * outputDeformationField->nz;
 
-   int i,x,y,z;
-   double position[4], pars[4], arrayy[4][3];
+   int i,x,y,z,tile,yEnd;
+   double position[4], pars[4], target[3], lineStart[3];
+   bool converged, lineStartValid, previousValid, seeded;
    struct ddata dat;
    DTYPE *outData;
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
+#pragma omp parallel for default(none) schedule(dynamic) \
    shared(outputDeformationField,tolerance,outputVoxelNumber, \
-   inputDeformationField, OutXYZMatrix, delta) \
-   private(i,x,y,z,dat,outData,position,pars,arrayy)
+   inputDeformationField, OutXYZMatrix, InIJKMatrix, delta, \
+   tileNumber, tileNumberY) \
+   private(i,x,y,z,tile,yEnd,dat,outData,position,pars,target, \
+   lineStart,converged,lineStartValid,previousValid,seeded)
 #endif
-   for (z=0; z<outputDeformationField->nz; ++z)
+   for(tile=0; tile<tileNumber; ++tile)
    {
       dat.deformationField = inputDeformationField;
-      for(i=0; i<4; ++i)              /* set up 2D array pointers */
-         dat.arrayy[i]= arrayy[i];
-
-      outData = (DTYPE *)(outputDeformationField->data) +
-            outputDeformationField->nx * outputDeformationField->ny * z;
-
-      for(y=0; y<outputDeformationField->ny; ++y)
+      z = tile / tileNumberY;
+      y = (tile % tileNumberY) * DEFFIELD_INVERT_TILE_LINES;
+      yEnd = y + DEFFIELD_INVERT_TILE_LINES;
+      if(yEnd>outputDeformationField->ny)
+         yEnd = outputDeformationField->ny;
+      lineStartValid = false;
+      lineStart[0] = lineStart[1] = lineStart[2] = 0.;
+
+      for(; y<yEnd; ++y)
       {
+         outData = (DTYPE *)(outputDeformationField->data) +
+               outputDeformationField->nx * (outputDeformationField->ny * z + y);
+         previousValid = false;
+
          for(x=0; x<outputDeformationField->nx; ++x)
          {
 
@@ -3315,18 +3426,42 @@ void reg_defFieldInvert3D(nifti_image *inputDeformationField,
             position[1] = y;
             position[2] = z;
             position[3] = 1;
-            reg_mat44_mul(OutXYZMatrix, position, pars);
-            dat.gx = pars[0];
-            dat.gy = pars[1];
-            dat.gz = pars[2];
-
-            // added
-            pars[0] += delta[0];
-            pars[1] += delta[1];
-            pars[2] += delta[2];
-            // end added
-
-            optimize(cost_function, pars, (void *)&dat, tolerance);
+            reg_mat44_mul(OutXYZMatrix, position, target);
+
+            // The solution at the previous voxel of the line, or at the start
+            // of the previous line, is the initial guess. The global offset is
+            // used otherwise
+            seeded = true;
+            if(x==0 && lineStartValid)
+            {
+               for(i=0; i<3; ++i) pars[i] = lineStart[i];
+            }
+            else if(x==0 || !previousValid)
+            {
+               for(i=0; i<3; ++i) pars[i] = target[i] + delta[i];
+               seeded = false;
+            }
+
+            converged = reg_defFieldInvert_newton<DTYPE>(pars, target, inputDeformationField, InIJKMatrix, tolerance);
+            if(!converged && seeded)
+            {
+               for(i=0; i<3; ++i) pars[i] = target[i] + delta[i];
+               converged = reg_defFieldInvert_newton<DTYPE>(pars, target, inputDeformationField, InIJKMatrix, tolerance);
+            }
+            if(!converged)
+            {
+               // The derivative-free search is used where Newton's method fails
+               dat.gx = target[0];
+               dat.gy = target[1];
+               dat.gz = target[2];
+               optimize(cost_function, pars, (void *)&dat, tolerance);
+            }
+            previousValid = converged;
+            if(x==0)
+            {
+               lineStartValid = converged;
+               for(i=0; i<3; ++i) lineStart[i] = pars[i];
+            }
             // output = (warp-1)(input);
 
             outData[0]        = pars[0];
@@ -3366,6 +3501,7 @@ void reg_defFieldInvert(nifti_image *inputDeformationField,
    case NIFTI_TYPE_FLOAT64:
       reg_defFieldInvert3D<double>
             (inputDeformationField,outputDeformationField,tolerance);
+      break;
    default:
       reg_print_fct_error("reg_defFieldInvert");
       reg_print_msg_error("Deformation field pixel type unsupported");
@@ -3904,9 +4040,516 @@ void reg_spline_getFlowFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
    velocityFieldGrid->num_ext=oldNumExt;
 }
 /* *************************************************************** */
+/* Internal routines used by the scaling-and-squaring. The squaring   */
+/* steps alternate between two buffers. The first step reads the flow */
+/* field directly: the affine component is removed and the            */
+/* displacement is scaled as the field is interpolated. The last step */
+/* restores the affine component as the result is written             */
+/* *************************************************************** */
+/* Trilinear interpolation of a deformation field at the real-world position
+ * realDef, which is overwritten. A sliding effect is used outside of the field.
+ * If scaling is not zero, the field is a flow field. The affine deformation
+ * removedAffine (voxel to real) is then subtracted from its nodes and the
+ * result is the position plus the scaled interpolated displacement */
+template <class DTYPE>
+static inline void reg_defField_interpolate3D(DTYPE *realDef,
+                                              DTYPE *fieldPtrX,
+                                              DTYPE *fieldPtrY,
+                                              DTYPE *fieldPtrZ,
+                                              int *dim,
+                                              mat44 *real2Voxel,
+                                              mat44 *voxel2Real,
+                                              DTYPE scaling,
+                                              mat44 *removedAffine)
+{
+   DTYPE voxel[3], relX[2], relY[2], relZ[2], value[3], result[3], basis;
+   int pre[3], current[3], clamped[3], a, b, c, j;
+   size_t index;
+
+   for(j=0; j<3; ++j)
+      voxel[j] = real2Voxel->m[j][0] * realDef[0] +
+            real2Voxel->m[j][1] * realDef[1] +
+            real2Voxel->m[j][2] * realDef[2] +
+            real2Voxel->m[j][3];
+   for(j=0; j<3; ++j)
+      pre[j]=static_cast<int>(reg_floor(voxel[j]));
+   relX[1]=voxel[0]-static_cast<DTYPE>(pre[0]);
+   relX[0]=1.-relX[1];
+   relY[1]=voxel[1]-static_cast<DTYPE>(pre[1]);
+   relY[0]=1.-relY[1];
+   relZ[1]=voxel[2]-static_cast<DTYPE>(pre[2]);
+   relZ[0]=1.-relZ[1];
+
+   result[0]=result[1]=result[2]=0.;
+   if(scaling==0 &&
+         pre[0]>-1 && pre[0]<dim[1]-1 &&
+         pre[1]>-1 && pre[1]<dim[2]-1 &&
+         pre[2]>-1 && pre[2]<dim[3]-1)
+   {
+      // The whole neighbourhood is within the deformation field
+      size_t planeVoxelNumber=(size_t)dim[1]*dim[2];
+      size_t firstIndex=(size_t)pre[2]*planeVoxelNumber+(size_t)pre[1]*dim[1]+pre[0];
+      for(c=0; c<2; ++c)
+      {
+         for(b=0; b<2; ++b)
+         {
+            index=firstIndex+c*planeVoxelNumber+b*dim[1];
+            for(a=0; a<2; ++a)
+            {
+               basis = relX[a] * relY[b] * relZ[c];
+               result[0] += fieldPtrX[index+a] * basis;
+               result[1] += fieldPtrY[index+a] * basis;
+               result[2] += fieldPtrZ[index+a] * basis;
+            }
+         }
+      }
+      for(j=0; j<3; ++j)
+         realDef[j] = result[j];
+      return;
+   }
+   for(c=0; c<2; ++c)
+   {
+      current[2] = pre[2]+c;
+      clamped[2] = current[2]<0 ? 0 : (current[2]<dim[3] ? current[2] : dim[3]-1);
+      for(b=0; b<2; ++b)
+      {
+         current[1] = pre[1]+b;
+         clamped[1] = current[1]<0 ? 0 : (current[1]<dim[2] ? current[1] : dim[2]-1);
+         for(a=0; a<2; ++a)
+         {
+            current[0] = pre[0]+a;
+            clamped[0] = current[0]<0 ? 0 : (current[0]<dim[1] ? current[0] : dim[1]-1);
+            index=((size_t)clamped[2]*dim[2]+clamped[1])*dim[1]+clamped[0];
+            value[0] = fieldPtrX[index];
+            value[1] = fieldPtrY[index];
+            value[2] = fieldPtrZ[index];
+            if(scaling!=0)
+            {
+               // The displacement is constant outside of the field
+               for(j=0; j<3; ++j)
+                  value[j] -= removedAffine->m[j][0] * static_cast<DTYPE>(clamped[0]) +
+                        removedAffine->m[j][1] * static_cast<DTYPE>(clamped[1]) +
+                        removedAffine->m[j][2] * static_cast<DTYPE>(clamped[2]) +
+                        removedAffine->m[j][3];
+            }
+            else if(current[0]!=clamped[0] || current[1]!=clamped[1] || current[2]!=clamped[2])
+            {
+               // Uses a sliding effect
+               for(j=0; j<3; ++j)
+                  value[j] += voxel2Real->m[j][0] * (current[0]-clamped[0]) +
+                        voxel2Real->m[j][1] * (current[1]-clamped[1]) +
+                        voxel2Real->m[j][2] * (current[2]-clamped[2]);
+            }
+            basis = relX[a] * relY[b] * relZ[c];
+            result[0] += value[0] * basis;
+            result[1] += value[1] * basis;
+            result[2] += value[2] * basis;
+         }
+      }
+   }
+   if(scaling!=0)
+   {
+      for(j=0; j<3; ++j)
+         realDef[j] += scaling * result[j];
+   }
+   else
+   {
+      for(j=0; j<3; ++j)
+         realDef[j] = result[j];
+   }
+}
+/* *************************************************************** */
+template <class DTYPE>
+static inline void reg_defField_interpolate2D(DTYPE *realDef,
+                                              DTYPE *fieldPtrX,
+                                              DTYPE *fieldPtrY,
+                                              int *dim,
+                                              mat44 *real2Voxel,
+                                              mat44 *voxel2Real,
+                                              DTYPE scaling,
+                                              mat44 *removedAffine)
+{
+   DTYPE voxel[2], relX[2], relY[2], value[2], result[2], basis;
+   int pre[2], current[2], clamped[2], a, b, j;
+   size_t index;
+
+   for(j=0; j<2; ++j)
+      voxel[j] = real2Voxel->m[j][0] * realDef[0] +
+            real2Voxel->m[j][1] * realDef[1] +
+            real2Voxel->m[j][3];
+   for(j=0; j<2; ++j)
+      pre[j]=static_cast<int>(reg_floor(voxel[j]));
+   relX[1]=voxel[0]-static_cast<DTYPE>(pre[0]);
+   relX[0]=1.-relX[1];
+   relY[1]=voxel[1]-static_cast<DTYPE>(pre[1]);
+   relY[0]=1.-relY[1];
+
+   result[0]=result[1]=0.;
+   if(scaling==0 &&
+         pre[0]>-1 && pre[0]<dim[1]-1 &&
+         pre[1]>-1 && pre[1]<dim[2]-1)
+   {
+      // The whole neighbourhood is within the deformation field
+      size_t firstIndex=(size_t)pre[1]*dim[1]+pre[0];
+      for(b=0; b<2; ++b)
+      {
+         index=firstIndex+b*dim[1];
+         for(a=0; a<2; ++a)
+         {
+            basis = relX[a] * relY[b];
+            result[0] += fieldPtrX[index+a] * basis;
+            result[1] += fieldPtrY[index+a] * basis;
+         }
+      }
+      realDef[0] = result[0];
+      realDef[1] = result[1];
+      return;
+   }
+   for(b=0; b<2; ++b)
+   {
+      current[1] = pre[1]+b;
+      clamped[1] = current[1]<0 ? 0 : (current[1]<dim[2] ? current[1] : dim[2]-1);
+      for(a=0; a<2; ++a)
+      {
+         current[0] = pre[0]+a;
+         clamped[0] = current[0]<0 ? 0 : (current[0]<dim[1] ? current[0] : dim[1]-1);
+         index=(size_t)clamped[1]*dim[1]+clamped[0];
+         value[0] = fieldPtrX[index];
+         value[1] = fieldPtrY[index];
+         if(scaling!=0)
+         {
+            // The displacement is constant outside of the field
+            for(j=0; j<2; ++j)
+               value[j] -= removedAffine->m[j][0] * static_cast<DTYPE>(clamped[0]) +
+                     removedAffine->m[j][1] * static_cast<DTYPE>(clamped[1]) +
+                     removedAffine->m[j][3];
+         }
+         else if(current[0]!=clamped[0] || current[1]!=clamped[1])
+         {
+            // Uses a sliding effect
+            for(j=0; j<2; ++j)
+               value[j] += voxel2Real->m[j][0] * (current[0]-clamped[0]) +
+                     voxel2Real->m[j][1] * (current[1]-clamped[1]);
+         }
+         basis = relX[a] * relY[b];
+         result[0] += value[0] * basis;
+         result[1] += value[1] * basis;
+      }
+   }
+   if(scaling!=0)
+   {
+      for(j=0; j<2; ++j)
+         realDef[j] += scaling * result[j];
+   }
+   else
+   {
+      for(j=0; j<2; ++j)
+         realDef[j] = result[j];
+   }
+}
+/* *************************************************************** */
+/* One squaring step: the field defined by fieldImage and fieldData is
+ * evaluated at every voxel of outputImage and stored in outputData.
+ * The positions are read from positionData, or are the voxel positions if
+ * positionData is NULL. If scaling is not zero, fieldData and positionData
+ * both point to the flow field, which is defined on the output grid.
+ * If restoredAffine is not NULL, the affine deformation it describes
+ * (voxel to real) replaces the identity in the output */
+template <class DTYPE>
+void reg_defField_squaringStep(nifti_image *fieldImage,
+                               DTYPE *fieldData,
+                               nifti_image *outputImage,
+                               DTYPE *outputData,
+                               DTYPE *positionData,
+                               DTYPE scaling,
+                               mat44 *removedAffine,
+                               mat44 *restoredAffine)
+{
+   size_t fieldVoxelNumber=(size_t)fieldImage->nx*fieldImage->ny*fieldImage->nz;
+   size_t outputVoxelNumber=(size_t)outputImage->nx*outputImage->ny*outputImage->nz;
+   int nDim = fieldImage->nu==2 ? 2 : 3;
+
+   mat44 *real2Voxel, *voxel2Real, *outputVoxel2Real;
+   if(fieldImage->sform_code>0)
+   {
+      real2Voxel=&(fieldImage->sto_ijk);
+      voxel2Real=&(fieldImage->sto_xyz);
+   }
+   else
+   {
+      real2Voxel=&(fieldImage->qto_ijk);
+      voxel2Real=&(fieldImage->qto_xyz);
+   }
+   if(outputImage->sform_code>0)
+      outputVoxel2Real=&(outputImage->sto_xyz);
+   else outputVoxel2Real=&(outputImage->qto_xyz);
+
+   DTYPE *fieldPtrX = fieldData;
+   DTYPE *fieldPtrY = &fieldPtrX[fieldVoxelNumber];
+   DTYPE *fieldPtrZ = nDim==3 ? &fieldPtrY[fieldVoxelNumber] : NULL;
+
+   int x, y, z, j;
+   size_t index;
+   DTYPE realDef[3], voxelPosition[3], voxel[3];
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(fieldImage, outputImage, outputData, positionData, scaling, \
+   removedAffine, restoredAffine, real2Voxel, voxel2Real, outputVoxel2Real, \
+   fieldPtrX, fieldPtrY, fieldPtrZ, outputVoxelNumber, nDim) \
+   private(x, y, z, j, index, realDef, voxelPosition, voxel)
+#endif
+   for(z=0; z<outputImage->nz; ++z)
+   {
+      index=(size_t)z*outputImage->nx*outputImage->ny;
+      voxel[2]=z;
+      for(y=0; y<outputImage->ny; ++y)
+      {
+         voxel[1]=y;
+         for(x=0; x<outputImage->nx; ++x)
+         {
+            voxel[0]=x;
+            for(j=0; j<nDim; ++j)
+               voxelPosition[j] = outputVoxel2Real->m[j][0] * voxel[0] +
+                     outputVoxel2Real->m[j][1] * voxel[1] +
+                     outputVoxel2Real->m[j][2] * voxel[2] +
+                     outputVoxel2Real->m[j][3];
+            if(positionData==NULL)
+            {
+               for(j=0; j<nDim; ++j)
+                  realDef[j] = voxelPosition[j];
+            }
+            else if(scaling!=0)
+            {
+               // The scaled deformation is computed from the flow field
+               for(j=0; j<nDim; ++j)
+                  realDef[j] = voxelPosition[j] + scaling * (positionData[index+j*outputVoxelNumber] -
+                        (removedAffine->m[j][0] * voxel[0] +
+                         removedAffine->m[j][1] * voxel[1] +
+                         removedAffine->m[j][2] * voxel[2] +
+                         removedAffine->m[j][3]));
+            }
+            else
+            {
+               for(j=0; j<nDim; ++j)
+                  realDef[j] = positionData[index+j*outputVoxelNumber];
+            }
+
+            if(nDim==3)
+               reg_defField_interpolate3D<DTYPE>(realDef, fieldPtrX, fieldPtrY, fieldPtrZ,
+                                                 fieldImage->dim, real2Voxel, voxel2Real,
+                                                 scaling, removedAffine);
+            else
+               reg_defField_interpolate2D<DTYPE>(realDef, fieldPtrX, fieldPtrY,
+                                                 fieldImage->dim, real2Voxel, voxel2Real,
+                                                 scaling, removedAffine);
+
+            if(restoredAffine!=NULL)
+            {
+               for(j=0; j<nDim; ++j)
+                  realDef[j] += restoredAffine->m[j][0] * voxel[0] +
+                        restoredAffine->m[j][1] * voxel[1] +
+                        restoredAffine->m[j][2] * voxel[2] +
+                        restoredAffine->m[j][3] -
+                        voxelPosition[j];
+            }
+            for(j=0; j<nDim; ++j)
+               outputData[index+j*outputVoxelNumber] = realDef[j];
+            ++index;
+         }
+      }
+   }
+}
+/* *************************************************************** */
+/* Largest absolute value of the displacements of a flow field, once the
+ * affine deformation removedAffine (voxel to real) is subtracted */
+template <class DTYPE>
+float reg_defField_getFlowFieldExtremum(nifti_image *flowFieldImage,
+                                        mat44 *removedAffine)
+{
+   size_t voxelNumber=(size_t)flowFieldImage->nx*flowFieldImage->ny*flowFieldImage->nz;
+   int nDim = flowFieldImage->nu==2 ? 2 : 3;
+   DTYPE *flowPtr = static_cast<DTYPE *>(flowFieldImage->data);
+   float minValue=std::numeric_limits<float>::max();
+   float maxValue=-std::numeric_limits<float>::max();
+   float value;
+   size_t index=0;
+   for(int z=0; z<flowFieldImage->nz; ++z)
+   {
+      for(int y=0; y<flowFieldImage->ny; ++y)
+      {
+         for(int x=0; x<flowFieldImage->nx; ++x)
+         {
+            for(int j=0; j<nDim; ++j)
+            {
+               value = static_cast<DTYPE>(flowPtr[index+j*voxelNumber] -
+                     (removedAffine->m[j][0] * x +
+                      removedAffine->m[j][1] * y +
+                      removedAffine->m[j][2] * z +
+                      removedAffine->m[j][3]));
+               minValue=value<minValue?value:minValue;
+               maxValue=value>maxValue?value:maxValue;
+            }
+            ++index;
+         }
+      }
+   }
+   minValue=fabsf(minValue);
+   return minValue>maxValue?minValue:maxValue;
+}
+/* *************************************************************** */
+/* Creates a field with about half the resolution of the input. Its first
+ * and last nodes are at the same positions as those of the input field */
+static nifti_image *reg_defField_createCoarseField(nifti_image *field)
+{
+   nifti_image *coarseField = nifti_copy_nim_info(field);
+   float factor;
+   for(int i=1; i<=3; ++i)
+   {
+      if(field->dim[i]<2) continue;
+      coarseField->dim[i]=field->dim[i]/2+1;
+      factor=static_cast<float>(field->dim[i]-1)/static_cast<float>(coarseField->dim[i]-1);
+      coarseField->pixdim[i]=factor*field->pixdim[i];
+      for(int j=0; j<3; ++j)
+      {
+         coarseField->qto_xyz.m[j][i-1]*=factor;
+         coarseField->sto_xyz.m[j][i-1]*=factor;
+      }
+   }
+   coarseField->nx=coarseField->dim[1];
+   coarseField->ny=coarseField->dim[2];
+   coarseField->nz=coarseField->dim[3];
+   coarseField->dx=coarseField->pixdim[1];
+   coarseField->dy=coarseField->pixdim[2];
+   coarseField->dz=coarseField->pixdim[3];
+   coarseField->qto_ijk=nifti_mat44_inverse(coarseField->qto_xyz);
+   coarseField->sto_ijk=nifti_mat44_inverse(coarseField->sto_xyz);
+   coarseField->nvox=(size_t)coarseField->nx*coarseField->ny*coarseField->nz*coarseField->nt*coarseField->nu;
+   coarseField->data=(void *)malloc(coarseField->nvox*coarseField->nbyper);
+   return coarseField;
+}
+/* *************************************************************** */
+template <class DTYPE>
+void reg_defField_scalingAndSquaring(nifti_image *flowFieldImage,
+                                     nifti_image *deformationFieldImage,
+                                     int squaringNumber,
+                                     DTYPE scaling,
+                                     mat44 *removedAffine,
+                                     mat44 *restoredAffine,
+                                     bool coarseSquaring)
+{
+   // The squaring is computed on the grid of the flow field or on a coarser one
+   nifti_image *squaringImage = flowFieldImage;
+   nifti_image *coarseImage = NULL;
+   DTYPE *buffer[2], *temporaryBuffer=NULL;
+   if(coarseSquaring)
+   {
+      coarseImage = reg_defField_createCoarseField(flowFieldImage);
+      squaringImage = coarseImage;
+      // The flow field is interpolated at the nodes of the coarse grid
+      reg_defField_squaringStep<DTYPE>(flowFieldImage,
+                                       static_cast<DTYPE *>(flowFieldImage->data),
+                                       coarseImage,
+                                       static_cast<DTYPE *>(coarseImage->data),
+                                       NULL, 0, NULL, NULL);
+      buffer[0] = static_cast<DTYPE *>(coarseImage->data);
+      buffer[1] = (DTYPE *)malloc(coarseImage->nvox*sizeof(DTYPE));
+   }
+   else
+   {
+      // The last step has to be written in the deformation field. When the
+      // number of steps is even, a third buffer is required since the flow
+      // field is read by the first step
+      if(squaringNumber%2==1)
+      {
+         buffer[0] = static_cast<DTYPE *>(flowFieldImage->data);
+         buffer[1] = static_cast<DTYPE *>(deformationFieldImage->data);
+      }
+      else
+      {
+         buffer[0] = static_cast<DTYPE *>(deformationFieldImage->data);
+         if(squaringNumber>0)
+            temporaryBuffer = (DTYPE *)malloc(deformationFieldImage->nvox*sizeof(DTYPE));
+         buffer[1] = temporaryBuffer;
+      }
+   }
+
+   // Voxel to real matrices of the affine components on the squaring grid
+   mat44 *squaringVoxel2Real;
+   if(squaringImage->sform_code>0)
+      squaringVoxel2Real=&(squaringImage->sto_xyz);
+   else squaringVoxel2Real=&(squaringImage->qto_xyz);
+   mat44 removedVoxel2Real = reg_mat44_mul(removedAffine, squaringVoxel2Real);
+   mat44 restoredVoxel2Real;
+   mat44 *restored=NULL;
+   if(restoredAffine!=NULL && !coarseSquaring)
+   {
+      restoredVoxel2Real = reg_mat44_mul(restoredAffine, squaringVoxel2Real);
+      restored=&restoredVoxel2Real;
+   }
+
+   DTYPE *flowData = coarseSquaring ? buffer[0] : static_cast<DTYPE *>(flowFieldImage->data);
+   DTYPE *input = flowData;
+   DTYPE *output = NULL;
+   for(int i=0; i<squaringNumber; ++i)
+   {
+      output = buffer[(i+1)%2];
+      if(i==0)
+         // The flow field is scaled and composed with itself
+         reg_defField_squaringStep<DTYPE>(squaringImage, flowData,
+                                          squaringImage, output, flowData,
+                                          scaling, &removedVoxel2Real,
+                                          i==squaringNumber-1 ? restored : NULL);
+      else
+         // The deformation field is applied to itself
+         reg_defField_squaringStep<DTYPE>(squaringImage, input,
+                                          squaringImage, output, input,
+                                          0, NULL,
+                                          i==squaringNumber-1 ? restored : NULL);
+      input = output;
+#ifndef NDEBUG
+      char text[255];
+      sprintf(text, "Squaring (composition) step %i/%i", i+1, squaringNumber);
+      reg_print_msg_debug(text);
+#endif
+   }
+
+   if(coarseSquaring || squaringNumber==0)
+   {
+      // The result is interpolated onto the deformation field grid
+      mat44 *outputVoxel2Real;
+      if(deformationFieldImage->sform_code>0)
+         outputVoxel2Real=&(deformationFieldImage->sto_xyz);
+      else outputVoxel2Real=&(deformationFieldImage->qto_xyz);
+      if(restoredAffine!=NULL)
+      {
+         restoredVoxel2Real = reg_mat44_mul(restoredAffine, outputVoxel2Real);
+         restored=&restoredVoxel2Real;
+      }
+      if(squaringNumber==0)
+         reg_defField_squaringStep<DTYPE>(squaringImage, flowData,
+                                          deformationFieldImage,
+                                          static_cast<DTYPE *>(deformationFieldImage->data),
+                                          NULL, scaling, &removedVoxel2Real, restored);
+      else
+         reg_defField_squaringStep<DTYPE>(squaringImage, input,
+                                          deformationFieldImage,
+                                          static_cast<DTYPE *>(deformationFieldImage->data),
+                                          NULL, 0, NULL, restored);
+   }
+
+   if(coarseSquaring)
+   {
+      free(buffer[1]);
+      nifti_image_free(coarseImage);
+   }
+   if(temporaryBuffer!=NULL)
+      free(temporaryBuffer);
+}
+/* *************************************************************** */
 void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
                                                    nifti_image *deformationFieldImage,
-                                                   bool updateStepNumber)
+                                                   bool updateStepNumber,
+                                                   bool coarseSquaring)
 {
    // Check first if the velocity field is actually a velocity field
    if(flowFieldImage->intent_p1 != DEF_VEL_FIELD)
@@ -3915,32 +4558,48 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
       reg_print_msg_error("The provide field is not a velocity field");
       reg_exit(1);
    }
+   if(flowFieldImage->datatype != deformationFieldImage->datatype)
+   {
+      reg_print_fct_error("reg_defField_getDeformationFieldFromFlowField");
+      reg_print_msg_error("Both fields are expected to have the same type");
+      reg_exit(1);
+   }
+   if(flowFieldImage->datatype != NIFTI_TYPE_FLOAT32 && flowFieldImage->datatype != NIFTI_TYPE_FLOAT64)
+   {
+      reg_print_fct_error("reg_defField_getDeformationFieldFromFlowField");
+      reg_print_msg_error("Deformation field pixel type unsupported");
+      reg_exit(1);
+   }
 
-   // Remove the affine component from the flow field
-   nifti_image *affineOnly=NULL;
+   // The affine component of the flow field, if any, is removed during the
+   // first squaring step and restored during the last one
+   mat44 removedAffine, *restoredAffine=NULL;
+   reg_mat44_eye(&removedAffine);
    if(flowFieldImage->num_ext>0)
    {
       if(flowFieldImage->ext_list[0].edata!=NULL)
       {
-         // Create a field that contains the affine component only
-         affineOnly = nifti_copy_nim_info(deformationFieldImage);
-         affineOnly->data = (void *)calloc(affineOnly->nvox,affineOnly->nbyper);
-         reg_affine_getDeformationField(reinterpret_cast<mat44 *>(flowFieldImage->ext_list[0].edata),
-               affineOnly,
-               false);
-         reg_tools_substractImageToImage(flowFieldImage,affineOnly,flowFieldImage);
+         restoredAffine = reinterpret_cast<mat44 *>(flowFieldImage->ext_list[0].edata);
+         removedAffine = *restoredAffine;
       }
+      // The flow field is otherwise used as a displacement field
+      else memset(&removedAffine, 0, sizeof(mat44));
    }
-   else reg_getDisplacementFromDeformation(flowFieldImage);
 
    // Compute the number of scaling value to ensure unfolded transformation
    int squaringNumber = 1;
    if(updateStepNumber || flowFieldImage->intent_p2==0)
    {
       // Check the largest value
-      float extrema = fabsf(reg_tools_getMinValue(flowFieldImage));
-      float temp = reg_tools_getMaxValue(flowFieldImage);
-      extrema=extrema>temp?extrema:temp;
+      mat44 *flowVoxel2Real;
+      if(flowFieldImage->sform_code>0)
+         flowVoxel2Real=&(flowFieldImage->sto_xyz);
+      else flowVoxel2Real=&(flowFieldImage->qto_xyz);
+      mat44 removedVoxel2Real = reg_mat44_mul(&removedAffine, flowVoxel2Real);
+      float extrema;
+      if(flowFieldImage->datatype==NIFTI_TYPE_FLOAT32)
+         extrema = reg_defField_getFlowFieldExtremum<float>(flowFieldImage, &removedVoxel2Real);
+      else extrema = reg_defField_getFlowFieldExtremum<double>(flowFieldImage, &removedVoxel2Real);
       // Check the values for scaling purpose
       float maxLength;
       if(deformationFieldImage->nz>1)
@@ -3973,50 +4632,33 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
    }
    else squaringNumber=static_cast<int>(fabsf(flowFieldImage->intent_p2));
 
-   // The displacement field is scaled
+   // The squaring is only computed on a coarser grid if it is large enough
+   if(deformationFieldImage->nx<4 || deformationFieldImage->ny<4 ||
+         (deformationFieldImage->nz>1 && deformationFieldImage->nz<4))
+      coarseSquaring=false;
+
+   // The displacement field is scaled down, and negated for a backward
+   // deformation field, as part of the first squaring step
    float scalingValue = pow(2.0f,std::abs(squaringNumber));
    if(flowFieldImage->intent_p2<0)
-      // backward deformation field is scaled down
-      reg_tools_divideValueToImage(flowFieldImage,
-                                   flowFieldImage,
-                                   -scalingValue); // (/-scalingValue)
+      scalingValue = -scalingValue;
+   if(flowFieldImage->datatype==NIFTI_TYPE_FLOAT32)
+      reg_defField_scalingAndSquaring<float>(flowFieldImage,
+                                             deformationFieldImage,
+                                             squaringNumber,
+                                             1.f/scalingValue,
+                                             &removedAffine,
+                                             restoredAffine,
+                                             coarseSquaring);
    else
-      // forward deformation field is scaled down
-      reg_tools_divideValueToImage(flowFieldImage,
-                                   flowFieldImage,
-                                   scalingValue); // (/scalingValue)
-
-   // Conversion from displacement to deformation
-   reg_getDeformationFromDisplacement(flowFieldImage);
-
-   // The computed scaled deformation field is copied over
-   memcpy(deformationFieldImage->data, flowFieldImage->data,
-          deformationFieldImage->nvox*deformationFieldImage->nbyper);
-
-   // The deformation field is squared
-   for(unsigned short i=0; i<squaringNumber; ++i)
-   {
-      // The deformation field is applied to itself
-      reg_defField_compose(deformationFieldImage,
-                           flowFieldImage,
-                           NULL);
-      // The computed scaled deformation field is copied over
-      memcpy(deformationFieldImage->data, flowFieldImage->data,
-             deformationFieldImage->nvox*deformationFieldImage->nbyper);
-#ifndef NDEBUG
-      char text[255];
-      sprintf(text, "Squaring (composition) step %u/%u", i+1, squaringNumber);
-      reg_print_msg_debug(text);
-#endif
-   }
-   // The affine conponent of the transformation is restored
-   if(affineOnly!=NULL)
-   {
-      reg_getDisplacementFromDeformation(deformationFieldImage);
-      reg_tools_addImageToImage(deformationFieldImage,affineOnly,deformationFieldImage);
-      nifti_image_free(affineOnly);
-      affineOnly=NULL;
-   }
+      reg_defField_scalingAndSquaring<double>(flowFieldImage,
+                                              deformationFieldImage,
+                                              squaringNumber,
+                                              1.0/scalingValue,
+                                              &removedAffine,
+                                              restoredAffine,
+                                              coarseSquaring);
+
    deformationFieldImage->intent_p1=DEF_FIELD;
    deformationFieldImage->intent_p2=0;
    // If required an affine component is composed
@@ -4030,7 +4672,8 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
 /* *************************************************************** */
 void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
                                             nifti_image *deformationFieldImage,
-                                            bool updateStepNumber)
+                                            bool updateStepNumber,
+                                            bool coarseSquaring)
 {
    // Check if the velocity field is actually a velocity field
    if(velocityFieldGrid->intent_p1 == SPLINE_GRID)
@@ -4062,7 +4705,8 @@ void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
       // Exponentiate the flow field
       reg_defField_getDeformationFieldFromFlowField(flowField,
                                                     deformationFieldImage,
-                                                    updateStepNumber);
+                                                    updateStepNumber,
+                                                    coarseSquaring);
       // Update the number of step required. No action otherwise
       velocityFieldGrid->intent_p2=flowField->intent_p2;
       // Clear the allocated flow field
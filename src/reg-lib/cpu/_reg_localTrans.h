@@ -323,10 +323,22 @@ void reg_defFieldInvert(nifti_image *inputDeformationField,
                         nifti_image *outputDeformationField,
                         float tolerance);
 /* *************************************************************** */
+/** @brief The deformation field is computed by exponentiating a flow
+ * field using scaling-and-squaring
+ * @param flowFieldImage Image that contains the flow field. Its content
+ * may be overwritten
+ * @param deformationFieldImage Deformation field image that will be
+ * filled using the exponentiation of the flow field
+ * @param updateStepNumber The number of squaring steps is updated
+ * from the largest displacement if true
+ * @param coarseSquaring The squaring steps are computed on a grid of
+ * half the resolution of the flow field, and the result is interpolated
+ */
 extern "C++"
 void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
                                                    nifti_image *deformationFieldImage,
-                                                   bool updateStepNumber);
+                                                   bool updateStepNumber,
+                                                   bool coarseSquaring = false);
 /* *********************************************** */
 /* ****     FLOW BASED FUNCTIONS    **** */
 /* *********************************************** */
@@ -371,11 +383,15 @@ int reg_spline_GetJacobianDetFromVelocityGrid(nifti_image *jacobianDetImage,
  * parametrised using a grid of control points
  * @param deformationFieldImage Deformation field image that will
  * be filled using the exponentiation of the velocity field.
+ * @param updateStepNumber The number of squaring steps is updated
+ * from the largest displacement if true
+ * @param coarseSquaring The squaring steps are computed on a coarser grid
  */
 extern "C++"
 void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
                                             nifti_image *deformationFieldImage,
-                                            bool updateStepNumber);
+                                            bool updateStepNumber,
+                                            bool coarseSquaring = false);
 /* *************************************************************** */
 extern "C++"
 void reg_spline_getIntermediateDefFieldFromVelGrid(nifti_image *velocityFieldGrid,
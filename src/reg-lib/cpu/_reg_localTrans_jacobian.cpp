@@ -539,118 +539,15 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
          useHeaderInformation=true;
 
       // Allocate variables that are used in both scenarii
-      int pre[3], oldPre[3], incr0;
+      int pre[3], oldPre[3], coord, incr0, incr1;
       DTYPE basis, xBasis[4], xFirst[4], yBasis[4], yFirst[4], zBasis[4], zFirst[4];
-#if _USE_SSE
-      union
-      {
-         __m128 m;
-         float f[4];
-      } val;
-      __m128 _xBasis, _xFirst, _yBasis, _yFirst;
-      __m128 tempX_x, tempX_y, tempX_z, tempY_x, tempY_y, tempY_z, tempZ_x, tempZ_y, tempZ_z;
-#ifdef _WINDOWS
-      union
-      {
-         __m128 m[4];
-         __declspec(align(16)) DTYPE f[16];
-      } tempX;
-      union
-      {
-         __m128 m[4];
-         __declspec(align(16)) DTYPE f[16];
-      } tempY;
-      union
-      {
-         __m128 m[4];
-         __declspec(align(16)) DTYPE f[16];
-      } tempZ;
-      union
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } basisX;
-      union
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } basisY;
-      union
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } basisZ;
-      union
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } coeffX;
-      union
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } coeffY;
-      union
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } coeffZ;
-#else // _WINDOWS
-      union
-      {
-         __m128 m[4];
-         DTYPE f[16] __attribute__((aligned(16)));
-      } tempX;
-      union
-      {
-         __m128 m[4];
-         DTYPE f[16] __attribute__((aligned(16)));
-      } tempY;
-      union
-      {
-         __m128 m[4];
-         DTYPE f[16] __attribute__((aligned(16)));
-      } tempZ;
-      memset(&(tempX.f[0]),0,16*sizeof(float));
-      memset(&(tempY.f[0]),0,16*sizeof(float));
-      memset(&(tempZ.f[0]),0,16*sizeof(float));
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } basisX;
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } basisY;
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } basisZ;
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } coeffX;
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } coeffY;
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } coeffZ;
-#endif // _WINDOWS
-#else
-      int coord, incr1, incr2;
       DTYPE tempX[16], tempY[16], tempZ[16];
-      DTYPE basisX[64], basisY[64], basisZ[64];
       DTYPE coeffX[64], coeffY[64], coeffZ[64];
-#endif
+      DTYPE firstX[3], firstY[3], firstZ[3];
+
+      // The nine sums are obtained as three tensor products, one per derivative
+      typename reg_splineTensorProduct<DTYPE>::Function tensorProduct=reg_spline_getTensorProduct<DTYPE>();
+
       DTYPE gridVoxelSpacing[3]=
       {
          splineControlPoint->dx / referenceImage->dx,
@@ -658,7 +555,6 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
          splineControlPoint->dz / referenceImage->dz
       };
       size_t voxelIndex;
-
       if(useHeaderInformation)
       {
          // The reference image is not necessarly aligned with the grid
@@ -676,7 +572,6 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
          if(splineControlPoint->sform_code>0)
             transformation=reg_mat44_mul(&(splineControlPoint->sto_ijk), &transformation);
          else transformation=reg_mat44_mul(&(splineControlPoint->qto_ijk), &transformation);
-
          float imageCoord[3], gridCoord[3], basis;
          for(z=0; z<referenceImage->nz; z++)
          {
@@ -702,79 +597,21 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
                   get_BSplineBasisValues<DTYPE>(basis, yBasis, yFirst);
                   basis = gridCoord[2] - pre[2];
                   get_BSplineBasisValues<DTYPE>(basis, zBasis, zFirst);
-                  // Compute the 64 basis values and the corresponding derivatives
-#if _USE_SSE
-                  val.f[0]=yBasis[0];
-                  val.f[1]=yBasis[1];
-                  val.f[2]=yBasis[2];
-                  val.f[3]=yBasis[3];
-                  _yBasis=val.m;
-                  val.f[0]=yFirst[0];
-                  val.f[1]=yFirst[1];
-                  val.f[2]=yFirst[2];
-                  val.f[3]=yFirst[3];
-                  _yFirst=val.m;
-                  for(incr0=0; incr0<4; ++incr0)
-                  {
-                     val.m=_mm_set_ps1(zBasis[incr0]);
-                     tempX.m[incr0]=_mm_mul_ps(_yBasis,val.m);
-                     tempY.m[incr0]=_mm_mul_ps(_yFirst,val.m);
-                     val.m=_mm_set_ps1(zFirst[incr0]);
-                     tempZ.m[incr0]=_mm_mul_ps(_yBasis,val.m);
-                  }
-                  val.f[0]=xBasis[0];
-                  val.f[1]=xBasis[1];
-                  val.f[2]=xBasis[2];
-                  val.f[3]=xBasis[3];
-                  _xBasis=val.m;
-                  val.f[0]=xFirst[0];
-                  val.f[1]=xFirst[1];
-                  val.f[2]=xFirst[2];
-                  val.f[3]=xFirst[3];
-                  _xFirst=val.m;
-                  for(incr0=0; incr0<16; ++incr0)
-                  {
-                     val.m=_mm_set_ps1(tempX.f[incr0]);
-                     basisX.m[incr0]=_mm_mul_ps(_xFirst,val.m);
-                     val.m=_mm_set_ps1(tempY.f[incr0]);
-                     basisY.m[incr0]=_mm_mul_ps(_xBasis,val.m);
-                     val.m=_mm_set_ps1(tempZ.f[incr0]);
-                     basisZ.m[incr0]=_mm_mul_ps(_xBasis,val.m);
-                  }
-#else
+                  // Compute the 16 products along y and z and the corresponding derivatives
                   coord=0;
                   for(incr0=0; incr0<4; incr0++)
                   {
                      for(incr1=0; incr1<4; incr1++)
                      {
-                        for(incr2=0; incr2<4; incr2++)
-                        {
-                           basisX[coord]=zBasis[incr0]*yBasis[incr1]*xFirst[incr2]; // z * y * x'
-                           basisY[coord]=zBasis[incr0]*yFirst[incr1]*xBasis[incr2]; // z * y' * x
-                           basisZ[coord]=zFirst[incr0]*yBasis[incr1]*xBasis[incr2]; // z' * y * x
-                           ++coord;
-                        }
+                        tempX[coord]=zBasis[incr0]*yBasis[incr1]; // z * y
+                        tempY[coord]=zBasis[incr0]*yFirst[incr1]; // z * y'
+                        tempZ[coord]=zFirst[incr0]*yBasis[incr1]; // z'* y
+                        coord++;
                      }
                   }
-#endif
                   // Fetch the required coefficients
                   if(oldPre[0]!=pre[0] || oldPre[1]!=pre[1] || oldPre[2]!=pre[2])
                   {
-#ifdef _USE_SSE
-                     get_GridValues<DTYPE>(pre[0]-1,
-                           pre[1]-1,
-                           pre[2]-1,
-                           splineControlPoint,
-                           coeffPtrX,
-                           coeffPtrY,
-                           coeffPtrZ,
-                           coeffX.f,
-                           coeffY.f,
-                           coeffZ.f,
-                           false, // no approx
-                           false // not disp
-                           );
-#else // _USE_SSE
                      get_GridValues<DTYPE>(pre[0]-1,
                            pre[1]-1,
                            pre[2]-1,
@@ -788,72 +625,20 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
                            false, // no approx
                            false // not disp
                            );
-#endif // _USE_SSE
                      oldPre[0]=pre[0];
                      oldPre[1]=pre[1];
                      oldPre[2]=pre[2];
                   }
                   // Compute the Jacobian matrix
-#if _USE_SSE
-                  tempX_x =  _mm_set_ps1(0.0);
-                  tempX_y =  _mm_set_ps1(0.0);
-                  tempX_z =  _mm_set_ps1(0.0);
-                  tempY_x =  _mm_set_ps1(0.0);
-                  tempY_y =  _mm_set_ps1(0.0);
-                  tempY_z =  _mm_set_ps1(0.0);
-                  tempZ_x =  _mm_set_ps1(0.0);
-                  tempZ_y =  _mm_set_ps1(0.0);
-                  tempZ_z =  _mm_set_ps1(0.0);
-                  //addition and multiplication of the 16 basis value and CP position for each axis
-                  for(incr0=0; incr0<16; ++incr0)
+                  tensorProduct(xFirst, tempX, coeffX, coeffY, coeffZ, firstX); // z * y * x'
+                  tensorProduct(xBasis, tempY, coeffX, coeffY, coeffZ, firstY); // z * y'* x
+                  tensorProduct(xBasis, tempZ, coeffX, coeffY, coeffZ, firstZ); // z'* y * x
+                  for(incr0=0; incr0<3; ++incr0)
                   {
-                     tempX_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffX.m[incr0]), tempX_x );
-                     tempX_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffX.m[incr0]), tempX_y );
-                     tempX_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffX.m[incr0]), tempX_z );
-
-                     tempY_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffY.m[incr0]), tempY_x );
-                     tempY_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffY.m[incr0]), tempY_y );
-                     tempY_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffY.m[incr0]), tempY_z );
-
-                     tempZ_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffZ.m[incr0]), tempZ_x );
-                     tempZ_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffZ.m[incr0]), tempZ_y );
-                     tempZ_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffZ.m[incr0]), tempZ_z );
+                     jacobianMatrix.m[incr0][0] = firstX[incr0];
+                     jacobianMatrix.m[incr0][1] = firstY[incr0];
+                     jacobianMatrix.m[incr0][2] = firstZ[incr0];
                   }
-
-                  //the values stored in SSE variables are transfered to normal float
-                  val.m = tempX_x;
-                  jacobianMatrix.m[0][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_y;
-                  jacobianMatrix.m[0][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_z;
-                  jacobianMatrix.m[0][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_x;
-                  jacobianMatrix.m[1][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_y;
-                  jacobianMatrix.m[1][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_z;
-                  jacobianMatrix.m[1][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_x;
-                  jacobianMatrix.m[2][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_y;
-                  jacobianMatrix.m[2][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_z;
-                  jacobianMatrix.m[2][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-#else
-                  memset(&jacobianMatrix, 0, sizeof(mat33));
-                  for(incr0=0; incr0<64; ++incr0)
-                  {
-                     jacobianMatrix.m[0][0] += basisX[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][1] += basisY[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][2] += basisZ[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[1][0] += basisX[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][1] += basisY[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][2] += basisZ[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[2][0] += basisX[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][1] += basisY[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][2] += basisZ[incr0]*coeffZ[incr0];
-                  }
-#endif
                   // reorient the matrix
                   jacobianMatrix=nifti_mat33_mul(reorientation,
                                                  jacobianMatrix);
@@ -871,23 +656,11 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
       {
          // The grid is assumed to be aligned with the reference image
 #ifdef _OPENMP
-#ifdef _USE_SSE
 #pragma omp parallel for default(shared) \
-   private(x, y, z, pre, oldPre, basis, val, \
-   _xBasis, _xFirst, _yBasis, _yFirst, \
-   tempX, tempY, tempZ, basisX, basisY, basisZ, \
+   private(x, y, z, pre, oldPre, basis, coord, tempX, tempY, tempZ, \
    xBasis, xFirst, yBasis, yFirst, zBasis, zFirst, \
-   coeffX, coeffY, coeffZ, incr0, \
-   jacobianMatrix, voxelIndex, \
-   tempX_x, tempX_y, tempX_z, tempY_x, tempY_y, tempY_z, tempZ_x, tempZ_y, tempZ_z)
-#else // _USE_SEE
-#pragma omp parallel for default(shared) \
-   private(x, y, z, pre, oldPre, basis, \
-   basisX, basisY, basisZ, coord, tempX, tempY, tempZ, \
-   xBasis, xFirst, yBasis, yFirst, zBasis, zFirst, \
-   coeffX, coeffY, coeffZ, incr0, incr1, incr2, \
+   coeffX, coeffY, coeffZ, firstX, firstY, firstZ, incr0, incr1, \
    jacobianMatrix, voxelIndex)
-#endif // _USE_SEE
 #endif // _USE_OPENMP
          for(z=0; z<referenceImage->nz; z++)
          {
@@ -907,26 +680,6 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
                if(basis<0.0) basis=0.0; //rounding error
                get_BSplineBasisValues<DTYPE>(basis, yBasis, yFirst);
 
-#if _USE_SSE
-               val.f[0]=yBasis[0];
-               val.f[1]=yBasis[1];
-               val.f[2]=yBasis[2];
-               val.f[3]=yBasis[3];
-               _yBasis=val.m;
-               val.f[0]=yFirst[0];
-               val.f[1]=yFirst[1];
-               val.f[2]=yFirst[2];
-               val.f[3]=yFirst[3];
-               _yFirst=val.m;
-               for(incr0=0; incr0<4; ++incr0)
-               {
-                  val.m=_mm_set_ps1(zBasis[incr0]);
-                  tempX.m[incr0]=_mm_mul_ps(_yBasis,val.m);
-                  tempY.m[incr0]=_mm_mul_ps(_yFirst,val.m);
-                  val.m=_mm_set_ps1(zFirst[incr0]);
-                  tempZ.m[incr0]=_mm_mul_ps(_yBasis,val.m);
-               }
-#else
                coord=0;
                for(incr0=0; incr0<4; incr0++)
                {
@@ -938,7 +691,6 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
                      coord++;
                   }
                }
-#endif
                for(x=0; x<referenceImage->nx; x++)
                {
 
@@ -947,57 +699,8 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
                   if(basis<0.0) basis=0.0; //rounding error
                   get_BSplineBasisValues<DTYPE>(basis, xBasis, xFirst);
 
-#if _USE_SSE
-                  val.f[0]=xBasis[0];
-                  val.f[1]=xBasis[1];
-                  val.f[2]=xBasis[2];
-                  val.f[3]=xBasis[3];
-                  _xBasis=val.m;
-                  val.f[0]=xFirst[0];
-                  val.f[1]=xFirst[1];
-                  val.f[2]=xFirst[2];
-                  val.f[3]=xFirst[3];
-                  _xFirst=val.m;
-                  for(incr0=0; incr0<16; ++incr0)
-                  {
-                     val.m=_mm_set_ps1(tempX.f[incr0]);
-                     basisX.m[incr0]=_mm_mul_ps(_xFirst,val.m);
-                     val.m=_mm_set_ps1(tempY.f[incr0]);
-                     basisY.m[incr0]=_mm_mul_ps(_xBasis,val.m);
-                     val.m=_mm_set_ps1(tempZ.f[incr0]);
-                     basisZ.m[incr0]=_mm_mul_ps(_xBasis,val.m);
-                  }
-#else
-                  coord=0;
-                  for(incr0=0; incr0<16; ++incr0)
-                  {
-                     for(incr1=0; incr1<4; ++incr1)
-                     {
-                        basisX[coord]=tempX[incr0]*xFirst[incr1];   // z * y * x'
-                        basisY[coord]=tempY[incr0]*xBasis[incr1];    // z * y'* x
-                        basisZ[coord]=tempZ[incr0]*xBasis[incr1];    // z'* y * x
-                        coord++;
-                     }
-                  }
-#endif
-
                   if(oldPre[0]!=pre[0] || oldPre[1]!=pre[1] || oldPre[2]!=pre[2])
                   {
-#ifdef _USE_SSE
-                     get_GridValues<DTYPE>(pre[0],
-                           pre[1],
-                           pre[2],
-                           splineControlPoint,
-                           coeffPtrX,
-                           coeffPtrY,
-                           coeffPtrZ,
-                           coeffX.f,
-                           coeffY.f,
-                           coeffZ.f,
-                           false, // no approx
-                           false // not disp
-                           );
-#else // _USE_SSE
                      get_GridValues<DTYPE>(pre[0],
                            pre[1],
                            pre[2],
@@ -1011,71 +714,19 @@ void reg_spline_jacobian3D(nifti_image *splineControlPoint,
                            false, // no approx
                            false // not disp
                            );
-#endif // _USE_SSE
                      oldPre[0]=pre[0];
                      oldPre[1]=pre[1];
                      oldPre[2]=pre[2];
                   }
-#if _USE_SSE
-                  tempX_x =  _mm_set_ps1(0.0);
-                  tempX_y =  _mm_set_ps1(0.0);
-                  tempX_z =  _mm_set_ps1(0.0);
-                  tempY_x =  _mm_set_ps1(0.0);
-                  tempY_y =  _mm_set_ps1(0.0);
-                  tempY_z =  _mm_set_ps1(0.0);
-                  tempZ_x =  _mm_set_ps1(0.0);
-                  tempZ_y =  _mm_set_ps1(0.0);
-                  tempZ_z =  _mm_set_ps1(0.0);
-                  //addition and multiplication of the 16 basis value and CP position for each axis
-                  for(incr0=0; incr0<16; ++incr0)
-                  {
-                     tempX_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffX.m[incr0]), tempX_x );
-                     tempX_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffX.m[incr0]), tempX_y );
-                     tempX_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffX.m[incr0]), tempX_z );
-
-                     tempY_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffY.m[incr0]), tempY_x );
-                     tempY_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffY.m[incr0]), tempY_y );
-                     tempY_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffY.m[incr0]), tempY_z );
-
-                     tempZ_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffZ.m[incr0]), tempZ_x );
-                     tempZ_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffZ.m[incr0]), tempZ_y );
-                     tempZ_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffZ.m[incr0]), tempZ_z );
-                  }
-
-                  //the values stored in SSE variables are transfered to normal float
-                  val.m = tempX_x;
-                  jacobianMatrix.m[0][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_y;
-                  jacobianMatrix.m[0][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_z;
-                  jacobianMatrix.m[0][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_x;
-                  jacobianMatrix.m[1][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_y;
-                  jacobianMatrix.m[1][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_z;
-                  jacobianMatrix.m[1][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_x;
-                  jacobianMatrix.m[2][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_y;
-                  jacobianMatrix.m[2][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_z;
-                  jacobianMatrix.m[2][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-#else
-                  memset(&jacobianMatrix, 0, sizeof(mat33));
-                  for(incr0=0; incr0<64; ++incr0)
+                  tensorProduct(xFirst, tempX, coeffX, coeffY, coeffZ, firstX); // z * y * x'
+                  tensorProduct(xBasis, tempY, coeffX, coeffY, coeffZ, firstY); // z * y'* x
+                  tensorProduct(xBasis, tempZ, coeffX, coeffY, coeffZ, firstZ); // z'* y * x
+                  for(incr0=0; incr0<3; ++incr0)
                   {
-                     jacobianMatrix.m[0][0] += basisX[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][1] += basisY[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][2] += basisZ[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[1][0] += basisX[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][1] += basisY[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][2] += basisZ[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[2][0] += basisX[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][1] += basisY[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][2] += basisZ[incr0]*coeffZ[incr0];
+                     jacobianMatrix.m[incr0][0] = firstX[incr0];
+                     jacobianMatrix.m[incr0][1] = firstY[incr0];
+                     jacobianMatrix.m[incr0][2] = firstZ[incr0];
                   }
-#endif
                   jacobianMatrix=nifti_mat33_mul(reorientation,
                                                  jacobianMatrix);
                   if(JacobianMatrices!=NULL)
@@ -0,0 +1,366 @@
+/*
+ *  _reg_localTrans_simd.cpp
+ *
+ *  Copyright (c) 2009, University College London. All rights reserved.
+ *  Centre for Medical Image Computing (CMIC)
+ *  See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+
+#ifndef _REG_LOCALTRANS_SIMD_CPP
+#define _REG_LOCALTRANS_SIMD_CPP
+
+#include "_reg_localTrans_simd.h"
+
+// The vectorised implementations rely on the target attribute and on the CPU
+// detection builtins of GCC and Clang, and are only available on x86
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define _REG_SIMD_X86
+#include <immintrin.h>
+// The Windows toolchains do not realign the stack for the 32 and 64 byte
+// registers, which may then be spilled to misaligned addresses
+#if !defined(_WIN32)
+#define _REG_SIMD_AVX
+#endif
+#endif
+
+#define REG_SIMD_SCALAR 0
+#define REG_SIMD_SSE2 1
+#define REG_SIMD_AVX2 2
+#define REG_SIMD_AVX512 3
+
+/* *************************************************************** */
+/* *************************************************************** */
+template <class DTYPE>
+static void reg_spline_tensorProduct_scalar(const DTYPE *xBasis,
+                                            const DTYPE *yzBasis,
+                                            const DTYPE *xValues,
+                                            const DTYPE *yValues,
+                                            const DTYPE *zValues,
+                                            DTYPE *result)
+{
+   DTYPE real[3]= {0, 0, 0};
+   DTYPE weight;
+   int coord=0;
+   for(int a=0; a<16; ++a)
+   {
+      for(int b=0; b<4; ++b)
+      {
+         weight=xBasis[b]*yzBasis[a];
+         real[0] += xValues[coord] * weight;
+         real[1] += yValues[coord] * weight;
+         real[2] += zValues[coord] * weight;
+         ++coord;
+      }
+   }
+   result[0]=real[0];
+   result[1]=real[1];
+   result[2]=real[2];
+}
+/* *************************************************************** */
+/* *************************************************************** */
+#ifdef _REG_SIMD_X86
+// Each implementation alternates between two sets of accumulators, which
+// halves the length of the chains of dependent additions.
+// The helpers are forced inline, as a call to them would otherwise pass the
+// registers through memory when the library is built without optimisation
+__attribute__((target("sse2"), always_inline))
+static inline float reg_simd_sum(__m128 value)
+{
+   float f[4];
+   _mm_storeu_ps(f, value);
+   return (f[0]+f[1])+(f[2]+f[3]);
+}
+/* *************************************************************** */
+__attribute__((target("sse2"), always_inline))
+static inline double reg_simd_sum(__m128d value)
+{
+   double f[2];
+   _mm_storeu_pd(f, value);
+   return f[0]+f[1];
+}
+/* *************************************************************** */
+__attribute__((target("sse2")))
+static void reg_spline_tensorProduct_sse2(const float *xBasis,
+                                          const float *yzBasis,
+                                          const float *xValues,
+                                          const float *yValues,
+                                          const float *zValues,
+                                          float *result)
+{
+   // One row of four control points per accumulator
+   const __m128 basis=_mm_loadu_ps(xBasis);
+   __m128 sumX[2]= {_mm_setzero_ps(), _mm_setzero_ps()};
+   __m128 sumY[2]= {_mm_setzero_ps(), _mm_setzero_ps()};
+   __m128 sumZ[2]= {_mm_setzero_ps(), _mm_setzero_ps()};
+   __m128 weight;
+   for(int a=0; a<16; ++a)
+   {
+      weight=_mm_mul_ps(basis, _mm_set1_ps(yzBasis[a]));
+      sumX[a&1]=_mm_add_ps(sumX[a&1], _mm_mul_ps(weight, _mm_loadu_ps(&xValues[4*a])));
+      sumY[a&1]=_mm_add_ps(sumY[a&1], _mm_mul_ps(weight, _mm_loadu_ps(&yValues[4*a])));
+      sumZ[a&1]=_mm_add_ps(sumZ[a&1], _mm_mul_ps(weight, _mm_loadu_ps(&zValues[4*a])));
+   }
+   result[0]=reg_simd_sum(_mm_add_ps(sumX[0], sumX[1]));
+   result[1]=reg_simd_sum(_mm_add_ps(sumY[0], sumY[1]));
+   result[2]=reg_simd_sum(_mm_add_ps(sumZ[0], sumZ[1]));
+}
+/* *************************************************************** */
+__attribute__((target("sse2")))
+static void reg_spline_tensorProduct_sse2(const double *xBasis,
+                                          const double *yzBasis,
+                                          const double *xValues,
+                                          const double *yValues,
+                                          const double *zValues,
+                                          double *result)
+{
+   // One half row of two control points per accumulator
+   const __m128d basis[2]= {_mm_loadu_pd(xBasis), _mm_loadu_pd(&xBasis[2])};
+   __m128d sumX[2]= {_mm_setzero_pd(), _mm_setzero_pd()};
+   __m128d sumY[2]= {_mm_setzero_pd(), _mm_setzero_pd()};
+   __m128d sumZ[2]= {_mm_setzero_pd(), _mm_setzero_pd()};
+   __m128d yz, weight;
+   for(int a=0; a<16; ++a)
+   {
+      yz=_mm_set1_pd(yzBasis[a]);
+      for(int b=0; b<2; ++b)
+      {
+         weight=_mm_mul_pd(basis[b], yz);
+         sumX[b]=_mm_add_pd(sumX[b], _mm_mul_pd(weight, _mm_loadu_pd(&xValues[4*a+2*b])));
+         sumY[b]=_mm_add_pd(sumY[b], _mm_mul_pd(weight, _mm_loadu_pd(&yValues[4*a+2*b])));
+         sumZ[b]=_mm_add_pd(sumZ[b], _mm_mul_pd(weight, _mm_loadu_pd(&zValues[4*a+2*b])));
+      }
+   }
+   result[0]=reg_simd_sum(_mm_add_pd(sumX[0], sumX[1]));
+   result[1]=reg_simd_sum(_mm_add_pd(sumY[0], sumY[1]));
+   result[2]=reg_simd_sum(_mm_add_pd(sumZ[0], sumZ[1]));
+}
+/* *************************************************************** */
+/* *************************************************************** */
+#ifdef _REG_SIMD_AVX
+// The AVX implementations clear the upper halves of the registers before
+// returning, as the compiler only does so itself when optimising, and the
+// transition to the SSE code of the caller is otherwise very slow
+__attribute__((target("avx2,fma"), always_inline))
+static inline float reg_simd_sum(__m256 value)
+{
+   float f[8];
+   _mm256_storeu_ps(f, value);
+   return ((f[0]+f[1])+(f[2]+f[3]))+((f[4]+f[5])+(f[6]+f[7]));
+}
+/* *************************************************************** */
+__attribute__((target("avx2,fma"), always_inline))
+static inline double reg_simd_sum(__m256d value)
+{
+   double f[4];
+   _mm256_storeu_pd(f, value);
+   return (f[0]+f[1])+(f[2]+f[3]);
+}
+/* *************************************************************** */
+__attribute__((target("avx2,fma")))
+static void reg_spline_tensorProduct_avx2(const float *xBasis,
+                                          const float *yzBasis,
+                                          const float *xValues,
+                                          const float *yValues,
+                                          const float *zValues,
+                                          float *result)
+{
+   // Two rows of four control points per accumulator
+   const __m128 basis128=_mm_loadu_ps(xBasis);
+   const __m256 basis=_mm256_insertf128_ps(_mm256_castps128_ps256(basis128), basis128, 1);
+   __m256 sumX[2]= {_mm256_setzero_ps(), _mm256_setzero_ps()};
+   __m256 sumY[2]= {_mm256_setzero_ps(), _mm256_setzero_ps()};
+   __m256 sumZ[2]= {_mm256_setzero_ps(), _mm256_setzero_ps()};
+   __m256 weight;
+   for(int a=0; a<8; ++a)
+   {
+      weight=_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(yzBasis[2*a])),
+                                  _mm_set1_ps(yzBasis[2*a+1]), 1);
+      weight=_mm256_mul_ps(basis, weight);
+      sumX[a&1]=_mm256_fmadd_ps(weight, _mm256_loadu_ps(&xValues[8*a]), sumX[a&1]);
+      sumY[a&1]=_mm256_fmadd_ps(weight, _mm256_loadu_ps(&yValues[8*a]), sumY[a&1]);
+      sumZ[a&1]=_mm256_fmadd_ps(weight, _mm256_loadu_ps(&zValues[8*a]), sumZ[a&1]);
+   }
+   result[0]=reg_simd_sum(_mm256_add_ps(sumX[0], sumX[1]));
+   result[1]=reg_simd_sum(_mm256_add_ps(sumY[0], sumY[1]));
+   result[2]=reg_simd_sum(_mm256_add_ps(sumZ[0], sumZ[1]));
+   _mm256_zeroupper();
+}
+/* *************************************************************** */
+__attribute__((target("avx2,fma")))
+static void reg_spline_tensorProduct_avx2(const double *xBasis,
+                                          const double *yzBasis,
+                                          const double *xValues,
+                                          const double *yValues,
+                                          const double *zValues,
+                                          double *result)
+{
+   // One row of four control points per accumulator
+   const __m256d basis=_mm256_loadu_pd(xBasis);
+   __m256d sumX[2]= {_mm256_setzero_pd(), _mm256_setzero_pd()};
+   __m256d sumY[2]= {_mm256_setzero_pd(), _mm256_setzero_pd()};
+   __m256d sumZ[2]= {_mm256_setzero_pd(), _mm256_setzero_pd()};
+   __m256d weight;
+   for(int a=0; a<16; ++a)
+   {
+      weight=_mm256_mul_pd(basis, _mm256_set1_pd(yzBasis[a]));
+      sumX[a&1]=_mm256_fmadd_pd(weight, _mm256_loadu_pd(&xValues[4*a]), sumX[a&1]);
+      sumY[a&1]=_mm256_fmadd_pd(weight, _mm256_loadu_pd(&yValues[4*a]), sumY[a&1]);
+      sumZ[a&1]=_mm256_fmadd_pd(weight, _mm256_loadu_pd(&zValues[4*a]), sumZ[a&1]);
+   }
+   result[0]=reg_simd_sum(_mm256_add_pd(sumX[0], sumX[1]));
+   result[1]=reg_simd_sum(_mm256_add_pd(sumY[0], sumY[1]));
+   result[2]=reg_simd_sum(_mm256_add_pd(sumZ[0], sumZ[1]));
+   _mm256_zeroupper();
+}
+/* *************************************************************** */
+/* *************************************************************** */
+__attribute__((target("avx512f"), always_inline))
+static inline float reg_simd_sum(__m512 value)
+{
+   float f[16];
+   _mm512_storeu_ps(f, value);
+   return (((f[0]+f[1])+(f[2]+f[3]))+((f[4]+f[5])+(f[6]+f[7])))+
+         (((f[8]+f[9])+(f[10]+f[11]))+((f[12]+f[13])+(f[14]+f[15])));
+}
+/* *************************************************************** */
+__attribute__((target("avx512f"), always_inline))
+static inline double reg_simd_sum(__m512d value)
+{
+   double f[8];
+   _mm512_storeu_pd(f, value);
+   return ((f[0]+f[1])+(f[2]+f[3]))+((f[4]+f[5])+(f[6]+f[7]));
+}
+/* *************************************************************** */
+__attribute__((target("avx512f")))
+static void reg_spline_tensorProduct_avx512(const float *xBasis,
+                                            const float *yzBasis,
+                                            const float *xValues,
+                                            const float *yValues,
+                                            const float *zValues,
+                                            float *result)
+{
+   // One plane of sixteen control points per accumulator. The weights of a
+   // plane are obtained by spreading four of the y-z products over the lanes;
+   // the masked permutation avoids an undefined register in some headers
+   const __m512 basis=_mm512_set4_ps(xBasis[3], xBasis[2], xBasis[1], xBasis[0]);
+   const __m512 yz=_mm512_loadu_ps(yzBasis);
+   const __m512i rows=_mm512_set_epi32(3,3,3,3,2,2,2,2,1,1,1,1,0,0,0,0);
+   __m512 sumX[2]= {_mm512_setzero_ps(), _mm512_setzero_ps()};
+   __m512 sumY[2]= {_mm512_setzero_ps(), _mm512_setzero_ps()};
+   __m512 sumZ[2]= {_mm512_setzero_ps(), _mm512_setzero_ps()};
+   __m512 weight;
+   for(int a=0; a<4; ++a)
+   {
+      weight=_mm512_mask_permutexvar_ps(_mm512_setzero_ps(), 0xFFFF,
+                                        _mm512_add_epi32(rows, _mm512_set1_epi32(4*a)), yz);
+      weight=_mm512_mul_ps(basis, weight);
+      sumX[a&1]=_mm512_fmadd_ps(weight, _mm512_loadu_ps(&xValues[16*a]), sumX[a&1]);
+      sumY[a&1]=_mm512_fmadd_ps(weight, _mm512_loadu_ps(&yValues[16*a]), sumY[a&1]);
+      sumZ[a&1]=_mm512_fmadd_ps(weight, _mm512_loadu_ps(&zValues[16*a]), sumZ[a&1]);
+   }
+   result[0]=reg_simd_sum(_mm512_add_ps(sumX[0], sumX[1]));
+   result[1]=reg_simd_sum(_mm512_add_ps(sumY[0], sumY[1]));
+   result[2]=reg_simd_sum(_mm512_add_ps(sumZ[0], sumZ[1]));
+   _mm256_zeroupper();
+}
+/* *************************************************************** */
+__attribute__((target("avx512f")))
+static void reg_spline_tensorProduct_avx512(const double *xBasis,
+                                            const double *yzBasis,
+                                            const double *xValues,
+                                            const double *yValues,
+                                            const double *zValues,
+                                            double *result)
+{
+   // Two rows of four control points per accumulator
+   const __m512d basis=_mm512_set4_pd(xBasis[3], xBasis[2], xBasis[1], xBasis[0]);
+   __m512d sumX[2]= {_mm512_setzero_pd(), _mm512_setzero_pd()};
+   __m512d sumY[2]= {_mm512_setzero_pd(), _mm512_setzero_pd()};
+   __m512d sumZ[2]= {_mm512_setzero_pd(), _mm512_setzero_pd()};
+   __m512d weight;
+   for(int a=0; a<8; ++a)
+   {
+      weight=_mm512_mask_blend_pd(0xF0, _mm512_set1_pd(yzBasis[2*a]),
+                                  _mm512_set1_pd(yzBasis[2*a+1]));
+      weight=_mm512_mul_pd(basis, weight);
+      sumX[a&1]=_mm512_fmadd_pd(weight, _mm512_loadu_pd(&xValues[8*a]), sumX[a&1]);
+      sumY[a&1]=_mm512_fmadd_pd(weight, _mm512_loadu_pd(&yValues[8*a]), sumY[a&1]);
+      sumZ[a&1]=_mm512_fmadd_pd(weight, _mm512_loadu_pd(&zValues[8*a]), sumZ[a&1]);
+   }
+   result[0]=reg_simd_sum(_mm512_add_pd(sumX[0], sumX[1]));
+   result[1]=reg_simd_sum(_mm512_add_pd(sumY[0], sumY[1]));
+   result[2]=reg_simd_sum(_mm512_add_pd(sumZ[0], sumZ[1]));
+   _mm256_zeroupper();
+}
+#endif // _REG_SIMD_AVX
+#endif // _REG_SIMD_X86
+/* *************************************************************** */
+/* *************************************************************** */
+static int reg_spline_detectSimdLevel()
+{
+#ifdef _REG_SIMD_X86
+   __builtin_cpu_init();
+#ifdef _REG_SIMD_AVX
+   if(__builtin_cpu_supports("avx512f"))
+      return REG_SIMD_AVX512;
+   if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return REG_SIMD_AVX2;
+#endif
+   if(__builtin_cpu_supports("sse2"))
+      return REG_SIMD_SSE2;
+#endif
+   return REG_SIMD_SCALAR;
+}
+/* *************************************************************** */
+static int reg_spline_getSimdLevel()
+{
+   // The host CPU is only queried once
+   static const int level=reg_spline_detectSimdLevel();
+   return level;
+}
+/* *************************************************************** */
+template <class DTYPE>
+typename reg_splineTensorProduct<DTYPE>::Function reg_spline_getTensorProduct()
+{
+   typename reg_splineTensorProduct<DTYPE>::Function function=&reg_spline_tensorProduct_scalar<DTYPE>;
+#ifdef _REG_SIMD_X86
+   switch(reg_spline_getSimdLevel())
+   {
+#ifdef _REG_SIMD_AVX
+   case REG_SIMD_AVX512:
+      function=&reg_spline_tensorProduct_avx512;
+      break;
+   case REG_SIMD_AVX2:
+      function=&reg_spline_tensorProduct_avx2;
+      break;
+#endif
+   case REG_SIMD_SSE2:
+      function=&reg_spline_tensorProduct_sse2;
+      break;
+   default:
+      break;
+   }
+#endif
+   return function;
+}
+template reg_splineTensorProduct<float>::Function reg_spline_getTensorProduct<float>();
+template reg_splineTensorProduct<double>::Function reg_spline_getTensorProduct<double>();
+/* *************************************************************** */
+const char *reg_spline_getTensorProductName()
+{
+   switch(reg_spline_getSimdLevel())
+   {
+   case REG_SIMD_AVX512:
+      return "AVX-512";
+   case REG_SIMD_AVX2:
+      return "AVX2";
+   case REG_SIMD_SSE2:
+      return "SSE2";
+   default:
+      return "scalar";
+   }
+}
+/* *************************************************************** */
+/* *************************************************************** */
+#endif // _REG_LOCALTRANS_SIMD_CPP
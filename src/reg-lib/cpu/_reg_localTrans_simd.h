@@ -0,0 +1,56 @@
+/**
+ * @file _reg_localTrans_simd.h
+ * @brief Vectorised evaluation of the cubic spline tensor products
+ *
+ * Copyright (c) 2009, University College London. All rights reserved.
+ * Centre for Medical Image Computing (CMIC)
+ * See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+
+#ifndef _REG_LOCALTRANS_SIMD_H
+#define _REG_LOCALTRANS_SIMD_H
+
+/* *************************************************************** */
+/** @brief Type of the functions that evaluate the 4x4x4 tensor product of
+ * a cubic spline at one position, for the three components at once.
+ * The function computes, for each component, the sum over the 64 control
+ * points of the value times xBasis[a]*yzBasis[b+4*c], where a, b and c
+ * are the indices along x, y and z. The control point values are expected
+ * in the order used by get_GridValues, i.e. a+4*b+16*c.
+ * @param xBasis Four basis values, or derivatives, along the x axis
+ * @param yzBasis Sixteen products of the basis values along the y and z axes
+ * @param xValues Sixty-four control point values along the x axis
+ * @param yValues Sixty-four control point values along the y axis
+ * @param zValues Sixty-four control point values along the z axis
+ * @param result Array of three values that receives the weighted sums
+ */
+template <class DTYPE>
+struct reg_splineTensorProduct
+{
+   typedef void (*Function)(const DTYPE *xBasis,
+                            const DTYPE *yzBasis,
+                            const DTYPE *xValues,
+                            const DTYPE *yValues,
+                            const DTYPE *zValues,
+                            DTYPE *result);
+};
+/* *************************************************************** */
+/** @brief Returns the tensor product implementation that best suits the
+ * host CPU: AVX-512, AVX2 with FMA, SSE2 or plain scalar code. The choice
+ * is made at run time, the first time the function is called, so that
+ * the same binary runs on any processor. The scalar implementation
+ * accumulates in the same order as the original per-voxel loops; the
+ * vectorised ones accumulate by lane and may differ in the last bits.
+ */
+extern "C++" template <class DTYPE>
+typename reg_splineTensorProduct<DTYPE>::Function reg_spline_getTensorProduct();
+/* *************************************************************** */
+/** @brief Returns the name of the instruction set used by the tensor
+ * product implementation returned by reg_spline_getTensorProduct
+ */
+extern "C++"
+const char *reg_spline_getTensorProductName();
+/* *************************************************************** */
+
+#endif
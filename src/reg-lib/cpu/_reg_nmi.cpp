@@ -13,6 +13,7 @@
 #define _REG_NMI_CPP
 
 #include "_reg_nmi.h"
+#include "_reg_resampling.h"
 
 /* *************************************************************** */
 /* *************************************************************** */
@@ -261,6 +262,426 @@ PrecisionTYPE GetBasisSplineDerivativeValue(PrecisionTYPE ori)
 }
 /* *************************************************************** */
 /* *************************************************************** */
+/// Number of doubles per cache line, used to pad the per-thread histograms
+#define NMI_CACHE_LINE_DOUBLES 8
+/// Below this number of voxels the joint histogram is always filled serially
+#define NMI_THREADED_HISTOGRAM_MIN_VOXELS 32768
+/* *************************************************************** */
+/// Reads the warped intensities from an already resampled image
+template <class DTYPE>
+class reg_nmi_warpedIntensity
+{
+public:
+   reg_nmi_warpedIntensity(DTYPE *warPtr)
+      : warPtr(warPtr) {}
+   DTYPE operator()(size_t voxel)
+   {
+      return this->warPtr[voxel];
+   }
+private:
+   DTYPE *warPtr;
+};
+/* *************************************************************** */
+/* Interpolates the warped intensities on the fly, the floating image being
+ * sampled through the deformation field exactly as reg_resampleImage does it,
+ * so that no warped image has to be written and read back.
+ */
+template <class DTYPE, class FieldTYPE>
+class reg_nmi_resampledIntensity
+{
+public:
+   reg_nmi_resampledIntensity(nifti_image *floatingImage,
+                              nifti_image *deformationField,
+                              int t,
+                              int interpolation,
+                              FieldTYPE paddingValue)
+   {
+      this->floatingImage=floatingImage;
+      size_t floatingVoxelNumber = (size_t)floatingImage->nx *
+                                   floatingImage->ny *
+                                   floatingImage->nz;
+      this->floatingIntensity=&static_cast<DTYPE *>(floatingImage->data)[t*floatingVoxelNumber];
+      size_t fieldVoxelNumber = (size_t)deformationField->nx *
+                                deformationField->ny *
+                                deformationField->nz;
+      this->fieldPtrX=static_cast<FieldTYPE *>(deformationField->data);
+      this->fieldPtrY=&this->fieldPtrX[fieldVoxelNumber];
+      this->fieldPtrZ=&this->fieldPtrY[fieldVoxelNumber];
+      this->is3D=deformationField->nz>1;
+      if(floatingImage->sform_code>0)
+         this->floatingIJKMatrix=&(floatingImage->sto_ijk);
+      else this->floatingIJKMatrix=&(floatingImage->qto_ijk);
+      this->paddingValue=paddingValue;
+      // Define the kernel to use
+      switch(interpolation)
+      {
+      case 0:
+         this->kernelSize=2;
+         this->kernelOffset=0;
+         this->kernelCompFctPtr=&interpNearestNeighKernel;
+         break; // nearest-neighbour interpolation
+      case 1:
+         this->kernelSize=2;
+         this->kernelOffset=0;
+         this->kernelCompFctPtr=&interpLinearKernel;
+         break; // linear interpolation
+      case 4:
+         this->kernelSize=SINC_KERNEL_SIZE;
+         this->kernelOffset=SINC_KERNEL_RADIUS;
+         this->kernelCompFctPtr=&interpWindowedSincKernel;
+         break; // sinc interpolation
+      default:
+         this->kernelSize=4;
+         this->kernelOffset=1;
+         this->kernelCompFctPtr=&interpCubicSplineKernel;
+         break; // cubic spline interpolation
+      }
+   }
+   DTYPE operator()(size_t voxel)
+   {
+      if(this->is3D)
+         return this->Interpolate3D(voxel);
+      return this->Interpolate2D(voxel);
+   }
+private:
+   nifti_image *floatingImage;
+   DTYPE *floatingIntensity;
+   FieldTYPE *fieldPtrX;
+   FieldTYPE *fieldPtrY;
+   FieldTYPE *fieldPtrZ;
+   mat44 *floatingIJKMatrix;
+   FieldTYPE paddingValue;
+   bool is3D;
+   int kernelSize;
+   int kernelOffset;
+   void (*kernelCompFctPtr)(double,double *);
+
+   // Mirrors the per-voxel computation of ResampleImage3D
+   DTYPE Interpolate3D(size_t voxel)
+   {
+      double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE];
+      double world[3], position[3], relative[3];
+      int previous[3];
+      world[0]=static_cast<double>(this->fieldPtrX[voxel]);
+      world[1]=static_cast<double>(this->fieldPtrY[voxel]);
+      world[2]=static_cast<double>(this->fieldPtrZ[voxel]);
+      // real -> voxel; floating space
+      reg_mat44_mul(this->floatingIJKMatrix, world, position);
+      for(int i=0; i<3; ++i)
+      {
+         previous[i] = static_cast<int>(reg_floor(position[i]));
+         relative[i] = position[i]-static_cast<double>(previous[i]);
+      }
+      (*this->kernelCompFctPtr)(relative[0], xBasis);
+      (*this->kernelCompFctPtr)(relative[1], yBasis);
+      (*this->kernelCompFctPtr)(relative[2], zBasis);
+      previous[0]-=this->kernelOffset;
+      previous[1]-=this->kernelOffset;
+      previous[2]-=this->kernelOffset;
+
+      int nx=this->floatingImage->nx;
+      int ny=this->floatingImage->ny;
+      int nz=this->floatingImage->nz;
+      double intensity=0.0;
+      for(int c=0; c<this->kernelSize; c++)
+      {
+         int Z= previous[2]+c;
+         DTYPE *zPointer = &this->floatingIntensity[Z*nx*ny];
+         double yTempNewValue=0.0;
+         for(int b=0; b<this->kernelSize; b++)
+         {
+            int Y= previous[1]+b;
+            DTYPE *xyzPointer = &zPointer[Y*nx+previous[0]];
+            double xTempNewValue=0.0;
+            for(int a=0; a<this->kernelSize; a++)
+            {
+               if(-1<(previous[0]+a) && (previous[0]+a)<nx &&
+                     -1<Z && Z<nz &&
+                     -1<Y && Y<ny)
+                  xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
+               else xTempNewValue +=  this->paddingValue * xBasis[a];
+               xyzPointer++;
+            }
+            yTempNewValue += xTempNewValue * yBasis[b];
+         }
+         intensity += yTempNewValue * zBasis[c];
+      }
+      return static_cast<DTYPE>(intensity);
+   }
+   // Mirrors the per-voxel computation of ResampleImage2D
+   DTYPE Interpolate2D(size_t voxel)
+   {
+      double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE];
+      FieldTYPE world[3], position[3], relative[2];
+      int previous[2];
+      world[0]=static_cast<FieldTYPE>(this->fieldPtrX[voxel]);
+      world[1]=static_cast<FieldTYPE>(this->fieldPtrY[voxel]);
+      world[2]=0;
+      // real -> voxel; floating space
+      reg_mat44_mul(this->floatingIJKMatrix, world, position);
+      for(int i=0; i<2; ++i)
+      {
+         previous[i] = static_cast<int>(reg_floor(position[i]));
+         relative[i] = position[i]-static_cast<FieldTYPE>(previous[i]);
+      }
+      (*this->kernelCompFctPtr)(relative[0], xBasis);
+      (*this->kernelCompFctPtr)(relative[1], yBasis);
+      previous[0]-=this->kernelOffset;
+      previous[1]-=this->kernelOffset;
+
+      int nx=this->floatingImage->nx;
+      int ny=this->floatingImage->ny;
+      FieldTYPE intensity=static_cast<FieldTYPE>(0);
+      for(int b=0; b<this->kernelSize; b++)
+      {
+         int Y= previous[1]+b;
+         DTYPE *xyzPointer = &this->floatingIntensity[Y*nx+previous[0]];
+         FieldTYPE xTempNewValue=0.0;
+         for(int a=0; a<this->kernelSize; a++)
+         {
+            if(-1<(previous[0]+a) && (previous[0]+a)<nx &&
+                  -1<Y && Y<ny)
+               xTempNewValue +=  (FieldTYPE)*xyzPointer * xBasis[a];
+            else xTempNewValue +=  this->paddingValue * xBasis[a];
+            xyzPointer++;
+         }
+         intensity += xTempNewValue * yBasis[b];
+      }
+      return static_cast<DTYPE>(intensity);
+   }
+};
+/* *************************************************************** */
+/* Fill the (unsmoothed) joint histogram of one time point. The warped
+ * intensities are provided by one of the classes above. When several
+ * threads are available, each of them fills a private histogram, padded and
+ * aligned to whole cache lines to avoid false sharing, and the private copies
+ * are then summed. Every bin only ever holds an integer count, so the result
+ * is bit-identical to the serial fill whatever the number of threads.
+ */
+template <class DTYPE, class WarpedTYPE>
+void reg_getNMIJointHistogram(DTYPE *refPtr,
+                              WarpedTYPE *warped,
+                              int *referenceMask,
+                              size_t voxelNumber,
+                              unsigned short referenceBinNumber,
+                              unsigned short floatingBinNumber,
+                              unsigned short totalBinNumber,
+                              double *jointHistoProPtr)
+{
+   // Empty the joint histogram
+   memset(jointHistoProPtr,0,totalBinNumber*sizeof(double));
+#if defined (_OPENMP)
+   int threadNumber = omp_get_max_threads();
+   if(threadNumber>1 && voxelNumber>=NMI_THREADED_HISTOGRAM_MIN_VOXELS)
+   {
+      size_t binNumber = (size_t)referenceBinNumber*floatingBinNumber;
+      size_t stride = NMI_CACHE_LINE_DOUBLES *
+                            ((binNumber+NMI_CACHE_LINE_DOUBLES-1)/NMI_CACHE_LINE_DOUBLES);
+      double *buffer = (double *)calloc(threadNumber*stride+NMI_CACHE_LINE_DOUBLES,sizeof(double));
+      // Align the first private histogram on a cache line boundary
+      size_t misalignment = ((size_t)buffer/sizeof(double)) % NMI_CACHE_LINE_DOUBLES;
+      double *privateHistograms = &buffer[(NMI_CACHE_LINE_DOUBLES-misalignment) % NMI_CACHE_LINE_DOUBLES];
+#ifdef WIN32
+      long voxel, bin;
+      long voxelNumber_l = (long)voxelNumber, binNumber_l = (long)binNumber;
+#else
+      size_t voxel, bin;
+      size_t voxelNumber_l = voxelNumber, binNumber_l = binNumber;
+#endif
+      #pragma omp parallel default(none) num_threads(threadNumber) \
+      private(voxel) \
+      shared(refPtr,warped,referenceMask,voxelNumber_l,referenceBinNumber, \
+             floatingBinNumber,privateHistograms,stride)
+      {
+         double *histoPtr = &privateHistograms[omp_get_thread_num()*stride];
+         #pragma omp for schedule(static)
+         for(voxel=0; voxel<voxelNumber_l; ++voxel)
+         {
+            if(referenceMask[voxel]>-1)
+            {
+               DTYPE refValue=refPtr[voxel];
+               DTYPE warValue=(*warped)(voxel);
+               if(refValue==refValue && warValue==warValue &&
+                     refValue>=0 && warValue>=0 &&
+                     refValue<referenceBinNumber &&
+                     warValue<floatingBinNumber)
+               {
+                  ++histoPtr[static_cast<int>(refValue) +
+                             static_cast<int>(warValue) * referenceBinNumber];
+               }
+            }
+         }
+      }
+      // Reduce the private histograms
+      #pragma omp parallel for default(none) \
+      private(bin) \
+      shared(binNumber_l,threadNumber,privateHistograms,stride,jointHistoProPtr)
+      for(bin=0; bin<binNumber_l; ++bin)
+      {
+         double sum=0.;
+         for(int th=0; th<threadNumber; ++th)
+            sum += privateHistograms[th*stride+bin];
+         jointHistoProPtr[bin]=sum;
+      }
+      free(buffer);
+      return;
+   }
+#endif // _OPENMP
+   for(size_t voxel=0; voxel<voxelNumber; ++voxel)
+   {
+      if(referenceMask[voxel]>-1)
+      {
+         DTYPE refValue=refPtr[voxel];
+         DTYPE warValue=(*warped)(voxel);
+         if(refValue==refValue && warValue==warValue &&
+               refValue>=0 && warValue>=0 &&
+               refValue<referenceBinNumber &&
+               warValue<floatingBinNumber)
+         {
+            ++jointHistoProPtr[static_cast<int>(refValue) +
+                               static_cast<int>(warValue) * referenceBinNumber];
+         }
+      }
+   }
+}
+/* *************************************************************** */
+/* Smooth, normalise and marginalise a filled joint histogram and compute
+ * the reference, warped and joint entropies as well as the log histogram
+ * used by the gradient computation.
+ */
+void reg_getNMIEntropies(unsigned short referenceBinNumber,
+                         unsigned short floatingBinNumber,
+                         unsigned short totalBinNumber,
+                         double *jointHistoLogPtr,
+                         double *jointHistoProPtr,
+                         double *entropyValues)
+{
+   // Convolve the histogram with a cubic B-spline kernel
+   double kernel[3];
+   kernel[0]=kernel[2]=GetBasisSplineValue(-1.);
+   kernel[1]=GetBasisSplineValue(0.);
+   // Histogram is first smooth along the reference axis
+   memset(jointHistoLogPtr,0,totalBinNumber*sizeof(double));
+   for(int f=0; f<floatingBinNumber; ++f)
+   {
+      for(int r=0; r<referenceBinNumber; ++r)
+      {
+         double value=0.0;
+         int index = r-1;
+         double *ptrHisto = &jointHistoProPtr[index+referenceBinNumber*f];
+
+         for(int it=0; it<3; it++)
+         {
+            if(-1<index && index<referenceBinNumber)
+            {
+               value += *ptrHisto * kernel[it];
+            }
+            ++ptrHisto;
+            ++index;
+         }
+         jointHistoLogPtr[r+referenceBinNumber*f] = value;
+      }
+   }
+   // Histogram is then smooth along the warped floating axis
+   for(int r=0; r<referenceBinNumber; ++r)
+   {
+      for(int f=0; f<floatingBinNumber; ++f)
+      {
+         double value=0.;
+         int index = f-1;
+         double *ptrHisto = &jointHistoLogPtr[r+referenceBinNumber*index];
+
+         for(int it=0; it<3; it++)
+         {
+            if(-1<index && index<floatingBinNumber)
+            {
+               value += *ptrHisto * kernel[it];
+            }
+            ptrHisto+=referenceBinNumber;
+            ++index;
+         }
+         jointHistoProPtr[r+referenceBinNumber*f] = value;
+      }
+   }
+   // Normalise the histogram
+   double activeVoxel=0.f;
+   for(int i=0; i<totalBinNumber; ++i)
+      activeVoxel+=jointHistoProPtr[i];
+   entropyValues[3]=activeVoxel;
+   for(int i=0; i<totalBinNumber; ++i)
+      jointHistoProPtr[i]/=activeVoxel;
+   // Marginalise over the reference axis
+   for(int r=0; r<referenceBinNumber; ++r)
+   {
+      double sum=0.;
+      int index=r;
+      for(int f=0; f<floatingBinNumber; ++f)
+      {
+         sum+=jointHistoProPtr[index];
+         index+=referenceBinNumber;
+      }
+      jointHistoProPtr[referenceBinNumber*
+                       floatingBinNumber+r]=sum;
+   }
+   // Marginalise over the warped floating axis
+   for(int f=0; f<floatingBinNumber; ++f)
+   {
+      double sum=0.;
+      int index=referenceBinNumber*f;
+      for(int r=0; r<referenceBinNumber; ++r)
+      {
+         sum+=jointHistoProPtr[index];
+         ++index;
+      }
+      jointHistoProPtr[referenceBinNumber*
+                       floatingBinNumber+referenceBinNumber+f]=sum;
+   }
+   // Set the log values to zero
+   memset(jointHistoLogPtr,0,totalBinNumber*sizeof(double));
+   // Compute the entropy of the reference image
+   double referenceEntropy=0.;
+   for(int r=0; r<referenceBinNumber; ++r)
+   {
+      double valPro=jointHistoProPtr[referenceBinNumber*floatingBinNumber+r];
+      if(valPro>0)
+      {
+         double valLog=log(valPro);
+         referenceEntropy -= valPro * valLog;
+         jointHistoLogPtr[referenceBinNumber*floatingBinNumber+r]=valLog;
+      }
+   }
+   entropyValues[0]=referenceEntropy;
+   // Compute the entropy of the warped floating image
+   double warpedEntropy=0.;
+   for(int f=0; f<floatingBinNumber; ++f)
+   {
+      double valPro=jointHistoProPtr[referenceBinNumber*floatingBinNumber+
+                                     referenceBinNumber+f];
+      if(valPro>0)
+      {
+         double valLog=log(valPro);
+         warpedEntropy -= valPro * valLog;
+         jointHistoLogPtr[referenceBinNumber*floatingBinNumber+
+                          referenceBinNumber+f]=valLog;
+      }
+   }
+   entropyValues[1]=warpedEntropy;
+   // Compute the joint entropy
+   double jointEntropy=0.;
+   for(int i=0; i<referenceBinNumber*floatingBinNumber; ++i)
+   {
+      double valPro=jointHistoProPtr[i];
+      if(valPro>0)
+      {
+         double valLog=log(valPro);
+         jointEntropy -= valPro * valLog;
+         jointHistoLogPtr[i]=valLog;
+      }
+   }
+   entropyValues[2]=jointEntropy;
+}
+/* *************************************************************** */
+/* *************************************************************** */
 template <class DTYPE>
 void reg_getNMIValue(nifti_image *referenceImage,
                      nifti_image *warpedImage,
@@ -294,150 +715,23 @@ void reg_getNMIValue(nifti_image *referenceImage,
          // Define some pointers to the current histograms
          double *jointHistoProPtr = jointhistogramPro[t];
          double *jointHistoLogPtr = jointHistogramLog[t];
-         // Empty the joint histogram
-         memset(jointHistoProPtr,0,totalBinNumber[t]*sizeof(double));
          // Fill the joint histograms using an approximation
-         DTYPE *refPtr = &refImagePtr[t*voxelNumber];
-         DTYPE *warPtr = &warImagePtr[t*voxelNumber];
-         for(size_t voxel=0; voxel<voxelNumber; ++voxel)
-         {
-            if(referenceMask[voxel]>-1)
-            {
-               DTYPE refValue=refPtr[voxel];
-               DTYPE warValue=warPtr[voxel];
-               if(refValue==refValue && warValue==warValue &&
-                     refValue>=0 && warValue>=0 &&
-                     refValue<referenceBinNumber[t] &&
-                     warValue<floatingBinNumber[t])
-               {
-                  ++jointHistoProPtr[static_cast<int>(refValue) +
-                                     static_cast<int>(warValue) * referenceBinNumber[t]];
-               }
-            }
-         }
-         // Convolve the histogram with a cubic B-spline kernel
-         double kernel[3];
-         kernel[0]=kernel[2]=GetBasisSplineValue(-1.);
-         kernel[1]=GetBasisSplineValue(0.);
-         // Histogram is first smooth along the reference axis
-         memset(jointHistoLogPtr,0,totalBinNumber[t]*sizeof(double));
-         for(int f=0; f<floatingBinNumber[t]; ++f)
-         {
-            for(int r=0; r<referenceBinNumber[t]; ++r)
-            {
-               double value=0.0;
-               int index = r-1;
-               double *ptrHisto = &jointHistoProPtr[index+referenceBinNumber[t]*f];
-
-               for(int it=0; it<3; it++)
-               {
-                  if(-1<index && index<referenceBinNumber[t])
-                  {
-                     value += *ptrHisto * kernel[it];
-                  }
-                  ++ptrHisto;
-                  ++index;
-               }
-               jointHistoLogPtr[r+referenceBinNumber[t]*f] = value;
-            }
-         }
-         // Histogram is then smooth along the warped floating axis
-         for(int r=0; r<referenceBinNumber[t]; ++r)
-         {
-            for(int f=0; f<floatingBinNumber[t]; ++f)
-            {
-               double value=0.;
-               int index = f-1;
-               double *ptrHisto = &jointHistoLogPtr[r+referenceBinNumber[t]*index];
-
-               for(int it=0; it<3; it++)
-               {
-                  if(-1<index && index<floatingBinNumber[t])
-                  {
-                     value += *ptrHisto * kernel[it];
-                  }
-                  ptrHisto+=referenceBinNumber[t];
-                  ++index;
-               }
-               jointHistoProPtr[r+referenceBinNumber[t]*f] = value;
-            }
-         }
-         // Normalise the histogram
-         double activeVoxel=0.f;
-         for(int i=0; i<totalBinNumber[t]; ++i)
-            activeVoxel+=jointHistoProPtr[i];
-         entropyValues[t][3]=activeVoxel;
-         for(int i=0; i<totalBinNumber[t]; ++i)
-            jointHistoProPtr[i]/=activeVoxel;
-         // Marginalise over the reference axis
-         for(int r=0; r<referenceBinNumber[t]; ++r)
-         {
-            double sum=0.;
-            int index=r;
-            for(int f=0; f<floatingBinNumber[t]; ++f)
-            {
-               sum+=jointHistoProPtr[index];
-               index+=referenceBinNumber[t];
-            }
-            jointHistoProPtr[referenceBinNumber[t]*
-                             floatingBinNumber[t]+r]=sum;
-         }
-         // Marginalise over the warped floating axis
-         for(int f=0; f<floatingBinNumber[t]; ++f)
-         {
-            double sum=0.;
-            int index=referenceBinNumber[t]*f;
-            for(int r=0; r<referenceBinNumber[t]; ++r)
-            {
-               sum+=jointHistoProPtr[index];
-               ++index;
-            }
-            jointHistoProPtr[referenceBinNumber[t]*
-                             floatingBinNumber[t]+referenceBinNumber[t]+f]=sum;
-         }
-         // Set the log values to zero
-         memset(jointHistoLogPtr,0,totalBinNumber[t]*sizeof(double));
-         // Compute the entropy of the reference image
-         double referenceEntropy=0.;
-         for(int r=0; r<referenceBinNumber[t]; ++r)
-         {
-            double valPro=jointHistoProPtr[referenceBinNumber[t]*floatingBinNumber[t]+r];
-            if(valPro>0)
-            {
-               double valLog=log(valPro);
-               referenceEntropy -= valPro * valLog;
-               jointHistoLogPtr[referenceBinNumber[t]*floatingBinNumber[t]+r]=valLog;
-            }
-         }
-         entropyValues[t][0]=referenceEntropy;
-         // Compute the entropy of the warped floating image
-         double warpedEntropy=0.;
-         for(int f=0; f<floatingBinNumber[t]; ++f)
-         {
-            double valPro=jointHistoProPtr[referenceBinNumber[t]*floatingBinNumber[t]+
-                                           referenceBinNumber[t]+f];
-            if(valPro>0)
-            {
-               double valLog=log(valPro);
-               warpedEntropy -= valPro * valLog;
-               jointHistoLogPtr[referenceBinNumber[t]*floatingBinNumber[t]+
-                                referenceBinNumber[t]+f]=valLog;
-            }
-         }
-         entropyValues[t][1]=warpedEntropy;
-         // Compute the joint entropy
-         double jointEntropy=0.;
-         for(int i=0; i<referenceBinNumber[t]*floatingBinNumber[t]; ++i)
-         {
-            double valPro=jointHistoProPtr[i];
-            if(valPro>0)
-            {
-               double valLog=log(valPro);
-               jointEntropy -= valPro * valLog;
-               jointHistoLogPtr[i]=valLog;
-            }
-         }
-         entropyValues[t][2]=jointEntropy;
+         reg_nmi_warpedIntensity<DTYPE> warped(&warImagePtr[t*voxelNumber]);
+         reg_getNMIJointHistogram(&refImagePtr[t*voxelNumber],
+                                  &warped,
+                                  referenceMask,
+                                  voxelNumber,
+                                  referenceBinNumber[t],
+                                  floatingBinNumber[t],
+                                  totalBinNumber[t],
+                                  jointHistoProPtr);
+         // Smooth the histogram and compute the entropies
+         reg_getNMIEntropies(referenceBinNumber[t],
+                             floatingBinNumber[t],
+                             totalBinNumber[t],
+                             jointHistoLogPtr,
+                             jointHistoProPtr,
+                             entropyValues[t]);
       } // if active time point
    } // iterate over all time point in the reference image
 }
@@ -446,6 +740,109 @@ template void reg_getNMIValue<float>(nifti_image *,nifti_image *,bool *,unsigned
 template void reg_getNMIValue<double>(nifti_image *,nifti_image *,bool *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *);
 /* *************************************************************** */
 /* *************************************************************** */
+template <class DTYPE, class FieldTYPE>
+void reg_getNMIValueFromDeformationField2(nifti_image *referenceImage,
+                                          nifti_image *floatingImage,
+                                          nifti_image *deformationField,
+                                          int interpolation,
+                                          FieldTYPE paddingValue,
+                                          bool *activeTimePoint,
+                                          unsigned short *referenceBinNumber,
+                                          unsigned short *floatingBinNumber,
+                                          unsigned short *totalBinNumber,
+                                          double **jointHistogramLog,
+                                          double **jointhistogramPro,
+                                          double **entropyValues,
+                                          int *referenceMask
+                                         )
+{
+   // Create pointers to the image data arrays
+   DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
+   // Useful variable
+   size_t voxelNumber = (size_t)referenceImage->nx *
+                        referenceImage->ny *
+                        referenceImage->nz;
+   // Iterate over all active time points
+   for(int t=0; t<referenceImage->nt; ++t)
+   {
+      if(activeTimePoint[t])
+      {
+#ifndef NDEBUG
+         char text[255];
+         sprintf(text, "Computing NMI from the deformation field for time point %i",t);
+         reg_print_msg_debug(text);
+#endif
+         // Define some pointers to the current histograms
+         double *jointHistoProPtr = jointhistogramPro[t];
+         double *jointHistoLogPtr = jointHistogramLog[t];
+         // Fill the joint histograms while resampling the floating image
+         reg_nmi_resampledIntensity<DTYPE,FieldTYPE> warped(floatingImage,
+                                                            deformationField,
+                                                            t,
+                                                            interpolation,
+                                                            paddingValue);
+         reg_getNMIJointHistogram(&refImagePtr[t*voxelNumber],
+                                  &warped,
+                                  referenceMask,
+                                  voxelNumber,
+                                  referenceBinNumber[t],
+                                  floatingBinNumber[t],
+                                  totalBinNumber[t],
+                                  jointHistoProPtr);
+         // Smooth the histogram and compute the entropies
+         reg_getNMIEntropies(referenceBinNumber[t],
+                             floatingBinNumber[t],
+                             totalBinNumber[t],
+                             jointHistoLogPtr,
+                             jointHistoProPtr,
+                             entropyValues[t]);
+      } // if active time point
+   } // iterate over all time point in the reference image
+}
+/* *************************************************************** */
+template <class DTYPE>
+void reg_getNMIValueFromDeformationField(nifti_image *referenceImage,
+                                         nifti_image *floatingImage,
+                                         nifti_image *deformationField,
+                                         int interpolation,
+                                         float paddingValue,
+                                         bool *activeTimePoint,
+                                         unsigned short *referenceBinNumber,
+                                         unsigned short *floatingBinNumber,
+                                         unsigned short *totalBinNumber,
+                                         double **jointHistogramLog,
+                                         double **jointhistogramPro,
+                                         double **entropyValues,
+                                         int *referenceMask
+                                        )
+{
+   switch(deformationField->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_getNMIValueFromDeformationField2<DTYPE,float>
+            (referenceImage, floatingImage, deformationField, interpolation,
+             paddingValue, activeTimePoint, referenceBinNumber, floatingBinNumber,
+             totalBinNumber, jointHistogramLog, jointhistogramPro, entropyValues,
+             referenceMask);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_getNMIValueFromDeformationField2<DTYPE,double>
+            (referenceImage, floatingImage, deformationField, interpolation,
+             paddingValue, activeTimePoint, referenceBinNumber, floatingBinNumber,
+             totalBinNumber, jointHistogramLog, jointhistogramPro, entropyValues,
+             referenceMask);
+      break;
+   default:
+      reg_print_fct_error("reg_getNMIValueFromDeformationField");
+      reg_print_msg_error("Unsupported deformation field datatype");
+      reg_exit(1);
+   }
+}
+/* *************************************************************** */
+template void reg_getNMIValueFromDeformationField<float>(nifti_image *,nifti_image *,nifti_image *,int,float,bool *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *);
+template void reg_getNMIValueFromDeformationField<double>(nifti_image *,nifti_image *,nifti_image *,int,float,bool *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *);
+/* *************************************************************** */
+/* *************************************************************** */
 double reg_nmi::GetSimilarityMeasureValue()
 {
    // Check that all the specified image are of the same datatype
@@ -537,6 +934,119 @@ double reg_nmi::GetSimilarityMeasureValue()
       }
    }
 
+#ifndef NDEBUG
+   reg_print_msg_debug("reg_nmi::GetSimilarityMeasureValue called");
+#endif
+   return this->GetNMIFromEntropyValues();
+}
+/* *************************************************************** */
+bool reg_nmi::CanUseDeformationField(nifti_image *forwardDeformationField,
+                                     nifti_image *backwardDeformationField)
+{
+   // The warped images are expected to share the floating (or reference)
+   // image datatype, which has to match the other input image
+   if(this->referenceImagePointer->datatype!=this->floatingImagePointer->datatype)
+      return false;
+   if(this->referenceImagePointer->datatype!=NIFTI_TYPE_FLOAT32 &&
+         this->referenceImagePointer->datatype!=NIFTI_TYPE_FLOAT64)
+      return false;
+   if(this->referenceImagePointer->nt!=this->floatingImagePointer->nt)
+      return false;
+   if(forwardDeformationField==NULL)
+      return false;
+   if(this->isSymmetric && backwardDeformationField==NULL)
+      return false;
+   return true;
+}
+/* *************************************************************** */
+double reg_nmi::GetSimilarityMeasureValue(nifti_image *forwardDeformationField,
+                                          nifti_image *backwardDeformationField,
+                                          int interpolation,
+                                          float paddingValue)
+{
+   if(!this->CanUseDeformationField(forwardDeformationField,backwardDeformationField))
+   {
+      reg_print_fct_error("reg_nmi::GetSimilarityMeasureValue()");
+      reg_print_msg_error("The deformation field(s) can not be used with the current input images");
+      reg_exit(1);
+   }
+   switch(this->referenceImagePointer->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_getNMIValueFromDeformationField<float>
+      (this->referenceImagePointer,
+       this->floatingImagePointer,
+       forwardDeformationField,
+       interpolation,
+       paddingValue,
+       this->activeTimePoint,
+       this->referenceBinNumber,
+       this->floatingBinNumber,
+       this->totalBinNumber,
+       this->forwardJointHistogramLog,
+       this->forwardJointHistogramPro,
+       this->forwardEntropyValues,
+       this->referenceMaskPointer
+      );
+      if(this->isSymmetric)
+         reg_getNMIValueFromDeformationField<float>
+         (this->floatingImagePointer,
+          this->referenceImagePointer,
+          backwardDeformationField,
+          interpolation,
+          paddingValue,
+          this->activeTimePoint,
+          this->floatingBinNumber,
+          this->referenceBinNumber,
+          this->totalBinNumber,
+          this->backwardJointHistogramLog,
+          this->backwardJointHistogramPro,
+          this->backwardEntropyValues,
+          this->floatingMaskPointer
+         );
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_getNMIValueFromDeformationField<double>
+      (this->referenceImagePointer,
+       this->floatingImagePointer,
+       forwardDeformationField,
+       interpolation,
+       paddingValue,
+       this->activeTimePoint,
+       this->referenceBinNumber,
+       this->floatingBinNumber,
+       this->totalBinNumber,
+       this->forwardJointHistogramLog,
+       this->forwardJointHistogramPro,
+       this->forwardEntropyValues,
+       this->referenceMaskPointer
+      );
+      if(this->isSymmetric)
+         reg_getNMIValueFromDeformationField<double>
+         (this->floatingImagePointer,
+          this->referenceImagePointer,
+          backwardDeformationField,
+          interpolation,
+          paddingValue,
+          this->activeTimePoint,
+          this->floatingBinNumber,
+          this->referenceBinNumber,
+          this->totalBinNumber,
+          this->backwardJointHistogramLog,
+          this->backwardJointHistogramPro,
+          this->backwardEntropyValues,
+          this->floatingMaskPointer
+         );
+      break;
+   }
+#ifndef NDEBUG
+   reg_print_msg_debug("reg_nmi::GetSimilarityMeasureValue(deformation fields) called");
+#endif
+   return this->GetNMIFromEntropyValues();
+}
+/* *************************************************************** */
+double reg_nmi::GetNMIFromEntropyValues()
+{
    double nmi_value_forward=0.;
    double nmi_value_backward=0.;
    for(int t=0; t<this->referenceTimePoint; ++t)
@@ -552,9 +1062,6 @@ double reg_nmi::GetSimilarityMeasureValue()
                   this->backwardEntropyValues[t][2];
       }
    }
-#ifndef NDEBUG
-   reg_print_msg_debug("reg_nmi::GetSimilarityMeasureValue called");
-#endif
    return nmi_value_forward+nmi_value_backward;
 }
 /* *************************************************************** */
@@ -38,6 +38,17 @@ public:
                           nifti_image *bckVoxBasedGraPtr = NULL);
    /// @brief Returns the nmi value
    double GetSimilarityMeasureValue();
+   /// @brief Returns the nmi value, the floating (and reference) images being
+   /// resampled on the fly through the deformation field(s) while the joint
+   /// histograms are filled. The warped images are left untouched.
+   double GetSimilarityMeasureValue(nifti_image *forwardDeformationField,
+                                    nifti_image *backwardDeformationField,
+                                    int interpolation,
+                                    float paddingValue);
+   /// @brief Returns true if the input images allow the nmi value to be
+   /// computed directly from the deformation field(s)
+   bool CanUseDeformationField(nifti_image *forwardDeformationField,
+                               nifti_image *backwardDeformationField);
    /// @brief Compute the voxel based nmi gradient
    void GetVoxelBasedSimilarityMeasureGradient();
    void SetRefAndFloatBinNumbers(unsigned short refBinNumber, unsigned short floBinNumber, int timepoint)
@@ -76,6 +87,7 @@ protected:
    double **backwardEntropyValues;
 
    void ClearHistogram();
+   double GetNMIFromEntropyValues();
 };
 /* *************************************************************** */
 /* *************************************************************** */
@@ -123,6 +135,27 @@ void reg_getNMIValue(nifti_image *referenceImage,
                      int *referenceMask
                     );
 /* *************************************************************** */
+/** @brief Computes the nmi value exactly as reg_getNMIValue does for a warped
+ * image obtained using reg_resampleImage, but without generating the warped
+ * image: every voxel of the floating image is interpolated through the
+ * deformation field and directly added to the joint histogram.
+ */
+extern "C++" template <class DTYPE>
+void reg_getNMIValueFromDeformationField(nifti_image *referenceImage,
+                                         nifti_image *floatingImage,
+                                         nifti_image *deformationField,
+                                         int interpolation,
+                                         float paddingValue,
+                                         bool *activeTimePoint,
+                                         unsigned short *referenceBinNumber,
+                                         unsigned short *floatingBinNumber,
+                                         unsigned short *totalBinNumber,
+                                         double **jointHistogramLog,
+                                         double **jointhistogramPro,
+                                         double **entropyValues,
+                                         int *referenceMask
+                                        );
+/* *************************************************************** */
 extern "C++" template <class DTYPE>
 void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
                                     nifti_image *warpedImage,
@@ -144,6 +144,11 @@ public:
    {
       this->currentIterationNumber++;
    }
+   /// @brief Returns the number of bytes allocated by the optimiser
+   virtual size_t GetMemoryUsage()
+   {
+      return (this->dofNumber+this->dofNumber_b)*sizeof(T);
+   }
    virtual void Initialise(size_t nvox,
                            int dim,
                            bool optX,
@@ -202,6 +207,11 @@ public:
                          T smallLength,
                          T &startLength);
    virtual void Perturbation(float length);
+   virtual size_t GetMemoryUsage()
+   {
+      // The two conjugate directions are stored with the best parameters
+      return 3*(this->dofNumber+this->dofNumber_b)*sizeof(T);
+   }
 
    // Function used for testing
    virtual void reg_test_optimiser();
@@ -15,9 +15,6 @@
 #include "_reg_resampling.h"
 #include "_reg_maths.h"
 
-#define SINC_KERNEL_RADIUS 3
-#define SINC_KERNEL_SIZE SINC_KERNEL_RADIUS*2
-
 /* *************************************************************** */
 void interpWindowedSincKernel(double relative, double *basis)
 {
@@ -344,7 +341,7 @@ void reg_dti_resampling_postprocessing(nifti_image *inputImage,
    }
 }
 /* *************************************************************** */
-template<class FloatingTYPE, class FieldTYPE>
+template<class FloatingTYPE, class FieldTYPE, class WarpedTYPE>
 void ResampleImage3D(nifti_image *floatingImage,
                      nifti_image *deformationField,
                      nifti_image *warpedImage,
@@ -362,7 +359,7 @@ void ResampleImage3D(nifti_image *floatingImage,
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
 #endif
    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
-   FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+   WarpedTYPE *warpedIntensityPtr = static_cast<WarpedTYPE *>(warpedImage->data);
    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
    FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
@@ -410,7 +407,7 @@ void ResampleImage3D(nifti_image *floatingImage,
       reg_print_msg_debug(text);
 #endif
 
-      FloatingTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
+      WarpedTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
       FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
 
       double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE], relative[3];
@@ -484,10 +481,10 @@ void ResampleImage3D(nifti_image *floatingImage,
             }
          }
 
-         switch(floatingImage->datatype)
+         switch(warpedImage->datatype)
          {
          case NIFTI_TYPE_FLOAT32:
-            warpedIntensity[index]=static_cast<FloatingTYPE>(intensity);
+            warpedIntensity[index]=static_cast<WarpedTYPE>(intensity);
             break;
          case NIFTI_TYPE_FLOAT64:
             warpedIntensity[index]=intensity;
@@ -496,31 +493,31 @@ void ResampleImage3D(nifti_image *floatingImage,
             if(intensity!=intensity)
                intensity=0;
             intensity=(intensity<=255?reg_round(intensity):255); // 255=2^8-1
-            warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+            warpedIntensity[index]=static_cast<WarpedTYPE>(intensity>0?reg_round(intensity):0);
             break;
          case NIFTI_TYPE_UINT16:
             if(intensity!=intensity)
                intensity=0;
             intensity=(intensity<=65535?reg_round(intensity):65535); // 65535=2^16-1
-            warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+            warpedIntensity[index]=static_cast<WarpedTYPE>(intensity>0?reg_round(intensity):0);
             break;
          case NIFTI_TYPE_UINT32:
             if(intensity!=intensity)
                intensity=0;
             intensity=(intensity<=4294967295U?reg_round(intensity):4294967295U); // 4294967295=2^32-1
-            warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+            warpedIntensity[index]=static_cast<WarpedTYPE>(intensity>0?reg_round(intensity):0);
             break;
          default:
             if(intensity!=intensity)
                intensity=0;
-            warpedIntensity[index]=static_cast<FloatingTYPE>(reg_round(intensity));
+            warpedIntensity[index]=static_cast<WarpedTYPE>(reg_round(intensity));
             break;
          }
       }
    }
 }
 /* *************************************************************** */
-template<class FloatingTYPE, class FieldTYPE>
+template<class FloatingTYPE, class FieldTYPE, class WarpedTYPE>
 void ResampleImage2D(nifti_image *floatingImage,
                      nifti_image *deformationField,
                      nifti_image *warpedImage,
@@ -538,7 +535,7 @@ void ResampleImage2D(nifti_image *floatingImage,
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny;
 #endif
    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
-   FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+   WarpedTYPE *warpedIntensityPtr = static_cast<WarpedTYPE *>(warpedImage->data);
    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
 
@@ -557,7 +554,7 @@ void ResampleImage2D(nifti_image *floatingImage,
       sprintf(text, "2D resampling of volume number %lu",t);
       reg_print_msg_debug(text);
 #endif
-      FloatingTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
+      WarpedTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
       FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
 
       double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], relative[2];
@@ -643,28 +640,28 @@ void ResampleImage2D(nifti_image *floatingImage,
                intensity += xTempNewValue * yBasis[b];
             }
 
-            switch(floatingImage->datatype)
+            switch(warpedImage->datatype)
             {
             case NIFTI_TYPE_FLOAT32:
-               warpedIntensity[index]=static_cast<FloatingTYPE>(intensity);
+               warpedIntensity[index]=static_cast<WarpedTYPE>(intensity);
                break;
             case NIFTI_TYPE_FLOAT64:
                warpedIntensity[index]=intensity;
                break;
             case NIFTI_TYPE_UINT8:
                intensity=(intensity<=255?reg_round(intensity):255); // 255=2^8-1
-               warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+               warpedIntensity[index]=static_cast<WarpedTYPE>(intensity>0?reg_round(intensity):0);
                break;
             case NIFTI_TYPE_UINT16:
                intensity=(intensity<=65535?reg_round(intensity):65535); // 65535=2^16-1
-               warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+               warpedIntensity[index]=static_cast<WarpedTYPE>(intensity>0?reg_round(intensity):0);
                break;
             case NIFTI_TYPE_UINT32:
                intensity=(intensity<=4294967295U?reg_round(intensity):4294967295U); // 4294967295=2^32-1
-               warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+               warpedIntensity[index]=static_cast<WarpedTYPE>(intensity>0?reg_round(intensity):0);
                break;
             default:
-               warpedIntensity[index]=static_cast<FloatingTYPE>(reg_round(intensity));
+               warpedIntensity[index]=static_cast<WarpedTYPE>(reg_round(intensity));
                break;
             }
          }
@@ -686,7 +683,7 @@ void ResampleImage2D(nifti_image *floatingImage,
  * that provides the position of the DT components (if there are any)
  * these values are set to -1 if there are not
  */
-template <class FieldTYPE, class FloatingTYPE>
+template <class FieldTYPE, class FloatingTYPE, class WarpedTYPE>
 void reg_resampleImage2(nifti_image *floatingImage,
                         nifti_image *warpedImage,
                         nifti_image *deformationFieldImage,
@@ -706,21 +703,21 @@ void reg_resampleImage2(nifti_image *floatingImage,
    // The deformation field contains the position in the real world
    if(deformationFieldImage->nz>1)
    {
-      ResampleImage3D<FloatingTYPE,FieldTYPE>(floatingImage,
-                                              deformationFieldImage,
-                                              warpedImage,
-                                              mask,
-                                              paddingValue,
-                                              interp);
+      ResampleImage3D<FloatingTYPE,FieldTYPE,WarpedTYPE>(floatingImage,
+                                                         deformationFieldImage,
+                                                         warpedImage,
+                                                         mask,
+                                                         paddingValue,
+                                                         interp);
    }
    else
    {
-      ResampleImage2D<FloatingTYPE,FieldTYPE>(floatingImage,
-                                              deformationFieldImage,
-                                              warpedImage,
-                                              mask,
-                                              paddingValue,
-                                              interp);
+      ResampleImage2D<FloatingTYPE,FieldTYPE,WarpedTYPE>(floatingImage,
+                                                         deformationFieldImage,
+                                                         warpedImage,
+                                                         mask,
+                                                         paddingValue,
+                                                         interp);
    }
    // The temporary logged floating array is deleted and the original restored
    if(originalFloatingData!=NULL)
@@ -731,10 +728,50 @@ void reg_resampleImage2(nifti_image *floatingImage,
    }
 
    // The interpolated tensors are reoriented and exponentiated
-   reg_dti_resampling_postprocessing<FloatingTYPE>(warpedImage,
-                                                   mask,
-                                                   jacMat,
-                                                   dtIndicies);
+   reg_dti_resampling_postprocessing<WarpedTYPE>(warpedImage,
+                                                 mask,
+                                                 jacMat,
+                                                 dtIndicies);
+}
+/* *************************************************************** */
+/// Resamples into a warped image of the floating data type or, for floating
+/// images stored with another type, of single or double precision
+template <class FieldTYPE, class FloatingTYPE>
+void reg_resampleImage1(nifti_image *floatingImage,
+                        nifti_image *warpedImage,
+                        nifti_image *deformationFieldImage,
+                        int *mask,
+                        int interp,
+                        FieldTYPE paddingValue,
+                        int *dtIndicies,
+                        mat33 * jacMat)
+{
+   if(warpedImage->datatype==floatingImage->datatype)
+      reg_resampleImage2<FieldTYPE,FloatingTYPE,FloatingTYPE>(floatingImage,
+                                                              warpedImage,
+                                                              deformationFieldImage,
+                                                              mask,
+                                                              interp,
+                                                              paddingValue,
+                                                              dtIndicies,
+                                                              jacMat);
+   else if(warpedImage->datatype==NIFTI_TYPE_FLOAT32)
+      reg_resampleImage2<FieldTYPE,FloatingTYPE,float>(floatingImage,
+                                                       warpedImage,
+                                                       deformationFieldImage,
+                                                       mask,
+                                                       interp,
+                                                       paddingValue,
+                                                       dtIndicies,
+                                                       jacMat);
+   else reg_resampleImage2<FieldTYPE,FloatingTYPE,double>(floatingImage,
+                                                           warpedImage,
+                                                           deformationFieldImage,
+                                                           mask,
+                                                           interp,
+                                                           paddingValue,
+                                                           dtIndicies,
+                                                           jacMat);
 }
 /* *************************************************************** */
 void reg_resampleImage(nifti_image *floatingImage,
@@ -746,10 +783,13 @@ void reg_resampleImage(nifti_image *floatingImage,
                        bool *dti_timepoint,
                        mat33 * jacMat)
 {
-   if(floatingImage->datatype != warpedImage->datatype)
+   // Floating images of any type can be resampled into single or double precision
+   if(floatingImage->datatype != warpedImage->datatype &&
+         ((warpedImage->datatype != NIFTI_TYPE_FLOAT32 && warpedImage->datatype != NIFTI_TYPE_FLOAT64) ||
+          dti_timepoint != NULL))
    {
       reg_print_fct_error("reg_resampleImage");
-      reg_print_msg_error("The floating and warped image should have the same data type");
+      reg_print_msg_error("The warped image should have the floating data type, or a floating point type");
       reg_exit(1);
    }
 
@@ -800,7 +840,7 @@ void reg_resampleImage(nifti_image *floatingImage,
       switch ( floatingImage->datatype )
       {
       case NIFTI_TYPE_UINT8:
-         reg_resampleImage2<float,unsigned char>(floatingImage,
+         reg_resampleImage1<float,unsigned char>(floatingImage,
                                                  warpedImage,
                                                  deformationField,
                                                  mask,
@@ -810,7 +850,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                  jacMat);
          break;
       case NIFTI_TYPE_INT8:
-         reg_resampleImage2<float,char>(floatingImage,
+         reg_resampleImage1<float,char>(floatingImage,
                                         warpedImage,
                                         deformationField,
                                         mask,
@@ -820,7 +860,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                         jacMat);
          break;
       case NIFTI_TYPE_UINT16:
-         reg_resampleImage2<float,unsigned short>(floatingImage,
+         reg_resampleImage1<float,unsigned short>(floatingImage,
                                                   warpedImage,
                                                   deformationField,
                                                   mask,
@@ -830,7 +870,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                   jacMat);
          break;
       case NIFTI_TYPE_INT16:
-         reg_resampleImage2<float,short>(floatingImage,
+         reg_resampleImage1<float,short>(floatingImage,
                                          warpedImage,
                                          deformationField,
                                          mask,
@@ -840,7 +880,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                          jacMat);
          break;
       case NIFTI_TYPE_UINT32:
-         reg_resampleImage2<float,unsigned int>(floatingImage,
+         reg_resampleImage1<float,unsigned int>(floatingImage,
                                                 warpedImage,
                                                 deformationField,
                                                 mask,
@@ -850,7 +890,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                 jacMat);
          break;
       case NIFTI_TYPE_INT32:
-         reg_resampleImage2<float,int>(floatingImage,
+         reg_resampleImage1<float,int>(floatingImage,
                                        warpedImage,
                                        deformationField,
                                        mask,
@@ -860,7 +900,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                        jacMat);
          break;
       case NIFTI_TYPE_FLOAT32:
-         reg_resampleImage2<float,float>(floatingImage,
+         reg_resampleImage1<float,float>(floatingImage,
                                          warpedImage,
                                          deformationField,
                                          mask,
@@ -870,7 +910,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                          jacMat);
          break;
       case NIFTI_TYPE_FLOAT64:
-         reg_resampleImage2<float,double>(floatingImage,
+         reg_resampleImage1<float,double>(floatingImage,
                                           warpedImage,
                                           deformationField,
                                           mask,
@@ -888,7 +928,7 @@ void reg_resampleImage(nifti_image *floatingImage,
       switch ( floatingImage->datatype )
       {
       case NIFTI_TYPE_UINT8:
-         reg_resampleImage2<double,unsigned char>(floatingImage,
+         reg_resampleImage1<double,unsigned char>(floatingImage,
                                                   warpedImage,
                                                   deformationField,
                                                   mask,
@@ -898,7 +938,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                   jacMat);
          break;
       case NIFTI_TYPE_INT8:
-         reg_resampleImage2<double,char>(floatingImage,
+         reg_resampleImage1<double,char>(floatingImage,
                                          warpedImage,
                                          deformationField,
                                          mask,
@@ -908,7 +948,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                          jacMat);
          break;
       case NIFTI_TYPE_UINT16:
-         reg_resampleImage2<double,unsigned short>(floatingImage,
+         reg_resampleImage1<double,unsigned short>(floatingImage,
                                                    warpedImage,
                                                    deformationField,
                                                    mask,
@@ -918,7 +958,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                    jacMat);
          break;
       case NIFTI_TYPE_INT16:
-         reg_resampleImage2<double,short>(floatingImage,
+         reg_resampleImage1<double,short>(floatingImage,
                                           warpedImage,
                                           deformationField,
                                           mask,
@@ -928,7 +968,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                           jacMat);
          break;
       case NIFTI_TYPE_UINT32:
-         reg_resampleImage2<double,unsigned int>(floatingImage,
+         reg_resampleImage1<double,unsigned int>(floatingImage,
                                                  warpedImage,
                                                  deformationField,
                                                  mask,
@@ -938,7 +978,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                  jacMat );
          break;
       case NIFTI_TYPE_INT32:
-         reg_resampleImage2<double,int>(floatingImage,
+         reg_resampleImage1<double,int>(floatingImage,
                                         warpedImage,
                                         deformationField,
                                         mask,
@@ -948,7 +988,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                         jacMat);
          break;
       case NIFTI_TYPE_FLOAT32:
-         reg_resampleImage2<double,float>(floatingImage,
+         reg_resampleImage1<double,float>(floatingImage,
                                           warpedImage,
                                           deformationField,
                                           mask,
@@ -958,7 +998,7 @@ void reg_resampleImage(nifti_image *floatingImage,
                                           jacMat);
          break;
       case NIFTI_TYPE_FLOAT64:
-         reg_resampleImage2<double,double>(floatingImage,
+         reg_resampleImage1<double,double>(floatingImage,
                                            warpedImage,
                                            deformationField,
                                            mask,
@@ -983,6 +1023,487 @@ void reg_resampleImage(nifti_image *floatingImage,
    }
 }
 /* *************************************************************** */
+/* *************************************************************** */
+/// Converts an interpolated intensity to the floating datatype, as done by ResampleImage3D()
+template<class FloatingTYPE>
+static inline FloatingTYPE reg_castResampledIntensity(double intensity, int datatype)
+{
+   switch(datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+   case NIFTI_TYPE_FLOAT64:
+      return static_cast<FloatingTYPE>(intensity);
+   case NIFTI_TYPE_UINT8:
+      if(intensity!=intensity)
+         intensity=0;
+      intensity=(intensity<=255?reg_round(intensity):255); // 255=2^8-1
+      return static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+   case NIFTI_TYPE_UINT16:
+      if(intensity!=intensity)
+         intensity=0;
+      intensity=(intensity<=65535?reg_round(intensity):65535); // 65535=2^16-1
+      return static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+   case NIFTI_TYPE_UINT32:
+      if(intensity!=intensity)
+         intensity=0;
+      intensity=(intensity<=4294967295U?reg_round(intensity):4294967295U); // 4294967295=2^32-1
+      return static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+   default:
+      if(intensity!=intensity)
+         intensity=0;
+      return static_cast<FloatingTYPE>(reg_round(intensity));
+   }
+}
+/* *************************************************************** */
+/// Selects the interpolation kernel, as done by ResampleImage3D()
+static void reg_getResamplingKernel(int kernel,
+                                    int &kernel_size,
+                                    int &kernel_offset,
+                                    void (*&kernelCompFctPtr)(double,double *))
+{
+   switch(kernel){
+   case 0:
+      kernel_size=2;
+      kernelCompFctPtr=&interpNearestNeighKernel;
+      kernel_offset=0;
+      break; // nereast-neighboor interpolation
+   case 1:
+      kernel_size=2;
+      kernelCompFctPtr=&interpLinearKernel;
+      kernel_offset=0;
+      break; // linear interpolation
+   case 4:
+      kernel_size=SINC_KERNEL_SIZE;
+      kernelCompFctPtr=&interpWindowedSincKernel;
+      kernel_offset=SINC_KERNEL_RADIUS;
+      break; // sinc interpolation
+   default:
+      kernel_size=4;
+      kernelCompFctPtr=&interpCubicSplineKernel;
+      kernel_offset=1;
+      break; // cubic spline interpolation
+   }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, class FieldTYPE>
+void ResampleImages3D(nifti_image **floatingImages,
+                      nifti_image **warpedImages,
+                      size_t imageNumber,
+                      nifti_image *deformationField,
+                      int *mask,
+                      FieldTYPE paddingValue,
+                      int kernel)
+{
+#if defined(_WIN32) && !defined(__GNUC__)
+   long  index;
+   long warpedVoxelNumber = (long)warpedImages[0]->nx*warpedImages[0]->ny*warpedImages[0]->nz;
+   long floatingVoxelNumber = (long)floatingImages[0]->nx*floatingImages[0]->ny*floatingImages[0]->nz;
+#else
+   size_t  index;
+   size_t warpedVoxelNumber = (size_t)warpedImages[0]->nx*warpedImages[0]->ny*warpedImages[0]->nz;
+   size_t floatingVoxelNumber = (size_t)floatingImages[0]->nx*floatingImages[0]->ny*floatingImages[0]->nz;
+#endif
+   const int floatingDim[3]={floatingImages[0]->nx,floatingImages[0]->ny,floatingImages[0]->nz};
+   const int datatype=floatingImages[0]->datatype;
+   FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
+   FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
+   FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
+
+   int *maskPtr = &mask[0];
+
+   // All floating images share the same geometry
+   mat44 *floatingIJKMatrix;
+   if(floatingImages[0]->sform_code>0)
+      floatingIJKMatrix=&(floatingImages[0]->sto_ijk);
+   else floatingIJKMatrix=&(floatingImages[0]->qto_ijk);
+
+   // Define the kernel to use
+   int kernel_size;
+   int kernel_offset=0;
+   void (*kernelCompFctPtr)(double,double *);
+   reg_getResamplingKernel(kernel, kernel_size, kernel_offset, kernelCompFctPtr);
+
+   double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE], relative[3];
+   int a, b, c, Y, Z, previous[3];
+   size_t n, t;
+   bool active, inside;
+
+   FloatingTYPE *zPointer, *xyzPointer;
+   double xTempNewValue, yTempNewValue, intensity, world[3], position[3];
+   // The weights of each warped voxel are computed once and applied to every volume of every image
+#if defined (_OPENMP)
+#pragma omp parallel for default(shared) \
+   private(index, intensity, world, position, previous, xBasis, yBasis, zBasis, relative, \
+   a, b, c, Y, Z, n, t, active, inside, zPointer, xyzPointer, xTempNewValue, yTempNewValue)
+#endif // _OPENMP
+   for(index=0; index<warpedVoxelNumber; index++)
+   {
+      // The private variables are reset as they are only set for active voxels
+      previous[0]=previous[1]=previous[2]=0;
+      inside=false;
+      active=(maskPtr[index])>-1;
+      if(active)
+      {
+         world[0]=static_cast<double>(deformationFieldPtrX[index]);
+         world[1]=static_cast<double>(deformationFieldPtrY[index]);
+         world[2]=static_cast<double>(deformationFieldPtrZ[index]);
+
+         // real -> voxel; floating space
+         reg_mat44_mul(floatingIJKMatrix, world, position);
+
+         previous[0] = static_cast<int>(reg_floor(position[0]));
+         previous[1] = static_cast<int>(reg_floor(position[1]));
+         previous[2] = static_cast<int>(reg_floor(position[2]));
+
+         relative[0]=position[0]-static_cast<double>(previous[0]);
+         relative[1]=position[1]-static_cast<double>(previous[1]);
+         relative[2]=position[2]-static_cast<double>(previous[2]);
+
+         (*kernelCompFctPtr)(relative[0], xBasis);
+         (*kernelCompFctPtr)(relative[1], yBasis);
+         (*kernelCompFctPtr)(relative[2], zBasis);
+         previous[0]-=kernel_offset;
+         previous[1]-=kernel_offset;
+         previous[2]-=kernel_offset;
+
+         // The bounds need not be checked for each weight if the whole kernel lies within the image
+         inside=previous[0]>-1 && previous[0]+kernel_size<=floatingDim[0] &&
+                previous[1]>-1 && previous[1]+kernel_size<=floatingDim[1] &&
+                previous[2]>-1 && previous[2]+kernel_size<=floatingDim[2];
+      }
+
+      for(n=0; n<imageNumber; ++n)
+      {
+         FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImages[n]->data);
+         FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImages[n]->data);
+         for(t=0; t<(size_t)warpedImages[n]->nt*warpedImages[n]->nu; ++t)
+         {
+            FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
+
+            intensity=paddingValue;
+            if(active && inside)
+            {
+               intensity=0.0;
+               for(c=0; c<kernel_size; c++)
+               {
+                  zPointer = &floatingIntensity[(previous[2]+c)*floatingDim[0]*floatingDim[1]];
+                  yTempNewValue=0.0;
+                  for(b=0; b<kernel_size; b++)
+                  {
+                     xyzPointer = &zPointer[(previous[1]+b)*floatingDim[0]+previous[0]];
+                     xTempNewValue=0.0;
+                     for(a=0; a<kernel_size; a++)
+                        xTempNewValue +=  static_cast<double>(xyzPointer[a]) * xBasis[a];
+                     yTempNewValue += xTempNewValue * yBasis[b];
+                  }
+                  intensity += yTempNewValue * zBasis[c];
+               }
+            }
+            else if(active)
+            {
+               intensity=0.0;
+               for(c=0; c<kernel_size; c++)
+               {
+                  Z= previous[2]+c;
+                  zPointer = &floatingIntensity[Z*floatingDim[0]*floatingDim[1]];
+                  yTempNewValue=0.0;
+                  for(b=0; b<kernel_size; b++)
+                  {
+                     Y= previous[1]+b;
+                     xyzPointer = &zPointer[Y*floatingDim[0]+previous[0]];
+                     xTempNewValue=0.0;
+                     for(a=0; a<kernel_size; a++)
+                     {
+                        if(-1<(previous[0]+a) && (previous[0]+a)<floatingDim[0] &&
+                              -1<Z && Z<floatingDim[2] &&
+                              -1<Y && Y<floatingDim[1])
+                        {
+                           xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
+                        }
+                        else
+                        {
+                           // paddingValue
+                           xTempNewValue +=  paddingValue * xBasis[a];
+                        }
+                        xyzPointer++;
+                     }
+                     yTempNewValue += xTempNewValue * yBasis[b];
+                  }
+                  intensity += yTempNewValue * zBasis[c];
+               }
+            }
+            warpedIntensityPtr[t*warpedVoxelNumber+index]=reg_castResampledIntensity<FloatingTYPE>(intensity, datatype);
+         }
+      }
+   }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, class FieldTYPE>
+void ResampleImages2D(nifti_image **floatingImages,
+                      nifti_image **warpedImages,
+                      size_t imageNumber,
+                      nifti_image *deformationField,
+                      int *mask,
+                      FieldTYPE paddingValue,
+                      int kernel)
+{
+#if defined(_WIN32) && !defined(__GNUC__)
+   long  index;
+   long warpedVoxelNumber = (long)warpedImages[0]->nx*warpedImages[0]->ny;
+   long floatingVoxelNumber = (long)floatingImages[0]->nx*floatingImages[0]->ny;
+#else
+   size_t  index;
+   size_t warpedVoxelNumber = (size_t)warpedImages[0]->nx*warpedImages[0]->ny;
+   size_t floatingVoxelNumber = (size_t)floatingImages[0]->nx*floatingImages[0]->ny;
+#endif
+   const int floatingDim[2]={floatingImages[0]->nx,floatingImages[0]->ny};
+   const int datatype=floatingImages[0]->datatype;
+   FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
+   FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
+
+   int *maskPtr = &mask[0];
+
+   // All floating images share the same geometry
+   mat44 *floatingIJKMatrix;
+   if(floatingImages[0]->sform_code>0)
+      floatingIJKMatrix=&(floatingImages[0]->sto_ijk);
+   else floatingIJKMatrix=&(floatingImages[0]->qto_ijk);
+
+   // Define the kernel to use
+   int kernel_size;
+   int kernel_offset=0;
+   void (*kernelCompFctPtr)(double,double *);
+   reg_getResamplingKernel(kernel, kernel_size, kernel_offset, kernelCompFctPtr);
+
+   double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], relative[2];
+   int a, b, Y, previous[2];
+   size_t n, t;
+   bool active, inside;
+
+   FloatingTYPE *xyzPointer;
+   FieldTYPE xTempNewValue, intensity, world[3], position[3];
+   // The weights of each warped pixel are computed once and applied to every volume of every image
+#if defined (_OPENMP)
+#pragma omp parallel for default(shared) \
+   private(index, intensity, world, position, previous, xBasis, yBasis, relative, \
+   a, b, Y, n, t, active, inside, xyzPointer, xTempNewValue)
+#endif // _OPENMP
+   for(index=0; index<warpedVoxelNumber; index++)
+   {
+      // The private variables are reset as they are only set for active pixels
+      previous[0]=previous[1]=0;
+      inside=false;
+      active=(maskPtr[index])>-1;
+      if(active)
+      {
+         world[0]=static_cast<FieldTYPE>(deformationFieldPtrX[index]);
+         world[1]=static_cast<FieldTYPE>(deformationFieldPtrY[index]);
+         world[2]=0;
+
+         // real -> voxel; floating space
+         reg_mat44_mul(floatingIJKMatrix, world, position);
+
+         previous[0] = static_cast<int>(reg_floor(position[0]));
+         previous[1] = static_cast<int>(reg_floor(position[1]));
+
+         relative[0]=position[0]-static_cast<FieldTYPE>(previous[0]);
+         relative[1]=position[1]-static_cast<FieldTYPE>(previous[1]);
+
+         (*kernelCompFctPtr)(relative[0], xBasis);
+         (*kernelCompFctPtr)(relative[1], yBasis);
+         previous[0]-=kernel_offset;
+         previous[1]-=kernel_offset;
+
+         // The bounds need not be checked for each weight if the whole kernel lies within the image
+         inside=previous[0]>-1 && previous[0]+kernel_size<=floatingDim[0] &&
+                previous[1]>-1 && previous[1]+kernel_size<=floatingDim[1];
+      }
+
+      for(n=0; n<imageNumber; ++n)
+      {
+         FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImages[n]->data);
+         FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImages[n]->data);
+         for(t=0; t<(size_t)warpedImages[n]->nt*warpedImages[n]->nu; ++t)
+         {
+            FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
+
+            intensity=paddingValue;
+            if(active && inside)
+            {
+               intensity=static_cast<FieldTYPE>(0);
+               for(b=0; b<kernel_size; b++)
+               {
+                  xyzPointer = &floatingIntensity[(previous[1]+b)*floatingDim[0]+previous[0]];
+                  xTempNewValue=0.0;
+                  for(a=0; a<kernel_size; a++)
+                     xTempNewValue +=  (FieldTYPE)xyzPointer[a] * xBasis[a];
+                  intensity += xTempNewValue * yBasis[b];
+               }
+            }
+            else if(active)
+            {
+               intensity=static_cast<FieldTYPE>(0);
+               for(b=0; b<kernel_size; b++)
+               {
+                  Y= previous[1]+b;
+                  xyzPointer = &floatingIntensity[Y*floatingDim[0]+previous[0]];
+                  xTempNewValue=0.0;
+                  for(a=0; a<kernel_size; a++)
+                  {
+                     if(-1<(previous[0]+a) && (previous[0]+a)<floatingDim[0] &&
+                           -1<Y && Y<floatingDim[1])
+                     {
+                        xTempNewValue +=  (FieldTYPE)*xyzPointer * xBasis[a];
+                     }
+                     else
+                     {
+                        // paddingValue
+                        xTempNewValue +=  paddingValue * xBasis[a];
+                     }
+                     xyzPointer++;
+                  }
+                  intensity += xTempNewValue * yBasis[b];
+               }
+            }
+            warpedIntensityPtr[t*warpedVoxelNumber+index]=reg_castResampledIntensity<FloatingTYPE>(intensity, datatype);
+         }
+      }
+   }
+}
+/* *************************************************************** */
+template <class FieldTYPE>
+void reg_resampleImages2(nifti_image **floatingImages,
+                         nifti_image **warpedImages,
+                         size_t imageNumber,
+                         nifti_image *deformationField,
+                         int *mask,
+                         int interp,
+                         FieldTYPE paddingValue)
+{
+   void (*resampleFctPtr)(nifti_image **, nifti_image **, size_t, nifti_image *, int *, FieldTYPE, int);
+   const bool is3D = deformationField->nz>1;
+   switch(floatingImages[0]->datatype)
+   {
+   case NIFTI_TYPE_UINT8:
+      resampleFctPtr = is3D ? &ResampleImages3D<unsigned char,FieldTYPE> : &ResampleImages2D<unsigned char,FieldTYPE>;
+      break;
+   case NIFTI_TYPE_INT8:
+      resampleFctPtr = is3D ? &ResampleImages3D<char,FieldTYPE> : &ResampleImages2D<char,FieldTYPE>;
+      break;
+   case NIFTI_TYPE_UINT16:
+      resampleFctPtr = is3D ? &ResampleImages3D<unsigned short,FieldTYPE> : &ResampleImages2D<unsigned short,FieldTYPE>;
+      break;
+   case NIFTI_TYPE_INT16:
+      resampleFctPtr = is3D ? &ResampleImages3D<short,FieldTYPE> : &ResampleImages2D<short,FieldTYPE>;
+      break;
+   case NIFTI_TYPE_UINT32:
+      resampleFctPtr = is3D ? &ResampleImages3D<unsigned int,FieldTYPE> : &ResampleImages2D<unsigned int,FieldTYPE>;
+      break;
+   case NIFTI_TYPE_INT32:
+      resampleFctPtr = is3D ? &ResampleImages3D<int,FieldTYPE> : &ResampleImages2D<int,FieldTYPE>;
+      break;
+   case NIFTI_TYPE_FLOAT32:
+      resampleFctPtr = is3D ? &ResampleImages3D<float,FieldTYPE> : &ResampleImages2D<float,FieldTYPE>;
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      resampleFctPtr = is3D ? &ResampleImages3D<double,FieldTYPE> : &ResampleImages2D<double,FieldTYPE>;
+      break;
+   default:
+      reg_print_msg_warn("floating pixel type unsupported.");
+      return;
+   }
+   (*resampleFctPtr)(floatingImages, warpedImages, imageNumber, deformationField, mask, paddingValue, interp);
+}
+/* *************************************************************** */
+void reg_resampleImages(nifti_image **floatingImages,
+                        nifti_image **warpedImages,
+                        size_t imageNumber,
+                        nifti_image *deformationField,
+                        int *mask,
+                        int interp,
+                        float paddingValue)
+{
+   if(imageNumber==0)
+      return;
+
+   nifti_image *floatingImage=floatingImages[0];
+   mat44 *floatingIJKMatrix=(floatingImage->sform_code>0 ? &floatingImage->sto_ijk : &floatingImage->qto_ijk);
+   for(size_t n=0; n<imageNumber; ++n)
+   {
+      if(floatingImages[n]->datatype != floatingImage->datatype ||
+            warpedImages[n]->datatype != floatingImage->datatype)
+      {
+         reg_print_fct_error("reg_resampleImages");
+         reg_print_msg_error("The floating and warped images should all have the same data type");
+         reg_exit(1);
+      }
+      if(floatingImages[n]->nt != warpedImages[n]->nt ||
+            floatingImages[n]->nu != warpedImages[n]->nu)
+      {
+         reg_print_fct_error("reg_resampleImages");
+         reg_print_msg_error("The floating and warped images have different dimension along the time axis");
+         reg_exit(1);
+      }
+      mat44 *currentIJKMatrix=(floatingImages[n]->sform_code>0 ? &floatingImages[n]->sto_ijk : &floatingImages[n]->qto_ijk);
+      if(floatingImages[n]->nx != floatingImage->nx ||
+            floatingImages[n]->ny != floatingImage->ny ||
+            floatingImages[n]->nz != floatingImage->nz ||
+            memcmp(currentIJKMatrix, floatingIJKMatrix, sizeof(mat44)) != 0)
+      {
+         reg_print_fct_error("reg_resampleImages");
+         reg_print_msg_error("The floating images should all have the same geometry");
+         reg_exit(1);
+      }
+      if(warpedImages[n]->nx != deformationField->nx ||
+            warpedImages[n]->ny != deformationField->ny ||
+            warpedImages[n]->nz != deformationField->nz)
+      {
+         reg_print_fct_error("reg_resampleImages");
+         reg_print_msg_error("The warped images and the deformation field should have the same dimensions");
+         reg_exit(1);
+      }
+   }
+
+   // a mask array is created if no mask is specified
+   bool MrPropreRules = false;
+   if(mask==NULL)
+   {
+      // voxels in the background are set to negative value so 0 corresponds to active voxel
+      mask=(int *)calloc(deformationField->nx*deformationField->ny*deformationField->nz,sizeof(int));
+      MrPropreRules = true;
+   }
+
+   switch ( deformationField->datatype )
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_resampleImages2<float>(floatingImages,
+                                 warpedImages,
+                                 imageNumber,
+                                 deformationField,
+                                 mask,
+                                 interp,
+                                 paddingValue);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_resampleImages2<double>(floatingImages,
+                                  warpedImages,
+                                  imageNumber,
+                                  deformationField,
+                                  mask,
+                                  interp,
+                                  paddingValue);
+      break;
+   default:
+      reg_print_msg_warn("Deformation field pixel type unsupported.");
+      break;
+   }
+   if(MrPropreRules==true)
+   {
+      free(mask);
+      mask=NULL;
+   }
+}
+/* *************************************************************** */
 
 template<class FloatingTYPE, class FieldTYPE>
 void ResampleImage3D_PSF_Sinc(nifti_image *floatingImage,
@@ -20,6 +20,24 @@
 #endif
 #include "_reg_tools.h"
 
+#define SINC_KERNEL_RADIUS 3
+#define SINC_KERNEL_SIZE SINC_KERNEL_RADIUS*2
+
+/** @brief Interpolation kernels used by the resampling functions. Each of them
+ * fills the basis array with the weights associated with the relative position
+ * of the sampled point, relative being in [0,1[. The basis array holds 2 values
+ * for the nearest neighbour and linear kernels, 4 for the cubic spline kernel
+ * and SINC_KERNEL_SIZE for the windowed sinc kernel.
+ */
+extern "C++"
+void interpNearestNeighKernel(double relative, double *basis);
+extern "C++"
+void interpLinearKernel(double relative, double *basis);
+extern "C++"
+void interpCubicSplineKernel(double relative, double *basis);
+extern "C++"
+void interpWindowedSincKernel(double relative, double *basis);
+
 /** @brief This function resample a source image into the space of a target/result image.
  * The deformation is provided by a 4D nifti image which is in the space of the target image.
  * In the 4D image, for each voxel i,j,k, the position in the real word for the source image is store.
@@ -27,7 +45,9 @@
  * The cubic spline interpolation assume a padding value of 0
  * The padding value for the NN and the LIN interpolation are user defined.
  * @param floatingImage Floating image that is interpolated
- * @param warpedImage Warped image that is being generated
+ * @param warpedImage Warped image that is being generated. It has the data type of the floating
+ * image or, except for DT images, a single or double precision type, in which case the floating
+ * intensities are converted as they are read
  * @param deformationField Vector field image that contains the dense correspondences
  * @param mask Array that contains information about the mask. Only voxel with mask value different
  * from zero are being considered. If NULL, all voxels are considered
@@ -47,6 +67,31 @@ void reg_resampleImage(nifti_image *floatingImage,
                        float paddingValue,
                        bool *dti_timepoint = NULL,
                        mat33 * jacMat = NULL);
+/** @brief Resamples several floating images which share the same geometry and data type
+ * into the space of the deformation field. The interpolation weights of each warped voxel
+ * are computed once and applied to all the images, which is cheaper than calling
+ * reg_resampleImage() on each of them in turn. Each warped image must have the data type
+ * of the floating images, the spatial dimensions of the deformation field and the number
+ * of volumes of its floating image.
+ * @param floatingImages Array of floating images that are interpolated
+ * @param warpedImages Array of warped images that are being generated
+ * @param imageNumber Number of floating and warped images
+ * @param deformationField Vector field image that contains the dense correspondences
+ * @param mask Array that contains information about the mask, as for reg_resampleImage().
+ * If NULL, all voxels are considered
+ * @param interp Interpolation type. 0, 1 or 3 correspond to nearest neighbor, linear or cubic
+ * interpolation
+ * @param paddingValue Value to be used for padding when the correspondences are outside of the
+ * floating image space.
+ */
+extern "C++"
+void reg_resampleImages(nifti_image **floatingImages,
+                        nifti_image **warpedImages,
+                        size_t imageNumber,
+                        nifti_image *deformationField,
+                        int *mask,
+                        int interp,
+                        float paddingValue);
 extern "C++"
 void reg_resampleImage_PSF(nifti_image *floatingImage,
                            nifti_image *warpedImage,
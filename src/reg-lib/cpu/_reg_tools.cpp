@@ -435,66 +435,43 @@ template double reg_getMaximalLength<double>(nifti_image *);
 /* *************************************************************** */
 /* *************************************************************** */
 template <class NewTYPE, class DTYPE>
-void reg_tools_changeDatatype1(nifti_image *image,int type)
+static void reg_tools_convertData1(nifti_image *image, NewTYPE *dataPtr)
 {
-   // the initial array is saved and freeed
-   DTYPE *initialValue = (DTYPE *)malloc(image->nvox*sizeof(DTYPE));
-   memcpy(initialValue, image->data, image->nvox*sizeof(DTYPE));
-
-   // the new array is allocated and then filled
-   if(type>-1){
-      image->datatype=type;
-   }
-   else{
-      if(sizeof(NewTYPE)==sizeof(unsigned char)) image->datatype = NIFTI_TYPE_UINT8;
-      else if(sizeof(NewTYPE)==sizeof(float)) image->datatype = NIFTI_TYPE_FLOAT32;
-      else if(sizeof(NewTYPE)==sizeof(double)) image->datatype = NIFTI_TYPE_FLOAT64;
-      else
-      {
-         reg_print_fct_error("reg_tools_changeDatatype1");
-         reg_print_msg_error("Only change to unsigned char, float or double are supported");
-         reg_exit(1);
-      }
-   }
-   free(image->data);
-   image->nbyper = sizeof(NewTYPE);
-   image->data = (void *)calloc(image->nvox,sizeof(NewTYPE));
-   NewTYPE *dataPtr = static_cast<NewTYPE *>(image->data);
+   DTYPE *initialValue = static_cast<DTYPE *>(image->data);
    for(size_t i=0; i<image->nvox; i++)
       dataPtr[i] = (NewTYPE)(initialValue[i]);
-
-   free(initialValue);
-   return;
 }
 /* *************************************************************** */
+/// Converts the data of an image into an array of another type, leaving the
+/// image unchanged
 template <class NewTYPE>
-void reg_tools_changeDatatype(nifti_image *image, int type)
+static void reg_tools_convertData(nifti_image *image, NewTYPE *dataPtr)
 {
    switch(image->datatype)
    {
    case NIFTI_TYPE_UINT8:
-      reg_tools_changeDatatype1<NewTYPE,unsigned char>(image,type);
+      reg_tools_convertData1<NewTYPE,unsigned char>(image,dataPtr);
       break;
    case NIFTI_TYPE_INT8:
-      reg_tools_changeDatatype1<NewTYPE,char>(image,type);
+      reg_tools_convertData1<NewTYPE,char>(image,dataPtr);
       break;
    case NIFTI_TYPE_UINT16:
-      reg_tools_changeDatatype1<NewTYPE,unsigned short>(image,type);
+      reg_tools_convertData1<NewTYPE,unsigned short>(image,dataPtr);
       break;
    case NIFTI_TYPE_INT16:
-      reg_tools_changeDatatype1<NewTYPE,short>(image,type);
+      reg_tools_convertData1<NewTYPE,short>(image,dataPtr);
       break;
    case NIFTI_TYPE_UINT32:
-      reg_tools_changeDatatype1<NewTYPE,unsigned int>(image,type);
+      reg_tools_convertData1<NewTYPE,unsigned int>(image,dataPtr);
       break;
    case NIFTI_TYPE_INT32:
-      reg_tools_changeDatatype1<NewTYPE,int>(image,type);
+      reg_tools_convertData1<NewTYPE,int>(image,dataPtr);
       break;
    case NIFTI_TYPE_FLOAT32:
-      reg_tools_changeDatatype1<NewTYPE,float>(image,type);
+      reg_tools_convertData1<NewTYPE,float>(image,dataPtr);
       break;
    case NIFTI_TYPE_FLOAT64:
-      reg_tools_changeDatatype1<NewTYPE,double>(image,type);
+      reg_tools_convertData1<NewTYPE,double>(image,dataPtr);
       break;
    default:
       reg_print_fct_error("reg_tools_changeDatatype");
@@ -503,6 +480,34 @@ void reg_tools_changeDatatype(nifti_image *image, int type)
    }
 }
 /* *************************************************************** */
+template <class NewTYPE>
+void reg_tools_changeDatatype(nifti_image *image, int type)
+{
+   int newDatatype;
+   if(type>-1){
+      newDatatype=type;
+   }
+   else{
+      if(sizeof(NewTYPE)==sizeof(unsigned char)) newDatatype = NIFTI_TYPE_UINT8;
+      else if(sizeof(NewTYPE)==sizeof(float)) newDatatype = NIFTI_TYPE_FLOAT32;
+      else if(sizeof(NewTYPE)==sizeof(double)) newDatatype = NIFTI_TYPE_FLOAT64;
+      else
+      {
+         reg_print_fct_error("reg_tools_changeDatatype");
+         reg_print_msg_error("Only change to unsigned char, float or double are supported");
+         reg_exit(1);
+      }
+   }
+
+   // the new array is filled straight from the initial one, which is then freed
+   NewTYPE *dataPtr = (NewTYPE *)malloc(image->nvox*sizeof(NewTYPE));
+   reg_tools_convertData<NewTYPE>(image, dataPtr);
+   free(image->data);
+   image->datatype = newDatatype;
+   image->nbyper = sizeof(NewTYPE);
+   image->data = (void *)dataPtr;
+}
+/* *************************************************************** */
 template void reg_tools_changeDatatype<unsigned char>(nifti_image *, int);
 template void reg_tools_changeDatatype<unsigned short>(nifti_image *, int);
 template void reg_tools_changeDatatype<unsigned int>(nifti_image *, int);
@@ -1056,19 +1061,127 @@ void reg_tools_divideValueToImage(nifti_image *img1,
 }
 /* *************************************************************** */
 /* *************************************************************** */
-template <class DTYPE>
-void reg_tools_kernelConvolution_core(nifti_image *image,
+/// Standard deviation, in voxels, from which the Gaussian kernel is applied recursively
+#define CONVOLUTION_RECURSIVE_MIN_SIGMA 3.0
+/// Number of adjacent lines that are convolved together
+#define CONVOLUTION_TILE_LINES 16
+/* *************************************************************** */
+/// Coefficients of the fourth order recursive approximation of a Gaussian
+/// kernel proposed by Deriche (INRIA research report 1893, 1993)
+struct reg_recursiveGaussian
+{
+   double causal[4];
+   double antiCausal[4];
+   double denominator[4];
+};
+/* *************************************************************** */
+/// Computes the recursive filter coefficients for a standard deviation in voxels.
+/// The coefficients are normalised so that the filter preserves a constant signal
+static void reg_tools_getRecursiveGaussian(double sigma,
+                                           reg_recursiveGaussian &filter)
+{
+   const double a0=1.68, a1=3.735, b0=1.783, b1=1.723;
+   const double w0=0.6318, w1=1.997, c0=-0.6803, c1=-0.2598;
+   double cos0=cos(w0/sigma), sin0=sin(w0/sigma);
+   double cos1=cos(w1/sigma), sin1=sin(w1/sigma);
+   double exp0=exp(-b0/sigma), exp1=exp(-b1/sigma);
+
+   filter.causal[0] = a0+c0;
+   filter.causal[1] = exp1*(c1*sin1-(c0+2.0*a0)*cos1) + exp0*(a1*sin0-(2.0*c0+a0)*cos0);
+   filter.causal[2] = 2.0*exp0*exp1*((a0+c0)*cos1*cos0-a1*cos1*sin0-c1*cos0*sin1) +
+         c0*exp0*exp0 + a0*exp1*exp1;
+   filter.causal[3] = exp1*exp0*exp0*(c1*sin1-c0*cos1) + exp0*exp1*exp1*(a1*sin0-a0*cos0);
+
+   filter.denominator[0] = -2.0*exp1*cos1 - 2.0*exp0*cos0;
+   filter.denominator[1] = 4.0*cos1*cos0*exp0*exp1 + exp1*exp1 + exp0*exp0;
+   filter.denominator[2] = -2.0*cos0*exp0*exp1*exp1 - 2.0*cos1*exp1*exp0*exp0;
+   filter.denominator[3] = exp0*exp0*exp1*exp1;
+
+   // The anti-causal part is the mirror of the causal one, without the central value
+   for(int i=0; i<3; ++i)
+      filter.antiCausal[i] = filter.causal[i+1] - filter.denominator[i]*filter.causal[0];
+   filter.antiCausal[3] = -filter.denominator[3]*filter.causal[0];
+
+   double numeratorSum=0, denominatorSum=1;
+   for(int i=0; i<4; ++i)
+   {
+      numeratorSum += filter.causal[i] + filter.antiCausal[i];
+      denominatorSum += filter.denominator[i];
+   }
+   for(int i=0; i<4; ++i)
+   {
+      filter.causal[i] *= denominatorSum/numeratorSum;
+      filter.antiCausal[i] *= denominatorSum/numeratorSum;
+   }
+}
+/* *************************************************************** */
+/// Applies the recursive Gaussian filter to width interleaved lines, the value
+/// of the lth line at position i being stored at i*width+l. The lines are padded
+/// with four zeros on each side. As both parts of the filter run over the input,
+/// the zero values beyond the lines are accounted for exactly
+static void reg_tools_recursiveGaussianLines(const reg_recursiveGaussian &filter,
+                                             const double *paddedLines,
+                                             double *output,
+                                             int length,
+                                             int width)
+{
+   const double *lines = &paddedLines[4*width];
+   double previous0[CONVOLUTION_TILE_LINES], previous1[CONVOLUTION_TILE_LINES];
+   double previous2[CONVOLUTION_TILE_LINES], previous3[CONVOLUTION_TILE_LINES];
+   const double *current;
+   double *currentOutput, value;
+   int i, l;
+   for(l=0; l<width; ++l)
+      previous0[l]=previous1[l]=previous2[l]=previous3[l]=0;
+   for(i=0; i<length; ++i)
+   {
+      current = &lines[i*width];
+      currentOutput = &output[i*width];
+      for(l=0; l<width; ++l)
+      {
+         value = filter.causal[0]*current[l] + filter.causal[1]*current[l-width] +
+               filter.causal[2]*current[l-2*width] + filter.causal[3]*current[l-3*width] -
+               filter.denominator[0]*previous0[l] - filter.denominator[1]*previous1[l] -
+               filter.denominator[2]*previous2[l] - filter.denominator[3]*previous3[l];
+         previous3[l]=previous2[l];
+         previous2[l]=previous1[l];
+         previous1[l]=previous0[l];
+         currentOutput[l] = previous0[l] = value;
+      }
+   }
+   for(l=0; l<width; ++l)
+      previous0[l]=previous1[l]=previous2[l]=previous3[l]=0;
+   for(i=length-1; i>=0; --i)
+   {
+      current = &lines[i*width];
+      currentOutput = &output[i*width];
+      for(l=0; l<width; ++l)
+      {
+         value = filter.antiCausal[0]*current[l+width] + filter.antiCausal[1]*current[l+2*width] +
+               filter.antiCausal[2]*current[l+3*width] + filter.antiCausal[3]*current[l+4*width] -
+               filter.denominator[0]*previous0[l] - filter.denominator[1]*previous1[l] -
+               filter.denominator[2]*previous2[l] - filter.denominator[3]*previous3[l];
+         previous3[l]=previous2[l];
+         previous2[l]=previous1[l];
+         previous1[l]=previous0[l];
+         previous0[l] = value;
+         currentOutput[l] += value;
+      }
+   }
+}
+/* *************************************************************** */
+// IMAGE_NUMBER is the number of images when it is known at compile time, so that
+// the loops over the images vanish for a single image, and 0 otherwise
+template <class DTYPE, int IMAGE_NUMBER>
+void reg_tools_kernelConvolution_core(nifti_image **images,
+                                      int imageNumber,
                                       float *sigma,
                                       int kernelType,
                                       int *mask,
                                       bool *timePoint,
                                       bool *axis)
 {
-   if(image->nx>2048 || image->ny>2048 || image->nz>2048){
-      reg_print_fct_error("reg_tools_kernelConvolution_core");
-      reg_print_msg_error("This function does not support images with dimension > 2048");
-      reg_exit(1);
-   }
+   nifti_image *image = images[0];
 #ifdef WIN32
    long index;
    long voxelNumber = (long)image->nx*image->ny*image->nz;
@@ -1076,30 +1189,37 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
    size_t index;
    size_t voxelNumber = (size_t)image->nx*image->ny*image->nz;
 #endif
-   DTYPE *imagePtr = static_cast<DTYPE *>(image->data);
    int imageDim[3]= {image->nx,image->ny,image->nz};
 
    bool *nanImagePtr = (bool *)calloc(voxelNumber, sizeof(bool));
    float *densityPtr = (float *)calloc(voxelNumber, sizeof(float));
+   DTYPE **intensityPtr = (DTYPE **)malloc(imageNumber*sizeof(DTYPE *));
+   int i;
 
    // Loop over the dimension higher than 3
    for(int t=0; t<image->nt*image->nu; t++)
    {
       if(timePoint[t])
       {
-         DTYPE *intensityPtr = &imagePtr[t * voxelNumber];
+         for(i=0; i<imageNumber; ++i)
+            intensityPtr[i] = &(static_cast<DTYPE *>(images[i]->data))[t * voxelNumber];
+         // The density is shared by all images and only covers the voxels
+         // that are defined in every one of them
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(densityPtr, intensityPtr, mask, nanImagePtr, voxelNumber) \
-   private(index)
+   shared(densityPtr, intensityPtr, mask, nanImagePtr, voxelNumber, imageNumber) \
+   private(index, i)
 #endif
          for(index=0; index<voxelNumber; index++)
          {
-            densityPtr[index] = (intensityPtr[index]==intensityPtr[index])?1:0;
-            densityPtr[index] *= (mask[index]>=0)?1:0;
+            densityPtr[index] = (mask[index]>=0)?1:0;
+            for(i=0; i<imageNumber; ++i)
+               if(intensityPtr[i][index]!=intensityPtr[i][index])
+                  densityPtr[index]=0;
             nanImagePtr[index] = static_cast<bool>(densityPtr[index]);
             if(nanImagePtr[index]==0)
-               intensityPtr[index]=static_cast<DTYPE>(0);
+               for(i=0; i<imageNumber; ++i)
+                  intensityPtr[i][index]=static_cast<DTYPE>(0);
          }
          // Loop over the x, y and z dimensions
          for(int n=0; n<3; n++)
@@ -1128,13 +1248,22 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
                }
                if(radius>0)
                {
-                  // Allocate the kernel
-                  float kernel[2048];
+                  // Wide Gaussian kernels are applied recursively and the mean filter
+                  // uses running sums, so that the cost per voxel does not depend on
+                  // the kernel size. The other kernels are explicitly convolved
+                  bool recursive = kernelType==0 && temp>=CONVOLUTION_RECURSIVE_MIN_SIGMA;
+                  reg_recursiveGaussian recursiveFilter;
+                  float *kernel=NULL;
                   double kernelSum=0;
+                  if(recursive)
+                  {
+                     reg_tools_getRecursiveGaussian(temp, recursiveFilter);
+                  }
                   // Fill the kernel
-                  if(kernelType==1)
+                  else if(kernelType==1)
                   {
                      // Compute the Cubic Spline kernel
+                     kernel=(float *)malloc((2*radius+1)*sizeof(float));
                      for(int i=-radius; i<=radius; i++)
                      {
                         // temp contains the kernel node spacing
@@ -1149,6 +1278,7 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
                   else if(kernelType!=2)
                   {
                      // Compute the Gaussian kernel
+                     kernel=(float *)malloc((2*radius+1)*sizeof(float));
                      for(int i=-radius; i<=radius; i++)
                      {
                         // 2.506... = sqrt(2*pi)
@@ -1161,168 +1291,275 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
                   // No need for kernel normalisation as this is handle by the density function
 #ifndef NDEBUG
                   char text[255];
-                  sprintf(text, "Convolution type[%i] dim[%i] tp[%i] radius[%i] kernelSum[%g]", kernelType, n, t, radius, kernelSum);
+                  sprintf(text, "Convolution type[%i] dim[%i] tp[%i] radius[%i] kernelSum[%g] recursive[%i]",
+                          kernelType, n, t, radius, kernelSum, recursive);
                   reg_print_msg_debug(text);
 #endif
-                  int planeNumber, planeIndex, lineOffset;
-                  int lineIndex, shiftPre, shiftPst, k;
+                  // The lines are convolved by tiles of adjacent lines, which are
+                  // copied into interleaved buffers so that each row of a tile is
+                  // read and written contiguously, whatever the axis
+                  int lineLength = imageDim[n];
+                  int lineOffset, laneNumber, laneOffset, rowOffset, rowNumber;
                   switch(n)
                   {
                   case 0:
-                     planeNumber=imageDim[1]*imageDim[2];
-                     lineOffset  = 1;
+                     lineOffset = 1;
+                     laneNumber = imageDim[1];
+                     laneOffset = imageDim[0];
+                     rowNumber = imageDim[2];
+                     rowOffset = imageDim[0]*imageDim[1];
                      break;
                   case 1:
-                     planeNumber = imageDim[0]*imageDim[2];
-                     lineOffset  = imageDim[0];
-                     break;
-                  case 2:
-                     planeNumber = imageDim[0]*imageDim[1];
-                     lineOffset  = planeNumber;
+                     lineOffset = imageDim[0];
+                     laneNumber = imageDim[0];
+                     laneOffset = 1;
+                     rowNumber = imageDim[2];
+                     rowOffset = imageDim[0]*imageDim[1];
                      break;
+                  default:
+                     lineOffset = imageDim[0]*imageDim[1];
+                     laneNumber = imageDim[0];
+                     laneOffset = 1;
+                     rowNumber = imageDim[1];
+                     rowOffset = imageDim[0];
                   }
-
-                  size_t realIndex;
-                  float *kernelPtr, kernelValue;
-                  double densitySum, intensitySum;
-                  DTYPE *currentIntensityPtr=NULL;
-                  float *currentDensityPtr = NULL;
-                  DTYPE bufferIntensity[2048];;
-                  float bufferDensity[2048];
-                  DTYPE bufferIntensitycur=0;
-                  float bufferDensitycur=0;
+                  int tilePerRow = (laneNumber+CONVOLUTION_TILE_LINES-1) / CONVOLUTION_TILE_LINES;
+                  int tileNumber = tilePerRow*rowNumber;
+                  int tileIndex;
 
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
-   shared(imageDim, intensityPtr, densityPtr, radius, kernel, lineOffset, n, \
-   planeNumber,kernelSum) \
-   private(realIndex,currentIntensityPtr,currentDensityPtr,lineIndex,bufferIntensity, \
-   bufferDensity,shiftPre,shiftPst,kernelPtr,kernelValue,densitySum,intensitySum, \
-   k, bufferIntensitycur,bufferDensitycur, planeIndex)
+#pragma omp parallel default(none) \
+   shared(intensityPtr, densityPtr, imageNumber, radius, kernel, kernelSum, recursive, \
+   recursiveFilter, lineLength, lineOffset, laneNumber, laneOffset, rowOffset, tilePerRow, \
+   tileNumber) \
+   private(tileIndex)
 #endif // _OPENMP
-                  // Loop over the different voxel
-                  for(planeIndex=0; planeIndex<planeNumber; ++planeIndex)
                   {
-
-                     switch(n)
-                     {
-                     case 0:
-                        realIndex = planeIndex * imageDim[0];
-                        break;
-                     case 1:
-                        realIndex = (planeIndex/imageDim[0]) *
-                              imageDim[0]*imageDim[1] +
-                              planeIndex%imageDim[0];
-                        break;
-                     case 2:
-                        realIndex = planeIndex;
-                        break;
-                     default:
-                        realIndex=0;
-                     }
-                     // Fetch the current line into a stack buffer
-                     currentIntensityPtr= &intensityPtr[realIndex];
-                     currentDensityPtr  = &densityPtr[realIndex];
-                     for(lineIndex=0; lineIndex<imageDim[n]; ++lineIndex)
-                     {
-                        bufferIntensity[lineIndex] = *currentIntensityPtr;
-                        bufferDensity[lineIndex]   = *currentDensityPtr;
-                        currentIntensityPtr       += lineOffset;
-                        currentDensityPtr         += lineOffset;
-                     }
-                     if(kernelSum>0)
+                     const int channelNumber = IMAGE_NUMBER>0 ? IMAGE_NUMBER : imageNumber;
+                     // Each thread holds its own tile buffers, whose size is not bounded.
+                     // The tile of every image is stored after the one of the previous image
+                     size_t channelSize = (size_t)lineLength*CONVOLUTION_TILE_LINES;
+                     DTYPE *bufferIntensity = (DTYPE *)malloc(channelNumber*channelSize*sizeof(DTYPE));
+                     float *bufferDensity = (float *)malloc(channelSize*sizeof(float));
+                     // The recursive filter works on a zero padded tile and on an output tile
+                     double *recursiveBuffer = NULL;
+                     if(recursive)
+                        recursiveBuffer = (double *)malloc((2*lineLength+8)*CONVOLUTION_TILE_LINES*sizeof(double));
+                     double *intensitySum = (double *)malloc(channelNumber*CONVOLUTION_TILE_LINES*sizeof(double));
+                     double densitySum[CONVOLUTION_TILE_LINES], *currentSum;
+                     DTYPE *currentIntensity, *currentImage;
+                     float *currentDensity, *kernelPtr, kernelValue;
+                     size_t tileStart, realIndex;
+                     int width, lineIndex, shiftPre, shiftPst, k, l, c;
+#if defined (_OPENMP)
+#pragma omp for
+#endif // _OPENMP
+                     // Loop over the tiles of adjacent lines
+                     for(tileIndex=0; tileIndex<tileNumber; ++tileIndex)
                      {
-                        // Perform the kernel convolution along 1 line
-                        for(lineIndex=0; lineIndex<imageDim[n]; ++lineIndex)
+                        width = laneNumber - (tileIndex%tilePerRow)*CONVOLUTION_TILE_LINES;
+                        if(width>CONVOLUTION_TILE_LINES) width=CONVOLUTION_TILE_LINES;
+                        tileStart = (size_t)(tileIndex/tilePerRow)*rowOffset +
+                              (size_t)(tileIndex%tilePerRow)*CONVOLUTION_TILE_LINES*laneOffset;
+                        // Fetch the current lines into the tile buffers
+                        for(lineIndex=0; lineIndex<lineLength; ++lineIndex)
                         {
-                           // Define the kernel boundaries
-                           shiftPre = lineIndex - radius;
-                           shiftPst = lineIndex + radius + 1;
-                           if(shiftPre<0)
+                           realIndex = tileStart + (size_t)lineIndex*lineOffset;
+                           currentDensity = &bufferDensity[lineIndex*width];
+                           for(l=0; l<width; ++l)
+                              currentDensity[l] = densityPtr[realIndex+l*laneOffset];
+                           for(c=0; c<channelNumber; ++c)
                            {
-                              kernelPtr = &kernel[-shiftPre];
-                              shiftPre=0;
+                              currentImage = &intensityPtr[c][realIndex];
+                              currentIntensity = &bufferIntensity[c*channelSize+lineIndex*width];
+                              for(l=0; l<width; ++l)
+                                 currentIntensity[l] = currentImage[l*laneOffset];
                            }
-                           else kernelPtr = &kernel[0];
-                           if(shiftPst>imageDim[n]) shiftPst=imageDim[n];
-                           // Set the current values to zero
-                           intensitySum=0;
-                           densitySum=0;
-                           // Increment the current value by performing the weighted sum
-                           for(k=shiftPre; k<shiftPst; ++k)
-                           {
-                              kernelValue   = *kernelPtr++;
-                              intensitySum +=  kernelValue * bufferIntensity[k];
-                              densitySum   +=  kernelValue * bufferDensity[k];
-                           }
-                           // Store the computed value inplace
-                           intensityPtr[realIndex] = static_cast<DTYPE>(intensitySum);
-                           densityPtr[realIndex] = static_cast<float>(densitySum);
-                           realIndex += lineOffset;
-                        } // line convolution
-                     } // kernel type
-                     else
-                     {
-                        for(lineIndex=1; lineIndex<imageDim[n]; ++lineIndex)
-                        {
-                           bufferIntensity[lineIndex]+=bufferIntensity[lineIndex-1];
-                           bufferDensity[lineIndex]+=bufferDensity[lineIndex-1];
                         }
-                        shiftPre = -radius - 1;
-                        shiftPst = radius;
-                        for(lineIndex=0; lineIndex<imageDim[n]; ++lineIndex,++shiftPre,++shiftPst)
+                        if(recursive)
                         {
-                           if(shiftPre>-1)
+                           double *padded = recursiveBuffer;
+                           double *filtered = &recursiveBuffer[(lineLength+8)*width];
+                           for(l=0; l<4*width; ++l)
+                              padded[l] = padded[(lineLength+4)*width+l] = 0;
+                           // The images are filtered first, then the density
+                           for(c=0; c<=channelNumber; ++c)
                            {
-                              if(shiftPst<imageDim[n])
+                              if(c<channelNumber)
                               {
-                                 bufferIntensitycur = (DTYPE)(bufferIntensity[shiftPre]-bufferIntensity[shiftPst]);
-                                 bufferDensitycur = (DTYPE)(bufferDensity[shiftPre]-bufferDensity[shiftPst]);
+                                 currentIntensity = &bufferIntensity[c*channelSize];
+                                 for(l=0; l<lineLength*width; ++l)
+                                    padded[4*width+l] = static_cast<double>(currentIntensity[l]);
                               }
                               else
                               {
-                                 bufferIntensitycur = (DTYPE)(bufferIntensity[shiftPre]-bufferIntensity[imageDim[n]-1]);
-                                 bufferDensitycur = (DTYPE)(bufferDensity[shiftPre]-bufferDensity[imageDim[n]-1]);
+                                 for(l=0; l<lineLength*width; ++l)
+                                    padded[4*width+l] = static_cast<double>(bufferDensity[l]);
+                              }
+                              reg_tools_recursiveGaussianLines(recursiveFilter, padded, filtered, lineLength, width);
+                              for(lineIndex=0; lineIndex<lineLength; ++lineIndex)
+                              {
+                                 realIndex = tileStart + (size_t)lineIndex*lineOffset;
+                                 for(l=0; l<width; ++l)
+                                 {
+                                    if(c<channelNumber)
+                                       intensityPtr[c][realIndex] = static_cast<DTYPE>(filtered[lineIndex*width+l]);
+                                    else densityPtr[realIndex] = static_cast<float>(filtered[lineIndex*width+l]);
+                                    realIndex += laneOffset;
+                                 }
                               }
                            }
-                           else
+                        }
+                        else if(kernelSum>0)
+                        {
+                           // Perform the kernel convolution along the lines of the tile
+                           for(lineIndex=0; lineIndex<lineLength; ++lineIndex)
                            {
-                              if(shiftPst<imageDim[n])
+                              // Define the kernel boundaries
+                              shiftPre = lineIndex - radius;
+                              shiftPst = lineIndex + radius + 1;
+                              if(shiftPre<0)
+                              {
+                                 kernelPtr = &kernel[-shiftPre];
+                                 shiftPre=0;
+                              }
+                              else kernelPtr = &kernel[0];
+                              if(shiftPst>lineLength) shiftPst=lineLength;
+                              // Set the current values to zero
+                              for(l=0; l<channelNumber*CONVOLUTION_TILE_LINES; ++l)
+                                 intensitySum[l]=0;
+                              for(l=0; l<width; ++l)
+                                 densitySum[l]=0;
+                              // Increment the current values by performing the weighted sums
+                              if(IMAGE_NUMBER==1)
+                              {
+                                 // A single image is accumulated along with the density
+                                 for(k=shiftPre; k<shiftPst; ++k)
+                                 {
+                                    kernelValue = *kernelPtr++;
+                                    currentIntensity = &bufferIntensity[k*width];
+                                    currentDensity = &bufferDensity[k*width];
+                                    for(l=0; l<width; ++l)
+                                    {
+                                       intensitySum[l] += kernelValue * currentIntensity[l];
+                                       densitySum[l] += kernelValue * currentDensity[l];
+                                    }
+                                 }
+                              }
+                              else for(k=shiftPre; k<shiftPst; ++k)
+                              {
+                                 kernelValue = *kernelPtr++;
+                                 for(c=0; c<channelNumber; ++c)
+                                 {
+                                    currentIntensity = &bufferIntensity[c*channelSize+k*width];
+                                    currentSum = &intensitySum[c*CONVOLUTION_TILE_LINES];
+                                    for(l=0; l<width; ++l)
+                                       currentSum[l] += kernelValue * currentIntensity[l];
+                                 }
+                                 currentDensity = &bufferDensity[k*width];
+                                 for(l=0; l<width; ++l)
+                                    densitySum[l] += kernelValue * currentDensity[l];
+                              }
+                              // Store the computed values inplace
+                              realIndex = tileStart + (size_t)lineIndex*lineOffset;
+                              for(l=0; l<width; ++l)
                               {
-                                 bufferIntensitycur = (DTYPE)(-bufferIntensity[shiftPst]);
-                                 bufferDensitycur = (DTYPE)(-bufferDensity[shiftPst]);
+                                 for(c=0; c<channelNumber; ++c)
+                                    intensityPtr[c][realIndex] = static_cast<DTYPE>(intensitySum[c*CONVOLUTION_TILE_LINES+l]);
+                                 densityPtr[realIndex] = static_cast<float>(densitySum[l]);
+                                 realIndex += laneOffset;
                               }
-                              else{
-                                 bufferIntensitycur = (DTYPE)(0);
-                                 bufferDensitycur = (DTYPE)(0);
+                           } // line convolution
+                        } // kernel type
+                        else
+                        {
+                           // The sums over the window are updated as it slides along the lines
+                           for(l=0; l<channelNumber*CONVOLUTION_TILE_LINES; ++l)
+                              intensitySum[l]=0;
+                           for(l=0; l<width; ++l)
+                              densitySum[l]=0;
+                           for(k=0; k<radius && k<lineLength; ++k)
+                           {
+                              for(c=0; c<channelNumber; ++c)
+                              {
+                                 currentIntensity = &bufferIntensity[c*channelSize+k*width];
+                                 currentSum = &intensitySum[c*CONVOLUTION_TILE_LINES];
+                                 for(l=0; l<width; ++l)
+                                    currentSum[l] += currentIntensity[l];
                               }
+                              for(l=0; l<width; ++l)
+                                 densitySum[l] += bufferDensity[k*width+l];
                            }
-                           intensityPtr[realIndex]=bufferIntensitycur;
-                           densityPtr[realIndex]=bufferDensitycur;
-
-                           realIndex += lineOffset;
-                        } // line convolution of mean filter
-                     } // No kernel computation
-                  } // pixel in starting plane
+                           shiftPre = -radius;
+                           shiftPst = radius;
+                           for(lineIndex=0; lineIndex<lineLength; ++lineIndex,++shiftPre,++shiftPst)
+                           {
+                              if(shiftPst<lineLength)
+                              {
+                                 for(c=0; c<channelNumber; ++c)
+                                 {
+                                    currentIntensity = &bufferIntensity[c*channelSize+shiftPst*width];
+                                    currentSum = &intensitySum[c*CONVOLUTION_TILE_LINES];
+                                    for(l=0; l<width; ++l)
+                                       currentSum[l] += currentIntensity[l];
+                                 }
+                                 for(l=0; l<width; ++l)
+                                    densitySum[l] += bufferDensity[shiftPst*width+l];
+                              }
+                              if(shiftPre>0)
+                              {
+                                 for(c=0; c<channelNumber; ++c)
+                                 {
+                                    currentIntensity = &bufferIntensity[c*channelSize+(shiftPre-1)*width];
+                                    currentSum = &intensitySum[c*CONVOLUTION_TILE_LINES];
+                                    for(l=0; l<width; ++l)
+                                       currentSum[l] -= currentIntensity[l];
+                                 }
+                                 for(l=0; l<width; ++l)
+                                    densitySum[l] -= bufferDensity[(shiftPre-1)*width+l];
+                              }
+                              realIndex = tileStart + (size_t)lineIndex*lineOffset;
+                              for(l=0; l<width; ++l)
+                              {
+                                 for(c=0; c<channelNumber; ++c)
+                                    intensityPtr[c][realIndex] = static_cast<DTYPE>(intensitySum[c*CONVOLUTION_TILE_LINES+l]);
+                                 densityPtr[realIndex] = static_cast<float>(densitySum[l]);
+                                 realIndex += laneOffset;
+                              }
+                           } // line convolution of mean filter
+                        } // No kernel computation
+                     } // tiles
+                     free(bufferIntensity);
+                     free(bufferDensity);
+                     free(intensitySum);
+                     if(recursiveBuffer!=NULL)
+                        free(recursiveBuffer);
+                  }
+                  if(kernel!=NULL)
+                     free(kernel);
                } // radius > 0
             } // active axis
          } // axes
          // Normalise per timepoint
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(voxelNumber, intensityPtr, densityPtr, nanImagePtr) \
-   private(index)
+   shared(voxelNumber, intensityPtr, densityPtr, nanImagePtr, imageNumber) \
+   private(index, i)
 #endif
          for(index=0; index<voxelNumber; ++index)
          {
-            if(nanImagePtr[index]!=0)
-               intensityPtr[index] = static_cast<DTYPE>((float)intensityPtr[index]/densityPtr[index]);
-            else intensityPtr[index] = std::numeric_limits<DTYPE>::quiet_NaN();
+            for(i=0; i<imageNumber; ++i)
+            {
+               if(nanImagePtr[index]!=0)
+                  intensityPtr[i][index] = static_cast<DTYPE>((float)intensityPtr[i][index]/densityPtr[index]);
+               else intensityPtr[i][index] = std::numeric_limits<DTYPE>::quiet_NaN();
+            }
          }
       } // check if the time point is active
    } // loop over the time points
    free(nanImagePtr);
    free(densityPtr);
+   free(intensityPtr);
 }
 
 
@@ -1336,11 +1573,6 @@ void reg_tools_labelKernelConvolution_core(nifti_image *image,
                                            int *mask,
                                            bool *timePoint)
 {
-   if(image->nx>2048 || image->ny>2048 || image->nz>2048){
-      reg_print_fct_error("reg_tools_labelKernelConvolution_core");
-      reg_print_msg_error("This function does not support images with dimension > 2048");
-      reg_exit(1);
-   }
 #ifdef WIN32
    long index;
    long voxelNumber = (long)image->nx*image->ny*image->nz;
@@ -1393,12 +1625,44 @@ void reg_tools_labelKernelConvolution_core(nifti_image *image,
          int dim_array[3]= {image->nx,image->ny,image->nz};
          int shiftdirection[3]= {1,image->nx,image->nx*image->ny};
 
-         int kernelXsize, kernelXshift, shiftXstart, shiftXstop;
-         int kernelYsize, kernelYshift, shiftYstart, shiftYstop;
-         int kernelZsize, kernelZshift, shiftZstart, shiftZstop;
+         // The kernel size does not depend on the position
+         int kernelXsize=(int)(sqrtf(gaussX_var)*6.0f) % 2 != 0 ?
+                  (int)(sqrtf(gaussX_var)*6.0f) : (int)(sqrtf(gaussX_var)*6.0f)+1;
+         int kernelXshift=(int)(kernelXsize/2.0f);
+         int kernelYsize=(int)(sqrtf(gaussY_var)*6.0f) % 2 != 0 ?
+                  (int)(sqrtf(gaussY_var)*6.0f) : (int)(sqrtf(gaussY_var)*6.0f)+1;
+         int kernelYshift=(int)(kernelYsize/2.0f);
+         int kernelZsize=(int)(sqrtf(gaussZ_var)*6.0f) % 2 != 0 ?
+                  (int)(sqrtf(gaussZ_var)*6.0f) : (int)(sqrtf(gaussZ_var)*6.0f)+1;
+         int kernelZshift=(int)(kernelZsize/2.0f);
+         int kernelWidth[2]= {2*kernelXshift+1, 2*kernelYshift+1};
+
+         // The kernel values are tabulated once, in the order in which the
+         // neighbours are visited: x being the fastest varying index, the
+         // neighbourhood is read along contiguous rows of the image
+         float *kernel=(float *)malloc(kernelWidth[0]*kernelWidth[1]*(2*kernelZshift+1)*sizeof(float));
          int shiftx, shifty, shiftz;
-         int indexNeighbour;
-         float kernelval;
+         for(shiftz=-kernelZshift; shiftz<=kernelZshift; shiftz++)
+         {
+            for(shifty=-kernelYshift; shifty<=kernelYshift; shifty++)
+            {
+               for(shiftx=-kernelXshift; shiftx<=kernelXshift; shiftx++)
+               {
+                  kernel[(shiftx+kernelXshift)+kernelWidth[0]*((shifty+kernelYshift)+kernelWidth[1]*(shiftz+kernelZshift))]=
+                        expf((float)(-0.5f *(powf(shiftx,2)/gaussX_var
+                                             +powf(shifty,2)/gaussY_var
+                                             +powf(shiftz,2)/gaussZ_var
+                                             )))/
+                        (sqrtf(2.0f*3.14159265*powf(gaussX_var*gaussY_var*gaussZ_var, 2)));
+               }
+            }
+         }
+
+         int shiftXstart, shiftXstop;
+         int shiftYstart, shiftYstop;
+         int shiftZstart, shiftZstop;
+         int indexNeighbour, indexRow;
+         float kernelval, *kernelRow;
          DTYPE maxindex;
          double maxval;
          DataPointMapIt location, currIterator;
@@ -1407,56 +1671,42 @@ void reg_tools_labelKernelConvolution_core(nifti_image *image,
          for(int currentZposition=0; currentZposition<dim_array[2]; currentZposition++)
          {
             currentXYZposition[2]=currentZposition;
+            // Calculate allowed kernel shifts
+            shiftZstart=((currentXYZposition[2]<kernelZshift)?
+                     -currentXYZposition[2]:-kernelZshift);
+            shiftZstop=((currentXYZposition[2]>=(dim_array[2]-kernelZshift))?
+                     (int)dim_array[2]-currentXYZposition[2]-1:kernelZshift);
             for(currentXYZposition[1]=0; currentXYZposition[1]<dim_array[1]; currentXYZposition[1]++)
             {
+               shiftYstart=((currentXYZposition[1]<kernelYshift)?
+                        -currentXYZposition[1]:-kernelYshift);
+               shiftYstop=((currentXYZposition[1]>=(dim_array[1]-kernelYshift))?
+                        (int)dim_array[1]-currentXYZposition[1]-1:kernelYshift);
                for(currentXYZposition[0]=0; currentXYZposition[0]<dim_array[0]; currentXYZposition[0]++)
                {
 
                   tmp_lab.clear();
                   index=currentXYZposition[0]+(currentXYZposition[1]+currentXYZposition[2]*dim_array[1])*dim_array[0];
 
-                  // Calculate allowed kernel shifts
-                  kernelXsize=(int)(sqrtf(gaussX_var)*6.0f) % 2 != 0 ?
-                           (int)(sqrtf(gaussX_var)*6.0f) : (int)(sqrtf(gaussX_var)*6.0f)+1;
-                  kernelXshift=(int)(kernelXsize/2.0f);
                   shiftXstart=((currentXYZposition[0]<kernelXshift)?
                            -currentXYZposition[0]:-kernelXshift);
                   shiftXstop=((currentXYZposition[0]>=(dim_array[0]-kernelXshift))?
                            (int)dim_array[0]-currentXYZposition[0]-1:kernelXshift);
 
-                  kernelYsize=(int)(sqrtf(gaussY_var)*6.0f) % 2 != 0 ?
-                           (int)(sqrtf(gaussY_var)*6.0f) : (int)(sqrtf(gaussY_var)*6.0f)+1;
-                  kernelYshift=(int)(kernelYsize/2.0f);
-                  shiftYstart=((currentXYZposition[1]<kernelYshift)?
-                           -currentXYZposition[1]:-kernelYshift);
-                  shiftYstop=((currentXYZposition[1]>=(dim_array[1]-kernelYshift))?
-                           (int)dim_array[1]-currentXYZposition[1]-1:kernelYshift);
-
-                  kernelZsize=(int)(sqrtf(gaussZ_var)*6.0f) % 2 != 0 ?
-                           (int)(sqrtf(gaussZ_var)*6.0f) : (int)(sqrtf(gaussZ_var)*6.0f)+1;
-                  kernelZshift=(int)(kernelZsize/2.0f);
-                  shiftZstart=((currentXYZposition[2]<kernelZshift)?
-                           -currentXYZposition[2]:-kernelZshift);
-                  shiftZstop=((currentXYZposition[2]>=(dim_array[2]-kernelZshift))?
-                           (int)dim_array[2]-currentXYZposition[2]-1:kernelZshift);
-
                   if(nanImagePtr[index]!=0){
-                     for(shiftx=shiftXstart; shiftx<=shiftXstop; shiftx++)
+                     for(shiftz=shiftZstart; shiftz<=shiftZstop; shiftz++)
                      {
                         for(shifty=shiftYstart; shifty<=shiftYstop; shifty++)
                         {
-                           for(shiftz=shiftZstart; shiftz<=shiftZstop; shiftz++)
+                           indexRow=index+(shifty*shiftdirection[1])+(shiftz*shiftdirection[2]);
+                           kernelRow=&kernel[kernelXshift+kernelWidth[0]*((shifty+kernelYshift)+kernelWidth[1]*(shiftz+kernelZshift))];
+                           for(shiftx=shiftXstart; shiftx<=shiftXstop; shiftx++)
                            {
 
                               // Data Blur
-                              indexNeighbour=index+(shiftx*shiftdirection[0])+
-                                    (shifty*shiftdirection[1])+(shiftz*shiftdirection[2]);
+                              indexNeighbour=indexRow+shiftx;
                               if(nanImagePtr[indexNeighbour]!=0){
-                                 kernelval=expf((float)(-0.5f *(powf(shiftx,2)/gaussX_var
-                                                                +powf(shifty,2)/gaussY_var
-                                                                +powf(shiftz,2)/gaussZ_var
-                                                                )))/
-                                       (sqrtf(2.0f*3.14159265*powf(gaussX_var*gaussY_var*gaussZ_var, 2)));
+                                 kernelval=kernelRow[shiftx];
 
                                  location=tmp_lab.find(intensityPtr[indexNeighbour]);
                                  if(location!=tmp_lab.end())
@@ -1491,6 +1741,7 @@ void reg_tools_labelKernelConvolution_core(nifti_image *image,
                }
             }
          }
+         free(kernel);
          // Normalise per timepoint
          for(index=0; index<voxelNumber; ++index)
          {
@@ -1557,18 +1808,46 @@ void reg_tools_labelKernelConvolution(nifti_image *image,
    return;
 }
 /* *************************************************************** */
+template <class DTYPE>
+void reg_tools_kernelConvolution_images(nifti_image **images,
+                                        int imageNumber,
+                                        float *sigma,
+                                        int kernelType,
+                                        int *mask,
+                                        bool *timePoint,
+                                        bool *axis)
+{
+   // Most callers smooth a single image, which is done without looping over the images
+   if(imageNumber==1)
+      reg_tools_kernelConvolution_core<DTYPE,1>(images, imageNumber, sigma, kernelType, mask, timePoint, axis);
+   else reg_tools_kernelConvolution_core<DTYPE,0>(images, imageNumber, sigma, kernelType, mask, timePoint, axis);
+}
+/* *************************************************************** */
 
-void reg_tools_kernelConvolution(nifti_image *image,
+void reg_tools_kernelConvolution(nifti_image **images,
+                                 int imageNumber,
                                  float *sigma,
                                  int kernelType,
                                  int *mask,
                                  bool *timePoint,
                                  bool *axis)
 {
-
-
-   if(image->nt<=0) image->nt=image->dim[4]=1;
-   if(image->nu<=0) image->nu=image->dim[5]=1;
+   for(int i=0; i<imageNumber; ++i)
+   {
+      if(images[i]->nt<=0) images[i]->nt=images[i]->dim[4]=1;
+      if(images[i]->nu<=0) images[i]->nu=images[i]->dim[5]=1;
+   }
+   nifti_image *image = images[0];
+   for(int i=1; i<imageNumber; ++i)
+   {
+      if(images[i]->nx!=image->nx || images[i]->ny!=image->ny || images[i]->nz!=image->nz ||
+            images[i]->nt*images[i]->nu!=image->nt*image->nu || images[i]->datatype!=image->datatype)
+      {
+         reg_print_fct_error("reg_tools_kernelConvolution");
+         reg_print_msg_error("The images to smooth together must have the same dimensions and data type");
+         reg_exit(1);
+      }
+   }
 
    bool *axisToSmooth = new bool[3];
    bool *activeTimePoint = new bool[image->nt*image->nu];
@@ -1596,28 +1875,28 @@ void reg_tools_kernelConvolution(nifti_image *image,
    switch(image->datatype)
    {
    case NIFTI_TYPE_UINT8:
-      reg_tools_kernelConvolution_core<unsigned char>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<unsigned char>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    case NIFTI_TYPE_INT8:
-      reg_tools_kernelConvolution_core<char>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<char>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    case NIFTI_TYPE_UINT16:
-      reg_tools_kernelConvolution_core<unsigned short>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<unsigned short>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    case NIFTI_TYPE_INT16:
-      reg_tools_kernelConvolution_core<short>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<short>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    case NIFTI_TYPE_UINT32:
-      reg_tools_kernelConvolution_core<unsigned int>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<unsigned int>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    case NIFTI_TYPE_INT32:
-      reg_tools_kernelConvolution_core<int>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<int>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    case NIFTI_TYPE_FLOAT32:
-      reg_tools_kernelConvolution_core<float>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<float>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    case NIFTI_TYPE_FLOAT64:
-      reg_tools_kernelConvolution_core<double>(image, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
+      reg_tools_kernelConvolution_images<double>(images, imageNumber, sigma, kernelType, currentMask, activeTimePoint, axisToSmooth);
       break;
    default:
       reg_print_fct_error("reg_tools_kernelConvolution");
@@ -1630,6 +1909,16 @@ void reg_tools_kernelConvolution(nifti_image *image,
    delete []activeTimePoint;
 }
 /* *************************************************************** */
+void reg_tools_kernelConvolution(nifti_image *image,
+                                 float *sigma,
+                                 int kernelType,
+                                 int *mask,
+                                 bool *timePoint,
+                                 bool *axis)
+{
+   reg_tools_kernelConvolution(&image, 1, sigma, kernelType, mask, timePoint, axis);
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class PrecisionTYPE, class ImageTYPE>
 void reg_downsampleImage1(nifti_image *image, int type, bool *downsampleAxis)
@@ -2143,12 +2432,13 @@ template <class DTYPE>
 int reg_createImagePyramid(nifti_image *inputImage, nifti_image **pyramid, int unsigned levelNumber, int unsigned levelToPerform)
 {
    // FINEST LEVEL OF REGISTRATION
+   // The input data are converted to the working precision as they are copied, so
+   // that the input image may keep its own data type
    pyramid[levelToPerform-1]=nifti_copy_nim_info(inputImage);
-   pyramid[levelToPerform-1]->data = (void *)calloc(pyramid[levelToPerform-1]->nvox,
-         pyramid[levelToPerform-1]->nbyper);
-   memcpy(pyramid[levelToPerform-1]->data, inputImage->data,
-         pyramid[levelToPerform-1]->nvox* pyramid[levelToPerform-1]->nbyper);
-   reg_tools_changeDatatype<DTYPE>(pyramid[levelToPerform-1]);
+   pyramid[levelToPerform-1]->datatype = sizeof(DTYPE)==sizeof(float) ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64;
+   pyramid[levelToPerform-1]->nbyper = sizeof(DTYPE);
+   pyramid[levelToPerform-1]->data = (void *)malloc(pyramid[levelToPerform-1]->nvox*sizeof(DTYPE));
+   reg_tools_convertData<DTYPE>(inputImage, static_cast<DTYPE *>(pyramid[levelToPerform-1]->data));
    reg_tools_removeSCLInfo(pyramid[levelToPerform-1]);
 
    // Images are downsampled if appropriate
@@ -2247,6 +2537,79 @@ int reg_createMaskPyramid(nifti_image *inputMaskImage, int **maskPyramid, int un
 template int reg_createMaskPyramid<float>(nifti_image *, int **, unsigned int , unsigned int , int *);
 template int reg_createMaskPyramid<double>(nifti_image *, int **, unsigned int , unsigned int , int *);
 /* *************************************************************** */
+template <class DTYPE>
+int reg_createImagePyramidLevel(nifti_image *inputImage, nifti_image **levelImage, unsigned int levelNumber, unsigned int level)
+{
+   // The input data are converted to the working precision as they are copied
+   nifti_image *image=nifti_copy_nim_info(inputImage);
+   image->datatype = sizeof(DTYPE)==sizeof(float) ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64;
+   image->nbyper = sizeof(DTYPE);
+   image->data = (void *)malloc(image->nvox*sizeof(DTYPE));
+   reg_tools_convertData<DTYPE>(inputImage, static_cast<DTYPE *>(image->data));
+   reg_tools_removeSCLInfo(image);
+
+   // Each finer level is downsampled in place to derive the next one, as
+   // in reg_createImagePyramid, so that the level is identical
+   for(unsigned int l=level+1; l<levelNumber; l++)
+   {
+      bool downsampleAxis[8]= {false,true,true,true,false,false,false,false};
+      if((image->nx/2) < 32) downsampleAxis[1]=false;
+      if((image->ny/2) < 32) downsampleAxis[2]=false;
+      if((image->nz/2) < 32) downsampleAxis[3]=false;
+      reg_downsampleImage<DTYPE>(image, 1, downsampleAxis);
+   }
+   *levelImage=image;
+   return EXIT_SUCCESS;
+}
+template int reg_createImagePyramidLevel<float>(nifti_image *, nifti_image **, unsigned int , unsigned int);
+template int reg_createImagePyramidLevel<double>(nifti_image *, nifti_image **, unsigned int , unsigned int);
+/* *************************************************************** */
+template <class DTYPE>
+int reg_createMaskPyramidLevel(nifti_image *inputMaskImage, int **levelMask, unsigned int levelNumber, unsigned int level, int *activeVoxelNumber)
+{
+   nifti_image *maskImage=nifti_copy_nim_info(inputMaskImage);
+   maskImage->data = (void *)malloc(maskImage->nvox*maskImage->nbyper);
+   memcpy(maskImage->data, inputMaskImage->data, maskImage->nvox*maskImage->nbyper);
+   reg_tools_binarise_image(maskImage);
+   reg_tools_changeDatatype<unsigned char>(maskImage);
+
+   // Each finer level is downsampled in place to derive the next one
+   for(unsigned int l=level+1; l<levelNumber; l++)
+   {
+      bool downsampleAxis[8]= {false,true,true,true,false,false,false,false};
+      if((maskImage->nx/2) < 32) downsampleAxis[1]=false;
+      if((maskImage->ny/2) < 32) downsampleAxis[2]=false;
+      if((maskImage->nz/2) < 32) downsampleAxis[3]=false;
+      reg_downsampleImage<DTYPE>(maskImage, 0, downsampleAxis);
+   }
+   *activeVoxelNumber=maskImage->nx*maskImage->ny*maskImage->nz;
+   *levelMask=(int *)malloc(*activeVoxelNumber * sizeof(int));
+   reg_tools_binaryImage2int(maskImage, *levelMask, *activeVoxelNumber);
+   nifti_image_free(maskImage);
+   return EXIT_SUCCESS;
+}
+template int reg_createMaskPyramidLevel<float>(nifti_image *, int **, unsigned int , unsigned int , int *);
+template int reg_createMaskPyramidLevel<double>(nifti_image *, int **, unsigned int , unsigned int , int *);
+/* *************************************************************** */
+void reg_getPyramidLevelDimension(nifti_image *image, unsigned int levelNumber, unsigned int level, int *dim, float *pixdim)
+{
+   for(int i=0; i<8; ++i)
+   {
+      dim[i]=image->dim[i];
+      pixdim[i]=image->pixdim[i];
+   }
+   // The downsampling rule of reg_createImagePyramid is followed
+   for(unsigned int l=level+1; l<levelNumber; l++)
+   {
+      for(int i=1; i<4; ++i)
+      {
+         if((dim[i]/2) < 32) continue;
+         dim[i]=static_cast<int>(reg_ceil(dim[i]/2.0));
+         if(pixdim[i]>0) pixdim[i]*=2.0f;
+      }
+   }
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class TYPE1, class TYPE2>
 int reg_tools_nanMask_image2(nifti_image *image, nifti_image *maskImage, nifti_image *resultImage)
@@ -77,6 +77,10 @@ void reg_getRealImageSpacing(nifti_image *image,
  * @param image Image to be smoothed
  * @param sigma Standard deviation of the Gaussian kernel
  * to use. The kernel is bounded between +/- 3 sigma.
+ * @param kernelType Gaussian (0), cubic spline (1) or mean (2) kernel.
+ * Gaussian kernels wider than three voxels are approximated by a
+ * recursive filter and mean filtering uses running sums, so that their
+ * cost does not depend on the kernel size.
  * @param axis Boolean array to specify which axis have to be
  * smoothed. The array follow the dim array of the nifti header.
  */
@@ -89,6 +93,26 @@ void reg_tools_kernelConvolution(nifti_image *image,
                                  bool *axis = NULL);
 
 /* *************************************************************** */
+/** @brief Smooth several images with the same kernel in a single pass.
+ * The images must have the same dimensions and data type. The density
+ * used to normalise the smoothed values is computed once for all the
+ * images, from the voxels that are defined in every one of them.
+ * @param images Array of images to be smoothed
+ * @param imageNumber Number of images in the array
+ * @param sigma Standard deviation of the kernel for each time point
+ * @param kernelType Gaussian (0), cubic spline (1) or mean (2) kernel
+ * @param axis Boolean array to specify which axis have to be
+ * smoothed. The array follow the dim array of the nifti header.
+ */
+extern "C++"
+void reg_tools_kernelConvolution(nifti_image **images,
+                                 int imageNumber,
+                                 float *sigma,
+                                 int kernelType,
+                                 int *mask = NULL,
+                                 bool *timePoints = NULL,
+                                 bool *axis = NULL);
+/* *************************************************************** */
 /** @brief Smooth a label image using a Gaussian kernel
  * @param image Image to be smoothed
  * @param varianceX The variance of the Gaussian kernel in X
@@ -330,6 +354,52 @@ int reg_createMaskPyramid(nifti_image *input,
                           unsigned int levelToPerform,
                           int *activeVoxelNumber);
 /* *************************************************************** */
+/** @brief Generate a single level of the pyramid created by
+ * reg_createImagePyramid. The level is derived from the input image
+ * through every finer level, which are not kept.
+ * @param input Input image to be downsampled to create the level
+ * @param levelImage Output image of the level
+ * @param levelNumber Number of level to use to create the pyramid.
+ * 1 level corresponds to the original image resolution.
+ * @param level Index of the level to create, 0 being the coarsest
+ */
+extern "C++" template<class DTYPE>
+int reg_createImagePyramidLevel(nifti_image *input,
+                                nifti_image **levelImage,
+                                unsigned int levelNumber,
+                                unsigned int level);
+/* *************************************************************** */
+/** @brief Generate a single level of the pyramid created by
+ * reg_createMaskPyramid.
+ * @param input Input mask image to be downsampled to create the level
+ * @param levelMask Output mask array of the level
+ * @param levelNumber Number of level to use to create the pyramid.
+ * 1 level corresponds to the original image resolution.
+ * @param level Index of the level to create, 0 being the coarsest
+ * @param activeVoxelNumber Number of active voxel of the level
+ */
+extern "C++" template<class DTYPE>
+int reg_createMaskPyramidLevel(nifti_image *input,
+                               int **levelMask,
+                               unsigned int levelNumber,
+                               unsigned int level,
+                               int *activeVoxelNumber);
+/* *************************************************************** */
+/** @brief Compute the dimensions and voxel spacings of a level of
+ * the pyramid created by reg_createImagePyramid, without creating it.
+ * @param input Input image from which the pyramid is created
+ * @param levelNumber Number of level to use to create the pyramid.
+ * @param level Index of the level, 0 being the coarsest
+ * @param dim Array of 8 values filled with the dimensions of the level
+ * @param pixdim Array of 8 values filled with the spacings of the level
+ */
+extern "C++"
+void reg_getPyramidLevelDimension(nifti_image *input,
+                                  unsigned int levelNumber,
+                                  unsigned int level,
+                                  int *dim,
+                                  float *pixdim);
+/* *************************************************************** */
 /** @brief this function will threshold an image to the values provided,
  * set the scl_slope and sct_inter of the image to 1 and 0
  * (SSD uses actual image data values),